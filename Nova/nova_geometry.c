@@ -0,0 +1,147 @@
+#include <math.h>
+#include <float.h>
+
+#include "nova_geometry.h"
+
+void BoxSetEmpty(struct BoundingBox *b)
+{
+	VecSet(&b->min, FLT_MAX, FLT_MAX, FLT_MAX, 1.0f);
+	VecSet(&b->max, -FLT_MAX, -FLT_MAX, -FLT_MAX, 1.0f);
+}
+
+bool BoxIsEmpty(const struct BoundingBox *b)
+{
+	return b->min.x > b->max.x || b->min.y > b->max.y || b->min.z > b->max.z;
+}
+
+void BoxAddPoint(struct BoundingBox *b, const struct Vector *p)
+{
+	b->min.x = min(b->min.x, p->x);
+	b->min.y = min(b->min.y, p->y);
+	b->min.z = min(b->min.z, p->z);
+	b->max.x = max(b->max.x, p->x);
+	b->max.y = max(b->max.y, p->y);
+	b->max.z = max(b->max.z, p->z);
+}
+
+void BoxUnion(const struct BoundingBox *b1, const struct BoundingBox *b2, struct BoundingBox *r)
+{
+	VecSet(&r->min, min(b1->min.x, b2->min.x), min(b1->min.y, b2->min.y), min(b1->min.z, b2->min.z), 1.0f);
+	VecSet(&r->max, max(b1->max.x, b2->max.x), max(b1->max.y, b2->max.y), max(b1->max.z, b2->max.z), 1.0f);
+}
+
+void BoxTransform(const struct Matrix *m, const struct BoundingBox *b, struct BoundingBox *r)
+{
+	// transform the center and take the extent along every new axis from
+	// the absolute values of the rotation and scale part
+	if (BoxIsEmpty(b))
+	{
+		BoxSetEmpty(r);
+		return;
+	}
+
+	float c[3] = { (b->min.x + b->max.x) * 0.5f, (b->min.y + b->max.y) * 0.5f, (b->min.z + b->max.z) * 0.5f };
+	float e[3] = { (b->max.x - b->min.x) * 0.5f, (b->max.y - b->min.y) * 0.5f, (b->max.z - b->min.z) * 0.5f };
+	float nc[3], ne[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		nc[i] = m->e[i][0] * c[0] + m->e[i][1] * c[1] + m->e[i][2] * c[2] + m->e[i][3];
+		ne[i] = fabsf(m->e[i][0]) * e[0] + fabsf(m->e[i][1]) * e[1] + fabsf(m->e[i][2]) * e[2];
+	}
+
+	VecSet(&r->min, nc[0] - ne[0], nc[1] - ne[1], nc[2] - ne[2], 1.0f);
+	VecSet(&r->max, nc[0] + ne[0], nc[1] + ne[1], nc[2] + ne[2], 1.0f);
+}
+
+void BoxCenter(const struct BoundingBox *b, struct Vector *r)
+{
+	VecSet(r, (b->min.x + b->max.x) * 0.5f, (b->min.y + b->max.y) * 0.5f, (b->min.z + b->max.z) * 0.5f, 1.0f);
+}
+
+void SphereTransform(const struct Matrix *m, const struct BoundingSphere *s, struct BoundingSphere *r)
+{
+	// the columns of the rotation and scale part are the transformed axes
+	float scale = 0.0f;
+
+	for (int c = 0; c < 3; c++)
+	{
+		float len = m->e[0][c] * m->e[0][c] + m->e[1][c] * m->e[1][c] + m->e[2][c] * m->e[2][c];
+		scale = max(scale, len);
+	}
+
+	struct Vector center = s->center;
+	center.w = 1.0f;
+	MatVecMul(m, &center, &r->center);
+	r->radius = s->radius * sqrtf(scale);
+}
+
+void FrustumSetFromMatrix(struct Frustum *f, const struct Matrix *m, float n, float fr)
+{
+	const float *r0 = m->e[0];
+	const float *r1 = m->e[1];
+	const float *r3 = m->e[3];
+
+	VecSet(&f->planes[0], r3[0] + r0[0], r3[1] + r0[1], r3[2] + r0[2], r3[3] + r0[3]);
+	VecSet(&f->planes[1], r3[0] - r0[0], r3[1] - r0[1], r3[2] - r0[2], r3[3] - r0[3]);
+	VecSet(&f->planes[2], r3[0] + r1[0], r3[1] + r1[1], r3[2] + r1[2], r3[3] + r1[3]);
+	VecSet(&f->planes[3], r3[0] - r1[0], r3[1] - r1[1], r3[2] - r1[2], r3[3] - r1[3]);
+	VecSet(&f->planes[4], r3[0], r3[1], r3[2], r3[3] - n);
+	VecSet(&f->planes[5], -r3[0], -r3[1], -r3[2], fr - r3[3]);
+
+	// normalized so distances are comparable between planes
+	for (int i = 0; i < 6; i++)
+	{
+		struct Vector *p = &f->planes[i];
+		float len = sqrtf(VecDot3(p, p));
+
+		if (len > 0.0f)
+			VecSet(p, p->x / len, p->y / len, p->z / len, p->w / len);
+	}
+}
+
+enum FrustumTest FrustumTestBox(const struct Frustum *f, const struct BoundingBox *b, int *plane_mask)
+{
+	struct Vector c, e;
+	BoxCenter(b, &c);
+	VecSub(&b->max, &c, &e);
+
+	for (int i = 0; i < 6; i++)
+	{
+		if (!(*plane_mask & (1 << i)))
+			continue;
+
+		const struct Vector *p = &f->planes[i];
+
+		// distance of the center and the projected half size of the box
+		float d = VecDot3(p, &c) + p->w;
+		float r = fabsf(p->x) * e.x + fabsf(p->y) * e.y + fabsf(p->z) * e.z;
+
+		if (d + r < 0.0f)
+			return FRUSTUM_OUTSIDE;
+
+		if (d - r >= 0.0f)
+			*plane_mask &= ~(1 << i);
+	}
+
+	return *plane_mask == 0 ? FRUSTUM_INSIDE : FRUSTUM_INTERSECTS;
+}
+
+enum FrustumTest FrustumTestSphere(const struct Frustum *f, const struct BoundingSphere *s)
+{
+	enum FrustumTest result = FRUSTUM_INSIDE;
+
+	for (int i = 0; i < 6; i++)
+	{
+		const struct Vector *p = &f->planes[i];
+		float d = VecDot3(p, &s->center) + p->w;
+
+		if (d < -s->radius)
+			return FRUSTUM_OUTSIDE;
+
+		if (d < s->radius)
+			result = FRUSTUM_INTERSECTS;
+	}
+
+	return result;
+}
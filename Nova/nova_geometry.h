@@ -5,10 +5,59 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+
 #include "nova_math.h"
 
+// axis aligned, empty while min is greater than max
+struct BoundingBox
+{
+	struct Vector min, max;
+};
+
+void BoxSetEmpty(struct BoundingBox *b);
+bool BoxIsEmpty(const struct BoundingBox *b);
+void BoxAddPoint(struct BoundingBox *b, const struct Vector *p);
+void BoxUnion(const struct BoundingBox *b1, const struct BoundingBox *b2, struct BoundingBox *r);
+void BoxTransform(const struct Matrix *m, const struct BoundingBox *b, struct BoundingBox *r);
+void BoxCenter(const struct BoundingBox *b, struct Vector *r);
+
+struct BoundingSphere
+{
+	struct Vector center;
+	float radius;
+};
+
+// the radius grows by the largest scale of m along any axis
+void SphereTransform(const struct Matrix *m, const struct BoundingSphere *s, struct BoundingSphere *r);
+
+enum FrustumTest
+{
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECTS,
+	FRUSTUM_INSIDE
+};
+
+// planes are (a, b, c, d) with a * x + b * y + c * z + d >= 0 inside, in
+// the order left, right, bottom, top, near, far
+struct Frustum
+{
+	struct Vector planes[6];
+};
+
+#define FRUSTUM_ALL_PLANES 0x3f
+
+// m maps to clip space with x and y in [-w, w] and w the distance in front
+// of the eye, as set up by MatSetPerspective
+void FrustumSetFromMatrix(struct Frustum *f, const struct Matrix *m, float n, float fr);
+
+// only the planes set in *plane_mask are tested, the ones the box is fully
+// inside of are cleared so children of the box can skip them
+enum FrustumTest FrustumTestBox(const struct Frustum *f, const struct BoundingBox *b, int *plane_mask);
+enum FrustumTest FrustumTestSphere(const struct Frustum *f, const struct BoundingSphere *s);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,924 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "nova_lod.h"
+
+// no level is made with fewer triangles than this
+#define LOD_MIN_TRIANGLES 32
+
+// wedges a collapse keeps track of, one moving more of them is skipped
+#define LOD_MAX_WEDGES 8
+
+// a collapse may not leave a triangle thinner than this unless it was
+// already, 1 is equilateral. Flat areas cost nothing to collapse and would
+// otherwise turn into fans of slivers that are slow to rasterize.
+#define LOD_MIN_QUALITY 0.1f
+
+// a level is only kept when it has at most this fraction of the triangles of
+// the one before, collapsing stops once the locked vertices get in the way
+#define LOD_MIN_REDUCTION 0.75
+
+// how far past lod_pixel_error the error of a level has to be before another
+// level is picked, as a fraction of it
+#define LOD_HYSTERESIS 0.15f
+
+// the squared distances to a set of planes as a symmetric 4x4 matrix, the
+// upper triangle row by row, and the number of planes
+struct Quadric
+{
+	double a[10];
+	double weight;
+};
+
+// moving from onto to, cost is the mean of their quadrics at to. It is stale
+// once either vertex changed after it was queued.
+struct Collapse
+{
+	double cost;
+	int from, to;
+	int from_stamp, to_stamp;
+};
+
+struct LodVertex
+{
+	struct Quadric quadric;
+
+	// triangles using the vertex, removed ones are dropped as they are found
+	int *tris;
+	int num_tris;
+	int tris_alloc;
+
+	int stamp;
+
+	// at the end of a seam, where seams cross or on an open edge
+	bool locked;
+	bool removed;
+};
+
+// the uv, normal and material of a triangle at one of its corners make up a
+// wedge, a vertex on a uv seam, normal crease or material border has two
+struct LodTriangle
+{
+	int v[3], n[3], uv[3];
+	int material;
+	bool removed;
+};
+
+struct Simplifier
+{
+	const struct Mesh *mesh;
+
+	struct LodVertex *vertices;
+	struct LodTriangle *tris;
+	int num_tris;
+
+	// min heap of collapses by cost
+	struct Collapse *heap;
+	int heap_size;
+	int heap_alloc;
+
+	// per vertex scratch for finding shared neighbors
+	int *marks;
+	int mark;
+
+	double max_cost;
+};
+
+static bool init_simplifier(struct Simplifier *s, const struct Mesh *mesh);
+static void destroy_simplifier(struct Simplifier *s);
+static bool add_vertex_triangle(struct LodVertex *vertex, int tri);
+static void compact_vertex_triangles(struct Simplifier *s, struct LodVertex *vertex);
+static int find_corner(const struct LodTriangle *t, int v);
+static bool same_wedge(const struct LodTriangle *t1, int v1, const struct LodTriangle *t2, int v2);
+static int find_wedge(const struct LodTriangle *const *wedges, int num_wedges, const struct LodTriangle *t, int v);
+static int find_edge_triangles(struct Simplifier *s, int a, int b, int *tris);
+static void lock_vertices(struct Simplifier *s);
+static void add_plane_quadrics(struct Simplifier *s);
+static void add_quadric(struct Quadric *q, const struct Vector *normal, const struct Vector *p);
+static double quadric_cost(const struct Quadric *q1, const struct Quadric *q2, const struct Vector *p);
+static void queue_vertex_edges(struct Simplifier *s, int v);
+static void push_collapse(struct Simplifier *s, int from, int to);
+static bool pop_collapse(struct Simplifier *s, struct Collapse *collapse);
+static int collapse_edge(struct Simplifier *s, const struct Collapse *collapse);
+static void triangle_normal(const struct Vector *p0, const struct Vector *p1, const struct Vector *p2, struct Vector *n);
+static float triangle_quality(const struct Vector *p0, const struct Vector *p1, const struct Vector *p2, const struct Vector *n);
+static struct Mesh *create_level_mesh(struct Simplifier *s, int live_tris);
+static void destroy_level_mesh(struct Mesh *mesh);
+
+struct MeshLod *CreateMeshLod(struct Mesh *mesh, int max_levels)
+{
+	if (mesh == NULL)
+		return NULL;
+
+	struct MeshLod *lod = (struct MeshLod *)calloc(1, sizeof(struct MeshLod));
+	if (lod == NULL)
+		return NULL;
+
+	lod->levels[0] = mesh;
+	lod->num_levels = 1;
+
+	// centered on the bounding box like render_mesh_instanced's spheres
+	struct BoundingBox box;
+	BoxSetEmpty(&box);
+
+	for (int i = 0; i < mesh->num_vertices; i++)
+		BoxAddPoint(&box, &mesh->vertices[i].pos);
+
+	VecSet(&lod->sphere.center, 0.0f, 0.0f, 0.0f, 1.0f);
+
+	if (!BoxIsEmpty(&box))
+	{
+		BoxCenter(&box, &lod->sphere.center);
+
+		float radius_sq = 0.0f;
+
+		for (int i = 0; i < mesh->num_vertices; i++)
+		{
+			struct Vector d;
+			VecSub(&mesh->vertices[i].pos, &lod->sphere.center, &d);
+			radius_sq = max(radius_sq, VecDot3(&d, &d));
+		}
+
+		lod->sphere.radius = sqrtf(radius_sq);
+	}
+
+	max_levels = min(max_levels, MAX_LOD_LEVELS);
+
+	struct Simplifier s;
+	if (max_levels < 2 || !init_simplifier(&s, mesh))
+		return lod;
+
+	int live_tris = 0;
+	for (int i = 0; i < s.num_tris; i++)
+		if (!s.tris[i].removed)
+			live_tris++;
+
+	// one pass down to the coarsest level, the quadrics keep measuring from
+	// the full mesh and every level is taken on the way
+	int level_tris = live_tris;
+
+	while (lod->num_levels < max_levels && level_tris / 2 >= LOD_MIN_TRIANGLES)
+	{
+		int target = level_tris / 2;
+		struct Collapse collapse;
+
+		while (live_tris > target && pop_collapse(&s, &collapse))
+			live_tris -= collapse_edge(&s, &collapse);
+
+		if (live_tris > level_tris * LOD_MIN_REDUCTION)
+			break;
+
+		struct Mesh *level = create_level_mesh(&s, live_tris);
+		if (level == NULL)
+			break;
+
+		lod->levels[lod->num_levels] = level;
+		lod->errors[lod->num_levels] = (float)sqrt(s.max_cost);
+		lod->num_levels++;
+		level_tris = live_tris;
+	}
+
+	destroy_simplifier(&s);
+
+	return lod;
+}
+
+int SelectMeshLodLevel(const struct RenderContext *context, const struct MeshLod *lod, int level)
+{
+	if (context == NULL || lod == NULL || lod->num_levels <= 1)
+		return 0;
+
+	level = max(0, min(level, lod->num_levels - 1));
+
+	// pixels per model unit at the nearest point of the bounding sphere
+	struct BoundingSphere sphere;
+	SphereTransform(&context->mv_mat, &lod->sphere, &sphere);
+
+	struct Vector clip;
+	MatVecMul(&context->proj_mat, &sphere.center, &clip);
+
+	float distance = clip.w - sphere.radius;
+
+	// reaching up to the camera, nothing but the full mesh will do
+	if (distance <= context->znear)
+		return 0;
+
+	float scale = lod->sphere.radius > 0.0f ? sphere.radius / lod->sphere.radius : 1.0f;
+	float pixels_per_unit = 0.5f * context->screen_width * fabsf(context->proj_mat.e[0][0]) * scale / distance;
+
+	float coarser = context->lod_pixel_error * (1.0f - LOD_HYSTERESIS);
+	float finer = context->lod_pixel_error * (1.0f + LOD_HYSTERESIS);
+
+	while (level + 1 < lod->num_levels && lod->errors[level + 1] * pixels_per_unit <= coarser)
+		level++;
+
+	while (level > 0 && lod->errors[level] * pixels_per_unit > finer)
+		level--;
+
+	return level;
+}
+
+int RenderMeshLod(struct RenderContext *context, const struct MeshLod *lod, int level)
+{
+	if (context == NULL || lod == NULL)
+		return level;
+
+	level = SelectMeshLodLevel(context, lod, level);
+	render_mesh(context, lod->levels[level]);
+
+	return level;
+}
+
+void DestroyMeshLod(struct MeshLod *lod)
+{
+	if (lod == NULL)
+		return;
+
+	for (int i = 1; i < lod->num_levels; i++)
+		destroy_level_mesh(lod->levels[i]);
+
+	free(lod);
+}
+
+bool init_simplifier(struct Simplifier *s, const struct Mesh *mesh)
+{
+	// assumes s and mesh are valid
+
+	memset(s, 0, sizeof(struct Simplifier));
+	s->mesh = mesh;
+	s->num_tris = mesh->num_triangles;
+
+	s->vertices = (struct LodVertex *)calloc(mesh->num_vertices, sizeof(struct LodVertex));
+	s->tris = (struct LodTriangle *)malloc(mesh->num_triangles * sizeof(struct LodTriangle));
+	s->marks = (int *)calloc(mesh->num_vertices, sizeof(int));
+
+	if (s->vertices == NULL || s->tris == NULL || s->marks == NULL)
+	{
+		destroy_simplifier(s);
+		return false;
+	}
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+	{
+		const struct Triangle *tri = &mesh->triangles[i];
+		struct LodTriangle *t = &s->tris[i];
+
+		t->v[0] = tri->v0; t->v[1] = tri->v1; t->v[2] = tri->v2;
+		t->n[0] = tri->n0; t->n[1] = tri->n1; t->n[2] = tri->n2;
+		t->uv[0] = tri->uv0; t->uv[1] = tri->uv1; t->uv[2] = tri->uv2;
+		t->material = tri->material;
+
+		// triangles without area to begin with are left out of every level
+		t->removed = t->v[0] == t->v[1] || t->v[1] == t->v[2] || t->v[2] == t->v[0];
+		if (t->removed)
+			continue;
+
+		for (int k = 0; k < 3; k++)
+		{
+			if (!add_vertex_triangle(&s->vertices[t->v[k]], i))
+			{
+				destroy_simplifier(s);
+				return false;
+			}
+		}
+	}
+
+	lock_vertices(s);
+	add_plane_quadrics(s);
+
+	for (int v = 0; v < mesh->num_vertices; v++)
+		queue_vertex_edges(s, v);
+
+	return true;
+}
+
+void destroy_simplifier(struct Simplifier *s)
+{
+	// assumes s is valid
+
+	for (int v = 0; s->vertices != NULL && v < s->mesh->num_vertices; v++)
+		free(s->vertices[v].tris);
+
+	free(s->vertices);
+	free(s->tris);
+	free(s->marks);
+	free(s->heap);
+
+	memset(s, 0, sizeof(struct Simplifier));
+}
+
+bool add_vertex_triangle(struct LodVertex *vertex, int tri)
+{
+	// assumes vertex is valid
+
+	if (vertex->num_tris == vertex->tris_alloc)
+	{
+		int alloc = max(8, 2 * vertex->tris_alloc);
+		int *tris = (int *)realloc(vertex->tris, alloc * sizeof(int));
+		if (tris == NULL)
+			return false;
+
+		vertex->tris = tris;
+		vertex->tris_alloc = alloc;
+	}
+
+	vertex->tris[vertex->num_tris++] = tri;
+	return true;
+}
+
+void compact_vertex_triangles(struct Simplifier *s, struct LodVertex *vertex)
+{
+	// assumes s and vertex are valid
+
+	int count = 0;
+
+	for (int i = 0; i < vertex->num_tris; i++)
+		if (!s->tris[vertex->tris[i]].removed)
+			vertex->tris[count++] = vertex->tris[i];
+
+	vertex->num_tris = count;
+}
+
+int find_corner(const struct LodTriangle *t, int v)
+{
+	return t->v[0] == v ? 0 : t->v[1] == v ? 1 : t->v[2] == v ? 2 : -1;
+}
+
+bool same_wedge(const struct LodTriangle *t1, int v1, const struct LodTriangle *t2, int v2)
+{
+	// assumes v1 is a corner of t1 and v2 of t2
+	int k1 = find_corner(t1, v1);
+	int k2 = find_corner(t2, v2);
+
+	return t1->uv[k1] == t2->uv[k2] && t1->n[k1] == t2->n[k2] && t1->material == t2->material;
+}
+
+int find_wedge(const struct LodTriangle *const *wedges, int num_wedges, const struct LodTriangle *t, int v)
+{
+	// assumes v is a corner of t and all of wedges
+	// returns num_wedges when none has t's wedge at v
+
+	int w = 0;
+	while (w < num_wedges && !same_wedge(wedges[w], v, t, v))
+		w++;
+
+	return w;
+}
+
+int find_edge_triangles(struct Simplifier *s, int a, int b, int *tris)
+{
+	// assumes s is valid and tris holds 2
+	// returns how many triangles share the edge, the first 2 are stored
+
+	const struct LodVertex *vertex = &s->vertices[a];
+	int count = 0;
+
+	for (int i = 0; i < vertex->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[vertex->tris[i]];
+
+		if (!t->removed && find_corner(t, b) >= 0)
+		{
+			if (count < 2)
+				tris[count] = vertex->tris[i];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void lock_vertices(struct Simplifier *s)
+{
+	// assumes s is valid
+	// a vertex on a seam only moves along it onto the next vertex of the
+	// seam, so the ones where it ends or meets another do not move at all.
+	// Neither do ones on edges not shared by exactly two triangles, which
+	// are open or non manifold.
+
+	int mark = ++s->mark;
+
+	for (int v = 0; v < s->mesh->num_vertices; v++)
+	{
+		struct LodVertex *vertex = &s->vertices[v];
+		int seams = 0;
+
+		for (int i = 0; i < vertex->num_tris; i++)
+		{
+			const struct LodTriangle *t = &s->tris[vertex->tris[i]];
+
+			for (int j = 0; j < 3; j++)
+			{
+				int w = t->v[j];
+				if (w == v || s->marks[w] == mark)
+					continue;
+
+				s->marks[w] = mark;
+
+				int tris[2];
+				if (find_edge_triangles(s, v, w, tris) != 2)
+					vertex->locked = true;
+				else if (!same_wedge(&s->tris[tris[0]], v, &s->tris[tris[1]], v) ||
+					!same_wedge(&s->tris[tris[0]], w, &s->tris[tris[1]], w))
+					seams++;
+			}
+		}
+
+		if (seams != 0 && seams != 2)
+			vertex->locked = true;
+
+		mark = ++s->mark;
+	}
+}
+
+void add_plane_quadrics(struct Simplifier *s)
+{
+	// assumes s is valid
+	// every vertex starts with the planes of its triangles, unweighted so the
+	// cost of a collapse is a mean squared distance in model units. Seams also get
+	// the planes standing on them along the triangles, which keeps them from
+	// drifting sideways across the surface.
+
+	const struct Vertex *verts = s->mesh->vertices;
+
+	for (int i = 0; i < s->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[i];
+		if (t->removed)
+			continue;
+
+		struct Vector n;
+		triangle_normal(&verts[t->v[0]].pos, &verts[t->v[1]].pos, &verts[t->v[2]].pos, &n);
+
+		if (VecDot3(&n, &n) == 0.0f)
+			continue;
+
+		for (int k = 0; k < 3; k++)
+			add_quadric(&s->vertices[t->v[k]].quadric, &n, &verts[t->v[0]].pos);
+
+		for (int k = 0; k < 3; k++)
+		{
+			int a = t->v[k];
+			int b = t->v[(k + 1) % 3];
+
+			int tris[2];
+			if (find_edge_triangles(s, a, b, tris) == 2 &&
+				same_wedge(&s->tris[tris[0]], a, &s->tris[tris[1]], a) &&
+				same_wedge(&s->tris[tris[0]], b, &s->tris[tris[1]], b))
+				continue;
+
+			struct Vector edge, side;
+			VecSub(&verts[b].pos, &verts[a].pos, &edge);
+			VecCross3(&edge, &n, &side);
+
+			if (VecDot3(&side, &side) == 0.0f)
+				continue;
+
+			add_quadric(&s->vertices[a].quadric, &side, &verts[a].pos);
+			add_quadric(&s->vertices[b].quadric, &side, &verts[a].pos);
+		}
+	}
+}
+
+void add_quadric(struct Quadric *q, const struct Vector *normal, const struct Vector *p)
+{
+	// assumes q, normal and p are valid
+	// the plane through p facing normal
+
+	double len = sqrt((double)normal->x * normal->x + (double)normal->y * normal->y + (double)normal->z * normal->z);
+	double a = normal->x / len, b = normal->y / len, c = normal->z / len;
+	double d = -(a * p->x + b * p->y + c * p->z);
+
+	q->a[0] += a * a; q->a[1] += a * b; q->a[2] += a * c; q->a[3] += a * d;
+	q->a[4] += b * b; q->a[5] += b * c; q->a[6] += b * d;
+	q->a[7] += c * c; q->a[8] += c * d;
+	q->a[9] += d * d;
+	q->weight += 1.0;
+}
+
+double quadric_cost(const struct Quadric *q1, const struct Quadric *q2, const struct Vector *p)
+{
+	double weight = q1->weight + q2->weight;
+	if (weight == 0.0)
+		return 0.0;
+
+	double q[10];
+	for (int j = 0; j < 10; j++)
+		q[j] = q1->a[j] + q2->a[j];
+
+	double x = p->x, y = p->y, z = p->z;
+
+	double cost = q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x +
+		q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y +
+		q[7] * z * z + 2.0 * q[8] * z + q[9];
+
+	// rounding can take it a little below 0
+	return max(cost, 0.0) / weight;
+}
+
+void queue_vertex_edges(struct Simplifier *s, int v)
+{
+	// assumes s is valid
+	// queues both directions of every edge of v that has a movable end
+
+	struct LodVertex *vertex = &s->vertices[v];
+	compact_vertex_triangles(s, vertex);
+
+	for (int i = 0; i < vertex->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[vertex->tris[i]];
+
+		for (int j = 0; j < 3; j++)
+		{
+			int w = t->v[j];
+			if (w == v)
+				continue;
+
+			if (!vertex->locked)
+				push_collapse(s, v, w);
+
+			if (!s->vertices[w].locked)
+				push_collapse(s, w, v);
+		}
+	}
+}
+
+void push_collapse(struct Simplifier *s, int from, int to)
+{
+	// assumes s is valid
+
+	if (s->heap_size == s->heap_alloc)
+	{
+		int alloc = max(1024, 2 * s->heap_alloc);
+		struct Collapse *heap = (struct Collapse *)realloc(s->heap, alloc * sizeof(struct Collapse));
+		if (heap == NULL)
+			return;
+
+		s->heap = heap;
+		s->heap_alloc = alloc;
+	}
+
+	struct Collapse c;
+	c.cost = quadric_cost(&s->vertices[from].quadric, &s->vertices[to].quadric, &s->mesh->vertices[to].pos);
+	c.from = from;
+	c.to = to;
+	c.from_stamp = s->vertices[from].stamp;
+	c.to_stamp = s->vertices[to].stamp;
+
+	// sift up
+	int i = s->heap_size++;
+
+	while (i > 0 && s->heap[(i - 1) / 2].cost > c.cost)
+	{
+		s->heap[i] = s->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	s->heap[i] = c;
+}
+
+bool pop_collapse(struct Simplifier *s, struct Collapse *collapse)
+{
+	// assumes s and collapse are valid
+	// the cheapest collapse that is not stale, false once there are none
+
+	while (s->heap_size > 0)
+	{
+		*collapse = s->heap[0];
+
+		// sift the last one down from the top
+		struct Collapse last = s->heap[--s->heap_size];
+		int i = 0;
+
+		for (;;)
+		{
+			int child = 2 * i + 1;
+			if (child >= s->heap_size)
+				break;
+
+			if (child + 1 < s->heap_size && s->heap[child + 1].cost < s->heap[child].cost)
+				child++;
+
+			if (s->heap[child].cost >= last.cost)
+				break;
+
+			s->heap[i] = s->heap[child];
+			i = child;
+		}
+
+		if (s->heap_size > 0)
+			s->heap[i] = last;
+
+		const struct LodVertex *from = &s->vertices[collapse->from];
+		const struct LodVertex *to = &s->vertices[collapse->to];
+
+		if (!from->removed && !to->removed && from->stamp == collapse->from_stamp && to->stamp == collapse->to_stamp)
+			return true;
+	}
+
+	return false;
+}
+
+int collapse_edge(struct Simplifier *s, const struct Collapse *collapse)
+{
+	// assumes s and collapse are valid
+	// moves from onto to unless that would fold a triangle over or pinch the
+	// surface, returns the number of triangles that went away
+
+	const struct Vertex *verts = s->mesh->vertices;
+	int from = collapse->from;
+	int to = collapse->to;
+	struct LodVertex *vf = &s->vertices[from];
+	struct LodVertex *vt = &s->vertices[to];
+
+	compact_vertex_triangles(s, vf);
+	compact_vertex_triangles(s, vt);
+
+	// the triangles on the edge go away and the rest of from's take the wedge
+	// at to of the one among them with the same wedge at from. That has to be
+	// one wedge, and there has to be one for each of from's, so a vertex on a
+	// seam can only move along it.
+	const struct LodTriangle *from_wedges[LOD_MAX_WEDGES];
+	const struct LodTriangle *to_wedges[LOD_MAX_WEDGES];
+	int num_wedges = 0;
+	int num_edge_tris = 0;
+
+	for (int i = 0; i < vf->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[vf->tris[i]];
+		if (find_corner(t, to) < 0)
+			continue;
+
+		num_edge_tris++;
+
+		int w = find_wedge(from_wedges, num_wedges, t, from);
+
+		if (w < num_wedges)
+		{
+			if (!same_wedge(to_wedges[w], to, t, to))
+				return 0;
+			continue;
+		}
+
+		if (num_wedges == LOD_MAX_WEDGES)
+			return 0;
+
+		from_wedges[num_wedges] = t;
+		to_wedges[num_wedges] = t;
+		num_wedges++;
+	}
+
+	if (num_edge_tris == 0)
+		return 0;
+
+	for (int i = 0; i < vf->num_tris; i++)
+		if (find_wedge(from_wedges, num_wedges, &s->tris[vf->tris[i]], from) == num_wedges)
+			return 0;
+
+	// the link condition, the vertices next to both ends are exactly the
+	// ones opposite the edge, or the surface would pinch
+	int mark = s->mark += 2;
+	int shared = 0;
+
+	for (int i = 0; i < vt->num_tris; i++)
+		for (int j = 0; j < 3; j++)
+			s->marks[s->tris[vt->tris[i]].v[j]] = mark;
+
+	for (int i = 0; i < vf->num_tris; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			int w = s->tris[vf->tris[i]].v[j];
+
+			if (w != from && w != to && s->marks[w] == mark)
+			{
+				s->marks[w] = mark + 1;
+				shared++;
+			}
+		}
+	}
+
+	if (shared != num_edge_tris)
+		return 0;
+
+	// none of the triangles that stay may turn over, lose their area or get
+	// much thinner
+	for (int i = 0; i < vf->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[vf->tris[i]];
+		if (find_corner(t, to) >= 0)
+			continue;
+
+		struct Vector p[3], before, after;
+
+		for (int j = 0; j < 3; j++)
+			p[j] = verts[t->v[j]].pos;
+
+		triangle_normal(&p[0], &p[1], &p[2], &before);
+
+		for (int j = 0; j < 3; j++)
+			if (t->v[j] == from)
+				p[j] = verts[to].pos;
+
+		triangle_normal(&p[0], &p[1], &p[2], &after);
+
+		if (!(VecDot3(&before, &after) > 0.0f))
+			return 0;
+
+		float quality = triangle_quality(&p[0], &p[1], &p[2], &after);
+
+		if (quality < LOD_MIN_QUALITY && quality < triangle_quality(&verts[t->v[0]].pos, &verts[t->v[1]].pos, &verts[t->v[2]].pos, &before))
+			return 0;
+	}
+
+	// the wedges are read before the triangles they come from go away
+	int uvs[LOD_MAX_WEDGES], normals[LOD_MAX_WEDGES];
+
+	for (int w = 0; w < num_wedges; w++)
+	{
+		int k = find_corner(to_wedges[w], to);
+		uvs[w] = to_wedges[w]->uv[k];
+		normals[w] = to_wedges[w]->n[k];
+	}
+
+	int removed = 0;
+
+	for (int i = 0; i < vf->num_tris; i++)
+	{
+		int index = vf->tris[i];
+		struct LodTriangle *t = &s->tris[index];
+
+		if (find_corner(t, to) >= 0)
+		{
+			t->removed = true;
+			removed++;
+			continue;
+		}
+
+		int w = find_wedge(from_wedges, num_wedges, t, from);
+		int k = find_corner(t, from);
+		t->v[k] = to;
+		t->uv[k] = uvs[w];
+		t->n[k] = normals[w];
+
+		if (!add_vertex_triangle(vt, index))
+		{
+			t->removed = true;
+			removed++;
+		}
+	}
+
+	for (int j = 0; j < 10; j++)
+		vt->quadric.a[j] += vf->quadric.a[j];
+
+	vt->quadric.weight += vf->quadric.weight;
+
+	vf->removed = true;
+	vf->num_tris = 0;
+	vf->stamp++;
+	vt->stamp++;
+
+	s->max_cost = max(s->max_cost, collapse->cost);
+
+	queue_vertex_edges(s, to);
+
+	return removed;
+}
+
+void triangle_normal(const struct Vector *p0, const struct Vector *p1, const struct Vector *p2, struct Vector *n)
+{
+	struct Vector e1, e2;
+	VecSub(p1, p0, &e1);
+	VecSub(p2, p0, &e2);
+	VecCross3(&e1, &e2, n);
+}
+
+float triangle_quality(const struct Vector *p0, const struct Vector *p1, const struct Vector *p2, const struct Vector *n)
+{
+	// assumes n is the triangle's normal from triangle_normal
+	// twice the area over the summed squared sides, scaled to 1 for an
+	// equilateral triangle
+
+	struct Vector e0, e1, e2;
+	VecSub(p1, p0, &e0);
+	VecSub(p2, p1, &e1);
+	VecSub(p0, p2, &e2);
+
+	float sides = VecDot3(&e0, &e0) + VecDot3(&e1, &e1) + VecDot3(&e2, &e2);
+	if (sides == 0.0f)
+		return 0.0f;
+
+	return 2.0f * sqrtf(3.0f) * sqrtf(VecDot3(n, n)) / sides;
+}
+
+struct Mesh *create_level_mesh(struct Simplifier *s, int live_tris)
+{
+	// assumes s is valid
+	// a mesh of the triangles left, with only the vertices, normals and uvs
+	// they use so drawing it transforms no more than it needs
+
+	const struct Mesh *mesh = s->mesh;
+
+	struct Mesh *level = (struct Mesh *)calloc(1, sizeof(struct Mesh));
+	if (level == NULL)
+		return NULL;
+
+	int *vertex_map = (int *)malloc(mesh->num_vertices * sizeof(int));
+	int *normal_map = (int *)malloc(max(mesh->num_normals, 1) * sizeof(int));
+	int *uv_map = (int *)malloc(max(mesh->num_uvcoords, 1) * sizeof(int));
+
+	level->triangles = (struct Triangle *)malloc(max(live_tris, 1) * sizeof(struct Triangle));
+	level->vertices = (struct Vertex *)malloc(max(mesh->num_vertices, 1) * sizeof(struct Vertex));
+	level->normals = (struct Vector *)malloc(max(mesh->num_normals, 1) * sizeof(struct Vector));
+	level->uvcoords = (struct UVCoord *)malloc(max(mesh->num_uvcoords, 1) * sizeof(struct UVCoord));
+
+	if (vertex_map == NULL || normal_map == NULL || uv_map == NULL ||
+		level->triangles == NULL || level->vertices == NULL || level->normals == NULL || level->uvcoords == NULL)
+	{
+		free(vertex_map);
+		free(normal_map);
+		free(uv_map);
+		destroy_level_mesh(level);
+		return NULL;
+	}
+
+	memset(vertex_map, -1, mesh->num_vertices * sizeof(int));
+	memset(normal_map, -1, max(mesh->num_normals, 1) * sizeof(int));
+	memset(uv_map, -1, max(mesh->num_uvcoords, 1) * sizeof(int));
+
+	// triangles keep the order they had in the mesh
+	for (int i = 0; i < s->num_tris; i++)
+	{
+		const struct LodTriangle *t = &s->tris[i];
+		if (t->removed)
+			continue;
+
+		int v[3], n[3], uv[3];
+
+		for (int k = 0; k < 3; k++)
+		{
+			if (vertex_map[t->v[k]] < 0)
+			{
+				vertex_map[t->v[k]] = level->num_vertices;
+				level->vertices[level->num_vertices++] = mesh->vertices[t->v[k]];
+			}
+
+			v[k] = vertex_map[t->v[k]];
+
+			// indices the mesh has nothing at are passed through as they are
+			n[k] = t->n[k];
+			if (t->n[k] >= 0 && t->n[k] < mesh->num_normals)
+			{
+				if (normal_map[t->n[k]] < 0)
+				{
+					normal_map[t->n[k]] = level->num_normals;
+					level->normals[level->num_normals++] = mesh->normals[t->n[k]];
+				}
+
+				n[k] = normal_map[t->n[k]];
+			}
+
+			uv[k] = t->uv[k];
+			if (t->uv[k] >= 0 && t->uv[k] < mesh->num_uvcoords)
+			{
+				if (uv_map[t->uv[k]] < 0)
+				{
+					uv_map[t->uv[k]] = level->num_uvcoords;
+					level->uvcoords[level->num_uvcoords++] = mesh->uvcoords[t->uv[k]];
+				}
+
+				uv[k] = uv_map[t->uv[k]];
+			}
+		}
+
+		struct Triangle *tri = &level->triangles[level->num_triangles++];
+		*tri = mesh->triangles[i];
+		tri->v0 = v[0]; tri->v1 = v[1]; tri->v2 = v[2];
+		tri->n0 = n[0]; tri->n1 = n[1]; tri->n2 = n[2];
+		tri->uv0 = uv[0]; tri->uv1 = uv[1]; tri->uv2 = uv[2];
+	}
+
+	free(vertex_map);
+	free(normal_map);
+	free(uv_map);
+
+	level->materials = mesh->materials;
+	level->num_materials = mesh->num_materials;
+
+	return level;
+}
+
+void destroy_level_mesh(struct Mesh *mesh)
+{
+	// the materials belong to the full mesh
+
+	if (mesh == NULL)
+		return;
+
+	free(mesh->vertices);
+	free(mesh->triangles);
+	free(mesh->normals);
+	free(mesh->uvcoords);
+	free(mesh);
+}
@@ -0,0 +1,58 @@
+#ifndef _NOVA_LOD_H_
+#define _NOVA_LOD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "nova_render.h"
+#include "nova_geometry.h"
+
+// levels of detail of a mesh including the mesh itself
+#define MAX_LOD_LEVELS 8
+
+	// levels[0] is the full mesh and every level after has about half the
+	// triangles of the one before
+	struct MeshLod
+	{
+		struct Mesh *levels[MAX_LOD_LEVELS];
+		int num_levels;
+
+		// the farthest a level's surface moved from the full mesh's, in model
+		// units, 0 for levels[0]
+		float errors[MAX_LOD_LEVELS];
+
+		// of the full mesh in model space
+		struct BoundingSphere sphere;
+	};
+
+	// builds levels of detail of mesh by quadric edge collapse, each with
+	// about half the triangles of the one before, until max_levels levels
+	// or LOD_MIN_TRIANGLES. Every collapse moves a vertex onto a neighbouring
+	// one. A vertex on a uv seam, normal crease or material border only moves
+	// along it onto the seam's next vertex, and ones where a seam ends or
+	// meets another, or on an open or non manifold edge, never move. Seams
+	// also get extra planes in their quadrics so they keep their shape.
+	// Collapses that would flip a triangle, pinch the surface or leave a
+	// triangle thinner than LOD_MIN_QUALITY are skipped, and the chain ends
+	// early once they keep a level from shrinking enough. The levels share
+	// mesh's materials, so mesh must outlive the chain.
+	struct MeshLod *CreateMeshLod(struct Mesh *mesh, int max_levels);
+
+	// frees the simplified levels, levels[0] is left to its owner
+	void DestroyMeshLod(struct MeshLod *lod);
+
+	// the coarsest level whose error is within context->lod_pixel_error at
+	// the size the mesh is projected to with context->mv_mat. level is the
+	// one drawn last time, it is only left once the error is LOD_HYSTERESIS
+	// past the limit, so a mesh near it does not switch every frame.
+	int SelectMeshLodLevel(const struct RenderContext *context, const struct MeshLod *lod, int level);
+
+	// renders the level SelectMeshLodLevel picks and returns it
+	int RenderMeshLod(struct RenderContext *context, const struct MeshLod *lod, int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
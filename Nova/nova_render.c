@@ -7,18 +7,384 @@
 
 #include "nova_render.h"
 #include "nova_math.h"
+#include "nova_geometry.h"
 #include "nova_utility.h"
+#include "nova_thread.h"
+
+// SIMD pixel evaluation, 8 wide with AVX2 and 4 wide with SSE2. Define
+// NOVA_NO_SIMD to force the scalar path.
+#if defined(NOVA_NO_SIMD)
+#define SIMD_WIDTH 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+// the pixel pipeline variants are copies of one span loop with their choices
+// as constants, which only folds away if the loop is inlined into each
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#elif defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
+// number of pixels of a row whose weights are stepped before they are shaded
+#define RASTER_SPAN 64
+
+// hi-z keeps a small margin so interpolation error in the weights can never
+// push a visible pixel in front of the triangle's nearest vertex depth
+#define HIZ_MARGIN (1.0f / 4096.0f)
+
+// sub-pixel precision of RASTER_MODE_FIXED_POINT, 28.4
+#define FIXED_SHIFT 4
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+// pixels beyond each screen edge a vertex may be at before its triangle has
+// to be clipped, the rasterizers only ever scan the on screen part
+#define GUARD_BAND 4096
+
+// planes a vertex is outside of, set in clip_flags by transform_vertices
+#define CLIP_NEAR 0x01
+#define CLIP_FAR 0x02
+#define CLIP_LEFT 0x04
+#define CLIP_RIGHT 0x08
+#define CLIP_TOP 0x10
+#define CLIP_BOTTOM 0x20
+#define CLIP_FRUSTUM 0x3f
+#define CLIP_GUARD_BAND 0x40
+
+// texel coordinates are kept within this before they are converted to int,
+// wrapping stays exact since it is a multiple of every power of two size
+#define TEXEL_COORD_LIMIT 16777216.0f
+
+// the farthest DEPTH_FORMAT_UNORM16 depth
+#define DEPTH_UNORM16_MAX 65535.0f
+
+// buffers of a tile in clear_tiles still to be filled with their clear values
+#define CLEAR_PIXELS 0x01
+#define CLEAR_DEPTH 0x02
+
+// depth buckets of DRAW_ORDER_FRONT_TO_BACK between the near and far planes
+#define DRAW_ORDER_BUCKETS 1024
+
+// instances render_mesh_instanced transforms at once, each into its own copy
+// of the vertex buffers
+#define INSTANCE_BATCH 16
+
+// forward shaded instances are rasterized whenever this many set up
+// triangles are kept, so drawing thousands does not keep them all
+#define INSTANCE_FLUSH_TRIS 65536
+
+// a triangle clipped by the near plane and the four guard band planes
+#define MAX_CLIP_VERTICES (3 + 5)
+#define MAX_CLIP_TRIANGLES (MAX_CLIP_VERTICES - 2)
+
+// a triangle corner with everything setup needs, pos is in clip space while
+// it is being clipped and screen x, y, depth and 1 / w afterwards
+struct RasterVertex
+{
+	struct Vector pos;
+	struct UVCoord uv;
+	float light;
+};
+
+// maps a texture coordinate to a column or row of a texture, the coordinate
+// is scaled, kept within [lo, hi], floored and masked
+struct TexelAxis
+{
+	float scale;
+	float lo, hi;
+	int mask;
+	bool wrap;
+};
+
+// everything needed to sample a triangle's texture, set up once per span
+struct TextureSampler
+{
+	const struct TextureMap *texture_map;
+	struct TexelAxis axes[2];
+	enum TextureFilter filter;
+
+	// gradients of u / w and v / w in texels of level 0 and of 1 / w
+	float dudx, dudy, dvdx, dvdy, dqdx, dqdy;
+	float width, height;
+	float max_lod;
+};
+
+// an attribute that varies linearly across the screen, its value at
+// (xmin, ymin) of the triangle and its steps per pixel
+struct AttributePlane
+{
+	float a, dx, dy;
+};
+
+// where the pixel pipeline gets a triangle's color from before lighting
+enum PixelColor
+{
+	// the material's diffuse color, for triangles without a texture
+	PIXEL_COLOR_MATERIAL,
+
+	// the nearest texel
+	PIXEL_COLOR_NEAREST,
+
+	// bilinear or trilinear filtered texels
+	PIXEL_COLOR_FILTERED
+};
+
+// inside where x * pos.x + y * pos.y + w * pos.w + d >= 0
+struct ClipPlane
+{
+	float x, y, w, d;
+};
+
+struct RasterTriangle
+{
+	int index;
+	int xmin, xmax, ymin, ymax;
+
+	float zmin;
+	struct TextureMap *tex_map;
+
+	// the pixel pipeline variant shading the triangle, picked from its
+	// material when it is set up, and the diffuse color as a pixel for
+	// PIXEL_COLOR_MATERIAL
+	enum PixelColor color;
+	bool lit;
+	uint32_t diffuse;
+
+	// depth, 1 / w, u / w, v / w and light set up once per triangle so a
+	// pixel costs a multiply and an add each, the gradients of u / w, v / w
+	// and 1 / w also give the texture level of detail
+	struct AttributePlane z, q, u, v, light;
+
+	// barycentric weights at (xmin, ymin) and their per pixel steps
+	float w0, w0dx, w0dy;
+	float w1, w1dx, w1dy;
+	float w2, w2dx, w2dy;
+
+	// fixed point edge functions at (xmin, ymin) for RASTER_MODE_FIXED_POINT,
+	// biased for the fill rule so a pixel is covered when all three are > 0
+	int64_t e0, e0dx, e0dy;
+	int64_t e1, e1dx, e1dy;
+	int64_t e2, e2dx, e2dy;
+	float area_inv;
+};
+
+// what the rasterizers do with the covered pixels of a triangle
+enum RasterPass
+{
+	// shade the ones in front of the depth buffer, or only write their depth
+	// and triangle to the visibility buffer when shading is deferred
+	RASTER_PASS_SHADE,
+
+	// only write the depth of the ones in front, for the depth pre-pass
+	RASTER_PASS_DEPTH,
+
+	// shade the ones at the depth the pre-pass left
+	RASTER_PASS_SHADE_EQUAL
+};
+
+// which pixels of a span shade_span shades
+enum ShadeTest
+{
+	// in front of the depth buffer, which is updated
+	SHADE_TEST_LESS,
+
+	// at or in front of the depth buffer, which is left alone
+	SHADE_TEST_EQUAL,
+
+	// showing the given triangle in the visibility buffer
+	SHADE_TEST_VISIBLE
+};
+
+// scratch memory and counters for whoever rasterizes a rectangle, one per
+// tile so the workers share nothing
+struct RasterState
+{
+	enum RasterPass pass;
+
+	// hi-z result for each block of the current block row
+	uint8_t *block_rejected;
+
+	// moved to the context's stats by add_raster_counts
+	struct RenderStats stats;
+};
+
+struct TileBin
+{
+	int *tris;
+	int count;
+	int alloc;
+
+	struct RasterState state;
+};
+
+struct TileJob
+{
+	struct RenderContext *context;
+	const struct Mesh *mesh;
+};
+
+struct ViewJob
+{
+	struct RenderContext *const *views;
+	struct Mesh *mesh;
+};
+
+// a copy of a mesh render_mesh_instanced draws, depth is the distance of its
+// bounding sphere's center in front of the eye and index its matrix
+struct MeshInstance
+{
+	struct Matrix mv_mat;
+	float depth;
+	int index;
+};
+
+struct InstanceJob
+{
+	struct RenderContext *context;
+	const struct Mesh *mesh;
+	int first;
+};
+
+// the vertex buffers as allocated, the context's point into them at the copy
+// of the instance being set up
+struct VertexBuffers
+{
+	struct Vertex *vertex_buffer;
+	struct Vector *vertex_normal_buffer;
+	struct Vector *clip_buffer;
+	uint8_t *clip_flags;
+};
+
+struct Swapchain
+{
+	struct SwapchainImage *images;
+	int num_images;
+
+	// every image not being rendered into or read is on one of these
+	struct WorkQueue *free_images;
+	struct WorkQueue *submitted_images;
+
+	// the image being rendered into, and pixel_buffer's own pixels which are
+	// put aside meanwhile
+	struct SwapchainImage *acquired;
+	uint32_t *context_pixels;
+
+	uint64_t frames_submitted;
+	bool closed;
+};
+
+static bool reserve_vertex_buffers(struct RenderContext *context, const struct Mesh *mesh, int copies);
+static void calc_render_mat(const struct RenderContext *context, const struct Matrix *mv_mat, struct Matrix *render_mat);
+static void transform_normals(const struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *mv_mat, int copy);
+static void transform_vertices(const struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *render_mat, int copy);
+static void render_view(void *data, int view);
+
+static int cull_instances(struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *matrices, int count);
+static int compare_instances(const void *a, const void *b);
+static void calc_mesh_sphere(const struct Mesh *mesh, struct BoundingSphere *sphere);
+static int transform_instances(struct RenderContext *context, const struct Mesh *mesh, int first, int count);
+static void transform_instance(void *data, int copy);
+static void select_vertex_copy(struct RenderContext *context, const struct VertexBuffers *buffers, const struct Mesh *mesh, int copy);
 
 static void render_mesh_bary_naive(struct RenderContext *context, const struct Mesh *mesh);
-static void render_mesh_bary_step(struct RenderContext *context, const struct Mesh *mesh);
+static void render_mesh_bary_step(struct RenderContext *context, const struct Mesh *mesh, int num_instances);
+static void raster_mesh_triangles(struct RenderContext *context, const struct Mesh *mesh, bool keep);
+static void draw_kept_triangles(struct RenderContext *context, int first, bool prepass, double *start);
+static void render_mesh_tiled(struct RenderContext *context, const struct Mesh *mesh, int num_instances);
+static void bin_mesh_triangles(struct RenderContext *context, const struct Mesh *mesh);
+static void draw_tiles(struct RenderContext *context, const struct Mesh *mesh, double *start);
+static void render_tile(void *data, int tile);
+static void bin_triangle(struct RenderContext *context, int index);
+static bool reserve_raster_tris(struct RenderContext *context, int count);
+static const int *sort_triangles(struct RenderContext *context, const struct Mesh *mesh);
+static void add_raster_counts(struct RenderContext *context, struct RasterState *state);
+static void resolve_band(void *data, int band);
+static void resolve_row(struct RenderContext *context, const uint32_t *ids, uint32_t num_ids, int x, int end, int y);
+
+static void destroy_swapchain(struct RenderContext *context);
+
+static int setup_mesh_triangle(struct RenderContext *context, const struct Mesh *mesh, int i, struct RasterTriangle *rts);
+static void set_triangle_material(struct RenderContext *context, const struct Material *material, struct RasterTriangle *rt);
+static void load_raster_vertex(struct RenderContext *context, const struct Mesh *mesh, int v, int n, int uv, bool clip_space, struct RasterVertex *rv);
+static int clip_polygon(const struct RasterVertex *in, int count, const struct ClipPlane *plane, struct RasterVertex *out);
+static bool setup_triangle(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt);
+static void setup_triangle_attributes(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt);
+static inline void setup_plane(float a0, float a1, float a2, float dx1, float dy1, float dx2, float dy2, float det_inv, float ox, float oy, struct AttributePlane *plane);
+static inline float plane_value(const struct AttributePlane *plane, int dx, int dy);
+static void rasterize_triangle(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1);
+
+static bool setup_triangle_bary_step(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt);
+static void rasterize_triangle_bary_step(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1);
+
+static bool setup_triangle_fixed_point(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt);
+static void setup_edge_fixed_point(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t px, int64_t py, int64_t *e, int64_t *edx, int64_t *edy);
+static void rasterize_triangle_fixed_point(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1);
+static void rasterize_triangle_span(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1);
+static bool find_span(const struct RasterTriangle *rt, int y, int xstart, int xend, int *left, int *right);
+static inline bool span_pixel_covered(const struct RasterTriangle *rt, const float *ws, int x);
+static void span_weights(const struct RasterTriangle *rt, int x, int y, int n, float *ws0, float *ws1, float *ws2);
+static void raster_span(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2);
+static int shade_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, enum ShadeTest test, uint32_t id);
+static FORCE_INLINE int shade_span_color(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id, enum ShadeTest test);
+static FORCE_INLINE int shade_span_light(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id, enum ShadeTest test, enum PixelColor color);
+static FORCE_INLINE int shade_span_variant(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id,
+	enum ShadeTest test, enum PixelColor color, bool lit, bool opaque);
+static int depth_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id);
+static inline bool depth_pixel(struct RenderContext *context, const struct RasterTriangle *rt, uint32_t id, int x, int y, bool covered);
+static FORCE_INLINE bool shade_pixel(struct RenderContext *context, const struct RasterTriangle *rt, const struct TextureSampler *sampler, enum ShadeTest test, uint32_t id, int x, int y, bool covered,
+	enum PixelColor color, bool lit, bool opaque);
+static FORCE_INLINE void shade_fragment(struct RenderContext *context, const struct RasterTriangle *rt, const struct TextureSampler *sampler, int x, int y, enum PixelColor color, bool lit, bool opaque);
 
-static inline void process_pixel_default(struct RenderContext *context, int x, int y, int r, int g, int b, int a, float light);
-static inline float calc_2xtri_area(struct Vector *v0, struct Vector *v1, struct Vector *v2);
+static float hiz_block_depth(struct RenderContext *context, int bx, int by);
+static inline float hiz_zmin(const struct RasterState *state, const struct RasterTriangle *rt);
+static bool hiz_rect_visible(struct RenderContext *context, float zmin, int x0, int y0, int x1, int y1);
+static void hiz_classify_row(struct RenderContext *context, struct RasterState *state, float zmin, int x0, int x1, int y);
+static int next_raster_run(struct RenderContext *context, struct RasterState *state, int x, int xstart, int xend, bool *rejected);
+
+static bool create_tile_bins(struct RenderContext *context);
+static void destroy_tile_bins(struct RenderContext *context);
+static int fill_clear_tile(struct RenderContext *context, int tile, uint8_t flags);
+static int fill_clear_tiles(struct RenderContext *context, int x0, int y0, int x1, int y1, uint8_t flags);
+
+static inline uint32_t shade_texel(uint32_t texel, float light, bool lit, bool opaque);
+static inline uint32_t material_color(const struct Material *material);
+static inline int count_bits(int mask);
+static inline int count_covered(int n, const float *ws0, const float *ws1, const float *ws2);
+static inline void add_shade_counts(struct RenderContext *context, int x, int y, int mask);
+static uint32_t heatmap_color(uint32_t count);
+static inline float calc_2xtri_area(const struct Vector *v0, const struct Vector *v1, const struct Vector *v2);
 
 static inline void set_pixel(struct RenderContext *context, int x, int y, uint32_t rgba);
 static inline uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
 static inline uint32_t sample_texture_map_nearest_neighbor(struct TextureMap *texture_map, float u, float v);
+static inline uint32_t sample_texture_nearest(const struct TextureSampler *sampler, float u, float v);
+static inline uint32_t sample_texture_map_bilinear(const struct TextureSampler *sampler, int level, float u, float v);
+static inline uint32_t sample_texture_map_trilinear(const struct TextureSampler *sampler, float lod, float u, float v);
+static inline uint32_t sample_texture(const struct TextureSampler *sampler, float z, float u, float v);
+static void setup_texture_sampler(struct RenderContext *context, const struct RasterTriangle *rt, struct TextureSampler *sampler);
+static inline float calc_texture_lod(const struct TextureSampler *sampler, float z, float u, float v);
+static inline void bilinear_taps(const struct TextureSampler *sampler, int level, float u, float v, uint32_t *taps, int *wx, int *wy);
+static inline int bilinear_coords(const struct TexelAxis *axis, int size, float t, int *c1, int *weight);
+static inline uint32_t lerp_texels(uint32_t a, uint32_t b, int weight);
+static inline void setup_texel_axis(int size, enum TextureAddress address, struct TexelAxis *axis);
+static inline int texel_coord(const struct TexelAxis *axis, float t);
+static inline int texel_index(const struct TextureMap *texture_map, int level, int x, int y);
+static inline uint32_t spread_bits(uint32_t x);
+static size_t texture_map_size(const struct TextureMap *texture_map);
 
+static inline float depth_value(const struct RenderContext *context, const struct Vector *pos);
+static inline int depth_texel_size(enum DepthFormat format);
+static inline float load_depth(const struct RenderContext *context, int i);
+static inline bool depth_is_nearest(const struct RenderContext *context, int x, int y, float Z);
 static inline bool set_depth_if_z_is_closer(struct RenderContext *context, int x, int y, float Z);
 
 void init(struct RenderContext *context)
@@ -26,8 +392,103 @@ void init(struct RenderContext *context)
 	if (context == NULL)
 		return;
 
-	context->vertex_buffer = malloc(MAX_MESH_VERTICES * sizeof(struct Vertex));
-	context->vertex_normal_buffer = malloc(MAX_MESH_VERTICES * sizeof(struct Vector));
+	context->screen_width = 0;
+	context->screen_height = 0;
+	context->hfov = 0.0f;
+	context->vfov = 0.0f;
+	context->pixel_buffer = NULL;
+	context->depth_buffer = NULL;
+
+	// the vertex buffers are allocated for the first mesh rendered
+	context->vertex_buffer = NULL;
+	context->vertex_normal_buffer = NULL;
+	context->vertex_buffer_alloc = 0;
+	context->normal_buffer_alloc = 0;
+	context->clip_buffer = NULL;
+	context->clip_flags = NULL;
+	context->znear = 0.5f;
+	context->zfar = 10.0f;
+
+	MatSetIdentity(&context->mv_mat);
+	MatSetIdentity(&context->proj_mat);
+	MatSetIdentity(&context->screen_mat);
+	MatSetIdentity(&context->render_mat);
+
+	context->raster_mode = RASTER_MODE_FLOAT;
+	context->texture_filter = TEXTURE_FILTER_NEAREST;
+	context->shading_mode = SHADING_MODE_FORWARD;
+	context->draw_order = DRAW_ORDER_MESH;
+	context->depth_format = DEPTH_FORMAT_FLOAT;
+	context->pixel_format = PIXEL_FORMAT_ARGB8888;
+	context->depth_prepass = false;
+
+	context->hiz_enabled = false;
+	context->hiz_buffer = NULL;
+	context->hiz_dirty = NULL;
+	context->hiz_width = 0;
+	context->hiz_height = 0;
+	memset(&context->stats, 0, sizeof(context->stats));
+	context->stats_enabled = false;
+	context->shade_count_buffer = NULL;
+	context->pixel_clear_value = rgba(0, 0, 0, 255);
+	context->depth_clear_value = 1000.0f; // behind every projected z
+	context->clear_tiles = NULL;
+	context->num_clear_tiles_x = 0;
+	context->num_clear_tiles_y = 0;
+	context->raster_state = calloc(1, sizeof(struct RasterState));
+
+	context->num_threads = 1;
+	context->thread_pool = NULL;
+	context->raster_tris = NULL;
+	context->num_raster_tris = 0;
+	context->raster_tris_alloc = 0;
+	context->visibility_buffer = NULL;
+	context->tri_order = NULL;
+	context->tri_order_alloc = 0;
+	context->instances = NULL;
+	context->instances_alloc = 0;
+	context->lod_pixel_error = 1.0f;
+	context->tile_bins = NULL;
+	context->num_tiles_x = 0;
+	context->num_tiles_y = 0;
+	context->swapchain = NULL;
+}
+
+void destroy(struct RenderContext *context)
+{
+	if (context == NULL)
+		return;
+
+	// the workers are stopped before anything they could touch is freed
+	DestroyThreadPool(context->thread_pool);
+	destroy_tile_bins(context);
+
+	// gives pixel_buffer its own pixels back before they are freed
+	destroy_swapchain(context);
+
+	DestroyTextureMap(context->pixel_buffer);
+	DestroyTextureMap(context->depth_buffer);
+
+	free(context->vertex_buffer);
+	free(context->vertex_normal_buffer);
+	free(context->clip_buffer);
+	free(context->clip_flags);
+	free(context->hiz_buffer);
+	free(context->hiz_dirty);
+	free(context->shade_count_buffer);
+	free(context->clear_tiles);
+	free(context->visibility_buffer);
+	free(context->raster_tris);
+	free(context->tri_order);
+	free(context->instances);
+
+	if (context->raster_state != NULL)
+		free(context->raster_state->block_rejected);
+
+	free(context->raster_state);
+
+	// nothing is left pointing at freed memory
+	memset(context, 0, sizeof(struct RenderContext));
 }
 
 void set_screen_size(struct RenderContext *context, int width, int height)
@@ -35,26 +496,68 @@ void set_screen_size(struct RenderContext *context, int width, int height)
 	if (context == NULL)
 		return;
 
+	// an acquired image was sized for the old screen and pixel_buffer has
+	// to hold the context's own pixels again before they are replaced
+	submit_image(context);
+
 	context->screen_width = width;
 	context->screen_height = height;
 
 	DestroyTextureMap(context->pixel_buffer);
-	context->pixel_buffer = malloc(sizeof(struct TextureMap));
+	context->pixel_buffer = calloc(1, sizeof(struct TextureMap));
 	context->pixel_buffer->width = width;
 	context->pixel_buffer->height = height;
 	context->pixel_buffer->buffer = malloc(width * height * BYTES_PER_PIXEL);
 
 	DestroyTextureMap(context->depth_buffer);
-	context->depth_buffer = malloc(sizeof(struct TextureMap));
+	context->depth_buffer = calloc(1, sizeof(struct TextureMap));
 	context->depth_buffer->width = width;
 	context->depth_buffer->height = height;
-	context->depth_buffer->buffer = malloc(width * height * BYTES_PER_PIXEL);
+	context->depth_buffer->buffer = malloc(width * height * depth_texel_size(context->depth_format));
+
+	// nothing drawn into the new buffers yet
+	free(context->visibility_buffer);
+	context->visibility_buffer = NULL;
+	context->num_raster_tris = 0;
+
+	if (context->shading_mode == SHADING_MODE_DEFERRED)
+		context->visibility_buffer = calloc(width * height, sizeof(uint32_t));
 
-	MatSetIdentity(context->screen_mat);
-	context->screen_mat->e[0][0] = width / 2.0f;
-	context->screen_mat->e[1][1] = -height / 2.0f;
-	context->screen_mat->e[0][3] = width / 2.0f;
-	context->screen_mat->e[1][3] = height / 2.0f;
+	free(context->shade_count_buffer);
+	context->shade_count_buffer = NULL;
+
+	if (context->stats_enabled)
+		context->shade_count_buffer = calloc(width * height, sizeof(uint32_t));
+
+	context->hiz_width = (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+	context->hiz_height = (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+
+	free(context->hiz_buffer);
+	context->hiz_buffer = malloc(context->hiz_width * context->hiz_height * sizeof(float));
+
+	// the new buffers are pending a clear, so are their hi-z blocks
+	context->num_clear_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	context->num_clear_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	free(context->clear_tiles);
+	context->clear_tiles = malloc(context->num_clear_tiles_x * context->num_clear_tiles_y);
+	memset(context->clear_tiles, CLEAR_PIXELS | CLEAR_DEPTH, context->num_clear_tiles_x * context->num_clear_tiles_y);
+
+	free(context->hiz_dirty);
+	context->hiz_dirty = malloc(context->hiz_width * context->hiz_height);
+	memset(context->hiz_dirty, 1, context->hiz_width * context->hiz_height);
+
+	free(context->raster_state->block_rejected);
+	context->raster_state->block_rejected = malloc(context->hiz_width);
+
+	MatSetIdentity(&context->screen_mat);
+	context->screen_mat.e[0][0] = width / 2.0f;
+	context->screen_mat.e[1][1] = -height / 2.0f;
+	context->screen_mat.e[0][3] = width / 2.0f;
+	context->screen_mat.e[1][3] = height / 2.0f;
+
+	// the bins are rebuilt for the new tile grid on the next tiled render
+	destroy_tile_bins(context);
 }
 
 void set_hfov(struct RenderContext *context, float new_hfov)
@@ -64,292 +567,3431 @@ void set_hfov(struct RenderContext *context, float new_hfov)
 
 	context->hfov = new_hfov;
 	context->vfov = context->hfov * context->screen_height / context->screen_width;
-	MatSetPerspective(context->proj_mat, context->hfov, context->vfov, 0.5f, 10.0f);
+	MatSetPerspective(&context->proj_mat, context->hfov, context->vfov, context->znear, context->zfar);
 }
 
-uint32_t *get_pixel_buffer(struct RenderContext *context)
+void set_raster_mode(struct RenderContext *context, enum RasterMode mode)
 {
 	if (context == NULL)
-		return NULL;
+		return;
 
-	return context->pixel_buffer->buffer;
+	context->raster_mode = mode;
 }
 
-void clear_pixel_buffer(struct RenderContext *context)
+void set_texture_filter(struct RenderContext *context, enum TextureFilter filter)
 {
 	if (context == NULL)
 		return;
 
-	memset(context->pixel_buffer->buffer, rgba(0, 0, 0, 255), context->screen_width * context->screen_height * sizeof(uint32_t));
+	context->texture_filter = filter;
 }
 
-void clear_depth_buffer(struct RenderContext *context)
+void set_shading_mode(struct RenderContext *context, enum ShadingMode mode)
 {
 	if (context == NULL)
 		return;
 
-	float f = 1000.0f; // arbitrarily chosen highish
-	memset(context->depth_buffer->buffer, *(int*)&f, context->screen_width * context->screen_height * sizeof(uint32_t));
+	// pixels drawn in the old mode are not tracked in the new one
+	free(context->visibility_buffer);
+	context->visibility_buffer = NULL;
+	context->num_raster_tris = 0;
+
+	if (mode == SHADING_MODE_DEFERRED)
+	{
+		context->visibility_buffer = calloc(context->screen_width * context->screen_height, sizeof(uint32_t));
+		if (context->visibility_buffer == NULL)
+			mode = SHADING_MODE_FORWARD;
+	}
+
+	context->shading_mode = mode;
 }
 
-void render_mesh(struct RenderContext *context, struct Mesh *mesh)
+void set_draw_order(struct RenderContext *context, enum DrawOrder order)
 {
-	if (context == NULL || mesh == NULL)
+	if (context == NULL)
 		return;
-    
-	struct Vertex *vertices = mesh->vertices;
-	struct Vector *normals = mesh->normals;
 
-	struct Vertex *vertex_buffer = context->vertex_buffer;
-	struct Vector *vertex_normal_buffer = context->vertex_normal_buffer;
+	context->draw_order = order;
+}
 
-	// apply the model view matrix
-	for (int i = 0; i < mesh->num_vertices; i++)
-	{
-		MatVecMul(context->mv_mat, &vertices[i].pos, &vertex_buffer[i].pos);
-	}
+void set_depth_format(struct RenderContext *context, enum DepthFormat format)
+{
+	if (context == NULL)
+		return;
 
-	for (int i = 0; i < mesh->num_normals; i++)
+	if (context->depth_buffer != NULL && depth_texel_size(format) != depth_texel_size(context->depth_format))
 	{
-		MatVecMul(context->mv_mat, &normals[i], &vertex_normal_buffer[i]);
-	}
+		uint32_t *buffer = (uint32_t *)malloc(context->screen_width * context->screen_height * depth_texel_size(format));
+		if (buffer == NULL)
+			return;
 
-	// apply the projection matrix
-	for (int i = 0; i < mesh->num_vertices; i++)
-	{
-		MatVecMul(context->proj_mat, &vertex_buffer[i].pos, &vertex_buffer[i].pos);
+		free(context->depth_buffer->buffer);
+		context->depth_buffer->buffer = buffer;
 	}
 
-	// perform clipping
+	context->depth_format = format;
 
-	// apply the screen matrix
-	for (int i = 0; i < mesh->num_vertices; i++)
+	switch (format)
 	{
-		MatVecMul(context->screen_mat, &vertex_buffer[i].pos, &vertex_buffer[i].pos);
-		vertex_buffer[i].pos.x /= vertex_buffer[i].pos.w;
-		vertex_buffer[i].pos.y /= vertex_buffer[i].pos.w;
-		vertex_buffer[i].pos.z /= vertex_buffer[i].pos.w;
+	case DEPTH_FORMAT_REVERSE_FLOAT:
+		context->depth_clear_value = 0.0f; // infinitely far
+		break;
+
+	case DEPTH_FORMAT_UNORM16:
+		context->depth_clear_value = DEPTH_UNORM16_MAX;
+		break;
+
+	default:
+		context->depth_clear_value = 1000.0f; // behind every projected z
+		break;
 	}
 
-	// render the mesh
-	render_mesh_bary_step(context, mesh);
-	//render_mesh_bary_naive(context, mesh);
+	// depth drawn in the old format means nothing in the new one
+	clear_depth_buffer(context);
 }
 
-void set_pixel(struct RenderContext *context, int x, int y, uint32_t rgba)
+void set_pixel_format(struct RenderContext *context, enum PixelFormat format)
 {
 	if (context == NULL)
 		return;
 
-	context->pixel_buffer->buffer[x + y * context->screen_width] = rgba;
+	context->pixel_format = format;
 }
 
-void render_mesh_bary_naive(struct RenderContext *context, const struct Mesh *mesh)
+void set_depth_prepass(struct RenderContext *context, bool enabled)
 {
-	if (context == NULL || mesh == NULL)
+	if (context == NULL)
 		return;
 
-	struct Vertex *v0, *v1, *v2;
+	context->depth_prepass = enabled;
+}
 
-	struct Triangle *tris = mesh->triangles;
-	struct Vertex *verts = context->vertex_buffer;
-	struct Vector *normals = context->vertex_normal_buffer;
-	struct UVCoord *uvcoords = mesh->uvcoords;
-	struct Material *materials = mesh->materials;
+void set_hiz_enabled(struct RenderContext *context, bool enabled)
+{
+	if (context == NULL)
+		return;
 
-	struct Vector light_vec = { 0.0f, 0.0f, -1.0f };
+	// depth writes made while hi-z was off are not reflected in it
+	if (enabled && !context->hiz_enabled && context->hiz_dirty != NULL)
+		memset(context->hiz_dirty, 1, context->hiz_width * context->hiz_height);
 
-	float t_area;
+	context->hiz_enabled = enabled;
+}
 
-	for (int i = 0; i < mesh->num_triangles; i++)
-	{
-		v0 = &verts[tris[i].v0];
-		v1 = &verts[tris[i].v1];
-		v2 = &verts[tris[i].v2];
+void set_render_threads(struct RenderContext *context, int num_threads)
+{
+	if (context == NULL)
+		return;
 
-		t_area = -calc_2xtri_area(&v0->pos, &v1->pos, &v2->pos);
+	if (num_threads <= 0)
+		num_threads = GetProcessorCount();
 
-		if (t_area > 0)
-		{
-			float v0_light = max(0.4f, -VecDot3(&normals[tris[i].n0], &light_vec));
-			float v1_light = max(0.4f, -VecDot3(&normals[tris[i].n1], &light_vec));
-			float v2_light = max(0.4f, -VecDot3(&normals[tris[i].n2], &light_vec));
+	DestroyThreadPool(context->thread_pool);
+	context->thread_pool = NULL;
 
-			struct UVCoord uv0 = { uvcoords[tris[i].uv0].u * v0->pos.z, uvcoords[tris[i].uv0].v * v0->pos.z };
-			struct UVCoord uv1 = { uvcoords[tris[i].uv1].u * v1->pos.z, uvcoords[tris[i].uv1].v * v1->pos.z };
-			struct UVCoord uv2 = { uvcoords[tris[i].uv2].u * v2->pos.z, uvcoords[tris[i].uv2].v * v2->pos.z };
+	// a single thread renders directly without binning
+	if (num_threads > 1)
+		context->thread_pool = CreateThreadPool(num_threads);
 
-			int xmin = max(0, (int)min(min(v0->pos.x, v1->pos.x), v2->pos.x));
-			int xmax = min((int)max(max(v0->pos.x, v1->pos.x), v2->pos.x) + 1, context->screen_width - 1);
-			int ymin = max(0, (int)min(min(v0->pos.y, v1->pos.y), v2->pos.y));
-			int ymax = min((int)max(max(v0->pos.y, v1->pos.y), v2->pos.y) + 1, context->screen_height - 1);
+	context->num_threads = GetThreadPoolSize(context->thread_pool);
+}
 
-			float t_area_inv = 1.0f / t_area;
+void set_stats_enabled(struct RenderContext *context, bool enabled)
+{
+	if (context == NULL)
+		return;
 
-			uint8_t diffuse[4] = { 255, 255, 255, 255 };
+	// counting starts over with the next clear of the depth buffer
+	free(context->shade_count_buffer);
+	context->shade_count_buffer = NULL;
 
-			for (int y = ymin; y <= ymax; y++)
-			{
-				for (int x = xmin; x <= xmax; x++)
-				{
-					struct Vector p = { (float)x, (float)y };
+	if (enabled)
+	{
+		context->shade_count_buffer = calloc(context->screen_width * context->screen_height, sizeof(uint32_t));
+		if (context->shade_count_buffer == NULL)
+			enabled = false;
+	}
 
-					float w0 = calc_2xtri_area(&v1->pos, &v2->pos, &p);
-					w0 *= t_area_inv;
+	context->stats_enabled = enabled;
+}
 
-					float w1 = calc_2xtri_area(&v0->pos, &p, &v2->pos);
-					w1 *= t_area_inv;
+void set_lod_pixel_error(struct RenderContext *context, float pixels)
+{
+	if (context == NULL)
+		return;
 
-					float w2 = 1.0f - w0 - w1;
+	context->lod_pixel_error = max(pixels, 0.0f);
+}
 
-					if (w0 > 0.0f && w1 > 0.0f && w2 > 0.0f)
-					{
-						float Z = v0->pos.z * w0 + v1->pos.z * w1 + v2->pos.z * w2;
-						float z = 1.0f / Z;
+bool set_swapchain(struct RenderContext *context, int num_images, uint32_t *const *buffers)
+{
+	if (context == NULL || num_images < 0)
+		return false;
 
-						if (set_depth_if_z_is_closer(context, x, y, Z))
-						{
-							float ui = uv0.u * w0 + uv1.u * w1 + uv2.u * w2;
-							float u = z * ui;
+	destroy_swapchain(context);
 
-							float vi = uv0.v * w0 + uv1.v * w1 + uv2.v * w2;
-							float v = z * vi;
+	if (num_images == 0)
+		return true;
 
-							float light = v0_light * w0 + v1_light * w1 + v2_light * w2;
+	struct Swapchain *swapchain = (struct Swapchain *)calloc(1, sizeof(struct Swapchain));
+	if (swapchain == NULL)
+		return false;
 
-							*((uint32_t *)diffuse) = sample_texture_map_nearest_neighbor(materials[tris[i].material].tex_map, u, v);
+	context->swapchain = swapchain;
+	swapchain->num_images = num_images;
+	swapchain->images = (struct SwapchainImage *)calloc(num_images, sizeof(struct SwapchainImage));
+	swapchain->free_images = CreateWorkQueue(num_images);
+	swapchain->submitted_images = CreateWorkQueue(num_images);
 
-							process_pixel_default(context, x, y, diffuse[2], diffuse[1], diffuse[0], diffuse[3], light);
-						}
-					}
-				}
-			}
+	if (swapchain->images == NULL || swapchain->free_images == NULL || swapchain->submitted_images == NULL)
+	{
+		destroy_swapchain(context);
+		return false;
+	}
+
+	size_t capacity = (size_t)context->screen_width * context->screen_height;
+
+	for (int i = 0; i < num_images; i++)
+	{
+		struct SwapchainImage *image = &swapchain->images[i];
+
+		image->index = i;
+		image->owned = buffers == NULL;
+		image->capacity = capacity;
+		image->pixels = buffers != NULL ? buffers[i] : (uint32_t *)malloc(capacity * BYTES_PER_PIXEL);
+
+		if (image->pixels == NULL)
+		{
+			destroy_swapchain(context);
+			return false;
 		}
+
+		PushWorkQueue(swapchain->free_images, image);
 	}
+
+	return true;
 }
 
-void render_mesh_bary_step(struct RenderContext *context, const struct Mesh *mesh)
+struct SwapchainImage *acquire_image(struct RenderContext *context)
 {
-	if (context == NULL || mesh == NULL)
-		return;
+	if (context == NULL || context->swapchain == NULL || context->pixel_buffer == NULL)
+		return NULL;
 
-	struct Vertex *v0, *v1, *v2;
+	struct Swapchain *swapchain = context->swapchain;
 
-	struct Triangle *tris = mesh->triangles;
-	struct Vertex *verts = context->vertex_buffer;
-	struct Vector *normals = context->vertex_normal_buffer;
-	struct UVCoord *uvcoords = mesh->uvcoords;
-	struct Material *materials = mesh->materials;
+	if (swapchain->closed)
+		return NULL;
 
-	struct Vector light_vec = { 0.0f, 0.0f, -1.0f };
+	// an image acquired twice is submitted first
+	if (swapchain->acquired != NULL)
+		submit_image(context);
 
-	float t_area;
+	// waits while the reader holds every other image
+	double start = GetTimeMs();
+	struct SwapchainImage *image = (struct SwapchainImage *)PopWorkQueue(swapchain->free_images);
+	if (image == NULL)
+		return NULL;
 
-	for (int i = 0; i < mesh->num_triangles; i++)
+	// the screen size may have changed since the image was last rendered
+	size_t size = (size_t)context->screen_width * context->screen_height;
+
+	if (size > image->capacity)
 	{
-		v0 = &verts[tris[i].v0];
-		v1 = &verts[tris[i].v1];
-		v2 = &verts[tris[i].v2];
+		uint32_t *pixels = image->owned ? (uint32_t *)realloc(image->pixels, size * BYTES_PER_PIXEL) : NULL;
 
-		t_area = -calc_2xtri_area(&v0->pos, &v1->pos, &v2->pos);
-        
-		if (t_area > 0)
+		if (pixels == NULL)
 		{
-            float v0_light = max(0.4f, -VecDot3(&normals[tris[i].n0], &light_vec));
-			float v1_light = max(0.4f, -VecDot3(&normals[tris[i].n1], &light_vec));
-			float v2_light = max(0.4f, -VecDot3(&normals[tris[i].n2], &light_vec));
+			PushWorkQueue(swapchain->free_images, image);
+			return NULL;
+		}
 
-			struct UVCoord uv0 = { uvcoords[tris[i].uv0].u * v0->pos.z, uvcoords[tris[i].uv0].v * v0->pos.z };
-			struct UVCoord uv1 = { uvcoords[tris[i].uv1].u * v1->pos.z, uvcoords[tris[i].uv1].v * v1->pos.z };
-			struct UVCoord uv2 = { uvcoords[tris[i].uv2].u * v2->pos.z, uvcoords[tris[i].uv2].v * v2->pos.z };
+		image->pixels = pixels;
+		image->capacity = size;
+	}
 
-			int xmin = max(0, (int)min(min(v0->pos.x, v1->pos.x), v2->pos.x));
-			int xmax = min((int)max(max(v0->pos.x, v1->pos.x), v2->pos.x) + 1, context->screen_width - 1);
-			int ymin = max(0, (int)min(min(v0->pos.y, v1->pos.y), v2->pos.y));
-			int ymax = min((int)max(max(v0->pos.y, v1->pos.y), v2->pos.y) + 1, context->screen_height - 1);
+	image->width = context->screen_width;
+	image->height = context->screen_height;
+	image->acquire_ms = start;
 
-			float t_area_inv = 1.0f / -t_area;
+	swapchain->acquired = image;
+	swapchain->context_pixels = context->pixel_buffer->buffer;
+	context->pixel_buffer->buffer = image->pixels;
 
-			struct Vector p = { (float)xmin, (float)ymin };
-            
-			float w0 = calc_2xtri_area(&v1->pos, &v2->pos, &p);
-			w0 *= t_area_inv;
+	return image;
+}
 
-			float ow0 = w0;
-			float w0dx = -(v2->pos.y - v1->pos.y) * t_area_inv;
-			float w0dy = (v2->pos.x - v1->pos.x) * t_area_inv;
-			float w0ady = 0.0f;
+void submit_image(struct RenderContext *context)
+{
+	if (context == NULL || context->swapchain == NULL || context->swapchain->acquired == NULL)
+		return;
 
-			float w1 = calc_2xtri_area(&v0->pos, &p, &v2->pos);
-			w1 *= t_area_inv;
-			float ow1 = w1;
-			float w1dx = -(v0->pos.y - v2->pos.y) * t_area_inv;
-			float w1dy = (v0->pos.x - v2->pos.x) * t_area_inv;
-			float w1ady = 0.0f;
+	struct Swapchain *swapchain = context->swapchain;
+	struct SwapchainImage *image = swapchain->acquired;
 
-			float w2 = 1.0f - w0 - w1;
-			float ow2 = w2;
-			float w2dx = -(v1->pos.y - v0->pos.y) * t_area_inv;
-			float w2dy = (v1->pos.x - v0->pos.x) * t_area_inv;
-			float w2ady = 0.0f;
+	get_pixel_buffer(context);
 
-			uint8_t diffuse[4] = { 255, 255, 255, 255 };
+	context->pixel_buffer->buffer = swapchain->context_pixels;
+	swapchain->acquired = NULL;
+	swapchain->context_pixels = NULL;
 
-			for (int y = ymin; y <= ymax; y++)
-			{
-				for (int x = xmin; x <= xmax; x++)
-				{
-					if (w0 > 0.0f && w1 > 0.0f && w2 > 0.0f)
-					{
-						float Z = v0->pos.z * w0 + v1->pos.z * w1 + v2->pos.z * w2;
-						float z = 1.0f / Z;
+	image->frame = swapchain->frames_submitted++;
+	image->submit_ms = GetTimeMs();
 
-						if (set_depth_if_z_is_closer(context, x, y, Z))
+	// never waits, there is room for every image
+	PushWorkQueue(swapchain->submitted_images, image);
+}
+
+struct SwapchainImage *take_submitted_image(struct RenderContext *context, bool wait)
+{
+	if (context == NULL || context->swapchain == NULL)
+		return NULL;
+
+	if (wait)
+		return (struct SwapchainImage *)PopWorkQueue(context->swapchain->submitted_images);
+
+	return (struct SwapchainImage *)TryPopWorkQueue(context->swapchain->submitted_images);
+}
+
+void release_image(struct RenderContext *context, struct SwapchainImage *image)
+{
+	if (context == NULL || context->swapchain == NULL || image == NULL)
+		return;
+
+	PushWorkQueue(context->swapchain->free_images, image);
+}
+
+void close_swapchain(struct RenderContext *context)
+{
+	if (context == NULL || context->swapchain == NULL)
+		return;
+
+	submit_image(context);
+
+	// the reader takes what was submitted and then gets NULL
+	context->swapchain->closed = true;
+	CloseWorkQueue(context->swapchain->submitted_images);
+}
+
+uint32_t *get_pixel_buffer(struct RenderContext *context)
+{
+	if (context == NULL)
+		return NULL;
+
+	fill_clear_tiles(context, 0, 0, context->screen_width - 1, context->screen_height - 1, CLEAR_PIXELS);
+
+	return context->pixel_buffer->buffer;
+}
+
+void clear_pixel_buffer(struct RenderContext *context)
+{
+	if (context == NULL)
+		return;
+
+	for (int t = 0; t < context->num_clear_tiles_x * context->num_clear_tiles_y; t++)
+		context->clear_tiles[t] |= CLEAR_PIXELS;
+}
+
+void clear_depth_buffer(struct RenderContext *context)
+{
+	if (context == NULL)
+		return;
+
+	// the visibility buffer ids of a tile are cleared along with its depth
+	for (int t = 0; t < context->num_clear_tiles_x * context->num_clear_tiles_y; t++)
+		context->clear_tiles[t] |= CLEAR_DEPTH;
+
+	for (int i = 0; i < context->hiz_width * context->hiz_height; i++)
+		context->hiz_buffer[i] = context->depth_clear_value;
+
+	if (context->hiz_dirty != NULL)
+		memset(context->hiz_dirty, 0, context->hiz_width * context->hiz_height);
+
+	// the triangles drawn so far can no longer be seen
+	context->num_raster_tris = 0;
+
+	memset(&context->stats, 0, sizeof(context->stats));
+
+	if (context->shade_count_buffer != NULL)
+		memset(context->shade_count_buffer, 0, context->screen_width * context->screen_height * sizeof(uint32_t));
+}
+
+float get_overdraw(struct RenderContext *context)
+{
+	if (context == NULL)
+		return 0.0f;
+
+	// every pixel still at the clear value was never drawn to, nor was any
+	// pixel of a tile whose depth clear is pending
+	int covered = 0;
+
+	for (int t = 0; t < context->num_clear_tiles_x * context->num_clear_tiles_y; t++)
+	{
+		if (context->clear_tiles[t] & CLEAR_DEPTH)
+			continue;
+
+		int x0 = (t % context->num_clear_tiles_x) * TILE_SIZE;
+		int y0 = (t / context->num_clear_tiles_x) * TILE_SIZE;
+		int x1 = min(x0 + TILE_SIZE, context->screen_width);
+		int y1 = min(y0 + TILE_SIZE, context->screen_height);
+
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				covered += load_depth(context, x + y * context->screen_width) != context->depth_clear_value;
+	}
+
+	if (covered == 0)
+		return 0.0f;
+
+	return (float)context->stats.fragments_shaded / covered;
+}
+
+bool get_overdraw_heatmap(struct RenderContext *context, uint32_t *pixels)
+{
+	if (context == NULL || pixels == NULL || context->shade_count_buffer == NULL)
+		return false;
+
+	for (int i = 0; i < context->screen_width * context->screen_height; i++)
+		pixels[i] = heatmap_color(context->shade_count_buffer[i]);
+
+	return true;
+}
+
+void render_mesh(struct RenderContext *context, struct Mesh *mesh)
+{
+	if (context == NULL || mesh == NULL)
+		return;
+
+	if (!reserve_vertex_buffers(context, mesh, 1))
+		return;
+
+	context->stats.triangles_submitted += mesh->num_triangles;
+
+	double start = context->stats_enabled ? GetTimeMs() : 0.0;
+
+	// apply the model view matrix to the normals, and the model view,
+	// projection and screen matrices and the perspective divide to the
+	// vertices and flag the ones outside the frustum
+	calc_render_mat(context, &context->mv_mat, &context->render_mat);
+	transform_normals(context, mesh, &context->mv_mat, 0);
+	transform_vertices(context, mesh, &context->render_mat, 0);
+
+	if (context->stats_enabled)
+		context->stats.transform_ms += GetTimeMs() - start;
+
+	// render the mesh, triangles are culled and clipped as they are set up
+	if (context->raster_mode == RASTER_MODE_NAIVE)
+		render_mesh_bary_naive(context, mesh);
+	else if (context->thread_pool != NULL)
+		render_mesh_tiled(context, mesh, 0);
+	else
+		render_mesh_bary_step(context, mesh, 0);
+}
+
+void render_mesh_instanced(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *matrices, int count)
+{
+	if (context == NULL || mesh == NULL || matrices == NULL || count <= 0)
+		return;
+
+	context->stats.triangles_submitted += (uint64_t)count * mesh->num_triangles;
+
+	int num_instances = cull_instances(context, mesh, matrices, count);
+	if (num_instances == 0)
+		return;
+
+	// the naive rasterizer reads the first copy of the buffers, so it gets
+	// one instance at a time
+	bool naive = context->raster_mode == RASTER_MODE_NAIVE;
+
+	if (!reserve_vertex_buffers(context, mesh, naive ? 1 : min(num_instances, INSTANCE_BATCH)))
+		return;
+
+	if (naive)
+	{
+		for (int i = 0; i < num_instances; i++)
+		{
+			transform_instances(context, mesh, i, 1);
+			render_mesh_bary_naive(context, mesh);
+		}
+	}
+	else if (context->thread_pool != NULL)
+		render_mesh_tiled(context, mesh, num_instances);
+	else
+		render_mesh_bary_step(context, mesh, num_instances);
+}
+
+void render_mesh_views(struct RenderContext *const *views, int num_views, struct Mesh *mesh, struct ThreadPool *pool)
+{
+	if (views == NULL || mesh == NULL)
+		return;
+
+	// the views only share the mesh, which rendering does not write to
+	struct ViewJob job = { views, mesh };
+
+	if (pool != NULL)
+		RunThreadPool(pool, render_view, &job, num_views);
+	else
+		for (int view = 0; view < num_views; view++)
+			render_view(&job, view);
+}
+
+void resolve_visibility_buffer(struct RenderContext *context)
+{
+	if (context == NULL)
+		return;
+
+	double start = context->stats_enabled ? GetTimeMs() : 0.0;
+
+	// bands of tile rows are filled and shaded independently
+	int num_bands = (context->screen_height + TILE_SIZE - 1) / TILE_SIZE;
+
+	if (context->thread_pool != NULL)
+		RunThreadPool(context->thread_pool, resolve_band, context, num_bands);
+	else
+		for (int band = 0; band < num_bands; band++)
+			resolve_band(context, band);
+
+	if (context->stats_enabled)
+		context->stats.resolve_ms += GetTimeMs() - start;
+}
+
+void set_pixel(struct RenderContext *context, int x, int y, uint32_t rgba)
+{
+	if (context == NULL)
+		return;
+
+	context->pixel_buffer->buffer[x + y * context->screen_width] = rgba;
+}
+
+void destroy_swapchain(struct RenderContext *context)
+{
+	struct Swapchain *swapchain = context->swapchain;
+	if (swapchain == NULL)
+		return;
+
+	if (swapchain->acquired != NULL)
+		context->pixel_buffer->buffer = swapchain->context_pixels;
+
+	for (int i = 0; swapchain->images != NULL && i < swapchain->num_images; i++)
+		if (swapchain->images[i].owned)
+			free(swapchain->images[i].pixels);
+
+	DestroyWorkQueue(swapchain->free_images);
+	DestroyWorkQueue(swapchain->submitted_images);
+	free(swapchain->images);
+	free(swapchain);
+
+	context->swapchain = NULL;
+}
+
+bool reserve_vertex_buffers(struct RenderContext *context, const struct Mesh *mesh, int copies)
+{
+	// assumes context and mesh are valid
+	// makes room for copies of the transformed vertices and normals of the
+	// mesh, one after another
+
+	int num_vertices = mesh->num_vertices * copies;
+	int num_normals = mesh->num_normals * copies;
+
+	if (num_vertices > context->vertex_buffer_alloc)
+	{
+		int alloc = max(num_vertices, 2 * context->vertex_buffer_alloc);
+
+		struct Vertex *vertex_buffer = (struct Vertex *)realloc(context->vertex_buffer, alloc * sizeof(struct Vertex));
+		if (vertex_buffer != NULL)
+			context->vertex_buffer = vertex_buffer;
+
+		struct Vector *clip_buffer = (struct Vector *)realloc(context->clip_buffer, alloc * sizeof(struct Vector));
+		if (clip_buffer != NULL)
+			context->clip_buffer = clip_buffer;
+
+		uint8_t *clip_flags = (uint8_t *)realloc(context->clip_flags, alloc);
+		if (clip_flags != NULL)
+			context->clip_flags = clip_flags;
+
+		if (vertex_buffer == NULL || clip_buffer == NULL || clip_flags == NULL)
+			return false;
+
+		context->vertex_buffer_alloc = alloc;
+	}
+
+	if (num_normals > context->normal_buffer_alloc)
+	{
+		int alloc = max(num_normals, 2 * context->normal_buffer_alloc);
+
+		struct Vector *normal_buffer = (struct Vector *)realloc(context->vertex_normal_buffer, alloc * sizeof(struct Vector));
+		if (normal_buffer == NULL)
+			return false;
+
+		context->vertex_normal_buffer = normal_buffer;
+		context->normal_buffer_alloc = alloc;
+	}
+
+	return true;
+}
+
+void calc_render_mat(const struct RenderContext *context, const struct Matrix *mv_mat, struct Matrix *render_mat)
+{
+	// assumes context is valid
+
+	struct Matrix proj_mv_mat;
+	MatMul(&context->proj_mat, mv_mat, &proj_mv_mat);
+	MatMul(&context->screen_mat, &proj_mv_mat, render_mat);
+}
+
+void transform_normals(const struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *mv_mat, int copy)
+{
+	// assumes context and mesh are valid and the buffers have room for copy
+
+	const struct Vector *normals = mesh->normals;
+	struct Vector *vertex_normal_buffer = context->vertex_normal_buffer + copy * mesh->num_normals;
+
+	for (int i = 0; i < mesh->num_normals; i++)
+	{
+		MatVecMul(mv_mat, &normals[i], &vertex_normal_buffer[i]);
+	}
+}
+
+void transform_vertices(const struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *render_mat, int copy)
+{
+	// assumes context and mesh are valid and the buffers have room for copy
+	// only writes to the copy, so instances can be transformed at once
+
+	const struct Vertex *vertices = mesh->vertices;
+	struct Vertex *vertex_buffer = context->vertex_buffer + copy * mesh->num_vertices;
+	struct Vector *clip_buffer = context->clip_buffer + copy * mesh->num_vertices;
+	uint8_t *clip_flags = context->clip_flags + copy * mesh->num_vertices;
+
+	// the screen matrix is already applied, so the frustum sides are at 0 and
+	// width or height times w
+	float width = (float)context->screen_width;
+	float height = (float)context->screen_height;
+	float guard = (float)GUARD_BAND;
+
+	// the result is screen x and y, depth and 1 / w for perspective correct
+	// interpolation
+	int i = 0;
+
+#if SIMD_WIDTH >= 4
+	__m128 m[4][4];
+	for (int r = 0; r < 4; r++)
+		for (int c = 0; c < 4; c++)
+			m[r][c] = _mm_set1_ps(render_mat->e[r][c]);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 znear = _mm_set1_ps(context->znear);
+	__m128 zfar = _mm_set1_ps(context->zfar);
+	__m128 width4 = _mm_set1_ps(width);
+	__m128 height4 = _mm_set1_ps(height);
+	__m128 guard_lo = _mm_set1_ps(-guard);
+	__m128 guard_hi_x = _mm_set1_ps(width + guard);
+	__m128 guard_hi_y = _mm_set1_ps(height + guard);
+
+	// four vertices at a time, transposed to x, y, z and w vectors
+	for (; i + 4 <= mesh->num_vertices; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&vertices[i].pos.x);
+		__m128 y = _mm_loadu_ps(&vertices[i + 1].pos.x);
+		__m128 z = _mm_loadu_ps(&vertices[i + 2].pos.x);
+		__m128 w = _mm_loadu_ps(&vertices[i + 3].pos.x);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		__m128 r[4];
+		for (int row = 0; row < 4; row++)
+			r[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[row][0], x), _mm_mul_ps(m[row][1], y)), _mm_add_ps(_mm_mul_ps(m[row][2], z), _mm_mul_ps(m[row][3], w)));
+
+		// one bit per vertex for every plane
+		int masks[7];
+		masks[0] = _mm_movemask_ps(_mm_cmplt_ps(r[3], znear));
+		masks[1] = _mm_movemask_ps(_mm_cmpgt_ps(r[3], zfar));
+		masks[2] = _mm_movemask_ps(_mm_cmplt_ps(r[0], zero));
+		masks[3] = _mm_movemask_ps(_mm_cmpgt_ps(r[0], _mm_mul_ps(r[3], width4)));
+		masks[4] = _mm_movemask_ps(_mm_cmplt_ps(r[1], zero));
+		masks[5] = _mm_movemask_ps(_mm_cmpgt_ps(r[1], _mm_mul_ps(r[3], height4)));
+		masks[6] = _mm_movemask_ps(_mm_or_ps(
+			_mm_or_ps(_mm_cmplt_ps(r[0], _mm_mul_ps(r[3], guard_lo)), _mm_cmpgt_ps(r[0], _mm_mul_ps(r[3], guard_hi_x))),
+			_mm_or_ps(_mm_cmplt_ps(r[1], _mm_mul_ps(r[3], guard_lo)), _mm_cmpgt_ps(r[1], _mm_mul_ps(r[3], guard_hi_y)))));
+
+		for (int k = 0; k < 4; k++)
+		{
+			uint8_t flags = 0;
+			for (int plane = 0; plane < 7; plane++)
+				flags |= ((masks[plane] >> k) & 1) << plane;
+
+			clip_flags[i + k] = flags;
+		}
+
+		x = r[0];
+		y = r[1];
+		z = r[2];
+		w = r[3];
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		_mm_storeu_ps(&clip_buffer[i].x, x);
+		_mm_storeu_ps(&clip_buffer[i + 1].x, y);
+		_mm_storeu_ps(&clip_buffer[i + 2].x, z);
+		_mm_storeu_ps(&clip_buffer[i + 3].x, w);
+
+		__m128 rhw = _mm_div_ps(_mm_set1_ps(1.0f), r[3]);
+		x = _mm_mul_ps(r[0], rhw);
+		y = _mm_mul_ps(r[1], rhw);
+		z = _mm_mul_ps(r[2], rhw);
+		w = rhw;
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		_mm_storeu_ps(&vertex_buffer[i].pos.x, x);
+		_mm_storeu_ps(&vertex_buffer[i + 1].pos.x, y);
+		_mm_storeu_ps(&vertex_buffer[i + 2].pos.x, z);
+		_mm_storeu_ps(&vertex_buffer[i + 3].pos.x, w);
+	}
+#endif
+
+	for (; i < mesh->num_vertices; i++)
+	{
+		const struct Vector *v = &vertices[i].pos;
+		struct Vector *r = &vertex_buffer[i].pos;
+
+		float x = (render_mat->e[0][0] * v->x + render_mat->e[0][1] * v->y) + (render_mat->e[0][2] * v->z + render_mat->e[0][3] * v->w);
+		float y = (render_mat->e[1][0] * v->x + render_mat->e[1][1] * v->y) + (render_mat->e[1][2] * v->z + render_mat->e[1][3] * v->w);
+		float z = (render_mat->e[2][0] * v->x + render_mat->e[2][1] * v->y) + (render_mat->e[2][2] * v->z + render_mat->e[2][3] * v->w);
+		float w = (render_mat->e[3][0] * v->x + render_mat->e[3][1] * v->y) + (render_mat->e[3][2] * v->z + render_mat->e[3][3] * v->w);
+
+		uint8_t flags = 0;
+		if (w < context->znear) flags |= CLIP_NEAR;
+		if (w > context->zfar) flags |= CLIP_FAR;
+		if (x < 0.0f) flags |= CLIP_LEFT;
+		if (x > w * width) flags |= CLIP_RIGHT;
+		if (y < 0.0f) flags |= CLIP_TOP;
+		if (y > w * height) flags |= CLIP_BOTTOM;
+		if (x < w * -guard || x > w * (width + guard) || y < w * -guard || y > w * (height + guard))
+			flags |= CLIP_GUARD_BAND;
+
+		clip_flags[i] = flags;
+		clip_buffer[i].x = x;
+		clip_buffer[i].y = y;
+		clip_buffer[i].z = z;
+		clip_buffer[i].w = w;
+
+		float rhw = 1.0f / w;
+		r->x = x * rhw;
+		r->y = y * rhw;
+		r->z = z * rhw;
+		r->w = rhw;
+	}
+}
+
+void render_view(void *data, int view)
+{
+	struct ViewJob *job = (struct ViewJob *)data;
+
+	render_mesh(job->views[view], job->mesh);
+}
+
+int cull_instances(struct RenderContext *context, const struct Mesh *mesh, const struct Matrix *matrices, int count)
+{
+	// assumes context, mesh and matrices are valid
+	// fills instances with the copies of the mesh not outside the frustum
+	// and returns how many, every triangle of the others is frustum culled
+
+	if (count > context->instances_alloc)
+	{
+		struct MeshInstance *instances = (struct MeshInstance *)realloc(context->instances, count * sizeof(struct MeshInstance));
+		if (instances == NULL)
+			return 0;
+
+		context->instances = instances;
+		context->instances_alloc = count;
+	}
+
+	// the spheres are tested in view space, so the planes come from the
+	// projection alone
+	struct Frustum frustum;
+	FrustumSetFromMatrix(&frustum, &context->proj_mat, context->znear, context->zfar);
+
+	struct BoundingSphere sphere;
+	calc_mesh_sphere(mesh, &sphere);
+
+	int num_instances = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		struct MeshInstance *instance = &context->instances[num_instances];
+		struct BoundingSphere view_sphere;
+		struct Vector clip_center;
+
+		MatMul(&context->mv_mat, &matrices[i], &instance->mv_mat);
+		SphereTransform(&instance->mv_mat, &sphere, &view_sphere);
+
+		if (FrustumTestSphere(&frustum, &view_sphere) == FRUSTUM_OUTSIDE)
+		{
+			context->stats.triangles_frustum_culled += mesh->num_triangles;
+			continue;
+		}
+
+		MatVecMul(&context->proj_mat, &view_sphere.center, &clip_center);
+		instance->depth = clip_center.w;
+		instance->index = i;
+		num_instances++;
+	}
+
+	// the triangles of each copy are sorted on their own, drawing the copies
+	// nearest first gets most of the way there
+	if (context->draw_order == DRAW_ORDER_FRONT_TO_BACK)
+		qsort(context->instances, num_instances, sizeof(struct MeshInstance), compare_instances);
+
+	return num_instances;
+}
+
+int compare_instances(const void *a, const void *b)
+{
+	const struct MeshInstance *ia = (const struct MeshInstance *)a;
+	const struct MeshInstance *ib = (const struct MeshInstance *)b;
+
+	// ties keep the order the matrices were passed in
+	if (ia->depth != ib->depth)
+		return ia->depth < ib->depth ? -1 : 1;
+
+	return ia->index - ib->index;
+}
+
+void calc_mesh_sphere(const struct Mesh *mesh, struct BoundingSphere *sphere)
+{
+	// assumes mesh is valid
+	// centered on the bounding box, which is close to the smallest sphere
+	// for the long thin shapes meshes often are
+
+	struct BoundingBox box;
+	BoxSetEmpty(&box);
+
+	for (int i = 0; i < mesh->num_vertices; i++)
+		BoxAddPoint(&box, &mesh->vertices[i].pos);
+
+	VecSet(&sphere->center, 0.0f, 0.0f, 0.0f, 1.0f);
+	sphere->radius = 0.0f;
+
+	if (BoxIsEmpty(&box))
+		return;
+
+	BoxCenter(&box, &sphere->center);
+
+	float radius_sq = 0.0f;
+
+	for (int i = 0; i < mesh->num_vertices; i++)
+	{
+		struct Vector d;
+		VecSub(&mesh->vertices[i].pos, &sphere->center, &d);
+		radius_sq = max(radius_sq, VecDot3(&d, &d));
+	}
+
+	sphere->radius = sqrtf(radius_sq);
+}
+
+int transform_instances(struct RenderContext *context, const struct Mesh *mesh, int first, int count)
+{
+	// assumes context and mesh are valid and the vertex buffers have room
+	// for min(count, INSTANCE_BATCH) copies
+	// transforms the next instances into a copy of the buffers each, spread
+	// over the thread pool when there is one, and returns how many
+
+	int num_copies = min(count, INSTANCE_BATCH);
+	double start = context->stats_enabled ? GetTimeMs() : 0.0;
+
+	struct InstanceJob job = { context, mesh, first };
+
+	if (context->thread_pool != NULL && num_copies > 1)
+		RunThreadPool(context->thread_pool, transform_instance, &job, num_copies);
+	else
+		for (int copy = 0; copy < num_copies; copy++)
+			transform_instance(&job, copy);
+
+	if (context->stats_enabled)
+		context->stats.transform_ms += GetTimeMs() - start;
+
+	return num_copies;
+}
+
+void transform_instance(void *data, int copy)
+{
+	struct InstanceJob *job = (struct InstanceJob *)data;
+	const struct MeshInstance *instance = &job->context->instances[job->first + copy];
+
+	struct Matrix render_mat;
+	calc_render_mat(job->context, &instance->mv_mat, &render_mat);
+
+	transform_normals(job->context, job->mesh, &instance->mv_mat, copy);
+	transform_vertices(job->context, job->mesh, &render_mat, copy);
+}
+
+void select_vertex_copy(struct RenderContext *context, const struct VertexBuffers *buffers, const struct Mesh *mesh, int copy)
+{
+	// assumes context, buffers and mesh are valid
+	// points the context's vertex buffers at a copy so triangles are set up
+	// from it as if it were the only one
+
+	context->vertex_buffer = buffers->vertex_buffer + copy * mesh->num_vertices;
+	context->vertex_normal_buffer = buffers->vertex_normal_buffer + copy * mesh->num_normals;
+	context->clip_buffer = buffers->clip_buffer + copy * mesh->num_vertices;
+	context->clip_flags = buffers->clip_flags + copy * mesh->num_vertices;
+}
+
+void render_mesh_bary_naive(struct RenderContext *context, const struct Mesh *mesh)
+{
+	if (context == NULL || mesh == NULL)
+		return;
+
+	struct Vertex *v0, *v1, *v2;
+
+	struct Triangle *tris = mesh->triangles;
+	struct Vertex *verts = context->vertex_buffer;
+	struct Vector *normals = context->vertex_normal_buffer;
+	struct UVCoord *uvcoords = mesh->uvcoords;
+	struct Material *materials = mesh->materials;
+
+	struct Vector light_vec = { 0.0f, 0.0f, -1.0f };
+
+	bool opaque = context->pixel_format == PIXEL_FORMAT_XRGB8888;
+
+	float t_area;
+
+	// drawn to pixel by pixel, so every tile is filled up front
+	fill_clear_tiles(context, 0, 0, context->screen_width - 1, context->screen_height - 1, CLEAR_PIXELS | CLEAR_DEPTH);
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+	{
+		v0 = &verts[tris[i].v0];
+		v1 = &verts[tris[i].v1];
+		v2 = &verts[tris[i].v2];
+
+		// screen positions behind the eye are meaningless
+		if ((context->clip_flags[tris[i].v0] | context->clip_flags[tris[i].v1] | context->clip_flags[tris[i].v2]) & CLIP_NEAR)
+			continue;
+
+		t_area = -calc_2xtri_area(&v0->pos, &v1->pos, &v2->pos);
+
+		if (t_area > 0)
+		{
+			float v0_light = max(0.4f, -VecDot3(&normals[tris[i].n0], &light_vec));
+			float v1_light = max(0.4f, -VecDot3(&normals[tris[i].n1], &light_vec));
+			float v2_light = max(0.4f, -VecDot3(&normals[tris[i].n2], &light_vec));
+
+			struct UVCoord uv0 = { uvcoords[tris[i].uv0].u * v0->pos.w, uvcoords[tris[i].uv0].v * v0->pos.w };
+			struct UVCoord uv1 = { uvcoords[tris[i].uv1].u * v1->pos.w, uvcoords[tris[i].uv1].v * v1->pos.w };
+			struct UVCoord uv2 = { uvcoords[tris[i].uv2].u * v2->pos.w, uvcoords[tris[i].uv2].v * v2->pos.w };
+
+			int xmin = max(0, (int)min(min(v0->pos.x, v1->pos.x), v2->pos.x));
+			int xmax = min((int)max(max(v0->pos.x, v1->pos.x), v2->pos.x) + 1, context->screen_width - 1);
+			int ymin = max(0, (int)min(min(v0->pos.y, v1->pos.y), v2->pos.y));
+			int ymax = min((int)max(max(v0->pos.y, v1->pos.y), v2->pos.y) + 1, context->screen_height - 1);
+
+			float t_area_inv = 1.0f / -t_area;
+
+			const struct Material *material = &materials[tris[i].material];
+
+			for (int y = ymin; y <= ymax; y++)
+			{
+				for (int x = xmin; x <= xmax; x++)
+				{
+					struct Vector p = { (float)x, (float)y };
+
+					float w0 = calc_2xtri_area(&v1->pos, &v2->pos, &p);
+					w0 *= t_area_inv;
+
+					float w1 = calc_2xtri_area(&v0->pos, &p, &v2->pos);
+					w1 *= t_area_inv;
+
+					float w2 = 1.0f - w0 - w1;
+
+					if (w0 > 0.0f && w1 > 0.0f && w2 > 0.0f)
+					{
+						float Z = depth_value(context, &v0->pos) * w0 + depth_value(context, &v1->pos) * w1 + depth_value(context, &v2->pos) * w2;
+						float z = 1.0f / (v0->pos.w * w0 + v1->pos.w * w1 + v2->pos.w * w2);
+
+						if (set_depth_if_z_is_closer(context, x, y, Z))
 						{
 							float ui = uv0.u * w0 + uv1.u * w1 + uv2.u * w2;
 							float u = z * ui;
 
-							float vi = uv0.v * w0 + uv1.v * w1 + uv2.v * w2;
-							float v = z * vi;
+							float vi = uv0.v * w0 + uv1.v * w1 + uv2.v * w2;
+							float v = z * vi;
+
+							float light = v0_light * w0 + v1_light * w1 + v2_light * w2;
+
+							uint32_t texel = material->tex_map != NULL ? sample_texture_map_nearest_neighbor(material->tex_map, u, v) : material_color(material);
+
+							set_pixel(context, x, y, shade_texel(texel, light, !material->unlit, opaque));
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void render_mesh_bary_step(struct RenderContext *context, const struct Mesh *mesh, int num_instances)
+{
+	// num_instances is 0 when render_mesh has transformed the mesh already
+
+	if (context == NULL || mesh == NULL)
+		return;
+
+	// deferred shading looks the triangles up again when resolving and the
+	// depth pre-pass draws them twice, so they are kept instead of set up on
+	// the stack. So they are when timing setup apart from rasterizing.
+	bool deferred = context->shading_mode == SHADING_MODE_DEFERRED;
+	bool prepass = context->depth_prepass && !deferred;
+	bool keep = deferred || prepass || context->stats_enabled;
+
+	if (keep && !deferred)
+		context->num_raster_tris = 0;
+
+	int first = context->num_raster_tris;
+	double start = context->stats_enabled ? GetTimeMs() : 0.0;
+
+	if (num_instances == 0)
+		raster_mesh_triangles(context, mesh, keep);
+
+	struct VertexBuffers buffers = { context->vertex_buffer, context->vertex_normal_buffer, context->clip_buffer, context->clip_flags };
+
+	for (int i = 0; i < num_instances;)
+	{
+		// transforming is timed on its own
+		double transform_ms = context->stats.transform_ms;
+		int num_copies = transform_instances(context, mesh, i, num_instances - i);
+		start += context->stats.transform_ms - transform_ms;
+
+		for (int copy = 0; copy < num_copies; copy++)
+		{
+			select_vertex_copy(context, &buffers, mesh, copy);
+			raster_mesh_triangles(context, mesh, keep);
+		}
+
+		// the next batch is transformed into the buffers from the start
+		select_vertex_copy(context, &buffers, mesh, 0);
+		i += num_copies;
+
+		if (keep && !deferred && i < num_instances && context->num_raster_tris >= INSTANCE_FLUSH_TRIS)
+		{
+			draw_kept_triangles(context, first, prepass, &start);
+			context->num_raster_tris = 0;
+		}
+	}
+
+	draw_kept_triangles(context, first, prepass, &start);
+	add_raster_counts(context, context->raster_state);
+}
+
+void raster_mesh_triangles(struct RenderContext *context, const struct Mesh *mesh, bool keep)
+{
+	// assumes context and mesh are valid and the vertices are transformed
+	// sets up the mesh's triangles and rasterizes them, or adds them to
+	// raster_tris when keep is set
+
+	struct RasterTriangle rts[MAX_CLIP_TRIANGLES];
+	struct RasterState *state = context->raster_state;
+	int x1 = context->screen_width - 1;
+	int y1 = context->screen_height - 1;
+
+	const int *order = sort_triangles(context, mesh);
+
+	for (int j = 0; j < mesh->num_triangles; j++)
+	{
+		int i = order != NULL ? order[j] : j;
+		struct RasterTriangle *setup = rts;
+
+		if (keep)
+		{
+			if (!reserve_raster_tris(context, MAX_CLIP_TRIANGLES))
+				break;
+
+			setup = &context->raster_tris[context->num_raster_tris];
+			context->num_raster_tris += setup_mesh_triangle(context, mesh, i, setup);
+			continue;
+		}
+
+		int count = setup_mesh_triangle(context, mesh, i, setup);
+
+		for (int k = 0; k < count; k++)
+			rasterize_triangle(context, state, &setup[k], 0, 0, x1, y1);
+	}
+}
+
+void draw_kept_triangles(struct RenderContext *context, int first, bool prepass, double *start)
+{
+	// assumes context and start are valid
+	// rasterizes the triangles kept from first on, with the depth pre-pass
+	// over all of them, timing setup up to now and rasterizing from *start
+
+	struct RasterState *state = context->raster_state;
+	int x1 = context->screen_width - 1;
+	int y1 = context->screen_height - 1;
+
+	if (context->stats_enabled)
+	{
+		double end = GetTimeMs();
+		context->stats.setup_ms += end - *start;
+		*start = end;
+	}
+
+	if (prepass)
+	{
+		// lay down the nearest depth of every pixel first so only the
+		// fragments that end up visible are shaded
+		state->pass = RASTER_PASS_DEPTH;
+		for (int i = 0; i < context->num_raster_tris; i++)
+			rasterize_triangle(context, state, &context->raster_tris[i], 0, 0, x1, y1);
+
+		state->pass = RASTER_PASS_SHADE_EQUAL;
+		for (int i = 0; i < context->num_raster_tris; i++)
+			rasterize_triangle(context, state, &context->raster_tris[i], 0, 0, x1, y1);
+
+		state->pass = RASTER_PASS_SHADE;
+	}
+	else
+	{
+		for (int i = first; i < context->num_raster_tris; i++)
+			rasterize_triangle(context, state, &context->raster_tris[i], 0, 0, x1, y1);
+	}
+
+	if (context->stats_enabled)
+	{
+		double end = GetTimeMs();
+		context->stats.raster_ms += end - *start;
+		*start = end;
+	}
+}
+
+void render_mesh_tiled(struct RenderContext *context, const struct Mesh *mesh, int num_instances)
+{
+	// num_instances is 0 when render_mesh has transformed the mesh already
+
+	if (context == NULL || mesh == NULL)
+		return;
+
+	if (context->tile_bins == NULL && !create_tile_bins(context))
+		return;
+
+	int num_tiles = context->num_tiles_x * context->num_tiles_y;
+	for (int t = 0; t < num_tiles; t++)
+		context->tile_bins[t].count = 0;
+
+	// set up every visible triangle once, then bin it into each tile its
+	// bounding box touches, keeping submission order within every bin.
+	// Deferred shading keeps the triangles of earlier meshes for the resolve.
+	if (context->shading_mode == SHADING_MODE_FORWARD)
+		context->num_raster_tris = 0;
+
+	reserve_raster_tris(context, mesh->num_triangles + MAX_CLIP_TRIANGLES);
+
+	double start = context->stats_enabled ? GetTimeMs() : 0.0;
+
+	if (num_instances == 0)
+		bin_mesh_triangles(context, mesh);
+
+	struct VertexBuffers buffers = { context->vertex_buffer, context->vertex_normal_buffer, context->clip_buffer, context->clip_flags };
+
+	for (int i = 0; i < num_instances;)
+	{
+		// transforming is timed on its own
+		double transform_ms = context->stats.transform_ms;
+		int num_copies = transform_instances(context, mesh, i, num_instances - i);
+		start += context->stats.transform_ms - transform_ms;
+
+		for (int copy = 0; copy < num_copies; copy++)
+		{
+			select_vertex_copy(context, &buffers, mesh, copy);
+			bin_mesh_triangles(context, mesh);
+		}
+
+		// the next batch is transformed into the buffers from the start
+		select_vertex_copy(context, &buffers, mesh, 0);
+		i += num_copies;
+
+		if (context->shading_mode == SHADING_MODE_FORWARD && i < num_instances && context->num_raster_tris >= INSTANCE_FLUSH_TRIS)
+		{
+			draw_tiles(context, mesh, &start);
+
+			for (int t = 0; t < num_tiles; t++)
+				context->tile_bins[t].count = 0;
+
+			context->num_raster_tris = 0;
+		}
+	}
+
+	draw_tiles(context, mesh, &start);
+}
+
+void bin_mesh_triangles(struct RenderContext *context, const struct Mesh *mesh)
+{
+	// assumes context and mesh are valid and the vertices are transformed
+	// sets up the mesh's triangles into raster_tris and bins them
+
+	const int *order = sort_triangles(context, mesh);
+
+	for (int j = 0; j < mesh->num_triangles; j++)
+	{
+		int i = order != NULL ? order[j] : j;
+
+		// clipping can turn one triangle into several
+		if (!reserve_raster_tris(context, MAX_CLIP_TRIANGLES))
+			break;
+
+		int first = context->num_raster_tris;
+		int count = setup_mesh_triangle(context, mesh, i, &context->raster_tris[first]);
+
+		for (int k = 0; k < count; k++)
+			bin_triangle(context, first + k);
+
+		context->num_raster_tris += count;
+	}
+}
+
+void draw_tiles(struct RenderContext *context, const struct Mesh *mesh, double *start)
+{
+	// assumes context, mesh and start are valid
+	// rasterizes the binned triangles, timing setup up to now and
+	// rasterizing from *start
+
+	int num_tiles = context->num_tiles_x * context->num_tiles_y;
+
+	if (context->stats_enabled)
+	{
+		double end = GetTimeMs();
+		context->stats.setup_ms += end - *start;
+		*start = end;
+	}
+
+	// every tile owns a disjoint rectangle of the pixel and depth buffers so
+	// the workers need no locking
+	struct TileJob job = { context, mesh };
+	RunThreadPool(context->thread_pool, render_tile, &job, num_tiles);
+
+	if (context->stats_enabled)
+	{
+		double end = GetTimeMs();
+		context->stats.raster_ms += end - *start;
+		*start = end;
+	}
+
+	for (int t = 0; t < num_tiles; t++)
+		add_raster_counts(context, &context->tile_bins[t].state);
+}
+
+void render_tile(void *data, int tile)
+{
+	struct TileJob *job = (struct TileJob *)data;
+	struct RenderContext *context = job->context;
+	struct TileBin *bin = &context->tile_bins[tile];
+
+	int x0 = (tile % context->num_tiles_x) * TILE_SIZE;
+	int y0 = (tile / context->num_tiles_x) * TILE_SIZE;
+	int x1 = min(x0 + TILE_SIZE, context->screen_width) - 1;
+	int y1 = min(y0 + TILE_SIZE, context->screen_height) - 1;
+
+	if (context->depth_prepass && context->shading_mode == SHADING_MODE_FORWARD)
+	{
+		// the tile's depth is complete before any of it is shaded
+		bin->state.pass = RASTER_PASS_DEPTH;
+		for (int i = 0; i < bin->count; i++)
+			rasterize_triangle(context, &bin->state, &context->raster_tris[bin->tris[i]], x0, y0, x1, y1);
+
+		bin->state.pass = RASTER_PASS_SHADE_EQUAL;
+	}
+
+	for (int i = 0; i < bin->count; i++)
+		rasterize_triangle(context, &bin->state, &context->raster_tris[bin->tris[i]], x0, y0, x1, y1);
+
+	bin->state.pass = RASTER_PASS_SHADE;
+}
+
+bool reserve_raster_tris(struct RenderContext *context, int count)
+{
+	// assumes context is valid
+	// makes room for count more triangles after the num_raster_tris in use
+
+	if (context->num_raster_tris + count <= context->raster_tris_alloc)
+		return true;
+
+	int alloc = max(context->raster_tris_alloc * 2, context->num_raster_tris + count);
+	struct RasterTriangle *raster_tris = (struct RasterTriangle *)realloc(context->raster_tris, alloc * sizeof(struct RasterTriangle));
+	if (raster_tris == NULL)
+		return false;
+
+	context->raster_tris = raster_tris;
+	context->raster_tris_alloc = alloc;
+
+	return true;
+}
+
+const int *sort_triangles(struct RenderContext *context, const struct Mesh *mesh)
+{
+	// assumes context and mesh are valid and the vertices are transformed
+	// returns the mesh's triangle indices nearest first, or NULL to draw them
+	// in mesh order
+
+	if (context->draw_order != DRAW_ORDER_FRONT_TO_BACK || mesh->num_triangles == 0)
+		return NULL;
+
+	// the indices followed by the key of every triangle
+	if (2 * mesh->num_triangles > context->tri_order_alloc)
+	{
+		int *tri_order = (int *)realloc(context->tri_order, 2 * mesh->num_triangles * sizeof(int));
+		if (tri_order == NULL)
+			return NULL;
+
+		context->tri_order = tri_order;
+		context->tri_order_alloc = 2 * mesh->num_triangles;
+	}
+
+	int *order = context->tri_order;
+	int *keys = context->tri_order + mesh->num_triangles;
+	int counts[DRAW_ORDER_BUCKETS + 1] = { 0 };
+
+	// a counting sort on the w of each triangle's nearest vertex, which is
+	// its view depth, bucketed between the near and far planes. Triangles in
+	// the same bucket keep their mesh order.
+	const struct Vector *clip_buffer = context->clip_buffer;
+	float scale = DRAW_ORDER_BUCKETS / (context->zfar - context->znear);
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+	{
+		const struct Triangle *tri = &mesh->triangles[i];
+		float w = min(clip_buffer[tri->v0].w, min(clip_buffer[tri->v1].w, clip_buffer[tri->v2].w));
+		float bucket = (w - context->znear) * scale;
+
+		// written so NaN lands in the last bucket
+		int key = DRAW_ORDER_BUCKETS - 1;
+		if (bucket < DRAW_ORDER_BUCKETS - 1)
+			key = bucket > 0.0f ? (int)bucket : 0;
+
+		keys[i] = key;
+		counts[key + 1]++;
+	}
+
+	for (int k = 1; k <= DRAW_ORDER_BUCKETS; k++)
+		counts[k] += counts[k - 1];
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+		order[counts[keys[i]]++] = i;
+
+	return order;
+}
+
+void add_raster_counts(struct RenderContext *context, struct RasterState *state)
+{
+	// assumes context is valid
+	// moves the counters of a finished raster state to the context, the
+	// rasterizers only count pixels and hi-z rejections
+
+	struct RenderStats *stats = &context->stats;
+
+	stats->pixels_tested += state->stats.pixels_tested;
+	stats->pixels_covered += state->stats.pixels_covered;
+	stats->depth_tests_passed += state->stats.depth_tests_passed;
+	stats->depth_tests_failed += state->stats.depth_tests_failed;
+	stats->fragments_shaded += state->stats.fragments_shaded;
+	stats->hiz_blocks_rejected += state->stats.hiz_blocks_rejected;
+	stats->hiz_triangles_rejected += state->stats.hiz_triangles_rejected;
+	stats->depth_bytes_read += state->stats.depth_bytes_read;
+	stats->depth_bytes_written += state->stats.depth_bytes_written;
+
+	memset(&state->stats, 0, sizeof(state->stats));
+}
+
+void resolve_band(void *data, int band)
+{
+	struct RenderContext *context = (struct RenderContext *)data;
+
+	// copies, the id stores could otherwise alias them
+	int width = context->screen_width;
+	uint32_t num_ids = (uint32_t)context->num_raster_tris;
+
+	int y0 = band * TILE_SIZE;
+	int y1 = min(y0 + TILE_SIZE, context->screen_height) - 1;
+
+	// tiles nothing was drawn to only need their clear color
+	const uint8_t *tiles = &context->clear_tiles[band * context->num_clear_tiles_x];
+
+	for (int tx = 0; tx < context->num_clear_tiles_x; tx++)
+		fill_clear_tile(context, tx + band * context->num_clear_tiles_x, CLEAR_PIXELS);
+
+	if (context->visibility_buffer == NULL)
+		return;
+
+	for (int y = y0; y <= y1; y++)
+	{
+		const uint32_t *ids = &context->visibility_buffer[y * width];
+
+		// the ids of tiles whose depth clear is pending are stale, so only
+		// runs of drawn tiles are shaded and spans never cross into the others
+		for (int tx = 0; tx < context->num_clear_tiles_x;)
+		{
+			if (tiles[tx] & CLEAR_DEPTH)
+			{
+				tx++;
+				continue;
+			}
+
+			int x = tx * TILE_SIZE;
+
+			while (tx < context->num_clear_tiles_x && !(tiles[tx] & CLEAR_DEPTH))
+				tx++;
+
+			int end = min(tx * TILE_SIZE, width);
+
+			resolve_row(context, ids, num_ids, x, end, y);
+		}
+	}
+}
+
+void resolve_row(struct RenderContext *context, const uint32_t *ids, uint32_t num_ids, int x, int end, int y)
+{
+	// assumes context is valid
+	// shades the pixels of row y from x up to end
+
+	while (x < end)
+	{
+		// skip the background a few pixels at a time
+		while (x + 8 <= end && (ids[x] | ids[x + 1] | ids[x + 2] | ids[x + 3] | ids[x + 4] | ids[x + 5] | ids[x + 6] | ids[x + 7]) == 0)
+			x += 8;
+
+		if (x == end)
+			break;
+
+		uint32_t id = ids[x];
+
+		if (id == 0 || id > num_ids)
+		{
+			x++;
+			continue;
+		}
+
+		// neighbouring pixels of the same triangle are shaded together,
+		// padded to whole SIMD groups where shade_span skips the pixels of
+		// other triangles
+		int n = 1;
+		while (n < RASTER_SPAN && x + n < end && ids[x + n] == id)
+			n++;
+
+		int padded = min((n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH, end - x);
+
+		// the visibility buffer already says which pixels are covered and the
+		// attributes come from the planes, so no weights are needed
+		shade_span(context, &context->raster_tris[id - 1], x, y, padded, NULL, NULL, NULL, SHADE_TEST_VISIBLE, id);
+
+		x += n;
+	}
+}
+
+float hiz_block_depth(struct RenderContext *context, int bx, int by)
+{
+	// assumes context is valid and hi-z is enabled
+
+	int block = bx + by * context->hiz_width;
+
+	if (context->hiz_dirty[block])
+	{
+		int x0 = bx * HIZ_BLOCK_SIZE;
+		int y0 = by * HIZ_BLOCK_SIZE;
+		int x1 = min(x0 + HIZ_BLOCK_SIZE, context->screen_width);
+		int y1 = min(y0 + HIZ_BLOCK_SIZE, context->screen_height);
+
+		float farthest = context->depth_clear_value;
+
+		// a block whose tile is pending its depth clear is all clear value
+		int tile = x0 / TILE_SIZE + (y0 / TILE_SIZE) * context->num_clear_tiles_x;
+
+		if (!(context->clear_tiles[tile] & CLEAR_DEPTH))
+		{
+			farthest = load_depth(context, x0 + y0 * context->screen_width);
+
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++)
+					farthest = max(farthest, load_depth(context, x + y * context->screen_width));
+		}
+
+		context->hiz_buffer[block] = farthest;
+		context->hiz_dirty[block] = 0;
+	}
+
+	return context->hiz_buffer[block];
+}
+
+float hiz_zmin(const struct RasterState *state, const struct RasterTriangle *rt)
+{
+	// shading after a depth pre-pass also passes pixels at exactly their
+	// stored depth, so a block whose farthest depth is the triangle's nearest
+	// one still has to be rasterized
+	if (state->pass == RASTER_PASS_SHADE_EQUAL)
+		return nextafterf(rt->zmin, -INFINITY);
+
+	return rt->zmin;
+}
+
+bool hiz_rect_visible(struct RenderContext *context, float zmin, int x0, int y0, int x1, int y1)
+{
+	// assumes context is valid and hi-z is enabled
+
+	// a pixel only passes if its stored depth is greater than the new one,
+	// so nothing in a block can pass if the triangle's nearest depth is at or
+	// behind the block's farthest depth
+	for (int by = y0 / HIZ_BLOCK_SIZE; by <= y1 / HIZ_BLOCK_SIZE; by++)
+		for (int bx = x0 / HIZ_BLOCK_SIZE; bx <= x1 / HIZ_BLOCK_SIZE; bx++)
+			if (hiz_block_depth(context, bx, by) > zmin)
+				return true;
+
+	return false;
+}
+
+void hiz_classify_row(struct RenderContext *context, struct RasterState *state, float zmin, int x0, int x1, int y)
+{
+	// assumes context is valid and hi-z is enabled
+
+	int by = y / HIZ_BLOCK_SIZE;
+	int bx0 = x0 / HIZ_BLOCK_SIZE;
+
+	for (int bx = bx0; bx <= x1 / HIZ_BLOCK_SIZE; bx++)
+	{
+		bool rejected = !(hiz_block_depth(context, bx, by) > zmin);
+		state->block_rejected[bx - bx0] = rejected;
+
+		// the block may be written from here on, its depth is recomputed the
+		// next time it is tested
+		if (rejected)
+			state->stats.hiz_blocks_rejected++;
+		else
+			context->hiz_dirty[bx + by * context->hiz_width] = 1;
+	}
+}
+
+int next_raster_run(struct RenderContext *context, struct RasterState *state, int x, int xstart, int xend, bool *rejected)
+{
+	// assumes context is valid
+	// returns the number of pixels from x on that hi-z treats the same way
+
+	int end = min(x + RASTER_SPAN - 1, xend);
+
+	if (!context->hiz_enabled)
+	{
+		*rejected = false;
+		return end - x + 1;
+	}
+
+	int bx0 = xstart / HIZ_BLOCK_SIZE;
+	int bx = x / HIZ_BLOCK_SIZE;
+
+	*rejected = state->block_rejected[bx - bx0];
+
+	int run_end = (bx + 1) * HIZ_BLOCK_SIZE - 1;
+	while (run_end < end && state->block_rejected[bx + 1 - bx0] == *rejected)
+	{
+		bx++;
+		run_end += HIZ_BLOCK_SIZE;
+	}
+
+	return min(run_end, end) - x + 1;
+}
+
+void bin_triangle(struct RenderContext *context, int index)
+{
+	// assumes context is valid
+
+	struct RasterTriangle *rt = &context->raster_tris[index];
+
+	if (rt->xmin > rt->xmax || rt->ymin > rt->ymax)
+		return;
+
+	int tx0 = rt->xmin / TILE_SIZE;
+	int tx1 = rt->xmax / TILE_SIZE;
+	int ty0 = rt->ymin / TILE_SIZE;
+	int ty1 = rt->ymax / TILE_SIZE;
+
+	for (int ty = ty0; ty <= ty1; ty++)
+	{
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			struct TileBin *bin = &context->tile_bins[tx + ty * context->num_tiles_x];
+
+			if (bin->count == bin->alloc)
+			{
+				int alloc = bin->alloc > 0 ? bin->alloc * 2 : 64;
+				int *tris = (int *)realloc(bin->tris, alloc * sizeof(int));
+				if (tris == NULL)
+					continue;
+
+				bin->tris = tris;
+				bin->alloc = alloc;
+			}
+
+			bin->tris[bin->count++] = index;
+		}
+	}
+}
+
+bool create_tile_bins(struct RenderContext *context)
+{
+	int num_tiles_x = (context->screen_width + TILE_SIZE - 1) / TILE_SIZE;
+	int num_tiles_y = (context->screen_height + TILE_SIZE - 1) / TILE_SIZE;
+
+	if (num_tiles_x <= 0 || num_tiles_y <= 0)
+		return false;
+
+	context->tile_bins = (struct TileBin *)calloc(num_tiles_x * num_tiles_y, sizeof(struct TileBin));
+	if (context->tile_bins == NULL)
+		return false;
+
+	for (int t = 0; t < num_tiles_x * num_tiles_y; t++)
+	{
+		context->tile_bins[t].state.block_rejected = malloc(TILE_SIZE / HIZ_BLOCK_SIZE + 1);
+		if (context->tile_bins[t].state.block_rejected == NULL)
+			return false;
+	}
+
+	context->num_tiles_x = num_tiles_x;
+	context->num_tiles_y = num_tiles_y;
+
+	return true;
+}
+
+void destroy_tile_bins(struct RenderContext *context)
+{
+	if (context->tile_bins != NULL)
+	{
+		for (int t = 0; t < context->num_tiles_x * context->num_tiles_y; t++)
+		{
+			free(context->tile_bins[t].tris);
+			free(context->tile_bins[t].state.block_rejected);
+		}
+
+		free(context->tile_bins);
+	}
+
+	context->tile_bins = NULL;
+	context->num_tiles_x = 0;
+	context->num_tiles_y = 0;
+}
+
+int fill_clear_tile(struct RenderContext *context, int tile, uint8_t flags)
+{
+	// assumes context is valid
+	// fills the buffers in flags of a tile that are still pending a clear,
+	// returns the number of depth values filled
+
+	uint8_t pending = context->clear_tiles[tile] & flags;
+
+	if (pending == 0)
+		return 0;
+
+	int x0 = (tile % context->num_clear_tiles_x) * TILE_SIZE;
+	int y0 = (tile / context->num_clear_tiles_x) * TILE_SIZE;
+	int x1 = min(x0 + TILE_SIZE, context->screen_width);
+	int y1 = min(y0 + TILE_SIZE, context->screen_height);
+
+	for (int y = y0; y < y1; y++)
+	{
+		if (pending & CLEAR_PIXELS)
+		{
+			uint32_t *pixels = &context->pixel_buffer->buffer[y * context->screen_width];
+
+			for (int x = x0; x < x1; x++)
+				pixels[x] = context->pixel_clear_value;
+		}
+
+		if (pending & CLEAR_DEPTH)
+		{
+			// the far values of the reverse and 16 bit formats are all zero
+			// or all one bits
+			if (context->depth_format == DEPTH_FORMAT_UNORM16)
+			{
+				memset((uint16_t *)context->depth_buffer->buffer + x0 + y * context->screen_width, 0xff, (x1 - x0) * sizeof(uint16_t));
+			}
+			else if (context->depth_format == DEPTH_FORMAT_REVERSE_FLOAT)
+			{
+				memset((float *)context->depth_buffer->buffer + x0 + y * context->screen_width, 0, (x1 - x0) * sizeof(float));
+			}
+			else
+			{
+				float *depths = (float *)&context->depth_buffer->buffer[y * context->screen_width];
+
+				for (int x = x0; x < x1; x++)
+					depths[x] = context->depth_clear_value;
+			}
+
+			if (context->visibility_buffer != NULL)
+				memset(&context->visibility_buffer[x0 + y * context->screen_width], 0, (x1 - x0) * sizeof(uint32_t));
+		}
+	}
+
+	context->clear_tiles[tile] &= ~pending;
+
+	return pending & CLEAR_DEPTH ? (x1 - x0) * (y1 - y0) : 0;
+}
+
+int fill_clear_tiles(struct RenderContext *context, int x0, int y0, int x1, int y1, uint8_t flags)
+{
+	// assumes context is valid
+	// fills the tiles overlapping the inclusive rectangle (x0, y0) - (x1, y1)
+
+	int filled = 0;
+
+	for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+		for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+			filled += fill_clear_tile(context, tx + ty * context->num_clear_tiles_x, flags);
+
+	return filled;
+}
+
+int setup_mesh_triangle(struct RenderContext *context, const struct Mesh *mesh, int i, struct RasterTriangle *rts)
+{
+	// assumes context and mesh are valid
+	// rts has room for MAX_CLIP_TRIANGLES
+
+	struct Triangle *tri = &mesh->triangles[i];
+	uint8_t *clip_flags = context->clip_flags;
+
+	uint8_t f0 = clip_flags[tri->v0];
+	uint8_t f1 = clip_flags[tri->v1];
+	uint8_t f2 = clip_flags[tri->v2];
+
+	// outside when every vertex is outside the same frustum plane
+	if (f0 & f1 & f2 & CLIP_FRUSTUM)
+	{
+		context->stats.triangles_frustum_culled++;
+		return 0;
+	}
+
+	uint8_t clip = (f0 | f1 | f2) & (CLIP_NEAR | CLIP_GUARD_BAND);
+
+	if (clip & CLIP_NEAR)
+	{
+		// vertices behind the eye flip the winding on screen, the sign of
+		// the determinant of the homogeneous x, y and w does not change
+		struct Vector *c0 = &context->clip_buffer[tri->v0];
+		struct Vector *c1 = &context->clip_buffer[tri->v1];
+		struct Vector *c2 = &context->clip_buffer[tri->v2];
+
+		float det = c0->x * (c1->y * c2->w - c2->y * c1->w) -
+			c0->y * (c1->x * c2->w - c2->x * c1->w) +
+			c0->w * (c1->x * c2->y - c2->x * c1->y);
+
+		if (!(det < 0))
+		{
+			context->stats.triangles_backface_culled++;
+			return 0;
+		}
+	}
+	else if (context->raster_mode != RASTER_MODE_FIXED_POINT)
+	{
+		// fixed point decides on the snapped vertices instead, culling here
+		// could open holes along silhouettes
+		struct Vertex *verts = context->vertex_buffer;
+
+		if (!(-calc_2xtri_area(&verts[tri->v0].pos, &verts[tri->v1].pos, &verts[tri->v2].pos) > 0))
+		{
+			context->stats.triangles_backface_culled++;
+			return 0;
+		}
+	}
+
+	const struct Material *material = &mesh->materials[tri->material];
+
+	struct RasterVertex poly[MAX_CLIP_VERTICES];
+	load_raster_vertex(context, mesh, tri->v0, tri->n0, tri->uv0, clip != 0, &poly[0]);
+	load_raster_vertex(context, mesh, tri->v1, tri->n1, tri->uv1, clip != 0, &poly[1]);
+	load_raster_vertex(context, mesh, tri->v2, tri->n2, tri->uv2, clip != 0, &poly[2]);
+
+	// inside the guard band the rasterizers clamp to the screen themselves
+	if (clip == 0)
+	{
+		rts[0].index = i;
+		set_triangle_material(context, material, &rts[0]);
+
+		if (!setup_triangle(context, &poly[0], &poly[1], &poly[2], &rts[0]))
+			return 0;
+
+		context->stats.triangles_rasterized++;
+		return 1;
+	}
+
+	context->stats.triangles_clipped++;
+
+	// clip in homogeneous space where all the attributes are linear
+	float width = (float)context->screen_width;
+	float height = (float)context->screen_height;
+	float guard = (float)GUARD_BAND;
+
+	struct ClipPlane planes[5] =
+	{
+		{ 0.0f, 0.0f, 1.0f, -context->znear },
+		{ 1.0f, 0.0f, guard, 0.0f },
+		{ -1.0f, 0.0f, width + guard, 0.0f },
+		{ 0.0f, 1.0f, guard, 0.0f },
+		{ 0.0f, -1.0f, height + guard, 0.0f }
+	};
+
+	struct RasterVertex temp[MAX_CLIP_VERTICES];
+	int n = 3;
+
+	for (int p = (clip & CLIP_NEAR) ? 0 : 1; p < 5 && n >= 3; p++)
+	{
+		n = clip_polygon(poly, n, &planes[p], temp);
+		memcpy(poly, temp, n * sizeof(struct RasterVertex));
+	}
+
+	for (int k = 0; k < n; k++)
+	{
+		struct Vector *pos = &poly[k].pos;
+		float rhw = 1.0f / pos->w;
+
+		pos->x *= rhw;
+		pos->y *= rhw;
+		pos->z *= rhw;
+		pos->w = rhw;
+	}
+
+	// the clipped polygon is convex, fan it out from its first vertex
+	int count = 0;
+
+	for (int k = 1; k + 1 < n; k++)
+	{
+		rts[count].index = i;
+		set_triangle_material(context, material, &rts[count]);
+
+		if (setup_triangle(context, &poly[0], &poly[k], &poly[k + 1], &rts[count]))
+			count++;
+	}
+
+	context->stats.triangles_rasterized += count;
+
+	return count;
+}
+
+void set_triangle_material(struct RenderContext *context, const struct Material *material, struct RasterTriangle *rt)
+{
+	// assumes context and material are valid
+	// picks the pixel pipeline variant once per triangle so the span loops
+	// never look at the material
+
+	rt->tex_map = material->tex_map;
+	rt->lit = !material->unlit;
+
+	if (material->tex_map == NULL)
+	{
+		rt->color = PIXEL_COLOR_MATERIAL;
+		rt->diffuse = material_color(material);
+	}
+	else
+	{
+		rt->color = context->texture_filter == TEXTURE_FILTER_NEAREST ? PIXEL_COLOR_NEAREST : PIXEL_COLOR_FILTERED;
+		rt->diffuse = 0;
+	}
+}
+
+void load_raster_vertex(struct RenderContext *context, const struct Mesh *mesh, int v, int n, int uv, bool clip_space, struct RasterVertex *rv)
+{
+	// assumes context and mesh are valid
+
+	struct Vector light_vec = { 0.0f, 0.0f, -1.0f };
+
+	rv->pos = clip_space ? context->clip_buffer[v] : context->vertex_buffer[v].pos;
+	rv->uv = mesh->uvcoords[uv];
+	rv->light = max(0.4f, -VecDot3(&context->vertex_normal_buffer[n], &light_vec));
+}
+
+int clip_polygon(const struct RasterVertex *in, int count, const struct ClipPlane *plane, struct RasterVertex *out)
+{
+	// keeps the part of the convex polygon in on the inside of the plane,
+	// out has room for count + 1 vertices
+
+	int n = 0;
+
+	const struct RasterVertex *a = &in[count - 1];
+	float da = plane->x * a->pos.x + plane->y * a->pos.y + plane->w * a->pos.w + plane->d;
+
+	for (int k = 0; k < count; k++)
+	{
+		const struct RasterVertex *b = &in[k];
+		float db = plane->x * b->pos.x + plane->y * b->pos.y + plane->w * b->pos.w + plane->d;
+
+		// emit the crossing point of every edge with ends on both sides
+		if ((da >= 0.0f) != (db >= 0.0f))
+		{
+			float t = da / (da - db);
+			struct RasterVertex *c = &out[n++];
+
+			c->pos.x = a->pos.x + (b->pos.x - a->pos.x) * t;
+			c->pos.y = a->pos.y + (b->pos.y - a->pos.y) * t;
+			c->pos.z = a->pos.z + (b->pos.z - a->pos.z) * t;
+			c->pos.w = a->pos.w + (b->pos.w - a->pos.w) * t;
+			c->uv.u = a->uv.u + (b->uv.u - a->uv.u) * t;
+			c->uv.v = a->uv.v + (b->uv.v - a->uv.v) * t;
+			c->light = a->light + (b->light - a->light) * t;
+		}
+
+		if (db >= 0.0f)
+			out[n++] = *b;
+
+		a = b;
+		da = db;
+	}
+
+	return n;
+}
+
+bool setup_triangle(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt)
+{
+	// assumes context is valid
+	// rt->index and the material are set by the caller
+
+	switch (context->raster_mode)
+	{
+	case RASTER_MODE_FIXED_POINT:
+		return setup_triangle_fixed_point(context, v0, v1, v2, rt);
+
+	default:
+		return setup_triangle_bary_step(context, v0, v1, v2, rt);
+	}
+}
+
+void rasterize_triangle(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1)
+{
+	// assumes context is valid
+
+	int xstart = max(rt->xmin, x0);
+	int xend = min(rt->xmax, x1);
+	int ystart = max(rt->ymin, y0);
+	int yend = min(rt->ymax, y1);
+
+	if (xstart > xend || ystart > yend)
+		return;
+
+	// reject the whole triangle when it is behind everything in its rectangle
+	if (context->hiz_enabled && !hiz_rect_visible(context, hiz_zmin(state, rt), xstart, ystart, xend, yend))
+	{
+		state->stats.hiz_triangles_rejected++;
+		return;
+	}
+
+	// the tiles drawn to get their clear values first, each tile is only
+	// ever drawn to by one thread
+	int filled = fill_clear_tiles(context, xstart, ystart, xend, yend, CLEAR_PIXELS | CLEAR_DEPTH);
+
+	if (context->stats_enabled)
+		state->stats.depth_bytes_written += (uint64_t)filled * depth_texel_size(context->depth_format);
+
+	switch (context->raster_mode)
+	{
+	case RASTER_MODE_FIXED_POINT:
+		rasterize_triangle_fixed_point(context, state, rt, x0, y0, x1, y1);
+		break;
+
+	case RASTER_MODE_SPAN:
+		rasterize_triangle_span(context, state, rt, x0, y0, x1, y1);
+		break;
+
+	default:
+		rasterize_triangle_bary_step(context, state, rt, x0, y0, x1, y1);
+		break;
+	}
+}
+
+void setup_triangle_attributes(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt)
+{
+	// assumes context is valid
+
+	// rt->xmin and rt->ymin are set, the planes start there
+
+	// in the units of the depth format, interpolated across the triangle
+	float z0 = depth_value(context, &v0->pos);
+	float z1 = depth_value(context, &v1->pos);
+	float z2 = depth_value(context, &v2->pos);
+	rt->zmin = min(min(z0, z1), z2);
+	rt->zmin -= fabsf(rt->zmin) * HIZ_MARGIN;
+
+	float dx1 = v1->pos.x - v0->pos.x;
+	float dy1 = v1->pos.y - v0->pos.y;
+	float dx2 = v2->pos.x - v0->pos.x;
+	float dy2 = v2->pos.y - v0->pos.y;
+
+	float det = dx1 * dy2 - dx2 * dy1;
+	float det_inv = det != 0.0f ? 1.0f / det : 0.0f;
+
+	float ox = (float)rt->xmin - v0->pos.x;
+	float oy = (float)rt->ymin - v0->pos.y;
+
+	setup_plane(z0, z1, z2, dx1, dy1, dx2, dy2, det_inv, ox, oy, &rt->z);
+	setup_plane(v0->pos.w, v1->pos.w, v2->pos.w, dx1, dy1, dx2, dy2, det_inv, ox, oy, &rt->q);
+	setup_plane(v0->uv.u * v0->pos.w, v1->uv.u * v1->pos.w, v2->uv.u * v2->pos.w, dx1, dy1, dx2, dy2, det_inv, ox, oy, &rt->u);
+	setup_plane(v0->uv.v * v0->pos.w, v1->uv.v * v1->pos.w, v2->uv.v * v2->pos.w, dx1, dy1, dx2, dy2, det_inv, ox, oy, &rt->v);
+	setup_plane(v0->light, v1->light, v2->light, dx1, dy1, dx2, dy2, det_inv, ox, oy, &rt->light);
+}
+
+void setup_plane(float a0, float a1, float a2, float dx1, float dy1, float dx2, float dy2, float det_inv, float ox, float oy, struct AttributePlane *plane)
+{
+	// the plane through the attribute at the three vertices, (dx1, dy1) and
+	// (dx2, dy2) lead from the first vertex to the other two and (ox, oy)
+	// from it to where the plane starts
+	float da1 = a1 - a0;
+	float da2 = a2 - a0;
+
+	plane->dx = (da1 * dy2 - da2 * dy1) * det_inv;
+	plane->dy = (da2 * dx1 - da1 * dx2) * det_inv;
+	plane->a = a0 + ox * plane->dx + oy * plane->dy;
+}
+
+float plane_value(const struct AttributePlane *plane, int dx, int dy)
+{
+	// (dx, dy) pixels from where the plane starts, the same arithmetic as
+	// the SIMD spans so a pixel gets the same bits whichever path draws it
+	return (plane->a + (float)dy * plane->dy) + (float)dx * plane->dx;
+}
+
+bool setup_triangle_bary_step(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt)
+{
+	// assumes context is valid
+
+	float t_area = -calc_2xtri_area(&v0->pos, &v1->pos, &v2->pos);
+
+	if (!(t_area > 0))
+		return false;
+
+	rt->xmin = max(0, (int)min(min(v0->pos.x, v1->pos.x), v2->pos.x));
+	rt->xmax = min((int)max(max(v0->pos.x, v1->pos.x), v2->pos.x) + 1, context->screen_width - 1);
+	rt->ymin = max(0, (int)min(min(v0->pos.y, v1->pos.y), v2->pos.y));
+	rt->ymax = min((int)max(max(v0->pos.y, v1->pos.y), v2->pos.y) + 1, context->screen_height - 1);
+
+	setup_triangle_attributes(context, v0, v1, v2, rt);
+
+	float t_area_inv = 1.0f / -t_area;
+
+	struct Vector p = { (float)rt->xmin, (float)rt->ymin };
+
+	rt->w0 = calc_2xtri_area(&v1->pos, &v2->pos, &p);
+	rt->w0 *= t_area_inv;
+	rt->w0dx = -(v2->pos.y - v1->pos.y) * t_area_inv;
+	rt->w0dy = (v2->pos.x - v1->pos.x) * t_area_inv;
+
+	rt->w1 = calc_2xtri_area(&v0->pos, &p, &v2->pos);
+	rt->w1 *= t_area_inv;
+	rt->w1dx = -(v0->pos.y - v2->pos.y) * t_area_inv;
+	rt->w1dy = (v0->pos.x - v2->pos.x) * t_area_inv;
+
+	rt->w2 = 1.0f - rt->w0 - rt->w1;
+	rt->w2dx = -(v1->pos.y - v0->pos.y) * t_area_inv;
+	rt->w2dy = (v1->pos.x - v0->pos.x) * t_area_inv;
+
+	return true;
+}
+
+void rasterize_triangle_bary_step(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1)
+{
+	// assumes context is valid
+	// only pixels inside the inclusive rectangle (x0, y0) - (x1, y1) are touched
+
+	int xstart = max(rt->xmin, x0);
+	int xend = min(rt->xmax, x1);
+	int ystart = max(rt->ymin, y0);
+	int yend = min(rt->ymax, y1);
+
+	if (xstart > xend || ystart > yend)
+		return;
+
+	// the weights are stepped exactly as a walk over the whole bounding box
+	// would step them, so a clipped rectangle produces bit-identical pixels
+	float w0ady = 0.0f;
+	float w1ady = 0.0f;
+	float w2ady = 0.0f;
+
+	float ws0[RASTER_SPAN];
+	float ws1[RASTER_SPAN];
+	float ws2[RASTER_SPAN];
+
+	for (int y = rt->ymin; y <= yend; y++)
+	{
+		if (y >= ystart)
+		{
+			if (context->hiz_enabled && (y == ystart || y % HIZ_BLOCK_SIZE == 0))
+				hiz_classify_row(context, state, hiz_zmin(state, rt), xstart, xend, y);
+
+			float w0 = y == rt->ymin ? rt->w0 : rt->w0 + w0ady;
+			float w1 = y == rt->ymin ? rt->w1 : rt->w1 + w1ady;
+			float w2 = y == rt->ymin ? rt->w2 : rt->w2 + w2ady;
+
+			for (int x = rt->xmin; x < xstart; x++)
+			{
+				w0 += rt->w0dx;
+				w1 += rt->w1dx;
+				w2 += rt->w2dx;
+			}
+
+			// the stepping is a serial chain of adds, so it runs ahead of the
+			// shading which then evaluates several pixels at once
+			for (int x = xstart; x <= xend;)
+			{
+				bool rejected;
+				int n = next_raster_run(context, state, x, xstart, xend, &rejected);
+
+				for (int k = 0; k < n; k++)
+				{
+					ws0[k] = w0;
+					ws1[k] = w1;
+					ws2[k] = w2;
+
+					w0 += rt->w0dx;
+					w1 += rt->w1dx;
+					w2 += rt->w2dx;
+				}
+
+				if (!rejected)
+					raster_span(context, state, rt, x, y, n, ws0, ws1, ws2);
+
+				x += n;
+			}
+		}
+
+		w0ady += rt->w0dy;
+		w1ady += rt->w1dy;
+		w2ady += rt->w2dy;
+	}
+}
+
+void rasterize_triangle_span(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1)
+{
+	// assumes context is valid
+	// only the covered pixels of each row inside the inclusive rectangle
+	// (x0, y0) - (x1, y1) are touched, set up like RASTER_MODE_FLOAT
+
+	int xstart = max(rt->xmin, x0);
+	int xend = min(rt->xmax, x1);
+	int ystart = max(rt->ymin, y0);
+	int yend = min(rt->ymax, y1);
+
+	if (xstart > xend || ystart > yend)
+		return;
+
+	float ws0[RASTER_SPAN];
+	float ws1[RASTER_SPAN];
+	float ws2[RASTER_SPAN];
+
+	for (int y = ystart; y <= yend; y++)
+	{
+		// every row of a block row relies on its classification
+		if (context->hiz_enabled && (y == ystart || y % HIZ_BLOCK_SIZE == 0))
+			hiz_classify_row(context, state, hiz_zmin(state, rt), xstart, xend, y);
+
+		int left, right;
+
+		if (!find_span(rt, y, xstart, xend, &left, &right))
+			continue;
+
+		for (int x = left; x <= right;)
+		{
+			bool rejected;
+			int n = next_raster_run(context, state, x, xstart, right, &rejected);
+
+			// evaluated rather than stepped, the way find_span tested the ends
+			if (!rejected)
+			{
+				span_weights(rt, x, y, n, ws0, ws1, ws2);
+				raster_span(context, state, rt, x, y, n, ws0, ws1, ws2);
+			}
+
+			x += n;
+		}
+	}
+}
+
+bool find_span(const struct RasterTriangle *rt, int y, int xstart, int xend, int *left, int *right)
+{
+	// finds the first and last pixel of row y between xstart and xend whose
+	// weights are all positive, returns false if there are none
+
+	float dy = (float)(y - rt->ymin);
+	float ws[6] = {
+		rt->w0 + dy * rt->w0dy, rt->w0dx,
+		rt->w1 + dy * rt->w1dy, rt->w1dx,
+		rt->w2 + dy * rt->w2dy, rt->w2dx
+	};
+
+	// where each weight crosses 0, in pixels from xmin
+	float lo = (float)(xstart - rt->xmin);
+	float hi = (float)(xend - rt->xmin);
+
+	for (int i = 0; i < 6; i += 2)
+	{
+		if (ws[i + 1] > 0.0f)
+			lo = max(lo, -ws[i] / ws[i + 1]);
+		else if (ws[i + 1] < 0.0f)
+			hi = min(hi, -ws[i] / ws[i + 1]);
+		else if (!(ws[i] > 0.0f))
+			return false;
+	}
+
+	if (!(lo <= hi))
+		return false;
+
+	// the divisions can round the crossings either way, so the bounds start a
+	// pixel wide and settle on the weights the pixels are drawn with
+	int l = rt->xmin + (int)floorf(lo);
+	int r = rt->xmin + (int)ceilf(hi);
+
+	while (l <= r && !span_pixel_covered(rt, ws, l))
+		l++;
+
+	while (r >= l && !span_pixel_covered(rt, ws, r))
+		r--;
+
+	if (l > r)
+		return false;
+
+	*left = l;
+	*right = r;
+
+	return true;
+}
+
+void span_weights(const struct RasterTriangle *rt, int x, int y, int n, float *ws0, float *ws1, float *ws2)
+{
+	// assumes rt is valid
+
+	// evaluated directly instead of stepped from the corner of the bounding
+	// box, so they may differ from the stepped ones in the last bits
+	float dy = (float)(y - rt->ymin);
+	float w0 = rt->w0 + dy * rt->w0dy, w0dx = rt->w0dx;
+	float w1 = rt->w1 + dy * rt->w1dy, w1dx = rt->w1dx;
+	float w2 = rt->w2 + dy * rt->w2dy, w2dx = rt->w2dx;
+	int dx0 = x - rt->xmin;
+
+	for (int k = 0; k < n; k++)
+	{
+		float dx = (float)(dx0 + k);
+
+		ws0[k] = w0 + dx * w0dx;
+		ws1[k] = w1 + dx * w1dx;
+		ws2[k] = w2 + dx * w2dx;
+	}
+}
+
+bool span_pixel_covered(const struct RasterTriangle *rt, const float *ws, int x)
+{
+	// ws holds each weight at xmin of the row followed by its step, the same
+	// arithmetic as span_weights
+
+	float dx = (float)(x - rt->xmin);
+
+	return ws[0] + dx * ws[1] > 0.0f && ws[2] + dx * ws[3] > 0.0f && ws[4] + dx * ws[5] > 0.0f;
+}
+
+bool setup_triangle_fixed_point(struct RenderContext *context, const struct RasterVertex *v0, const struct RasterVertex *v1, const struct RasterVertex *v2, struct RasterTriangle *rt)
+{
+	// assumes context is valid
+
+	const struct Vector *p0 = &v0->pos;
+	const struct Vector *p1 = &v1->pos;
+	const struct Vector *p2 = &v2->pos;
+
+	// the guard band keeps clipped vertices well inside this, anything
+	// further out would overflow the edge functions
+	float limit = (float)(1 << 23);
+	if (!(fabsf(p0->x) < limit && fabsf(p0->y) < limit &&
+		fabsf(p1->x) < limit && fabsf(p1->y) < limit &&
+		fabsf(p2->x) < limit && fabsf(p2->y) < limit))
+		return false;
+
+	// snap to 28.4 fixed point
+	int64_t x0 = (int64_t)floorf(p0->x * FIXED_ONE + 0.5f);
+	int64_t y0 = (int64_t)floorf(p0->y * FIXED_ONE + 0.5f);
+	int64_t x1 = (int64_t)floorf(p1->x * FIXED_ONE + 0.5f);
+	int64_t y1 = (int64_t)floorf(p1->y * FIXED_ONE + 0.5f);
+	int64_t x2 = (int64_t)floorf(p2->x * FIXED_ONE + 0.5f);
+	int64_t y2 = (int64_t)floorf(p2->y * FIXED_ONE + 0.5f);
+
+	// twice the area, positive for front facing triangles, the facing of
+	// triangles is only decided here in fixed point
+	int64_t area = (x2 - x0) * (y1 - y0) - (y2 - y0) * (x1 - x0);
+	if (area <= 0)
+	{
+		if (area < 0)
+			context->stats.triangles_backface_culled++;
+
+		return false;
+	}
+
+	// bounding box of the integer pixel positions inside the snapped triangle
+	int64_t fxmin = max(min(min(x0, x1), x2), 0);
+	int64_t fxmax = min(max(max(x0, x1), x2), (int64_t)(context->screen_width - 1) * FIXED_ONE);
+	int64_t fymin = max(min(min(y0, y1), y2), 0);
+	int64_t fymax = min(max(max(y0, y1), y2), (int64_t)(context->screen_height - 1) * FIXED_ONE);
+
+	if (fxmin > fxmax || fymin > fymax)
+		return false;
+
+	rt->xmin = (int)((fxmin + FIXED_ONE - 1) / FIXED_ONE);
+	rt->xmax = (int)(fxmax / FIXED_ONE);
+	rt->ymin = (int)((fymin + FIXED_ONE - 1) / FIXED_ONE);
+	rt->ymax = (int)(fymax / FIXED_ONE);
+
+	setup_triangle_attributes(context, v0, v1, v2, rt);
+
+	int64_t px = (int64_t)rt->xmin * FIXED_ONE;
+	int64_t py = (int64_t)rt->ymin * FIXED_ONE;
+
+	// edge v1 -> v2 weights v0, v2 -> v0 weights v1 and v0 -> v1 weights v2
+	setup_edge_fixed_point(x1, y1, x2, y2, px, py, &rt->e0, &rt->e0dx, &rt->e0dy);
+	setup_edge_fixed_point(x2, y2, x0, y0, px, py, &rt->e1, &rt->e1dx, &rt->e1dy);
+	setup_edge_fixed_point(x0, y0, x1, y1, px, py, &rt->e2, &rt->e2dx, &rt->e2dy);
+
+	// the spans only take coverage from the weights, the attributes come from
+	// their planes, so normalizing the biased edge values just keeps them small
+	rt->area_inv = (float)(1.0 / (double)(rt->e0 + rt->e1 + rt->e2));
+
+	return true;
+}
+
+void setup_edge_fixed_point(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t px, int64_t py, int64_t *e, int64_t *edx, int64_t *edy)
+{
+	int64_t dx = bx - ax;
+	int64_t dy = by - ay;
+
+	// positive on the inside of a front facing triangle
+	*e = dy * (px - ax) - dx * (py - ay);
+	*edx = dy * FIXED_ONE;
+	*edy = -dx * FIXED_ONE;
+
+	// top-left fill rule, with y pointing down the interior lies below a top
+	// edge and to the right of a left edge. Pixels exactly on any other edge
+	// belong to the neighbouring triangle, so the bias makes "e > 0" the
+	// coverage test for every edge.
+	bool top_left = (dy == 0 && dx < 0) || dy > 0;
+	if (top_left)
+		*e += 1;
+}
+
+void rasterize_triangle_fixed_point(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x0, int y0, int x1, int y1)
+{
+	// assumes context is valid
+	// only pixels inside the inclusive rectangle (x0, y0) - (x1, y1) are touched
+
+	int xstart = max(rt->xmin, x0);
+	int xend = min(rt->xmax, x1);
+	int ystart = max(rt->ymin, y0);
+	int yend = min(rt->ymax, y1);
+
+	if (xstart > xend || ystart > yend)
+		return;
+
+	float ws0[RASTER_SPAN];
+	float ws1[RASTER_SPAN];
+	float ws2[RASTER_SPAN];
+
+	// the edge functions are exact, so any pixel can be started directly
+	int64_t e0row = rt->e0 + (xstart - rt->xmin) * rt->e0dx + (ystart - rt->ymin) * rt->e0dy;
+	int64_t e1row = rt->e1 + (xstart - rt->xmin) * rt->e1dx + (ystart - rt->ymin) * rt->e1dy;
+	int64_t e2row = rt->e2 + (xstart - rt->xmin) * rt->e2dx + (ystart - rt->ymin) * rt->e2dy;
+
+	for (int y = ystart; y <= yend; y++)
+	{
+		if (context->hiz_enabled && (y == ystart || y % HIZ_BLOCK_SIZE == 0))
+			hiz_classify_row(context, state, hiz_zmin(state, rt), xstart, xend, y);
+
+		int64_t e0 = e0row;
+		int64_t e1 = e1row;
+		int64_t e2 = e2row;
+
+		for (int x = xstart; x <= xend;)
+		{
+			bool rejected;
+			int n = next_raster_run(context, state, x, xstart, xend, &rejected);
+
+			if (rejected)
+			{
+				e0 += n * rt->e0dx;
+				e1 += n * rt->e1dx;
+				e2 += n * rt->e2dx;
+			}
+			else
+			{
+				// the biased edge values convert to weights that are > 0
+				// exactly when the pixel is covered, so shading shares the
+				// float path
+				for (int k = 0; k < n; k++)
+				{
+					ws0[k] = (float)e0 * rt->area_inv;
+					ws1[k] = (float)e1 * rt->area_inv;
+					ws2[k] = (float)e2 * rt->area_inv;
+
+					e0 += rt->e0dx;
+					e1 += rt->e1dx;
+					e2 += rt->e2dx;
+				}
+
+				raster_span(context, state, rt, x, y, n, ws0, ws1, ws2);
+			}
+
+			x += n;
+		}
+
+		e0row += rt->e0dy;
+		e1row += rt->e1dy;
+		e2row += rt->e2dy;
+	}
+}
+
+void raster_span(struct RenderContext *context, struct RasterState *state, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2)
+{
+	// assumes context is valid
+
+	int passed;
+
+	switch (state->pass)
+	{
+	case RASTER_PASS_DEPTH:
+		passed = depth_span(context, rt, x, y, n, ws0, ws1, ws2, 0);
+		break;
+
+	case RASTER_PASS_SHADE_EQUAL:
+		passed = shade_span(context, rt, x, y, n, ws0, ws1, ws2, SHADE_TEST_EQUAL, 0);
+		state->stats.fragments_shaded += passed;
+		break;
+
+	default:
+		// the visibility buffer refers to triangles by their index + 1
+		if (context->shading_mode == SHADING_MODE_DEFERRED)
+			passed = depth_span(context, rt, x, y, n, ws0, ws1, ws2, (uint32_t)(rt - context->raster_tris) + 1);
+		else
+			passed = shade_span(context, rt, x, y, n, ws0, ws1, ws2, SHADE_TEST_LESS, 0);
+
+		state->stats.fragments_shaded += passed;
+	}
+
+	if (context->stats_enabled)
+	{
+		int covered = count_covered(n, ws0, ws1, ws2);
+
+		state->stats.pixels_tested += n;
+		state->stats.pixels_covered += covered;
+		state->stats.depth_tests_passed += passed;
+		state->stats.depth_tests_failed += covered - passed;
+
+		// shading after the pre-pass only reads depth
+		int size = depth_texel_size(context->depth_format);
+
+		state->stats.depth_bytes_read += (uint64_t)covered * size;
+		if (state->pass != RASTER_PASS_SHADE_EQUAL)
+			state->stats.depth_bytes_written += (uint64_t)passed * size;
+	}
+}
+
+#if SIMD_WIDTH == 8
+
+static inline __m256i modulate_channel(__m256i texels, int shift, __m256 light)
+{
+	__m256i c = _mm256_and_si256(_mm256_srli_epi32(texels, shift), _mm256_set1_epi32(0xff));
+	c = _mm256_cvttps_epi32(_mm256_mul_ps(light, _mm256_cvtepi32_ps(c)));
+	c = _mm256_max_epi32(_mm256_setzero_si256(), _mm256_min_epi32(c, _mm256_set1_epi32(255)));
+
+	return _mm256_slli_epi32(c, shift);
+}
+
+static inline __m256i spread_bits8(__m256i x)
+{
+	x = _mm256_and_si256(x, _mm256_set1_epi32(0xffff));
+	x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00ff00ff));
+	x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0f0f0f0f));
+	x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x33333333));
+	x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x55555555));
+
+	return x;
+}
+
+static inline __m256i texel_coord8(const struct TexelAxis *axis, __m256 t)
+{
+	// same as texel_coord, min returns its second operand for nan
+	__m256 f = _mm256_add_ps(_mm256_mul_ps(t, _mm256_set1_ps(axis->scale)), _mm256_set1_ps(0.5f));
+	f = _mm256_max_ps(_mm256_min_ps(f, _mm256_set1_ps(axis->hi)), _mm256_set1_ps(axis->lo));
+
+	return _mm256_and_si256(_mm256_cvttps_epi32(_mm256_floor_ps(f)), _mm256_set1_epi32(axis->mask));
+}
+
+static inline __m256i texel_index8(const struct TextureMap *texture_map, __m256i x, __m256i y)
+{
+	if (texture_map->layout == TEXTURE_LAYOUT_MORTON)
+	{
+		__m128i bits = _mm_cvtsi32_si128(texture_map->morton_bits);
+		__m128i bits2 = _mm_cvtsi32_si128(2 * texture_map->morton_bits);
+		__m256i low = _mm256_set1_epi32((1 << texture_map->morton_bits) - 1);
+
+		__m256i index = _mm256_or_si256(spread_bits8(_mm256_and_si256(x, low)), _mm256_slli_epi32(spread_bits8(_mm256_and_si256(y, low)), 1));
+		return _mm256_or_si256(index, _mm256_sll_epi32(_mm256_srl_epi32(_mm256_or_si256(x, y), bits), bits2));
+	}
+
+	return _mm256_add_epi32(x, _mm256_mullo_epi32(y, _mm256_set1_epi32(texture_map->width)));
+}
+
+static inline __m256 calc_texture_lod8(const struct TextureSampler *sampler, __m256 z, __m256 u, __m256 v)
+{
+	// same as calc_texture_lod
+	__m256 su = _mm256_mul_ps(u, _mm256_set1_ps(sampler->width));
+	__m256 sv = _mm256_mul_ps(v, _mm256_set1_ps(sampler->height));
+	__m256 qx = _mm256_set1_ps(sampler->dqdx);
+	__m256 qy = _mm256_set1_ps(sampler->dqdy);
+
+	__m256 ux = _mm256_mul_ps(z, _mm256_sub_ps(_mm256_set1_ps(sampler->dudx), _mm256_mul_ps(su, qx)));
+	__m256 uy = _mm256_mul_ps(z, _mm256_sub_ps(_mm256_set1_ps(sampler->dudy), _mm256_mul_ps(su, qy)));
+	__m256 vx = _mm256_mul_ps(z, _mm256_sub_ps(_mm256_set1_ps(sampler->dvdx), _mm256_mul_ps(sv, qx)));
+	__m256 vy = _mm256_mul_ps(z, _mm256_sub_ps(_mm256_set1_ps(sampler->dvdy), _mm256_mul_ps(sv, qy)));
+
+	__m256 rho2 = _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(ux, ux), _mm256_mul_ps(vx, vx)), _mm256_add_ps(_mm256_mul_ps(uy, uy), _mm256_mul_ps(vy, vy)));
+
+	return _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(rho2)), _mm256_set1_ps(1.0f / (1 << 24))), _mm256_set1_ps(63.5f));
+}
+
+static inline __m256i bilinear_coords8(const struct TexelAxis *axis, __m256i size, __m256 t, __m256i *c1, __m256i *weight)
+{
+	// same as bilinear_coords, the weight is copied into both 16 bit halves
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 limit = _mm256_set1_ps(TEXEL_COORD_LIMIT);
+
+	__m256 f = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_cvtepi32_ps(size)), _mm256_set1_ps(0.5f));
+	f = _mm256_max_ps(_mm256_min_ps(f, limit), _mm256_sub_ps(_mm256_setzero_ps(), limit));
+
+	__m256 fc0 = _mm256_floor_ps(f);
+	__m256i w = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(f, fc0), _mm256_set1_ps(128.0f)));
+	*weight = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+
+	__m256i c0 = _mm256_cvttps_epi32(fc0);
+	__m256i last = _mm256_sub_epi32(size, one);
+	*c1 = _mm256_add_epi32(c0, one);
+
+	if (axis->wrap)
+	{
+		*c1 = _mm256_and_si256(*c1, last);
+		return _mm256_and_si256(c0, last);
+	}
+
+	*c1 = _mm256_max_epi32(_mm256_min_epi32(*c1, last), _mm256_setzero_si256());
+	return _mm256_max_epi32(_mm256_min_epi32(c0, last), _mm256_setzero_si256());
+}
+
+static inline __m256i level_index8(const struct TextureMap *texture_map, __m256i x, __m256i y, __m256i width, __m256i bits, __m256i low)
+{
+	if (texture_map->layout == TEXTURE_LAYOUT_MORTON)
+	{
+		__m256i index = _mm256_or_si256(spread_bits8(_mm256_and_si256(x, low)), _mm256_slli_epi32(spread_bits8(_mm256_and_si256(y, low)), 1));
+		return _mm256_or_si256(index, _mm256_sllv_epi32(_mm256_srlv_epi32(_mm256_or_si256(x, y), bits), _mm256_add_epi32(bits, bits)));
+	}
+
+	return _mm256_add_epi32(x, _mm256_mullo_epi32(y, width));
+}
+
+static inline __m256i lerp_texels8(__m256i a, __m256i b, __m256i weight)
+{
+	// same as lerp_texels, two channels at a time in 16 bit halves
+	const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+
+	__m256i a_rb = _mm256_and_si256(a, mask);
+	__m256i a_ag = _mm256_and_si256(_mm256_srli_epi32(a, 8), mask);
+	__m256i b_rb = _mm256_and_si256(b, mask);
+	__m256i b_ag = _mm256_and_si256(_mm256_srli_epi32(b, 8), mask);
+
+	__m256i rb = _mm256_add_epi16(a_rb, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(b_rb, a_rb), weight), 7));
+	__m256i ag = _mm256_add_epi16(a_ag, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(b_ag, a_ag), weight), 7));
+
+	return _mm256_or_si256(_mm256_and_si256(rb, mask), _mm256_slli_epi32(_mm256_and_si256(ag, mask), 8));
+}
+
+static inline __m256i sample_texture_map_bilinear8(const struct TextureSampler *sampler, __m256i level, __m256 u, __m256 v)
+{
+	const struct TextureMap *texture_map = sampler->texture_map;
+	const __m256i one = _mm256_set1_epi32(1);
+	const int *buffer = (const int *)texture_map->buffer;
+
+	__m256i width = _mm256_max_epi32(_mm256_srlv_epi32(_mm256_set1_epi32(texture_map->width), level), one);
+	__m256i height = _mm256_max_epi32(_mm256_srlv_epi32(_mm256_set1_epi32(texture_map->height), level), one);
+	__m256i offset = _mm256_i32gather_epi32(texture_map->mip_offsets, level, 4);
+
+	__m256i bits = _mm256_max_epi32(_mm256_sub_epi32(_mm256_set1_epi32(texture_map->morton_bits), level), _mm256_setzero_si256());
+	__m256i low = _mm256_sub_epi32(_mm256_sllv_epi32(one, bits), one);
+
+	__m256i x1, y1, wx, wy;
+	__m256i x0 = bilinear_coords8(&sampler->axes[0], width, u, &x1, &wx);
+	__m256i y0 = bilinear_coords8(&sampler->axes[1], height, v, &y1, &wy);
+
+	__m256i t00 = _mm256_i32gather_epi32(buffer, _mm256_add_epi32(offset, level_index8(texture_map, x0, y0, width, bits, low)), 4);
+	__m256i t10 = _mm256_i32gather_epi32(buffer, _mm256_add_epi32(offset, level_index8(texture_map, x1, y0, width, bits, low)), 4);
+	__m256i t01 = _mm256_i32gather_epi32(buffer, _mm256_add_epi32(offset, level_index8(texture_map, x0, y1, width, bits, low)), 4);
+	__m256i t11 = _mm256_i32gather_epi32(buffer, _mm256_add_epi32(offset, level_index8(texture_map, x1, y1, width, bits, low)), 4);
+
+	return lerp_texels8(lerp_texels8(t00, t10, wx), lerp_texels8(t01, t11, wx), wy);
+}
+
+static inline __m256i sample_texture_filtered8(const struct TextureSampler *sampler, __m256 z, __m256 u, __m256 v)
+{
+	// same as sample_texture for the bilinear and trilinear filters
+	__m256 lod = calc_texture_lod8(sampler, z, u, v);
+	lod = _mm256_max_ps(_mm256_min_ps(lod, _mm256_set1_ps(sampler->max_lod)), _mm256_setzero_ps());
+
+	if (sampler->filter == TEXTURE_FILTER_BILINEAR)
+		return sample_texture_map_bilinear8(sampler, _mm256_cvttps_epi32(_mm256_add_ps(lod, _mm256_set1_ps(0.5f))), u, v);
+
+	__m256i level = _mm256_cvttps_epi32(lod);
+	__m256i weight = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(lod, _mm256_cvtepi32_ps(level)), _mm256_set1_ps(128.0f)));
+	__m256i texels = sample_texture_map_bilinear8(sampler, level, u, v);
+
+	// magnified or exactly on a level everywhere
+	if (_mm256_testz_si256(weight, weight))
+		return texels;
+
+	__m256i next = _mm256_min_epi32(_mm256_add_epi32(level, _mm256_set1_epi32(1)), _mm256_set1_epi32(sampler->texture_map->num_mip_levels));
+
+	return lerp_texels8(texels, sample_texture_map_bilinear8(sampler, next, u, v), _mm256_or_si256(weight, _mm256_slli_epi32(weight, 16)));
+}
+
+static inline __m256 depth_test8(struct RenderContext *context, int i, __m256 Z, __m256 covered, enum ShadeTest test)
+{
+	// returns the covered pixels from i on that pass the depth test, the
+	// less test also writes their depth
+
+	if (context->depth_format == DEPTH_FORMAT_UNORM16)
+	{
+		uint16_t *depth = (uint16_t *)context->depth_buffer->buffer + i;
+
+		__m256i z = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(Z, _mm256_setzero_ps()), _mm256_set1_ps(DEPTH_UNORM16_MAX)));
+		__m256i old_z = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)depth));
+
+		if (test == SHADE_TEST_EQUAL)
+			return _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(z, old_z)), covered);
+
+		__m256 pass = _mm256_and_ps(covered, _mm256_castsi256_ps(_mm256_cmpgt_epi32(old_z, z)));
+
+		if (_mm256_movemask_ps(pass) != 0)
+		{
+			// both halves of the packed words are gathered into the low lane
+			__m256i merged = _mm256_blendv_epi8(old_z, z, _mm256_castps_si256(pass));
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(merged, merged), 0x08);
+			_mm_storeu_si128((__m128i *)depth, _mm256_castsi256_si128(packed));
+		}
+
+		return pass;
+	}
+
+	float *depth = (float *)context->depth_buffer->buffer + i;
+	__m256 old_Z = _mm256_loadu_ps(depth);
+
+	if (test == SHADE_TEST_EQUAL)
+		return _mm256_and_ps(covered, _mm256_cmp_ps(old_Z, Z, _CMP_GE_OQ));
+
+	__m256 pass = _mm256_and_ps(covered, _mm256_cmp_ps(old_Z, Z, _CMP_GT_OQ));
+
+	if (_mm256_movemask_ps(pass) != 0)
+		_mm256_storeu_ps(depth, _mm256_blendv_ps(old_Z, Z, pass));
+
+	return pass;
+}
+
+int shade_span_variant(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id,
+	enum ShadeTest test, enum PixelColor color, bool lit, bool opaque)
+{
+	// assumes context is valid
+	// returns the number of pixels shaded, everything after id is a constant
+	// in each variant
+
+	uint32_t *pixels = &context->pixel_buffer->buffer[x + y * context->screen_width];
+	int depth_index = x + y * context->screen_width;
+	const struct TextureMap *tex_map = rt->tex_map;
+	bool count_shades = context->shade_count_buffer != NULL && test != SHADE_TEST_VISIBLE;
+
+	const __m256 zero = _mm256_setzero_ps();
+
+	// the planes at the start of the row, each pixel then adds its distance
+	// from xmin times the step of every attribute
+	int dy = y - rt->ymin;
+	const __m256 zr = _mm256_set1_ps(rt->z.a + (float)dy * rt->z.dy), zdx = _mm256_set1_ps(rt->z.dx);
+	const __m256 qr = _mm256_set1_ps(rt->q.a + (float)dy * rt->q.dy), qdx = _mm256_set1_ps(rt->q.dx);
+	const __m256 ur = _mm256_set1_ps(rt->u.a + (float)dy * rt->u.dy), udx = _mm256_set1_ps(rt->u.dx);
+	const __m256 vr = _mm256_set1_ps(rt->v.a + (float)dy * rt->v.dy), vdx = _mm256_set1_ps(rt->v.dx);
+	const __m256 lr = _mm256_set1_ps(rt->light.a + (float)dy * rt->light.dy), ldx = _mm256_set1_ps(rt->light.dx);
+
+	__m256 dx = _mm256_add_ps(_mm256_set1_ps((float)(x - rt->xmin)), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+
+	struct TextureSampler sampler;
+	if (color != PIXEL_COLOR_MATERIAL)
+		setup_texture_sampler(context, rt, &sampler);
+
+	int shaded = 0;
+	int k = 0;
+
+	for (; k + 8 <= n; k += 8, dx = _mm256_add_ps(dx, _mm256_set1_ps(8.0f)))
+	{
+		__m256 pass;
+
+		if (test == SHADE_TEST_VISIBLE)
+		{
+			// the depth test was done when drawing
+			__m256i ids = _mm256_loadu_si256((__m256i *)(context->visibility_buffer + x + y * context->screen_width + k));
+			pass = _mm256_castsi256_ps(_mm256_cmpeq_epi32(ids, _mm256_set1_epi32((int)id)));
+			if (_mm256_movemask_ps(pass) == 0)
+				continue;
+		}
+		else
+		{
+			__m256 w0 = _mm256_loadu_ps(ws0 + k);
+			__m256 w1 = _mm256_loadu_ps(ws1 + k);
+			__m256 w2 = _mm256_loadu_ps(ws2 + k);
+
+			__m256 covered = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GT_OQ), _mm256_cmp_ps(w1, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w2, zero, _CMP_GT_OQ));
+			if (_mm256_movemask_ps(covered) == 0)
+				continue;
+
+			__m256 Z = _mm256_add_ps(zr, _mm256_mul_ps(dx, zdx));
+
+			// with the equal test the depth pre-pass already wrote the nearest depth
+			pass = depth_test8(context, depth_index + k, Z, covered, test);
+			if (_mm256_movemask_ps(pass) == 0)
+				continue;
+		}
+
+		shaded += count_bits(_mm256_movemask_ps(pass));
+
+		if (count_shades)
+			add_shade_counts(context, x + k, y, _mm256_movemask_ps(pass));
+
+		__m256i pass_i = _mm256_castps_si256(pass);
+		__m256i texels;
+
+		if (color == PIXEL_COLOR_MATERIAL)
+		{
+			texels = _mm256_set1_epi32((int)rt->diffuse);
+		}
+		else
+		{
+			__m256 z = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(qr, _mm256_mul_ps(dx, qdx)));
+			__m256 u = _mm256_mul_ps(z, _mm256_add_ps(ur, _mm256_mul_ps(dx, udx)));
+			__m256 v = _mm256_mul_ps(z, _mm256_add_ps(vr, _mm256_mul_ps(dx, vdx)));
+
+			if (color == PIXEL_COLOR_NEAREST)
+			{
+				__m256i index = texel_index8(tex_map, texel_coord8(&sampler.axes[0], u), texel_coord8(&sampler.axes[1], v));
+				texels = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)tex_map->buffer, index, pass_i, 4);
+			}
+			else
+			{
+				texels = sample_texture_filtered8(&sampler, z, u, v);
+			}
+		}
+
+		__m256i out = texels;
+
+		if (lit)
+		{
+			__m256 light = _mm256_add_ps(lr, _mm256_mul_ps(dx, ldx));
+
+			out = _mm256_or_si256(_mm256_or_si256(modulate_channel(texels, 16, light), modulate_channel(texels, 8, light)), modulate_channel(texels, 0, light));
+			if (!opaque)
+				out = _mm256_or_si256(out, modulate_channel(texels, 24, light));
+		}
+
+		if (opaque)
+			out = _mm256_or_si256(out, _mm256_set1_epi32((int)0xff000000));
+
+		__m256i old_color = _mm256_loadu_si256((__m256i *)(pixels + k));
+		_mm256_storeu_si256((__m256i *)(pixels + k), _mm256_blendv_epi8(old_color, out, pass_i));
+	}
+
+	for (; k < n; k++)
+		shaded += shade_pixel(context, rt, &sampler, test, id, x + k, y, test == SHADE_TEST_VISIBLE || (ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f), color, lit, opaque);
+
+	return shaded;
+}
+
+int depth_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id)
+{
+	// assumes context is valid
+	// only tests and writes depth, and the triangle id unless it is 0
+	// returns the number of pixels written
+
+	uint32_t *ids = &context->visibility_buffer[x + y * context->screen_width];
+	int depth_index = x + y * context->screen_width;
+
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 zr = _mm256_set1_ps(rt->z.a + (float)(y - rt->ymin) * rt->z.dy), zdx = _mm256_set1_ps(rt->z.dx);
+	const __m256i id8 = _mm256_set1_epi32((int)id);
+
+	__m256 dx = _mm256_add_ps(_mm256_set1_ps((float)(x - rt->xmin)), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+
+	int written = 0;
+	int k = 0;
+
+	for (; k + 8 <= n; k += 8, dx = _mm256_add_ps(dx, _mm256_set1_ps(8.0f)))
+	{
+		__m256 w0 = _mm256_loadu_ps(ws0 + k);
+		__m256 w1 = _mm256_loadu_ps(ws1 + k);
+		__m256 w2 = _mm256_loadu_ps(ws2 + k);
+
+		__m256 covered = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GT_OQ), _mm256_cmp_ps(w1, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w2, zero, _CMP_GT_OQ));
+		if (_mm256_movemask_ps(covered) == 0)
+			continue;
+
+		__m256 Z = _mm256_add_ps(zr, _mm256_mul_ps(dx, zdx));
+
+		__m256 pass = depth_test8(context, depth_index + k, Z, covered, SHADE_TEST_LESS);
+		int pass_bits = _mm256_movemask_ps(pass);
+		if (pass_bits == 0)
+			continue;
+
+		written += count_bits(pass_bits);
+
+		if (context->shade_count_buffer != NULL && id != 0)
+			add_shade_counts(context, x + k, y, pass_bits);
+
+		if (id != 0)
+		{
+			__m256i old_ids = _mm256_loadu_si256((__m256i *)(ids + k));
+			_mm256_storeu_si256((__m256i *)(ids + k), _mm256_blendv_epi8(old_ids, id8, _mm256_castps_si256(pass)));
+		}
+	}
+
+	for (; k < n; k++)
+		written += depth_pixel(context, rt, id, x + k, y, ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f);
+
+	return written;
+}
+
+#elif SIMD_WIDTH == 4
+
+static inline __m128i modulate_channel(__m128i texels, int shift, __m128 light)
+{
+	__m128i c = _mm_and_si128(_mm_srli_epi32(texels, shift), _mm_set1_epi32(0xff));
+	c = _mm_cvttps_epi32(_mm_mul_ps(light, _mm_cvtepi32_ps(c)));
+
+	// SSE2 has no 32 bit min/max, clamp to [0, 255] with compares
+	c = _mm_and_si128(c, _mm_cmpgt_epi32(c, _mm_setzero_si128()));
+	__m128i over = _mm_cmpgt_epi32(c, _mm_set1_epi32(255));
+	c = _mm_or_si128(_mm_and_si128(over, _mm_set1_epi32(255)), _mm_andnot_si128(over, c));
+
+	return _mm_slli_epi32(c, shift);
+}
+
+static inline __m128i spread_bits4(__m128i x)
+{
+	x = _mm_and_si128(x, _mm_set1_epi32(0xffff));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)), _mm_set1_epi32(0x00ff00ff));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)), _mm_set1_epi32(0x0f0f0f0f));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)), _mm_set1_epi32(0x33333333));
+	x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 1)), _mm_set1_epi32(0x55555555));
+
+	return x;
+}
+
+static inline __m128i texel_coord4(const struct TexelAxis *axis, __m128 t)
+{
+	// same as texel_coord, min returns its second operand for nan
+	__m128 f = _mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(axis->scale)), _mm_set1_ps(0.5f));
+	f = _mm_max_ps(_mm_min_ps(f, _mm_set1_ps(axis->hi)), _mm_set1_ps(axis->lo));
+
+	// SSE2 has no floor, truncate and step down where that rounded up
+	__m128 i = _mm_cvtepi32_ps(_mm_cvttps_epi32(f));
+	i = _mm_sub_ps(i, _mm_and_ps(_mm_cmpgt_ps(i, f), _mm_set1_ps(1.0f)));
+
+	return _mm_and_si128(_mm_cvttps_epi32(i), _mm_set1_epi32(axis->mask));
+}
+
+static inline void texel_index4(const struct TextureMap *texture_map, __m128i x, __m128i y, int32_t *index)
+{
+	if (texture_map->layout == TEXTURE_LAYOUT_MORTON)
+	{
+		__m128i bits = _mm_cvtsi32_si128(texture_map->morton_bits);
+		__m128i bits2 = _mm_cvtsi32_si128(2 * texture_map->morton_bits);
+		__m128i low = _mm_set1_epi32((1 << texture_map->morton_bits) - 1);
+
+		__m128i i = _mm_or_si128(spread_bits4(_mm_and_si128(x, low)), _mm_slli_epi32(spread_bits4(_mm_and_si128(y, low)), 1));
+		_mm_storeu_si128((__m128i *)index, _mm_or_si128(i, _mm_sll_epi32(_mm_srl_epi32(_mm_or_si128(x, y), bits), bits2)));
+		return;
+	}
+
+	// SSE2 has no 32 bit multiply, the row offsets are done one by one
+	int32_t tx[4], ty[4];
+	_mm_storeu_si128((__m128i *)tx, x);
+	_mm_storeu_si128((__m128i *)ty, y);
+
+	for (int l = 0; l < 4; l++)
+		index[l] = tx[l] + ty[l] * texture_map->width;
+}
+
+static inline __m128 calc_texture_lod4(const struct TextureSampler *sampler, __m128 z, __m128 u, __m128 v)
+{
+	// same as calc_texture_lod
+	__m128 su = _mm_mul_ps(u, _mm_set1_ps(sampler->width));
+	__m128 sv = _mm_mul_ps(v, _mm_set1_ps(sampler->height));
+	__m128 qx = _mm_set1_ps(sampler->dqdx);
+	__m128 qy = _mm_set1_ps(sampler->dqdy);
+
+	__m128 ux = _mm_mul_ps(z, _mm_sub_ps(_mm_set1_ps(sampler->dudx), _mm_mul_ps(su, qx)));
+	__m128 uy = _mm_mul_ps(z, _mm_sub_ps(_mm_set1_ps(sampler->dudy), _mm_mul_ps(su, qy)));
+	__m128 vx = _mm_mul_ps(z, _mm_sub_ps(_mm_set1_ps(sampler->dvdx), _mm_mul_ps(sv, qx)));
+	__m128 vy = _mm_mul_ps(z, _mm_sub_ps(_mm_set1_ps(sampler->dvdy), _mm_mul_ps(sv, qy)));
+
+	__m128 rho2 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(vx, vx)), _mm_add_ps(_mm_mul_ps(uy, uy), _mm_mul_ps(vy, vy)));
+
+	return _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(rho2)), _mm_set1_ps(1.0f / (1 << 24))), _mm_set1_ps(63.5f));
+}
+
+static inline __m128i lerp_texels4(__m128i a, __m128i b, __m128i weight)
+{
+	// same as lerp_texels, two channels at a time in 16 bit halves
+	const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+
+	__m128i a_rb = _mm_and_si128(a, mask);
+	__m128i a_ag = _mm_and_si128(_mm_srli_epi32(a, 8), mask);
+	__m128i b_rb = _mm_and_si128(b, mask);
+	__m128i b_ag = _mm_and_si128(_mm_srli_epi32(b, 8), mask);
+
+	__m128i rb = _mm_add_epi16(a_rb, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(b_rb, a_rb), weight), 7));
+	__m128i ag = _mm_add_epi16(a_ag, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(b_ag, a_ag), weight), 7));
+
+	return _mm_or_si128(_mm_and_si128(rb, mask), _mm_slli_epi32(_mm_and_si128(ag, mask), 8));
+}
+
+static inline __m128i sample_texture_map_bilinear4(const struct TextureSampler *sampler, __m128i level, __m128 u, __m128 v, int pass_bits)
+{
+	// SSE2 has no gather or per lane shifts, the taps of the passing lanes
+	// are addressed and fetched one by one and blended together
+	int32_t levels[4];
+	float us[4], vs[4];
+	_mm_storeu_si128((__m128i *)levels, level);
+	_mm_storeu_ps(us, u);
+	_mm_storeu_ps(vs, v);
+
+	uint32_t taps[4][4] = { { 0 } };
+	int32_t wx[4] = { 0, 0, 0, 0 };
+	int32_t wy[4] = { 0, 0, 0, 0 };
+
+	for (int l = 0; l < 4; l++)
+	{
+		if (pass_bits & (1 << l))
+		{
+			uint32_t t[4];
+			bilinear_taps(sampler, levels[l], us[l], vs[l], t, &wx[l], &wy[l]);
+
+			taps[0][l] = t[0];
+			taps[1][l] = t[1];
+			taps[2][l] = t[2];
+			taps[3][l] = t[3];
+		}
+	}
+
+	__m128i x_weight = _mm_loadu_si128((__m128i *)wx);
+	__m128i y_weight = _mm_loadu_si128((__m128i *)wy);
+	x_weight = _mm_or_si128(x_weight, _mm_slli_epi32(x_weight, 16));
+	y_weight = _mm_or_si128(y_weight, _mm_slli_epi32(y_weight, 16));
+
+	__m128i top = lerp_texels4(_mm_loadu_si128((__m128i *)taps[0]), _mm_loadu_si128((__m128i *)taps[1]), x_weight);
+	__m128i bottom = lerp_texels4(_mm_loadu_si128((__m128i *)taps[2]), _mm_loadu_si128((__m128i *)taps[3]), x_weight);
+
+	return lerp_texels4(top, bottom, y_weight);
+}
+
+static inline __m128i sample_texture_filtered4(const struct TextureSampler *sampler, __m128 z, __m128 u, __m128 v, int pass_bits)
+{
+	// same as sample_texture for the bilinear and trilinear filters
+	__m128 lod = calc_texture_lod4(sampler, z, u, v);
+	lod = _mm_max_ps(_mm_min_ps(lod, _mm_set1_ps(sampler->max_lod)), _mm_setzero_ps());
+
+	if (sampler->filter == TEXTURE_FILTER_BILINEAR)
+		return sample_texture_map_bilinear4(sampler, _mm_cvttps_epi32(_mm_add_ps(lod, _mm_set1_ps(0.5f))), u, v, pass_bits);
+
+	__m128i level = _mm_cvttps_epi32(lod);
+	__m128i weight = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(lod, _mm_cvtepi32_ps(level)), _mm_set1_ps(128.0f)));
+	__m128i texels = sample_texture_map_bilinear4(sampler, level, u, v, pass_bits);
+
+	// magnified or exactly on a level everywhere
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(weight, _mm_setzero_si128())) == 0xffff)
+		return texels;
+
+	// SSE2 has no 32 bit min, the last level is its own next level
+	__m128i last = _mm_set1_epi32(sampler->texture_map->num_mip_levels);
+	__m128i next = _mm_add_epi32(level, _mm_set1_epi32(1));
+	__m128i over = _mm_cmpgt_epi32(next, last);
+	next = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, next));
+
+	return lerp_texels4(texels, sample_texture_map_bilinear4(sampler, next, u, v, pass_bits), _mm_or_si128(weight, _mm_slli_epi32(weight, 16)));
+}
+
+static inline __m128 depth_test4(struct RenderContext *context, int i, __m128 Z, __m128 covered, enum ShadeTest test)
+{
+	// returns the covered pixels from i on that pass the depth test, the
+	// less test also writes their depth
+
+	if (context->depth_format == DEPTH_FORMAT_UNORM16)
+	{
+		uint16_t *depth = (uint16_t *)context->depth_buffer->buffer + i;
+
+		__m128i z = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(Z, _mm_setzero_ps()), _mm_set1_ps(DEPTH_UNORM16_MAX)));
+		__m128i old_z = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)depth), _mm_setzero_si128());
+
+		if (test == SHADE_TEST_EQUAL)
+			return _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(z, old_z)), covered);
+
+		__m128 pass = _mm_and_ps(covered, _mm_castsi128_ps(_mm_cmpgt_epi32(old_z, z)));
+
+		if (_mm_movemask_ps(pass) != 0)
+		{
+			// SSE2 only packs signed words, so the values are biased into
+			// their range and back
+			__m128i pass_i = _mm_castps_si128(pass);
+			__m128i merged = _mm_sub_epi32(_mm_or_si128(_mm_and_si128(pass_i, z), _mm_andnot_si128(pass_i, old_z)), _mm_set1_epi32(32768));
+			_mm_storel_epi64((__m128i *)depth, _mm_xor_si128(_mm_packs_epi32(merged, merged), _mm_set1_epi16((short)0x8000)));
+		}
+
+		return pass;
+	}
+
+	float *depth = (float *)context->depth_buffer->buffer + i;
+	__m128 old_Z = _mm_loadu_ps(depth);
+
+	if (test == SHADE_TEST_EQUAL)
+		return _mm_and_ps(covered, _mm_cmpge_ps(old_Z, Z));
+
+	__m128 pass = _mm_and_ps(covered, _mm_cmpgt_ps(old_Z, Z));
+
+	if (_mm_movemask_ps(pass) != 0)
+		_mm_storeu_ps(depth, _mm_or_ps(_mm_and_ps(pass, Z), _mm_andnot_ps(pass, old_Z)));
+
+	return pass;
+}
+
+int shade_span_variant(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id,
+	enum ShadeTest test, enum PixelColor color, bool lit, bool opaque)
+{
+	// assumes context is valid
+	// returns the number of pixels shaded, everything after id is a constant
+	// in each variant
+
+	uint32_t *pixels = &context->pixel_buffer->buffer[x + y * context->screen_width];
+	int depth_index = x + y * context->screen_width;
+	const struct TextureMap *tex_map = rt->tex_map;
+	bool count_shades = context->shade_count_buffer != NULL && test != SHADE_TEST_VISIBLE;
+
+	const __m128 zero = _mm_setzero_ps();
+
+	// the planes at the start of the row, each pixel then adds its distance
+	// from xmin times the step of every attribute
+	int dy = y - rt->ymin;
+	const __m128 zr = _mm_set1_ps(rt->z.a + (float)dy * rt->z.dy), zdx = _mm_set1_ps(rt->z.dx);
+	const __m128 qr = _mm_set1_ps(rt->q.a + (float)dy * rt->q.dy), qdx = _mm_set1_ps(rt->q.dx);
+	const __m128 ur = _mm_set1_ps(rt->u.a + (float)dy * rt->u.dy), udx = _mm_set1_ps(rt->u.dx);
+	const __m128 vr = _mm_set1_ps(rt->v.a + (float)dy * rt->v.dy), vdx = _mm_set1_ps(rt->v.dx);
+	const __m128 lr = _mm_set1_ps(rt->light.a + (float)dy * rt->light.dy), ldx = _mm_set1_ps(rt->light.dx);
+
+	__m128 dx = _mm_add_ps(_mm_set1_ps((float)(x - rt->xmin)), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+
+	struct TextureSampler sampler;
+	if (color != PIXEL_COLOR_MATERIAL)
+		setup_texture_sampler(context, rt, &sampler);
+
+	int shaded = 0;
+	int k = 0;
+
+	for (; k + 4 <= n; k += 4, dx = _mm_add_ps(dx, _mm_set1_ps(4.0f)))
+	{
+		__m128 pass;
+		int pass_bits;
+
+		if (test == SHADE_TEST_VISIBLE)
+		{
+			// the depth test was done when drawing
+			__m128i ids = _mm_loadu_si128((__m128i *)(context->visibility_buffer + x + y * context->screen_width + k));
+			pass = _mm_castsi128_ps(_mm_cmpeq_epi32(ids, _mm_set1_epi32((int)id)));
+			pass_bits = _mm_movemask_ps(pass);
+			if (pass_bits == 0)
+				continue;
+		}
+		else
+		{
+			__m128 w0 = _mm_loadu_ps(ws0 + k);
+			__m128 w1 = _mm_loadu_ps(ws1 + k);
+			__m128 w2 = _mm_loadu_ps(ws2 + k);
+
+			__m128 covered = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(w0, zero), _mm_cmpgt_ps(w1, zero)), _mm_cmpgt_ps(w2, zero));
+			if (_mm_movemask_ps(covered) == 0)
+				continue;
+
+			__m128 Z = _mm_add_ps(zr, _mm_mul_ps(dx, zdx));
+
+			// with the equal test the depth pre-pass already wrote the nearest depth
+			pass = depth_test4(context, depth_index + k, Z, covered, test);
+			pass_bits = _mm_movemask_ps(pass);
+			if (pass_bits == 0)
+				continue;
+		}
+
+		shaded += count_bits(pass_bits);
+
+		if (count_shades)
+			add_shade_counts(context, x + k, y, pass_bits);
+
+		__m128i t;
+
+		if (color == PIXEL_COLOR_MATERIAL)
+		{
+			t = _mm_set1_epi32((int)rt->diffuse);
+		}
+		else
+		{
+			__m128 z = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(qr, _mm_mul_ps(dx, qdx)));
+			__m128 u = _mm_mul_ps(z, _mm_add_ps(ur, _mm_mul_ps(dx, udx)));
+			__m128 v = _mm_mul_ps(z, _mm_add_ps(vr, _mm_mul_ps(dx, vdx)));
+
+			if (color == PIXEL_COLOR_NEAREST)
+			{
+				// SSE2 has no gather, fetch the texels of the passing lanes one by one
+				int32_t index[4];
+				uint32_t texels[4] = { 0, 0, 0, 0 };
+				texel_index4(tex_map, texel_coord4(&sampler.axes[0], u), texel_coord4(&sampler.axes[1], v), index);
+
+				for (int l = 0; l < 4; l++)
+					if (pass_bits & (1 << l))
+						texels[l] = tex_map->buffer[index[l]];
+
+				t = _mm_loadu_si128((__m128i *)texels);
+			}
+			else
+			{
+				t = sample_texture_filtered4(&sampler, z, u, v, pass_bits);
+			}
+		}
+
+		__m128i out = t;
+
+		if (lit)
+		{
+			__m128 light = _mm_add_ps(lr, _mm_mul_ps(dx, ldx));
+
+			out = _mm_or_si128(_mm_or_si128(modulate_channel(t, 16, light), modulate_channel(t, 8, light)), modulate_channel(t, 0, light));
+			if (!opaque)
+				out = _mm_or_si128(out, modulate_channel(t, 24, light));
+		}
+
+		if (opaque)
+			out = _mm_or_si128(out, _mm_set1_epi32((int)0xff000000));
+
+		__m128i pass_i = _mm_castps_si128(pass);
+		__m128i old_color = _mm_loadu_si128((__m128i *)(pixels + k));
+		_mm_storeu_si128((__m128i *)(pixels + k), _mm_or_si128(_mm_and_si128(pass_i, out), _mm_andnot_si128(pass_i, old_color)));
+	}
+
+	for (; k < n; k++)
+		shaded += shade_pixel(context, rt, &sampler, test, id, x + k, y, test == SHADE_TEST_VISIBLE || (ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f), color, lit, opaque);
+
+	return shaded;
+}
+
+int depth_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id)
+{
+	// assumes context is valid
+	// only tests and writes depth, and the triangle id unless it is 0
+	// returns the number of pixels written
+
+	uint32_t *ids = &context->visibility_buffer[x + y * context->screen_width];
+	int depth_index = x + y * context->screen_width;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 zr = _mm_set1_ps(rt->z.a + (float)(y - rt->ymin) * rt->z.dy), zdx = _mm_set1_ps(rt->z.dx);
+	const __m128i id4 = _mm_set1_epi32((int)id);
+
+	__m128 dx = _mm_add_ps(_mm_set1_ps((float)(x - rt->xmin)), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+
+	int written = 0;
+	int k = 0;
+
+	for (; k + 4 <= n; k += 4, dx = _mm_add_ps(dx, _mm_set1_ps(4.0f)))
+	{
+		__m128 w0 = _mm_loadu_ps(ws0 + k);
+		__m128 w1 = _mm_loadu_ps(ws1 + k);
+		__m128 w2 = _mm_loadu_ps(ws2 + k);
+
+		__m128 covered = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(w0, zero), _mm_cmpgt_ps(w1, zero)), _mm_cmpgt_ps(w2, zero));
+		if (_mm_movemask_ps(covered) == 0)
+			continue;
+
+		__m128 Z = _mm_add_ps(zr, _mm_mul_ps(dx, zdx));
+
+		__m128 pass = depth_test4(context, depth_index + k, Z, covered, SHADE_TEST_LESS);
+		int pass_bits = _mm_movemask_ps(pass);
+		if (pass_bits == 0)
+			continue;
+
+		written += count_bits(pass_bits);
+
+		if (context->shade_count_buffer != NULL && id != 0)
+			add_shade_counts(context, x + k, y, pass_bits);
+
+		if (id != 0)
+		{
+			__m128i pass_i = _mm_castps_si128(pass);
+			__m128i old_ids = _mm_loadu_si128((__m128i *)(ids + k));
+			_mm_storeu_si128((__m128i *)(ids + k), _mm_or_si128(_mm_and_si128(pass_i, id4), _mm_andnot_si128(pass_i, old_ids)));
+		}
+	}
+
+	for (; k < n; k++)
+		written += depth_pixel(context, rt, id, x + k, y, ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f);
+
+	return written;
+}
+
+#else
+
+int shade_span_variant(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id,
+	enum ShadeTest test, enum PixelColor color, bool lit, bool opaque)
+{
+	// assumes context is valid
+	// returns the number of pixels shaded, everything after id is a constant
+	// in each variant
+
+	struct TextureSampler sampler;
+	if (color != PIXEL_COLOR_MATERIAL)
+		setup_texture_sampler(context, rt, &sampler);
+
+	int shaded = 0;
+
+	for (int k = 0; k < n; k++)
+		shaded += shade_pixel(context, rt, &sampler, test, id, x + k, y, test == SHADE_TEST_VISIBLE || (ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f), color, lit, opaque);
+
+	return shaded;
+}
+
+int depth_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id)
+{
+	// assumes context is valid
+	// only tests and writes depth, and the triangle id unless it is 0
+	// returns the number of pixels written
+
+	int written = 0;
+
+	for (int k = 0; k < n; k++)
+		written += depth_pixel(context, rt, id, x + k, y, ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f);
+
+	return written;
+}
+
+#endif
+
+int shade_span(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, enum ShadeTest test, uint32_t id)
+{
+	// assumes context is valid
+	// returns the number of pixels shaded by the variant of the span loop
+	// for the test, the triangle's pipeline and the pixel format, each a
+	// copy with its choices folded in
+
+	switch (test)
+	{
+	case SHADE_TEST_EQUAL:
+		return shade_span_color(context, rt, x, y, n, ws0, ws1, ws2, id, SHADE_TEST_EQUAL);
+
+	case SHADE_TEST_VISIBLE:
+		return shade_span_color(context, rt, x, y, n, ws0, ws1, ws2, id, SHADE_TEST_VISIBLE);
+
+	default:
+		return shade_span_color(context, rt, x, y, n, ws0, ws1, ws2, id, SHADE_TEST_LESS);
+	}
+}
+
+int shade_span_color(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id, enum ShadeTest test)
+{
+	switch (rt->color)
+	{
+	case PIXEL_COLOR_NEAREST:
+		return shade_span_light(context, rt, x, y, n, ws0, ws1, ws2, id, test, PIXEL_COLOR_NEAREST);
+
+	case PIXEL_COLOR_FILTERED:
+		return shade_span_light(context, rt, x, y, n, ws0, ws1, ws2, id, test, PIXEL_COLOR_FILTERED);
+
+	default:
+		return shade_span_light(context, rt, x, y, n, ws0, ws1, ws2, id, test, PIXEL_COLOR_MATERIAL);
+	}
+}
+
+int shade_span_light(struct RenderContext *context, const struct RasterTriangle *rt, int x, int y, int n, const float *ws0, const float *ws1, const float *ws2, uint32_t id, enum ShadeTest test, enum PixelColor color)
+{
+	bool opaque = context->pixel_format == PIXEL_FORMAT_XRGB8888;
+
+	if (rt->lit)
+	{
+		if (opaque)
+			return shade_span_variant(context, rt, x, y, n, ws0, ws1, ws2, id, test, color, true, true);
+
+		return shade_span_variant(context, rt, x, y, n, ws0, ws1, ws2, id, test, color, true, false);
+	}
+
+	if (opaque)
+		return shade_span_variant(context, rt, x, y, n, ws0, ws1, ws2, id, test, color, false, true);
+
+	return shade_span_variant(context, rt, x, y, n, ws0, ws1, ws2, id, test, color, false, false);
+}
+
+bool shade_pixel(struct RenderContext *context, const struct RasterTriangle *rt, const struct TextureSampler *sampler, enum ShadeTest test, uint32_t id, int x, int y, bool covered,
+	enum PixelColor color, bool lit, bool opaque)
+{
+	// assumes context is valid
+	// returns true if the pixel was shaded
 
-							float light = v0_light * w0 + v1_light * w1 + v2_light * w2;
+	bool pass;
+
+	if (test == SHADE_TEST_VISIBLE)
+	{
+		pass = context->visibility_buffer[x + y * context->screen_width] == id;
+	}
+	else
+	{
+		if (!covered)
+			return false;
 
-							*((uint32_t *)diffuse) = sample_texture_map_nearest_neighbor(materials[tris[i].material].tex_map, u, v);
+		float Z = plane_value(&rt->z, x - rt->xmin, y - rt->ymin);
 
-							process_pixel_default(context, x, y, diffuse[2], diffuse[1], diffuse[0], diffuse[3], light);
-						}
-					}
+		if (test == SHADE_TEST_EQUAL)
+			pass = depth_is_nearest(context, x, y, Z);
+		else
+			pass = set_depth_if_z_is_closer(context, x, y, Z);
+	}
 
-					w0 += w0dx;
-					w1 += w1dx;
-					w2 += w2dx;
-				}
+	if (pass)
+		shade_fragment(context, rt, sampler, x, y, color, lit, opaque);
 
-				w0ady += w0dy;
-				w1ady += w1dy;
-				w2ady += w2dy;
+	if (pass && context->shade_count_buffer != NULL && test != SHADE_TEST_VISIBLE)
+		add_shade_counts(context, x, y, 1);
 
-				w0 = ow0 + w0ady;
-				w1 = ow1 + w1ady;
-				w2 = ow2 + w2ady;
-			}
-		}
+	return pass;
+}
+
+void shade_fragment(struct RenderContext *context, const struct RasterTriangle *rt, const struct TextureSampler *sampler, int x, int y, enum PixelColor color, bool lit, bool opaque)
+{
+	// assumes context is valid
+
+	int dx = x - rt->xmin;
+	int dy = y - rt->ymin;
+
+	uint32_t texel;
+
+	if (color == PIXEL_COLOR_MATERIAL)
+	{
+		texel = rt->diffuse;
 	}
+	else
+	{
+		float z = 1.0f / plane_value(&rt->q, dx, dy);
+
+		float ui = plane_value(&rt->u, dx, dy);
+		float u = z * ui;
+
+		float vi = plane_value(&rt->v, dx, dy);
+		float v = z * vi;
+
+		if (color == PIXEL_COLOR_NEAREST)
+			texel = sample_texture_nearest(sampler, u, v);
+		else
+			texel = sample_texture(sampler, z, u, v);
+	}
+
+	float light = lit ? plane_value(&rt->light, dx, dy) : 1.0f;
+
+	set_pixel(context, x, y, shade_texel(texel, light, lit, opaque));
 }
 
-void process_pixel_default(struct RenderContext *context, int x, int y, int r, int g, int b, int a, float light)
+bool depth_pixel(struct RenderContext *context, const struct RasterTriangle *rt, uint32_t id, int x, int y, bool covered)
 {
 	// assumes context is valid
 
-	r = max(0, min((int)(light * r), 255));
-	g = max(0, min((int)(light * g), 255));
-	b = max(0, min((int)(light * b), 255));
-	a = max(0, min((int)(light * a), 255));
+	if (!covered)
+		return false;
+
+	float Z = plane_value(&rt->z, x - rt->xmin, y - rt->ymin);
+
+	if (!set_depth_if_z_is_closer(context, x, y, Z))
+		return false;
+
+	if (id != 0)
+	{
+		context->visibility_buffer[x + y * context->screen_width] = id;
+
+		if (context->shade_count_buffer != NULL)
+			add_shade_counts(context, x, y, 1);
+	}
+
+	return true;
+}
+
+uint32_t shade_texel(uint32_t texel, float light, bool lit, bool opaque)
+{
+	// the channels of texel lit the way modulate_channel does, opaque pixels
+	// keep alpha at 255
+
+	if (lit)
+	{
+		int r = max(0, min((int)(light * (int)((texel >> 16) & 0xff)), 255));
+		int g = max(0, min((int)(light * (int)((texel >> 8) & 0xff)), 255));
+		int b = max(0, min((int)(light * (int)(texel & 0xff)), 255));
+		int a = opaque ? 255 : max(0, min((int)(light * (int)(texel >> 24)), 255));
+
+		return rgba(r, g, b, a);
+	}
+
+	return opaque ? texel | 0xff000000 : texel;
+}
+
+uint32_t material_color(const struct Material *material)
+{
+	// the diffuse color as an opaque pixel
+	int r = max(0, min((int)(material->diffuse_rgb[0] * 255.0f + 0.5f), 255));
+	int g = max(0, min((int)(material->diffuse_rgb[1] * 255.0f + 0.5f), 255));
+	int b = max(0, min((int)(material->diffuse_rgb[2] * 255.0f + 0.5f), 255));
+
+	return rgba(r, g, b, 255);
+}
+
+int count_bits(int mask)
+{
+	// the number of set bits of a SIMD lane mask
+	mask = mask - ((mask >> 1) & 0x55);
+	mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+
+	return (mask + (mask >> 4)) & 0x0f;
+}
+
+int count_covered(int n, const float *ws0, const float *ws1, const float *ws2)
+{
+	// the coverage test of the spans, for the stats
+	int covered = 0;
+
+	for (int k = 0; k < n; k++)
+		covered += ws0[k] > 0.0f && ws1[k] > 0.0f && ws2[k] > 0.0f;
+
+	return covered;
+}
+
+void add_shade_counts(struct RenderContext *context, int x, int y, int mask)
+{
+	// assumes context is valid and stats are enabled
+	// counts a fragment at (x + k, y) for every bit k of mask
+
+	uint32_t *counts = &context->shade_count_buffer[x + y * context->screen_width];
+
+	for (int k = 0; mask != 0; k++, mask >>= 1)
+		counts[k] += mask & 1;
+}
+
+uint32_t heatmap_color(uint32_t count)
+{
+	// black, blue, cyan, green, yellow, orange, red, magenta and white for 8
+	// fragments or more
+	static const uint32_t colors[] =
+	{
+		0xff000000, 0xff0000ff, 0xff00ffff, 0xff00ff00, 0xffffff00,
+		0xffff8000, 0xffff0000, 0xffff00ff, 0xffffffff
+	};
 
-	set_pixel(context, x, y, rgba(r, g, b, a));
+	return colors[min(count, 8)];
 }
 
-float calc_2xtri_area(struct Vector *v0, struct Vector *v1, struct Vector *v2)
+float calc_2xtri_area(const struct Vector *v0, const struct Vector *v1, const struct Vector *v2)
 {
 	struct Vector v0v1, v0v2;
 	VecSub(v1, v0, &v0v1);
@@ -358,15 +4000,80 @@ float calc_2xtri_area(struct Vector *v0, struct Vector *v1, struct Vector *v2)
 	return v0v1.x * v0v2.y - v0v1.y * v0v2.x;;
 }
 
+float depth_value(const struct RenderContext *context, const struct Vector *pos)
+{
+	// assumes context is valid
+	// pos is a screen position with depth and 1 / w, the result is linear
+	// across a triangle and smaller nearer in every format
+
+	switch (context->depth_format)
+	{
+	case DEPTH_FORMAT_REVERSE_FLOAT:
+		return -context->znear * pos->w;
+
+	case DEPTH_FORMAT_UNORM16:
+		return DEPTH_UNORM16_MAX * (1.0f - context->znear * pos->w) / (1.0f - context->znear / context->zfar);
+
+	default:
+		return pos->z;
+	}
+}
+
+int depth_texel_size(enum DepthFormat format)
+{
+	return format == DEPTH_FORMAT_UNORM16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+float load_depth(const struct RenderContext *context, int i)
+{
+	// assumes context is valid
+	// the depth at index i in the units of depth_value
+
+	if (context->depth_format == DEPTH_FORMAT_UNORM16)
+		return ((const uint16_t *)context->depth_buffer->buffer)[i];
+
+	return ((const float *)context->depth_buffer->buffer)[i];
+}
+
+bool depth_is_nearest(const struct RenderContext *context, int x, int y, float Z)
+{
+	// assumes context is valid
+	// true if nothing nearer than Z was drawn at the pixel
+
+	int i = x + y * context->screen_width;
+
+	if (context->depth_format == DEPTH_FORMAT_UNORM16)
+		return ((const uint16_t *)context->depth_buffer->buffer)[i] >= (uint16_t)max(0.0f, min(Z, DEPTH_UNORM16_MAX));
+
+	return ((const float *)context->depth_buffer->buffer)[i] >= Z;
+}
+
 bool set_depth_if_z_is_closer(struct RenderContext *context, int x, int y, float Z)
 {
 	if (context == NULL)
 		return false;
 
-	float z = *(float*)&(context->depth_buffer->buffer[x + y * context->screen_width]);
-	if (z > Z)
+	int i = x + y * context->screen_width;
+
+	if (context->depth_format == DEPTH_FORMAT_UNORM16)
+	{
+		uint16_t *depth = (uint16_t *)context->depth_buffer->buffer + i;
+		uint16_t z = (uint16_t)max(0.0f, min(Z, DEPTH_UNORM16_MAX));
+
+		if (*depth > z)
+		{
+			*depth = z;
+			return true;
+		}
+
+		return false;
+	}
+
+	float *depth = (float *)context->depth_buffer->buffer + i;
+
+	if (*depth > Z)
 	{
-		context->depth_buffer->buffer[x + y * context->screen_width] = *(int32_t*)&Z;
+		*depth = Z;
 		return true;
 	}
 
@@ -380,8 +4087,374 @@ uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 
 uint32_t sample_texture_map_nearest_neighbor(struct TextureMap *texture_map, float u, float v)
 {
-	int x = (int)(u * (texture_map->width - 1) + 0.5f);
-	int y = (int)(v * (texture_map->height - 1) + 0.5f);
+	struct TexelAxis axis_x, axis_y;
+	setup_texel_axis(texture_map->width, texture_map->address, &axis_x);
+	setup_texel_axis(texture_map->height, texture_map->address, &axis_y);
+
+	int x = texel_coord(&axis_x, u);
+	int y = texel_coord(&axis_y, v);
+
+	return texture_map->buffer[texel_index(texture_map, 0, x, y)];
+}
+
+uint32_t sample_texture_map_bilinear(const struct TextureSampler *sampler, int level, float u, float v)
+{
+	uint32_t taps[4];
+	int wx, wy;
+	bilinear_taps(sampler, level, u, v, taps, &wx, &wy);
+
+	return lerp_texels(lerp_texels(taps[0], taps[1], wx), lerp_texels(taps[2], taps[3], wx), wy);
+}
+
+uint32_t sample_texture_map_trilinear(const struct TextureSampler *sampler, float lod, float u, float v)
+{
+	// lod is within [0, max_lod], the two nearest levels are blended
+	int level = (int)lod;
+	int weight = (int)((lod - (float)level) * 128.0f);
+
+	uint32_t texel = sample_texture_map_bilinear(sampler, level, u, v);
+
+	if (weight == 0)
+		return texel;
+
+	return lerp_texels(texel, sample_texture_map_bilinear(sampler, min(level + 1, sampler->texture_map->num_mip_levels), u, v), weight);
+}
+
+uint32_t sample_texture_nearest(const struct TextureSampler *sampler, float u, float v)
+{
+	const struct TextureMap *texture_map = sampler->texture_map;
+
+	int x = texel_coord(&sampler->axes[0], u);
+	int y = texel_coord(&sampler->axes[1], v);
+
+	return texture_map->buffer[texel_index(texture_map, 0, x, y)];
+}
+
+uint32_t sample_texture(const struct TextureSampler *sampler, float z, float u, float v)
+{
+	if (sampler->filter == TEXTURE_FILTER_NEAREST)
+		return sample_texture_nearest(sampler, u, v);
+
+	// a nan lod ends up at the smallest level
+	float lod = calc_texture_lod(sampler, z, u, v);
+	lod = max(min(lod, sampler->max_lod), 0.0f);
+
+	if (sampler->filter == TEXTURE_FILTER_BILINEAR)
+		return sample_texture_map_bilinear(sampler, (int)(lod + 0.5f), u, v);
+
+	return sample_texture_map_trilinear(sampler, lod, u, v);
+}
+
+void setup_texture_sampler(struct RenderContext *context, const struct RasterTriangle *rt, struct TextureSampler *sampler)
+{
+	// assumes context is valid
+
+	const struct TextureMap *texture_map = rt->tex_map;
+
+	sampler->texture_map = texture_map;
+	sampler->filter = context->texture_filter;
+
+	setup_texel_axis(texture_map->width, texture_map->address, &sampler->axes[0]);
+	setup_texel_axis(texture_map->height, texture_map->address, &sampler->axes[1]);
+
+	float width = (float)texture_map->width;
+	float height = (float)texture_map->height;
+
+	sampler->dudx = rt->u.dx * width;
+	sampler->dudy = rt->u.dy * width;
+	sampler->dvdx = rt->v.dx * height;
+	sampler->dvdy = rt->v.dy * height;
+	sampler->dqdx = rt->q.dx;
+	sampler->dqdy = rt->q.dy;
+	sampler->width = width;
+	sampler->height = height;
+	sampler->max_lod = (float)texture_map->num_mip_levels;
+}
+
+float calc_texture_lod(const struct TextureSampler *sampler, float z, float u, float v)
+{
+	// u = (u / w) / (1 / w), so du/dx = z * (d(u / w)/dx - u * d(1 / w)/dx),
+	// everything in texels of level 0
+	float su = u * sampler->width;
+	float sv = v * sampler->height;
+
+	float ux = z * (sampler->dudx - su * sampler->dqdx);
+	float uy = z * (sampler->dudy - su * sampler->dqdy);
+	float vx = z * (sampler->dvdx - sv * sampler->dqdx);
+	float vy = z * (sampler->dvdy - sv * sampler->dqdy);
+
+	float rho2 = max(ux * ux + vx * vx, uy * uy + vy * vy);
+
+	// half of log2 of the squared footprint, the exponent and mantissa bits
+	// of a float read as an int are a piecewise linear log2
+	int32_t bits;
+	memcpy(&bits, &rho2, sizeof(bits));
+
+	return (float)bits * (1.0f / (1 << 24)) - 63.5f;
+}
+
+void bilinear_taps(const struct TextureSampler *sampler, int level, float u, float v, uint32_t *taps, int *wx, int *wy)
+{
+	// taps are (x0, y0), (x1, y0), (x0, y1), (x1, y1) and the weights of
+	// x1 and y1 out of 128
+
+	const struct TextureMap *texture_map = sampler->texture_map;
+
+	int width = max(texture_map->width >> level, 1);
+	int height = max(texture_map->height >> level, 1);
+
+	int x1, y1;
+	int x0 = bilinear_coords(&sampler->axes[0], width, u, &x1, wx);
+	int y0 = bilinear_coords(&sampler->axes[1], height, v, &y1, wy);
+
+	taps[0] = texture_map->buffer[texel_index(texture_map, level, x0, y0)];
+	taps[1] = texture_map->buffer[texel_index(texture_map, level, x1, y0)];
+	taps[2] = texture_map->buffer[texel_index(texture_map, level, x0, y1)];
+	taps[3] = texture_map->buffer[texel_index(texture_map, level, x1, y1)];
+}
+
+int bilinear_coords(const struct TexelAxis *axis, int size, float t, int *c1, int *weight)
+{
+	// texel centers are at 0.5, the limits keep the conversion to int defined
+	float f = t * (float)size - 0.5f;
+	f = max(min(f, TEXEL_COORD_LIMIT), -TEXEL_COORD_LIMIT);
+
+	int c0 = (int)f;
+	c0 -= f < (float)c0;
+
+	*weight = (int)((f - (float)c0) * 128.0f);
+	*c1 = c0 + 1;
+
+	if (axis->wrap)
+	{
+		*c1 &= size - 1;
+		return c0 & (size - 1);
+	}
+
+	*c1 = max(min(*c1, size - 1), 0);
+	return max(min(c0, size - 1), 0);
+}
+
+uint32_t lerp_texels(uint32_t a, uint32_t b, int weight)
+{
+	// per channel a + (b - a) * weight / 128 rounded down, exactly as the
+	// SIMD versions do it in 16 bit lanes
+	uint32_t r = 0;
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		int ca = (a >> shift) & 0xff;
+		int cb = (b >> shift) & 0xff;
+
+		r |= (uint32_t)((ca + (((cb - ca) * weight) >> 7)) & 0xff) << shift;
+	}
+
+	return r;
+}
+
+void setup_texel_axis(int size, enum TextureAddress address, struct TexelAxis *axis)
+{
+	axis->scale = (float)(size - 1);
+	axis->wrap = address == TEXTURE_ADDRESS_WRAP && (size & (size - 1)) == 0;
+
+	if (axis->wrap)
+	{
+		// the limits only keep the conversion to int defined for huge or
+		// nan coordinates, the mask does the wrapping
+		axis->lo = -TEXEL_COORD_LIMIT;
+		axis->hi = TEXEL_COORD_LIMIT;
+		axis->mask = size - 1;
+	}
+	else
+	{
+		axis->lo = 0.0f;
+		axis->hi = (float)(size - 1);
+		axis->mask = -1;
+	}
+}
+
+int texel_coord(const struct TexelAxis *axis, float t)
+{
+	// a nan coordinate ends up at hi
+	float f = t * axis->scale + 0.5f;
+	f = max(min(f, axis->hi), axis->lo);
+
+	// floor without a call to floorf
+	int i = (int)f;
+	i -= f < (float)i;
+
+	return i & axis->mask;
+}
+
+int texel_index(const struct TextureMap *texture_map, int level, int x, int y)
+{
+	// assumes x and y are inside the level
+
+	int offset = level > 0 ? texture_map->mip_offsets[level] : 0;
+
+	if (texture_map->layout == TEXTURE_LAYOUT_MORTON)
+	{
+		// the bits of the longer side that have no partner go on top
+		int bits = max(texture_map->morton_bits - level, 0);
+		int low = (1 << bits) - 1;
+
+		return offset + ((int)(spread_bits(x & low) | (spread_bits(y & low) << 1)) | (((x | y) >> bits) << (2 * bits)));
+	}
+
+	return offset + x + y * max(texture_map->width >> level, 1);
+}
+
+uint32_t spread_bits(uint32_t x)
+{
+	// moves bit i of the low 16 bits to bit 2 * i
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+
+	return x;
+}
+
+size_t texture_map_size(const struct TextureMap *texture_map)
+{
+	// the last mip level is always 1x1
+	if (texture_map->num_mip_levels > 0)
+		return (size_t)texture_map->mip_offsets[texture_map->num_mip_levels] + 1;
+
+	return (size_t)texture_map->width * texture_map->height;
+}
+
+bool set_texture_layout(struct TextureMap *texture_map, enum TextureLayout layout)
+{
+	if (texture_map == NULL || texture_map->buffer == NULL)
+		return false;
+
+	if (texture_map->layout == layout)
+		return true;
+
+	int width = texture_map->width;
+	int height = texture_map->height;
+
+	if (layout == TEXTURE_LAYOUT_MORTON)
+	{
+		if (width <= 0 || height <= 0 || width > 65536 || height > 65536 ||
+			(width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+			return false;
+	}
+
+	// reordered through a copy so the buffer itself never moves
+	size_t size = texture_map_size(texture_map) * sizeof(uint32_t);
+	uint32_t *copy = (uint32_t *)malloc(size);
+	if (copy == NULL)
+		return false;
+
+	memcpy(copy, texture_map->buffer, size);
+
+	struct TextureMap target = *texture_map;
+	target.layout = layout;
+	target.morton_bits = 0;
+
+	if (layout == TEXTURE_LAYOUT_MORTON)
+	{
+		while ((2 << target.morton_bits) <= min(width, height))
+			target.morton_bits++;
+	}
+
+	for (int level = 0; level <= texture_map->num_mip_levels; level++)
+	{
+		int level_width = max(width >> level, 1);
+		int level_height = max(height >> level, 1);
+
+		for (int y = 0; y < level_height; y++)
+			for (int x = 0; x < level_width; x++)
+				texture_map->buffer[texel_index(&target, level, x, y)] = copy[texel_index(texture_map, level, x, y)];
+	}
+
+	free(copy);
+
+	texture_map->layout = layout;
+	texture_map->morton_bits = target.morton_bits;
+
+	return true;
+}
+
+bool create_texture_mip_levels(struct TextureMap *texture_map)
+{
+	if (texture_map == NULL || texture_map->buffer == NULL)
+		return false;
+
+	if (texture_map->num_mip_levels > 0)
+		return true;
+
+	int width = texture_map->width;
+	int height = texture_map->height;
+
+	if (width <= 1 && height <= 1)
+		return true;
+
+	int max_size = 1 << (MAX_TEXTURE_LEVELS - 1);
+	if (width <= 0 || height <= 0 || width > max_size || height > max_size ||
+		(width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+		return false;
+
+	// the levels follow level 0 in the same buffer so one base address
+	// reaches all of them
+	int num_levels = 0;
+	int offsets[MAX_TEXTURE_LEVELS] = { 0 };
+	size_t size = (size_t)width * height;
+
+	offsets[0] = 0;
+
+	for (int w = width, h = height; w > 1 || h > 1;)
+	{
+		w = max(w / 2, 1);
+		h = max(h / 2, 1);
+
+		offsets[++num_levels] = (int)size;
+		size += (size_t)w * h;
+	}
+
+	uint32_t *buffer = (uint32_t *)realloc(texture_map->buffer, size * sizeof(uint32_t));
+	if (buffer == NULL)
+		return false;
+
+	texture_map->buffer = buffer;
+	texture_map->num_mip_levels = num_levels;
+	memcpy(texture_map->mip_offsets, offsets, sizeof(offsets));
+
+	// every texel is the rounded average of the 2x2 texels above it, or of
+	// the 2x1 ones once a side is down to 1
+	for (int level = 1; level <= num_levels; level++)
+	{
+		int src_width = max(width >> (level - 1), 1);
+		int src_height = max(height >> (level - 1), 1);
+		int level_width = max(width >> level, 1);
+		int level_height = max(height >> level, 1);
+
+		for (int y = 0; y < level_height; y++)
+		{
+			for (int x = 0; x < level_width; x++)
+			{
+				int x0 = 2 * x, x1 = min(2 * x + 1, src_width - 1);
+				int y0 = 2 * y, y1 = min(2 * y + 1, src_height - 1);
+
+				uint32_t t00 = buffer[texel_index(texture_map, level - 1, x0, y0)];
+				uint32_t t10 = buffer[texel_index(texture_map, level - 1, x1, y0)];
+				uint32_t t01 = buffer[texel_index(texture_map, level - 1, x0, y1)];
+				uint32_t t11 = buffer[texel_index(texture_map, level - 1, x1, y1)];
 
-	return texture_map->buffer[x + y * texture_map->width];
-}
\ No newline at end of file
+				uint32_t texel = 0;
+				for (int shift = 0; shift < 32; shift += 8)
+				{
+					uint32_t sum = ((t00 >> shift) & 0xff) + ((t10 >> shift) & 0xff) + ((t01 >> shift) & 0xff) + ((t11 >> shift) & 0xff);
+					texel |= ((sum + 2) >> 2) << shift;
+				}
+
+				buffer[texel_index(texture_map, level, x, y)] = texel;
+			}
+		}
+	}
+
+	return true;
+}
@@ -5,18 +5,61 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include "nova_math.h"
 
 #define BYTES_PER_PIXEL 4
-#define MAX_MESH_VERTICES 4096
+#define TILE_SIZE 64
+#define HIZ_BLOCK_SIZE 8
+
+// mip levels of a texture including level 0, enough for 16384 texels a side
+#define MAX_TEXTURE_LEVELS 15
+
+	// texel order of a texture, morton interleaves the bits of x and y so
+	// texels near each other in any direction are near each other in memory,
+	// it needs power of two sides
+	enum TextureLayout
+	{
+		TEXTURE_LAYOUT_LINEAR,
+		TEXTURE_LAYOUT_MORTON
+	};
+
+	// how uvs outside of [0, 1] are mapped to texels, wrapping needs power of
+	// two sides and clamps otherwise
+	enum TextureAddress
+	{
+		TEXTURE_ADDRESS_WRAP,
+		TEXTURE_ADDRESS_CLAMP
+	};
+
+	// nearest samples level 0 only, bilinear the mip level closest to the
+	// pixel's footprint and trilinear blends the two closest
+	enum TextureFilter
+	{
+		TEXTURE_FILTER_NEAREST,
+		TEXTURE_FILTER_BILINEAR,
+		TEXTURE_FILTER_TRILINEAR
+	};
 
 	struct TextureMap
 	{
 		int width;
 		int height;
 		uint32_t *buffer;
+
+		// change the layout with set_texture_layout only, morton_bits is the
+		// number of bits of x and y that are interleaved
+		enum TextureLayout layout;
+		enum TextureAddress address;
+		int morton_bits;
+
+		// mip levels 1 to num_mip_levels follow level 0 in buffer, each half
+		// the size of the one before down to 1x1, mip_offsets[0] is 0
+		int num_mip_levels;
+		int mip_offsets[MAX_TEXTURE_LEVELS];
 	};
 
 	struct Material
@@ -26,6 +69,10 @@ extern "C" {
 		float ambient_rgb[3];
 		float diffuse_rgb[3];
 		float specular_rgb[3];
+
+		// illum 0 in the .mtl file, the texture or diffuse color is drawn as
+		// is without lighting
+		bool unlit;
 	};
 
 	struct Vertex
@@ -63,8 +110,157 @@ extern "C" {
 
 		struct Material *materials;
 		int num_materials;
+
+		// set when the mesh and its arrays live in a mapped cache file
+		void *cache;
+	};
+
+	enum RasterMode
+	{
+		// float barycentrics stepped across the bounding box
+		RASTER_MODE_FLOAT,
+
+		// integer edge functions on vertices snapped to 28.4 fixed point with
+		// a top-left fill rule, pixels on shared edges are shaded exactly once
+		RASTER_MODE_FIXED_POINT,
+
+		// float barycentrics evaluated only between the exact entry and exit
+		// of every row, long thin triangles test no pixels outside themselves
+		RASTER_MODE_SPAN,
+
+		// the reference, every pixel of each triangle's bounding box worked out
+		// from scratch and shaded with nearest texels right away whatever the
+		// shading mode, without threads, hi-z or stats, and triangles crossing
+		// the near plane are skipped instead of clipped
+		RASTER_MODE_NAIVE
+	};
+
+	enum ShadingMode
+	{
+		// every fragment that passes the depth test is shaded right away
+		SHADING_MODE_FORWARD,
+
+		// drawing only writes depth and the triangle covering each pixel to a
+		// visibility buffer, resolve_visibility_buffer then shades every
+		// visible pixel exactly once
+		SHADING_MODE_DEFERRED
+	};
+
+	// how depth_buffer stores depth, every format passes the nearer fragment
+	enum DepthFormat
+	{
+		// the projected z as a 32 bit float
+		DEPTH_FORMAT_FLOAT,
+
+		// znear / w as a 32 bit float, 1 at the near plane falling towards 0
+		// with distance where floats are densest, stored negated so nearer
+		// is still smaller
+		DEPTH_FORMAT_REVERSE_FLOAT,
+
+		// 16 bit unsigned, 0 at the near plane to 65535 at the far plane
+		// linear in 1 / w, half the memory traffic for scenes with a narrow
+		// depth range, anything beyond the far plane is not drawn
+		DEPTH_FORMAT_UNORM16
+	};
+
+	// how pixel_buffer stores a pixel, both as 0xAARRGGBB
+	enum PixelFormat
+	{
+		// alpha is lit along with the color channels
+		PIXEL_FORMAT_ARGB8888,
+
+		// opaque, alpha is always 255 and never lit
+		PIXEL_FORMAT_XRGB8888
 	};
 
+	enum DrawOrder
+	{
+		// triangles are drawn in the order of the mesh
+		DRAW_ORDER_MESH,
+
+		// triangles are sorted every frame by the view depth of their nearest
+		// vertex, so hidden fragments fail the depth test before being shaded
+		DRAW_ORDER_FRONT_TO_BACK
+	};
+
+	// what drawing did since the depth buffer was last cleared. The triangle,
+	// fragment and hi-z counts are always kept, the pixel and byte counts
+	// and stage times only while stats are enabled.
+	struct RenderStats
+	{
+		// triangles passed to render_mesh, once per copy for
+		// render_mesh_instanced, the ones outside the frustum or facing away,
+		// the ones clipped against the near plane or the guard band, and the
+		// triangles set up for rasterizing, clipping can turn one into
+		// several and ones covering no pixel are dropped
+		uint64_t triangles_submitted;
+		uint64_t triangles_frustum_culled;
+		uint64_t triangles_backface_culled;
+		uint64_t triangles_clipped;
+		uint64_t triangles_rasterized;
+
+		// pixels of the triangles' bounding boxes tested for coverage, leaving
+		// out blocks hi-z rejected, the ones inside their triangle, and of
+		// those the ones that passed and failed the depth test. Both passes
+		// of the depth pre-pass test every pixel.
+		uint64_t pixels_tested;
+		uint64_t pixels_covered;
+		uint64_t depth_tests_passed;
+		uint64_t depth_tests_failed;
+
+		// fragments shaded, or written to the visibility buffer when shading
+		// is deferred
+		uint64_t fragments_shaded;
+
+		uint64_t hiz_blocks_rejected;
+		uint64_t hiz_triangles_rejected;
+
+		// bytes of the depth buffer read by the depth tests of covered pixels
+		// and written by those that passed and by filling cleared tiles
+		uint64_t depth_bytes_read;
+		uint64_t depth_bytes_written;
+
+		// milliseconds spent transforming vertices and normals, culling,
+		// clipping, setting up and binning triangles, rasterizing and shading
+		// them, and shading the visibility buffer
+		double transform_ms;
+		double setup_ms;
+		double raster_ms;
+		double resolve_ms;
+	};
+
+	// a frame of a swapchain, rendered into between acquire_image and
+	// submit_image and read between take_submitted_image and release_image
+	struct SwapchainImage
+	{
+		// width * height pixels as in pixel_buffer
+		uint32_t *pixels;
+		int width;
+		int height;
+		int index;
+
+		// counted from 0 in the order frames are submitted, and GetTimeMs
+		// when the image was acquired for rendering and when it was submitted
+		uint64_t frame;
+		double acquire_ms;
+		double submit_ms;
+
+		// the pixels there is room for, grown by acquire_image when the
+		// swapchain allocated them
+		size_t capacity;
+		bool owned;
+	};
+
+	struct ThreadPool;
+	struct RasterState;
+	struct RasterTriangle;
+	struct TileBin;
+	struct Swapchain;
+	struct MeshInstance;
+
+	// Everything a context renders with is its own, from init until destroy.
+	// A context is used by one thread at a time, any number of them can
+	// render at once, from the same meshes too.
 	struct RenderContext
 	{
 		int screen_width;
@@ -74,23 +270,201 @@ extern "C" {
 
 		struct TextureMap *pixel_buffer;
 		struct TextureMap *depth_buffer;
+
+		// the vertices and normals of the mesh being drawn after transforming,
+		// one copy per instance transformed at once, grown to fit the largest
+		// mesh so far
 		struct Vertex *vertex_buffer;
 		struct Vector *vertex_normal_buffer;
+		int vertex_buffer_alloc;
+		int normal_buffer_alloc;
+
+		// every vertex before the perspective divide and the frustum planes
+		// it is outside of, triangles are culled and clipped against these
+		struct Vector *clip_buffer;
+		uint8_t *clip_flags;
+		float znear;
+		float zfar;
+
+		// set mv_mat before rendering, set_hfov and set_screen_size set the
+		// projection and screen matrices and render_mat is the product of all
+		// three used by the last render_mesh
+		struct Matrix mv_mat;
+		struct Matrix proj_mat;
+		struct Matrix screen_mat;
+		struct Matrix render_mat;
+
+		enum RasterMode raster_mode;
+		enum TextureFilter texture_filter;
+		enum ShadingMode shading_mode;
+		enum DrawOrder draw_order;
+		enum DepthFormat depth_format;
+		enum PixelFormat pixel_format;
+
+		// draw the depth of every triangle of a mesh before shading it, only
+		// fragments at the nearest depth get shaded, ignored when shading is
+		// deferred since that only draws depth anyway
+		bool depth_prepass;
+
+		// hierarchical z, the farthest depth of every HIZ_BLOCK_SIZE square of
+		// depth_buffer, lets whole blocks and triangles be rejected early
+		bool hiz_enabled;
+		float *hiz_buffer;
+		uint8_t *hiz_dirty;
+		int hiz_width;
+		int hiz_height;
+		struct RasterState *raster_state;
+
+		// reset by clear_depth_buffer along with shade_count_buffer, hi-z
+		// rejections are counted per triangle and tile when rendering with
+		// more than one thread
+		struct RenderStats stats;
+		bool stats_enabled;
+
+		// the fragments counted in stats.fragments_shaded per pixel, only
+		// allocated while stats are enabled
+		uint32_t *shade_count_buffer;
+
+		// what the pixel and depth buffers are cleared to, the depth in the
+		// units of depth_format and farther than anything drawn
+		uint32_t pixel_clear_value;
+		float depth_clear_value;
+
+		// clearing only flags every TILE_SIZE square of the pixel and depth
+		// buffers as pending, a tile is filled with the clear values when it
+		// is first drawn to and the pixels of untouched ones when the frame
+		// is resolved
+		uint8_t *clear_tiles;
+		int num_clear_tiles_x;
+		int num_clear_tiles_y;
+
+		int num_threads;
+		struct ThreadPool *thread_pool;
+
+		// set up triangles of the current mesh, or of everything drawn since
+		// the depth buffer was cleared when shading is deferred
+		struct RasterTriangle *raster_tris;
+		int num_raster_tris;
+		int raster_tris_alloc;
+
+		// triangle indices in front to back order and their depth keys
+		int *tri_order;
+		int tri_order_alloc;
 
-		struct Matrix *mv_mat;
-		struct Matrix *proj_mat;
-		struct Matrix *screen_mat;
-		struct Matrix *render_mat;
+		// the instances render_mesh_instanced found inside the frustum
+		struct MeshInstance *instances;
+		int instances_alloc;
+
+		// how far in pixels a level of detail may be off from the full mesh
+		// before a finer one is drawn
+		float lod_pixel_error;
+
+		// the index into raster_tris plus one of the triangle each pixel shows,
+		// 0 where nothing was drawn, only allocated when shading is deferred
+		uint32_t *visibility_buffer;
+
+		struct TileBin *tile_bins;
+		int num_tiles_x;
+		int num_tiles_y;
+
+		// a ring of images rendered into in turn instead of pixel_buffer's
+		// own pixels, so one frame is drawn while earlier ones are read
+		struct Swapchain *swapchain;
 	};
 
 	void init(struct RenderContext *context);
+
+	// frees everything the context allocated, init makes it usable again
+	void destroy(struct RenderContext *context);
 	void set_screen_size(struct RenderContext *context, int width, int height);
 	void set_hfov(struct RenderContext *context, float fov);
+	void set_raster_mode(struct RenderContext *context, enum RasterMode mode);
+	void set_texture_filter(struct RenderContext *context, enum TextureFilter filter);
+	void set_shading_mode(struct RenderContext *context, enum ShadingMode mode);
+	void set_draw_order(struct RenderContext *context, enum DrawOrder order);
+
+	// reallocates and clears the depth buffer
+	void set_depth_format(struct RenderContext *context, enum DepthFormat format);
+	void set_pixel_format(struct RenderContext *context, enum PixelFormat format);
+	void set_depth_prepass(struct RenderContext *context, bool enabled);
+	void set_hiz_enabled(struct RenderContext *context, bool enabled);
+	void set_render_threads(struct RenderContext *context, int num_threads);
+	void set_stats_enabled(struct RenderContext *context, bool enabled);
+	void set_lod_pixel_error(struct RenderContext *context, float pixels);
+
+	// replaces the swapchain with one of num_images images, 0 for none.
+	// buffers holds num_images buffers of screen_width * screen_height pixels
+	// that belong to the caller, shared memory for example, and when NULL
+	// the images are allocated. Every image has to be back from whoever
+	// reads them. Returns false if they could not be allocated.
+	bool set_swapchain(struct RenderContext *context, int num_images, uint32_t *const *buffers);
+
+	// waits for a free image and makes it the pixel buffer, it is rendered
+	// into like any other after clearing it and the screen size is kept until
+	// it is submitted, set_screen_size submits it first. Returns NULL once the swapchain is closed or when the
+	// screen is larger than the caller's buffers.
+	struct SwapchainImage *acquire_image(struct RenderContext *context);
+
+	// fills the pixels of tiles nothing was drawn to, hands the acquired
+	// image to its reader and gives pixel_buffer its own pixels back, shading
+	// has to be resolved before when it is deferred
+	void submit_image(struct RenderContext *context);
+
+	// the reader's side, safe to call from any one other thread while the
+	// context renders. Returns the images in the order they were submitted,
+	// NULL when none is waiting and wait is false, or once the swapchain is
+	// closed and all of them were taken.
+	struct SwapchainImage *take_submitted_image(struct RenderContext *context, bool wait);
+	void release_image(struct RenderContext *context, struct SwapchainImage *image);
+
+	// no more frames, acquire_image returns NULL from now on
+	void close_swapchain(struct RenderContext *context);
+
+	// fills the pixels of tiles nothing was drawn to since they were cleared
 	uint32_t *get_pixel_buffer(struct RenderContext *context);
+
+	// the buffers are filled a tile at a time as they are drawn to
 	void clear_pixel_buffer(struct RenderContext *context);
 	void clear_depth_buffer(struct RenderContext *context);
+
+	// fragments shaded per pixel drawn to since the depth buffer was cleared,
+	// 1 means nothing was shaded only to be covered later
+	float get_overdraw(struct RenderContext *context);
+
+	// colors every pixel by the number of fragments shaded at it since the
+	// depth buffer was cleared, black for none, then blue, cyan, green,
+	// yellow, orange, red and magenta to white for 8 or more. Returns false
+	// if stats are not enabled.
+	bool get_overdraw_heatmap(struct RenderContext *context, uint32_t *pixels);
+
 	void render_mesh(struct RenderContext *context, struct Mesh *mesh);
 
+	// renders count copies of a mesh like render_mesh does with mv_mat times
+	// each of matrices in turn. Copies whose bounding sphere is outside the
+	// frustum are skipped and the rest are transformed a batch at a time and
+	// rasterized together, nearest first when drawing front to back.
+	void render_mesh_instanced(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *matrices, int count);
+
+	// renders a mesh into several contexts, one per view with its own
+	// matrices, size and settings, like render_mesh on each of them. The
+	// views are rendered at the same time on the threads of pool, or in turn
+	// when it is NULL, and pool must not be the thread pool of any of them.
+	void render_mesh_views(struct RenderContext *const *views, int num_views, struct Mesh *mesh, struct ThreadPool *pool);
+
+	// fills the pixels of tiles nothing was drawn to since they were cleared
+	// and shades the pixels drawn with deferred shading since the depth
+	// buffer was cleared, their meshes and textures have to be alive until
+	// then and the raster mode unchanged
+	void resolve_visibility_buffer(struct RenderContext *context);
+
+	// reorders the texels in place, returns false if the layout is not
+	// possible for the texture's size
+	bool set_texture_layout(struct TextureMap *texture_map, enum TextureLayout layout);
+
+	// builds the mip levels of a texture with power of two sides, the buffer
+	// is reallocated to hold them so it must come from malloc
+	bool create_texture_mip_levels(struct TextureMap *texture_map);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nova_scene.h"
+
+// deep enough for a median split hierarchy over any number of instances
+#define SCENE_STACK_SIZE 64
+
+struct BuildItem
+{
+	float centroid[3];
+	int instance;
+};
+
+static int build_node(struct Scene *scene, struct BuildItem *items, int count, int parent);
+static void select_items(struct BuildItem *items, int count, int axis, int k);
+static void refit_node(struct Scene *scene, int node);
+
+struct Scene *CreateScene(void)
+{
+	struct Scene *scene = (struct Scene *)calloc(1, sizeof(struct Scene));
+	if (scene == NULL)
+		return NULL;
+
+	scene->root = -1;
+
+	return scene;
+}
+
+void DestroyScene(struct Scene *scene)
+{
+	if (scene == NULL)
+		return;
+
+	// the meshes and levels of detail belong to the caller
+	free(scene->instances);
+	free(scene->nodes);
+	free(scene);
+}
+
+int AddSceneInstance(struct Scene *scene, struct Mesh *mesh, const struct Matrix *world_mat)
+{
+	if (scene == NULL || mesh == NULL || world_mat == NULL)
+		return -1;
+
+	if (scene->num_instances == scene->instances_alloc)
+	{
+		int alloc = scene->instances_alloc > 0 ? scene->instances_alloc * 2 : 16;
+		struct SceneInstance *instances = (struct SceneInstance *)realloc(scene->instances, alloc * sizeof(struct SceneInstance));
+		if (instances == NULL)
+			return -1;
+
+		scene->instances = instances;
+		scene->instances_alloc = alloc;
+	}
+
+	int index = scene->num_instances++;
+	struct SceneInstance *instance = &scene->instances[index];
+
+	instance->mesh = mesh;
+	instance->lod = NULL;
+	instance->lod_level = 0;
+	instance->node = -1;
+	CalcMeshBounds(mesh, &instance->local_bounds);
+
+	MatCopy(world_mat, &instance->world_mat);
+	BoxTransform(&instance->world_mat, &instance->local_bounds, &instance->bounds);
+
+	scene->needs_rebuild = true;
+
+	return index;
+}
+
+void RemoveSceneInstance(struct Scene *scene, int index)
+{
+	if (scene == NULL || index < 0 || index >= scene->num_instances)
+		return;
+
+	scene->instances[index] = scene->instances[--scene->num_instances];
+	scene->needs_rebuild = true;
+}
+
+void SetSceneInstanceTransform(struct Scene *scene, int index, const struct Matrix *world_mat)
+{
+	if (scene == NULL || world_mat == NULL || index < 0 || index >= scene->num_instances)
+		return;
+
+	struct SceneInstance *instance = &scene->instances[index];
+
+	MatCopy(world_mat, &instance->world_mat);
+	BoxTransform(&instance->world_mat, &instance->local_bounds, &instance->bounds);
+
+	// grow or shrink the boxes from the leaf up to the root, a pending
+	// rebuild picks up the new bounds anyway
+	if (!scene->needs_rebuild && instance->node >= 0)
+		refit_node(scene, instance->node);
+}
+
+void SetSceneInstanceLod(struct Scene *scene, int index, struct MeshLod *lod)
+{
+	if (scene == NULL || index < 0 || index >= scene->num_instances)
+		return;
+
+	scene->instances[index].lod = lod;
+	scene->instances[index].lod_level = 0;
+}
+
+void BuildSceneHierarchy(struct Scene *scene)
+{
+	if (scene == NULL)
+		return;
+
+	scene->num_nodes = 0;
+	scene->root = -1;
+	scene->needs_rebuild = false;
+
+	if (scene->num_instances == 0)
+		return;
+
+	// a binary tree with one instance per leaf
+	struct SceneNode *nodes = (struct SceneNode *)realloc(scene->nodes, (2 * scene->num_instances - 1) * sizeof(struct SceneNode));
+	struct BuildItem *items = (struct BuildItem *)malloc(scene->num_instances * sizeof(struct BuildItem));
+
+	if (nodes != NULL)
+		scene->nodes = nodes;
+
+	if (nodes == NULL || items == NULL)
+	{
+		free(items);
+		scene->needs_rebuild = true;
+		return;
+	}
+
+	for (int i = 0; i < scene->num_instances; i++)
+	{
+		struct Vector c;
+		BoxCenter(&scene->instances[i].bounds, &c);
+
+		items[i].centroid[0] = c.x;
+		items[i].centroid[1] = c.y;
+		items[i].centroid[2] = c.z;
+		items[i].instance = i;
+	}
+
+	scene->root = build_node(scene, items, scene->num_instances, -1);
+
+	free(items);
+}
+
+void CalcMeshBounds(const struct Mesh *mesh, struct BoundingBox *bounds)
+{
+	if (mesh == NULL || bounds == NULL)
+		return;
+
+	BoxSetEmpty(bounds);
+
+	for (int i = 0; i < mesh->num_vertices; i++)
+		BoxAddPoint(bounds, &mesh->vertices[i].pos);
+}
+
+void RenderScene(struct RenderContext *context, struct Scene *scene, const struct Matrix *view_mat)
+{
+	if (context == NULL || scene == NULL || view_mat == NULL)
+		return;
+
+	scene->instances_rendered = 0;
+	scene->instances_culled = 0;
+	scene->nodes_visited = 0;
+
+	if (scene->needs_rebuild)
+		BuildSceneHierarchy(scene);
+
+	if (scene->root < 0)
+		return;
+
+	// world space frustum, whole subtrees outside of it are skipped before
+	// any of their vertices are transformed
+	struct Matrix clip_mat;
+	MatMul(&context->proj_mat, view_mat, &clip_mat);
+
+	struct Frustum frustum;
+	FrustumSetFromMatrix(&frustum, &clip_mat, context->znear, context->zfar);
+
+	// view_mat may well be the context's own mv_mat
+	struct Matrix saved_mv_mat = context->mv_mat;
+	struct Matrix view = *view_mat;
+
+	// planes a node is fully inside of are not tested again for its children
+	int stack_nodes[SCENE_STACK_SIZE];
+	int stack_masks[SCENE_STACK_SIZE];
+	int top = 0;
+
+	stack_nodes[top] = scene->root;
+	stack_masks[top] = FRUSTUM_ALL_PLANES;
+	top++;
+
+	while (top > 0)
+	{
+		top--;
+		struct SceneNode *node = &scene->nodes[stack_nodes[top]];
+		int mask = stack_masks[top];
+
+		scene->nodes_visited++;
+
+		if (BoxIsEmpty(&node->bounds))
+			continue;
+
+		if (mask != 0 && FrustumTestBox(&frustum, &node->bounds, &mask) == FRUSTUM_OUTSIDE)
+			continue;
+
+		if (node->instance >= 0)
+		{
+			struct SceneInstance *instance = &scene->instances[node->instance];
+
+			MatMul(&view, &instance->world_mat, &context->mv_mat);
+
+			if (instance->lod != NULL)
+				instance->lod_level = RenderMeshLod(context, instance->lod, instance->lod_level);
+			else
+				render_mesh(context, instance->mesh);
+
+			scene->instances_rendered++;
+			continue;
+		}
+
+		if (top + 2 > SCENE_STACK_SIZE)
+			continue;
+
+		stack_nodes[top] = node->right;
+		stack_masks[top] = mask;
+		top++;
+
+		stack_nodes[top] = node->left;
+		stack_masks[top] = mask;
+		top++;
+	}
+
+	context->mv_mat = saved_mv_mat;
+
+	scene->instances_culled = scene->num_instances - scene->instances_rendered;
+}
+
+int build_node(struct Scene *scene, struct BuildItem *items, int count, int parent)
+{
+	// assumes scene is valid and count > 0
+
+	int index = scene->num_nodes++;
+	struct SceneNode *node = &scene->nodes[index];
+
+	node->parent = parent;
+	node->left = -1;
+	node->right = -1;
+	node->instance = -1;
+
+	if (count == 1)
+	{
+		struct SceneInstance *instance = &scene->instances[items[0].instance];
+
+		node->instance = items[0].instance;
+		node->bounds = instance->bounds;
+		instance->node = index;
+
+		return index;
+	}
+
+	// split at the median centroid along the axis the centroids spread most
+	float cmin[3], cmax[3];
+	for (int a = 0; a < 3; a++)
+	{
+		cmin[a] = items[0].centroid[a];
+		cmax[a] = items[0].centroid[a];
+	}
+
+	for (int i = 1; i < count; i++)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			cmin[a] = min(cmin[a], items[i].centroid[a]);
+			cmax[a] = max(cmax[a], items[i].centroid[a]);
+		}
+	}
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+	{
+		if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+			axis = a;
+	}
+
+	int half = count / 2;
+	select_items(items, count, axis, half);
+
+	// the node array never moves during a build
+	node->left = build_node(scene, items, half, index);
+	node->right = build_node(scene, items + half, count - half, index);
+	BoxUnion(&scene->nodes[node->left].bounds, &scene->nodes[node->right].bounds, &node->bounds);
+
+	return index;
+}
+
+void select_items(struct BuildItem *items, int count, int axis, int k)
+{
+	// partially sorts items so the first k have centroids no greater along
+	// axis than the rest
+
+	int lo = 0;
+	int hi = count - 1;
+
+	while (lo < hi)
+	{
+		float pivot = items[(lo + hi) / 2].centroid[axis];
+		int i = lo;
+		int j = hi;
+
+		while (i <= j)
+		{
+			while (items[i].centroid[axis] < pivot)
+				i++;
+			while (items[j].centroid[axis] > pivot)
+				j--;
+
+			if (i <= j)
+			{
+				struct BuildItem t = items[i];
+				items[i] = items[j];
+				items[j] = t;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+void refit_node(struct Scene *scene, int node)
+{
+	// assumes scene is valid and node is a leaf
+
+	struct SceneNode *n = &scene->nodes[node];
+	n->bounds = scene->instances[n->instance].bounds;
+
+	for (node = n->parent; node >= 0; node = n->parent)
+	{
+		n = &scene->nodes[node];
+
+		struct BoundingBox bounds;
+		BoxUnion(&scene->nodes[n->left].bounds, &scene->nodes[n->right].bounds, &bounds);
+
+		// the ancestors above an unchanged box are unchanged too
+		if (memcmp(&bounds, &n->bounds, sizeof(struct BoundingBox)) == 0)
+			break;
+
+		n->bounds = bounds;
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef _NOVA_SCENE_H_
+#define _NOVA_SCENE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "nova_render.h"
+#include "nova_geometry.h"
+#include "nova_lod.h"
+
+	// a mesh placed in the world, meshes may be shared between instances
+	struct SceneInstance
+	{
+		struct Mesh *mesh;
+		struct Matrix world_mat;
+
+		// mesh bounds in model space and transformed to world space
+		struct BoundingBox local_bounds;
+		struct BoundingBox bounds;
+
+		// drawn instead of mesh when set, lod_level is the level drawn last
+		struct MeshLod *lod;
+		int lod_level;
+
+		int node;
+	};
+
+	// bounding volume hierarchy node, leaves hold exactly one instance
+	struct SceneNode
+	{
+		struct BoundingBox bounds;
+		int parent;
+		int left, right;
+		int instance;
+	};
+
+	struct Scene
+	{
+		struct SceneInstance *instances;
+		int num_instances;
+		int instances_alloc;
+
+		struct SceneNode *nodes;
+		int num_nodes;
+		int root;
+
+		// adding or removing instances rebuilds the hierarchy on the next
+		// render, moving them only refits it
+		bool needs_rebuild;
+
+		// counts from the last RenderScene
+		int instances_rendered;
+		int instances_culled;
+		int nodes_visited;
+	};
+
+	struct Scene *CreateScene(void);
+	void DestroyScene(struct Scene *scene);
+
+	// returns the index of the new instance or -1
+	int AddSceneInstance(struct Scene *scene, struct Mesh *mesh, const struct Matrix *world_mat);
+
+	// the last instance takes over the index of the removed one
+	void RemoveSceneInstance(struct Scene *scene, int index);
+
+	void SetSceneInstanceTransform(struct Scene *scene, int index, const struct Matrix *world_mat);
+
+	// renders the instance with the level of lod that fits its size on
+	// screen, lod->levels[0] should be the instance's mesh. NULL goes back
+	// to the mesh.
+	void SetSceneInstanceLod(struct Scene *scene, int index, struct MeshLod *lod);
+
+	void BuildSceneHierarchy(struct Scene *scene);
+	void CalcMeshBounds(const struct Mesh *mesh, struct BoundingBox *bounds);
+
+	// renders every instance whose bounds are inside the view frustum,
+	// context->mv_mat is set to view_mat * world_mat for each of them
+	// and restored afterwards
+	void RenderScene(struct RenderContext *context, struct Scene *scene, const struct Matrix *view_mat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,436 @@
+// clock_gettime is POSIX rather than C99
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#include "nova_thread.h"
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define mutex_init(m) InitializeSRWLock(m)
+#define mutex_destroy(m)
+#define mutex_lock(m) AcquireSRWLockExclusive(m)
+#define mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c)
+#define cond_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+struct ThreadPool
+{
+	int num_threads;
+	thread_t *threads;
+
+	mutex_t lock;
+	cond_t work_ready;
+	cond_t work_done;
+
+	ThreadPoolJob job;
+	void *data;
+	int job_count;
+	int next_job;
+	int jobs_done;
+
+	unsigned int generation;
+	bool quit;
+};
+
+struct Thread
+{
+	thread_t handle;
+	ThreadMain main;
+	void *data;
+};
+
+struct WorkQueue
+{
+	mutex_t lock;
+	cond_t not_empty;
+	cond_t not_full;
+
+	// a ring of capacity items starting at head
+	void **items;
+	int capacity;
+	int head;
+	int count;
+
+	bool closed;
+};
+
+static void run_jobs(struct ThreadPool *pool);
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID arg)
+#else
+static void *thread_main(void *arg)
+#endif
+{
+	struct Thread *thread = (struct Thread *)arg;
+	thread->main(thread->data);
+
+	return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+#else
+static void *worker_main(void *arg)
+#endif
+{
+	struct ThreadPool *pool = (struct ThreadPool *)arg;
+	unsigned int seen = 0;
+
+	mutex_lock(&pool->lock);
+
+	for (;;)
+	{
+		while (!pool->quit && pool->generation == seen)
+			cond_wait(&pool->work_ready, &pool->lock);
+
+		if (pool->quit)
+			break;
+
+		seen = pool->generation;
+		run_jobs(pool);
+	}
+
+	mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+struct ThreadPool *CreateThreadPool(int num_threads)
+{
+	if (num_threads < 1)
+		return NULL;
+
+	struct ThreadPool *pool = (struct ThreadPool *)calloc(1, sizeof(struct ThreadPool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = (thread_t *)malloc(num_threads * sizeof(thread_t));
+	if (pool->threads == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	mutex_init(&pool->lock);
+	cond_init(&pool->work_ready);
+	cond_init(&pool->work_done);
+
+	// thread 0 is the caller of RunThreadPool
+	pool->num_threads = 1;
+	for (int i = 1; i < num_threads; i++)
+	{
+#ifdef _WIN32
+		pool->threads[i] = CreateThread(NULL, 0, worker_main, pool, 0, NULL);
+		if (pool->threads[i] == NULL)
+			break;
+#else
+		if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+			break;
+#endif
+		pool->num_threads++;
+	}
+
+	return pool;
+}
+
+void DestroyThreadPool(struct ThreadPool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	mutex_lock(&pool->lock);
+	pool->quit = true;
+	cond_broadcast(&pool->work_ready);
+	mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->num_threads; i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], NULL);
+#endif
+	}
+
+	cond_destroy(&pool->work_done);
+	cond_destroy(&pool->work_ready);
+	mutex_destroy(&pool->lock);
+
+	free(pool->threads);
+	free(pool);
+}
+
+int GetThreadPoolSize(const struct ThreadPool *pool)
+{
+	if (pool == NULL)
+		return 1;
+
+	return pool->num_threads;
+}
+
+void RunThreadPool(struct ThreadPool *pool, ThreadPoolJob job, void *data, int count)
+{
+	if (job == NULL || count <= 0)
+		return;
+
+	if (pool == NULL || pool->num_threads == 1)
+	{
+		for (int i = 0; i < count; i++)
+			job(data, i);
+
+		return;
+	}
+
+	mutex_lock(&pool->lock);
+
+	pool->job = job;
+	pool->data = data;
+	pool->job_count = count;
+	pool->next_job = 0;
+	pool->jobs_done = 0;
+	pool->generation++;
+	cond_broadcast(&pool->work_ready);
+
+	run_jobs(pool);
+
+	while (pool->jobs_done < pool->job_count)
+		cond_wait(&pool->work_done, &pool->lock);
+
+	mutex_unlock(&pool->lock);
+}
+
+void run_jobs(struct ThreadPool *pool)
+{
+	// assumes pool->lock is held, it is released while a job runs
+
+	while (pool->next_job < pool->job_count)
+	{
+		int index = pool->next_job++;
+
+		mutex_unlock(&pool->lock);
+		pool->job(pool->data, index);
+		mutex_lock(&pool->lock);
+
+		pool->jobs_done++;
+		if (pool->jobs_done == pool->job_count)
+			cond_broadcast(&pool->work_done);
+	}
+}
+
+int GetProcessorCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+double GetTimeMs(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1000.0 / frequency.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+#endif
+}
+
+struct Thread *StartThread(ThreadMain main, void *data)
+{
+	if (main == NULL)
+		return NULL;
+
+	struct Thread *thread = (struct Thread *)calloc(1, sizeof(struct Thread));
+	if (thread == NULL)
+		return NULL;
+
+	thread->main = main;
+	thread->data = data;
+
+#ifdef _WIN32
+	thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+	if (thread->handle == NULL)
+#else
+	if (pthread_create(&thread->handle, NULL, thread_main, thread) != 0)
+#endif
+	{
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void JoinThread(struct Thread *thread)
+{
+	if (thread == NULL)
+		return;
+
+#ifdef _WIN32
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+
+	free(thread);
+}
+
+struct WorkQueue *CreateWorkQueue(int capacity)
+{
+	if (capacity < 1)
+		return NULL;
+
+	struct WorkQueue *queue = (struct WorkQueue *)calloc(1, sizeof(struct WorkQueue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->items = (void **)malloc(capacity * sizeof(void *));
+	if (queue->items == NULL)
+	{
+		free(queue);
+		return NULL;
+	}
+
+	queue->capacity = capacity;
+
+	mutex_init(&queue->lock);
+	cond_init(&queue->not_empty);
+	cond_init(&queue->not_full);
+
+	return queue;
+}
+
+void DestroyWorkQueue(struct WorkQueue *queue)
+{
+	if (queue == NULL)
+		return;
+
+	cond_destroy(&queue->not_full);
+	cond_destroy(&queue->not_empty);
+	mutex_destroy(&queue->lock);
+
+	free(queue->items);
+	free(queue);
+}
+
+void PushWorkQueue(struct WorkQueue *queue, void *item)
+{
+	if (queue == NULL)
+		return;
+
+	mutex_lock(&queue->lock);
+
+	while (queue->count == queue->capacity)
+		cond_wait(&queue->not_full, &queue->lock);
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	cond_broadcast(&queue->not_empty);
+
+	mutex_unlock(&queue->lock);
+}
+
+void *PopWorkQueue(struct WorkQueue *queue)
+{
+	if (queue == NULL)
+		return NULL;
+
+	mutex_lock(&queue->lock);
+
+	while (queue->count == 0 && !queue->closed)
+		cond_wait(&queue->not_empty, &queue->lock);
+
+	void *item = NULL;
+
+	if (queue->count > 0)
+	{
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		cond_broadcast(&queue->not_full);
+	}
+
+	mutex_unlock(&queue->lock);
+
+	return item;
+}
+
+void *TryPopWorkQueue(struct WorkQueue *queue)
+{
+	if (queue == NULL)
+		return NULL;
+
+	mutex_lock(&queue->lock);
+
+	void *item = NULL;
+
+	if (queue->count > 0)
+	{
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		cond_broadcast(&queue->not_full);
+	}
+
+	mutex_unlock(&queue->lock);
+
+	return item;
+}
+
+void CloseWorkQueue(struct WorkQueue *queue)
+{
+	if (queue == NULL)
+		return;
+
+	mutex_lock(&queue->lock);
+	queue->closed = true;
+	cond_broadcast(&queue->not_empty);
+	mutex_unlock(&queue->lock);
+}
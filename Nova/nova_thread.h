@@ -0,0 +1,57 @@
+#ifndef _NOVA_THREAD_H_
+#define _NOVA_THREAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// A fixed set of worker threads that run batches of indexed jobs.
+	// The calling thread takes part in every batch, so a pool created
+	// with num_threads = 4 starts 3 workers.
+	struct ThreadPool;
+
+	typedef void (*ThreadPoolJob)(void *data, int index);
+
+	struct ThreadPool *CreateThreadPool(int num_threads);
+	void DestroyThreadPool(struct ThreadPool *pool);
+	int GetThreadPoolSize(const struct ThreadPool *pool);
+
+	// Runs job(data, i) for every i in [0, count) and returns once all
+	// of them have finished. Jobs are handed out in increasing order.
+	void RunThreadPool(struct ThreadPool *pool, ThreadPoolJob job, void *data, int count);
+
+	int GetProcessorCount(void);
+
+	// Milliseconds on a monotonic clock, for timing.
+	double GetTimeMs(void);
+
+	// A single thread running alongside the caller, JoinThread waits for
+	// it to return and frees it.
+	struct Thread;
+
+	typedef void (*ThreadMain)(void *data);
+
+	struct Thread *StartThread(ThreadMain main, void *data);
+	void JoinThread(struct Thread *thread);
+
+	// A bounded first in, first out queue of pointers for handing work
+	// between threads. Pushing blocks while it is full and popping while
+	// it is empty.
+	struct WorkQueue;
+
+	struct WorkQueue *CreateWorkQueue(int capacity);
+	void DestroyWorkQueue(struct WorkQueue *queue);
+	void PushWorkQueue(struct WorkQueue *queue, void *item);
+
+	// Returns NULL once the queue is closed and every item was popped.
+	void *PopWorkQueue(struct WorkQueue *queue);
+
+	// Returns NULL right away when the queue is empty.
+	void *TryPopWorkQueue(struct WorkQueue *queue);
+	void CloseWorkQueue(struct WorkQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
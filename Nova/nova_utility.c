@@ -1,3 +1,8 @@
+// posix_madvise is POSIX rather than C99
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
@@ -6,256 +11,801 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <sys/stat.h>
+
 #include "nova_utility.h"
+#include "nova_thread.h"
+
+// smallest piece of an .obj file worth parsing on its own thread
+#define OBJ_MIN_CHUNK_SIZE (256 * 1024)
+
+// bump when the layout of the cache or of any struct in it changes
+#define MESH_CACHE_VERSION 6
+#define MESH_CACHE_EXTENSION ".nvmesh"
+#define MESH_CACHE_ALIGNMENT 64
+#define MAX_MESH_SOURCES 32
+
+struct MappedFile
+{
+	char *data;
+	size_t size;
+};
+
+// a file a mesh was built from, its cache is stale once any of them changes
+struct MeshSource
+{
+	char path[256];
+	int64_t size;
+	int64_t mtime;
+};
+
+struct MeshSources
+{
+	struct MeshSource files[MAX_MESH_SOURCES];
+	int count;
+};
+
+// the cache holds an image of the mesh with every pointer stored as an
+// offset from the start of the file, they are fixed up in place after a
+// copy on write mapping so only the pages holding the structs get copied
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+
+	// the image is only valid for the compiler that wrote it
+	uint32_t pointer_size;
+	uint32_t mesh_size;
+	uint32_t triangle_size;
+	uint32_t material_size;
+	uint32_t texture_map_size;
+	uint32_t num_sources;
+
+	uint64_t file_size;
+	uint64_t mesh_offset;
+	uint64_t sources_offset;
+};
+
+// a line aligned piece of an .obj file, counted in a first pass so every
+// chunk knows where its elements go in the mesh before it is parsed
+struct ObjChunk
+{
+	const char *begin;
+	const char *end;
+
+	int num_vertices, num_normals, num_uvcoords, num_triangles;
+	int vertex_base, normal_base, uvcoord_base, triangle_base;
+
+	const char *material_lib;
+	int material_lib_len;
+	const char *last_material;
+	int last_material_len;
+	int start_material;
+
+	bool failed;
+};
+
+struct ObjLoad
+{
+	struct Mesh *mesh;
+	struct ObjChunk *chunks;
+	int num_chunks;
+	struct MeshSources *sources;
+};
 
 static struct TextureMap *CreateTextureMapFromFile(char *file_name);
 
-static bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh);
+static bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh, struct MeshSources *sources);
 static void DestroyMaterial(struct Material *material);
 
 static bool GetFilePath(char *full_file_path, char *file_path);
 
+static void CountObjChunk(void *data, int index);
+static bool MergeObjChunks(struct ObjLoad *load, char *file_name);
+static void ParseObjChunk(void *data, int index);
+static void FinishObjChunk(void *data, int index);
+static int FindMaterial(const struct Mesh *mesh, const char *name, int len, int current_material);
+static bool IsIndexValid(int index, int count);
+
+static const char *FindLineEnd(const char *p, const char *end);
+static const char *SkipSpaces(const char *p, const char *end);
+static const char *SkipToken(const char *p, const char *end);
+static bool StartsWithKeyword(const char *p, const char *end, const char *keyword);
+static float ParseFloat(const char **next, const char *p, const char *end);
+static int ParseIndex(const char **next, const char *end, int count);
+
+static bool MapFile(const char *file_name, bool copy_on_write, struct MappedFile *file);
+static void UnmapFile(struct MappedFile *file);
+
+static size_t EncodePpm(const uint32_t *pixels, int width, int height, uint8_t *out);
+static size_t EncodeBmp(const uint32_t *pixels, int width, int height, uint8_t *out);
+static size_t EncodeQoi(const uint32_t *pixels, int width, int height, uint8_t *out);
+static uint8_t *PutUint32(uint8_t *p, uint32_t value, bool big_endian);
+
+static bool WriteMeshCache(const struct Mesh *mesh, char *cache_name, const struct MeshSources *sources);
+static uint64_t AddCacheSection(uint64_t *offset, uint64_t size);
+static bool WriteCacheSection(FILE *file, const void *data, size_t size, uint64_t offset);
+static bool IsMeshCacheFresh(const struct MeshCacheHeader *header);
+static bool FixUpPointer(void **pointer, char *base, size_t file_size, size_t size);
+static bool GetTextureMapTexels(const struct TextureMap *tex_map, size_t *count);
+static bool AddMeshSource(struct MeshSources *sources, const char *path);
+static bool GetFileStamp(const char *path, int64_t *size, int64_t *mtime);
+
 struct Mesh *CreateMeshFromFile(char *file_name)
 {
-	// Note this function does not clean up properly if an error occurs!
+	return CreateMeshFromFileWithThreads(file_name, 0);
+}
 
-	int v_count = 0;
-	int v_alloc = 1;
-	struct Vertex *v_buffer = (struct Vertex *)malloc(v_alloc * sizeof(struct Vertex));
+struct Mesh *CreateMeshFromFileWithThreads(char *file_name, int num_threads)
+{
+	// a fresh cache next to the file skips the parsing altogether
+	char cache_name[256 + sizeof(MESH_CACHE_EXTENSION)];
+	bool use_cache = strlen(file_name) < 256;
 
-	int f_count = 0;
-	int f_alloc = 1;
-	struct Triangle *f_buffer = (struct Triangle *)malloc(f_alloc * sizeof(struct Triangle));
+	if (use_cache)
+	{
+		strcpy(cache_name, file_name);
+		strcat(cache_name, MESH_CACHE_EXTENSION);
 
-	int n_count = 0;
-	int n_alloc = 1;
-	struct Vector *n_buffer = (struct Vector *)malloc(n_alloc * sizeof(struct Vector));
+		struct Mesh *cached = CreateMeshFromCache(cache_name);
+		if (cached != NULL)
+			return cached;
+	}
 
-	int uv_count = 0;
-	int uv_alloc = 1;
-	struct UVCoord *uv_buffer = (struct UVCoord *)malloc(uv_alloc * sizeof(struct UVCoord));
+	struct MeshSources sources;
+	sources.count = 0;
+	AddMeshSource(&sources, file_name);
 
-	FILE *file = fopen(file_name, "r");
-	if (file == NULL)
+	struct MappedFile file;
+	if (!MapFile(file_name, false, &file))
 		return NULL;
 
 	struct Mesh *mesh = (struct Mesh *)calloc(1, sizeof(struct Mesh));
 	if (mesh == NULL)
+	{
+		UnmapFile(&file);
 		return NULL;
+	}
 
-	char line_buf[80];
+	if (num_threads <= 0)
+		num_threads = GetProcessorCount();
 
-	int current_material = -1;
+	// a few chunks per thread evens out uneven lines, small files are not
+	// worth splitting
+	int num_chunks = (int)min(file.size / OBJ_MIN_CHUNK_SIZE + 1, (size_t)num_threads * 4);
 
-	while (fgets(line_buf, 80, file))
+	struct ObjLoad load = { 0 };
+	load.mesh = mesh;
+	load.sources = &sources;
+	load.chunks = (struct ObjChunk *)calloc(num_chunks, sizeof(struct ObjChunk));
+
+	struct ThreadPool *pool = num_threads > 1 && num_chunks > 1 ? CreateThreadPool(min(num_threads, num_chunks)) : NULL;
+
+	bool ok = load.chunks != NULL;
+
+	if (ok)
 	{
-		switch (line_buf[0])
+		// chunks start right after a newline so no line is split
+		const char *p = file.data;
+		const char *end = file.data + file.size;
+
+		for (int i = 0; i < num_chunks; i++)
 		{
-		case 'm':
-			if (strstr(line_buf, "mtllib") != NULL)
-			{
-				char material_file_name[256], full_path[256];
-				
-				sscanf(line_buf, "mtllib %s", material_file_name);
-				
-				GetFilePath(file_name, full_path);
+			const char *chunk_end = i == num_chunks - 1 ? end : file.data + file.size / num_chunks * (i + 1);
 
-				strncat(full_path, material_file_name, 256 - strlen(material_file_name));
+			if (chunk_end < p)
+				chunk_end = p;
 
-				if (!CreateMaterialsFromFile(full_path, mesh))
-					return NULL;
-			}
+			const char *newline = (const char *)memchr(chunk_end, '\n', end - chunk_end);
+			chunk_end = newline != NULL ? newline + 1 : end;
 
-			break;
+			load.chunks[i].begin = p;
+			load.chunks[i].end = chunk_end;
+			p = chunk_end;
+		}
 
-		case 'u':
-			if (strstr(line_buf, "usemtl") != NULL)
-			{
-				char material_name[80];
-				sscanf(line_buf, "usemtl %s", material_name);
-				for (int i = 0; i < mesh->num_materials; i++)
-					if (strncmp(material_name, mesh->materials[i].name, 80) == 0)
-					{
-						current_material = i;
-						break;
-					}
-			}
-			break;
+		load.num_chunks = num_chunks;
 
-		case 'v':
-			switch (line_buf[1])
-			{
-			case ' ':
-				v_count++;
+		RunThreadPool(pool, CountObjChunk, &load, num_chunks);
+		ok = MergeObjChunks(&load, file_name);
+	}
 
-				if (v_count > v_alloc)
-				{
-					v_alloc *= 2;
-					v_buffer = (struct Vertex *)realloc(v_buffer, v_alloc * sizeof(struct Vertex));
-				}
+	if (ok)
+	{
+		RunThreadPool(pool, ParseObjChunk, &load, num_chunks);
+		RunThreadPool(pool, FinishObjChunk, &load, num_chunks);
 
-				float x, y, z;
-				sscanf(line_buf, "v %f %f %f", &x, &y, &z);
+		for (int i = 0; i < num_chunks; i++)
+			ok = ok && !load.chunks[i].failed;
+	}
 
-				v_buffer[v_count - 1].pos.x = x;
-				v_buffer[v_count - 1].pos.y = y;
-				v_buffer[v_count - 1].pos.z = z;
-				v_buffer[v_count - 1].pos.w = 1.0f;
+	DestroyThreadPool(pool);
+	free(load.chunks);
+	UnmapFile(&file);
 
-				break;
+	if (!ok)
+	{
+		DestroyMesh(mesh);
+		return NULL;
+	}
 
-			case 'n':
-				n_count++;
+	// best effort, the directory may well be read only
+	if (use_cache && sources.count <= MAX_MESH_SOURCES)
+		WriteMeshCache(mesh, cache_name, &sources);
 
-				if (n_count > n_alloc)
-				{
-					n_alloc *= 2;
-					n_buffer = (struct Vector *)realloc(n_buffer, n_alloc * sizeof(struct Vector));
-				}
+	return mesh;
+}
 
-				sscanf(line_buf, "vn %f %f %f", &x, &y, &z);
+struct Mesh *CreateMeshFromCache(char *cache_name)
+{
+	struct MappedFile file;
+	if (!MapFile(cache_name, true, &file))
+		return NULL;
 
-				n_buffer[n_count - 1].x = x;
-				n_buffer[n_count - 1].y = y;
-				n_buffer[n_count - 1].z = z;
-				n_buffer[n_count - 1].w = 0.0f;
+	char *base = file.data;
+	struct MeshCacheHeader *header = (struct MeshCacheHeader *)base;
+
+	bool ok = file.size >= sizeof(struct MeshCacheHeader) &&
+		memcmp(header->magic, "NOVAMESH", 8) == 0 &&
+		header->version == MESH_CACHE_VERSION &&
+		header->byte_order == 0x01020304 &&
+		header->pointer_size == sizeof(void *) &&
+		header->mesh_size == sizeof(struct Mesh) &&
+		header->triangle_size == sizeof(struct Triangle) &&
+		header->material_size == sizeof(struct Material) &&
+		header->texture_map_size == sizeof(struct TextureMap) &&
+		header->file_size == file.size &&
+		header->mesh_offset <= file.size - sizeof(struct Mesh) &&
+		IsMeshCacheFresh(header);
+
+	struct Mesh *mesh = ok ? (struct Mesh *)(base + header->mesh_offset) : NULL;
+
+	// turn the offsets back into pointers, checking that everything they
+	// point at is inside the file
+	ok = ok &&
+		FixUpPointer((void **)&mesh->vertices, base, file.size, (size_t)mesh->num_vertices * sizeof(struct Vertex)) &&
+		FixUpPointer((void **)&mesh->triangles, base, file.size, (size_t)mesh->num_triangles * sizeof(struct Triangle)) &&
+		FixUpPointer((void **)&mesh->normals, base, file.size, (size_t)mesh->num_normals * sizeof(struct Vector)) &&
+		FixUpPointer((void **)&mesh->uvcoords, base, file.size, (size_t)mesh->num_uvcoords * sizeof(struct UVCoord)) &&
+		FixUpPointer((void **)&mesh->materials, base, file.size, (size_t)mesh->num_materials * sizeof(struct Material));
+
+	for (int i = 0; ok && i < mesh->num_materials; i++)
+	{
+		struct Material *material = &mesh->materials[i];
 
-				VecNormalize(&n_buffer[n_count - 1], &n_buffer[n_count - 1]);
+		ok = FixUpPointer((void **)&material->name, base, file.size, 1) &&
+			memchr(material->name, '\0', base + file.size - material->name) != NULL;
 
-				break;
+		size_t num_texels;
 
-			case 't':
-				uv_count++;
+		if (ok && material->tex_map != NULL)
+		{
+			ok = FixUpPointer((void **)&material->tex_map, base, file.size, sizeof(struct TextureMap)) &&
+				GetTextureMapTexels(material->tex_map, &num_texels) &&
+				FixUpPointer((void **)&material->tex_map->buffer, base, file.size, num_texels * sizeof(uint32_t));
+		}
+	}
 
-				if (uv_count > uv_alloc)
-				{
-					uv_alloc *= 2;
-					uv_buffer = (struct UVCoord *)realloc(uv_buffer, uv_alloc * sizeof(struct UVCoord));
-				}
+	if (!ok)
+	{
+		UnmapFile(&file);
+		return NULL;
+	}
 
-				sscanf(line_buf, "vt %f %f", &x, &y);
+	mesh->cache = base;
 
-				uv_buffer[uv_count - 1].u = x;
-				uv_buffer[uv_count - 1].v = y;
-				break;
-			}
+	return mesh;
+}
 
-			break;
+bool SaveMeshCache(const struct Mesh *mesh, char *cache_name)
+{
+	if (mesh == NULL || cache_name == NULL)
+		return false;
 
-		case 'f':
-			f_count++;
+	return WriteMeshCache(mesh, cache_name, NULL);
+}
 
-			if (f_count > f_alloc)
-			{
-				f_alloc *= 2;
-				f_buffer = (struct Triangle *)realloc(f_buffer, f_alloc * sizeof(struct Triangle));
-			}
+void CountObjChunk(void *data, int index)
+{
+	struct ObjLoad *load = (struct ObjLoad *)data;
+	struct ObjChunk *chunk = &load->chunks[index];
 
-			int v0, v1, v2;
-			int t0, t1, t2;
-			int n0, n1, n2;
+	const char *p = chunk->begin;
 
-			int match = sscanf(line_buf, "f %d/%d/%d %d/%d/%d %d/%d/%d", &v0, &t0, &n0, &v1, &t1, &n1, &v2, &t2, &n2);
-			bool vns = true;
-			bool vts = true;
+	while (p < chunk->end)
+	{
+		const char *line_end = FindLineEnd(p, chunk->end);
+		const char *s = SkipSpaces(p, line_end);
+
+		if (StartsWithKeyword(s, line_end, "v"))
+			chunk->num_vertices++;
+		else if (StartsWithKeyword(s, line_end, "vn"))
+			chunk->num_normals++;
+		else if (StartsWithKeyword(s, line_end, "vt"))
+			chunk->num_uvcoords++;
+		else if (StartsWithKeyword(s, line_end, "f"))
+		{
+			// polygons are split into a fan of triangles
+			int corners = 0;
+			s = SkipSpaces(s + 1, line_end);
 
-			if (match < 3)
+			while (s < line_end)
 			{
-				match = sscanf(line_buf, "f %d//%d %d//%d %d//%d", &v0, &n0, &v1, &n1, &v2, &n2);
-				vts = false;
+				corners++;
+				s = SkipSpaces(SkipToken(s, line_end), line_end);
 			}
 
-			if (match < 3)
-			{
-				match = sscanf(line_buf, "f %d %d %d", &v0, &v1, &v2);
-				vns = false;
-			}
+			if (corners >= 3)
+				chunk->num_triangles += corners - 2;
+		}
+		else if (StartsWithKeyword(s, line_end, "usemtl"))
+		{
+			chunk->last_material = SkipSpaces(s + 6, line_end);
+			chunk->last_material_len = (int)(SkipToken(chunk->last_material, line_end) - chunk->last_material);
+		}
+		else if (StartsWithKeyword(s, line_end, "mtllib") && chunk->material_lib == NULL)
+		{
+			chunk->material_lib = SkipSpaces(s + 6, line_end);
+			chunk->material_lib_len = (int)(SkipToken(chunk->material_lib, line_end) - chunk->material_lib);
+		}
 
-			v0--;
-			v1--;
-			v2--;
+		p = line_end + 1;
+	}
+}
 
-			f_buffer[f_count - 1].v0 = v0;
-			f_buffer[f_count - 1].v1 = v1;
-			f_buffer[f_count - 1].v2 = v2;
-			f_buffer[f_count - 1].material = current_material;
+bool MergeObjChunks(struct ObjLoad *load, char *file_name)
+{
+	// assumes every chunk has been counted
 
-			if (vts)
-			{
-				t0--;
-				t1--;
-				t2--;
+	struct Mesh *mesh = load->mesh;
 
-				f_buffer[f_count - 1].uv0 = t0;
-				f_buffer[f_count - 1].uv1 = t1;
-				f_buffer[f_count - 1].uv2 = t2;
-			}
+	int current_material = -1;
+	bool materials_loaded = false;
+
+	for (int i = 0; i < load->num_chunks; i++)
+	{
+		struct ObjChunk *chunk = &load->chunks[i];
+
+		chunk->vertex_base = mesh->num_vertices;
+		chunk->normal_base = mesh->num_normals;
+		chunk->uvcoord_base = mesh->num_uvcoords;
+		chunk->triangle_base = mesh->num_triangles;
+
+		mesh->num_vertices += chunk->num_vertices;
+		mesh->num_normals += chunk->num_normals;
+		mesh->num_uvcoords += chunk->num_uvcoords;
+		mesh->num_triangles += chunk->num_triangles;
+
+		// only the first material library is used, the usemtl names of the
+		// later chunks need it
+		if (chunk->material_lib != NULL && !materials_loaded)
+		{
+			char material_file_name[256], full_path[256];
+			int len = min(chunk->material_lib_len, 255);
+
+			memcpy(material_file_name, chunk->material_lib, len);
+			material_file_name[len] = '\0';
+
+			full_path[0] = '\0';
+			GetFilePath(file_name, full_path);
+
+			strncat(full_path, material_file_name, 256 - strlen(full_path) - 1);
+
+			if (!CreateMaterialsFromFile(full_path, mesh, load->sources))
+				return false;
+
+			materials_loaded = true;
+		}
+	}
+
+	// faces before the first usemtl of a chunk keep the material of the
+	// last usemtl before the chunk
+	for (int i = 0; i < load->num_chunks; i++)
+	{
+		struct ObjChunk *chunk = &load->chunks[i];
+
+		chunk->start_material = current_material;
 
-			if (vns)
+		if (chunk->last_material != NULL)
+			current_material = FindMaterial(mesh, chunk->last_material, chunk->last_material_len, current_material);
+	}
+
+	if (mesh->num_vertices > 0)
+		mesh->vertices = (struct Vertex *)malloc(mesh->num_vertices * sizeof(struct Vertex));
+	if (mesh->num_normals > 0)
+		mesh->normals = (struct Vector *)malloc(mesh->num_normals * sizeof(struct Vector));
+	if (mesh->num_uvcoords > 0)
+		mesh->uvcoords = (struct UVCoord *)malloc(mesh->num_uvcoords * sizeof(struct UVCoord));
+	if (mesh->num_triangles > 0)
+		mesh->triangles = (struct Triangle *)malloc(mesh->num_triangles * sizeof(struct Triangle));
+
+	return (mesh->num_vertices == 0 || mesh->vertices != NULL) &&
+		(mesh->num_normals == 0 || mesh->normals != NULL) &&
+		(mesh->num_uvcoords == 0 || mesh->uvcoords != NULL) &&
+		(mesh->num_triangles == 0 || mesh->triangles != NULL);
+}
+
+void ParseObjChunk(void *data, int index)
+{
+	struct ObjLoad *load = (struct ObjLoad *)data;
+	struct ObjChunk *chunk = &load->chunks[index];
+	struct Mesh *mesh = load->mesh;
+
+	// the chunk writes at its offsets from the counting pass, relative
+	// indices are resolved against the global counts at each face
+	int v_count = chunk->vertex_base;
+	int n_count = chunk->normal_base;
+	int uv_count = chunk->uvcoord_base;
+	int f_count = chunk->triangle_base;
+
+	int current_material = chunk->start_material;
+
+	const char *p = chunk->begin;
+
+	while (p < chunk->end)
+	{
+		const char *line_end = FindLineEnd(p, chunk->end);
+		const char *s = SkipSpaces(p, line_end);
+
+		if (StartsWithKeyword(s, line_end, "v"))
+		{
+			struct Vector *pos = &mesh->vertices[v_count++].pos;
+
+			pos->x = ParseFloat(&s, s + 1, line_end);
+			pos->y = ParseFloat(&s, s, line_end);
+			pos->z = ParseFloat(&s, s, line_end);
+			pos->w = 1.0f;
+		}
+		else if (StartsWithKeyword(s, line_end, "vn"))
+		{
+			struct Vector *n = &mesh->normals[n_count++];
+
+			n->x = ParseFloat(&s, s + 2, line_end);
+			n->y = ParseFloat(&s, s, line_end);
+			n->z = ParseFloat(&s, s, line_end);
+			n->w = 0.0f;
+
+			VecNormalize(n, n);
+		}
+		else if (StartsWithKeyword(s, line_end, "vt"))
+		{
+			struct UVCoord *uv = &mesh->uvcoords[uv_count++];
+
+			uv->u = ParseFloat(&s, s + 2, line_end);
+			uv->v = ParseFloat(&s, s, line_end);
+		}
+		else if (StartsWithKeyword(s, line_end, "f"))
+		{
+			int v[3] = { 0 }, t[3] = { 0 }, n[3] = { 0 };
+			int corners = 0;
+
+			s = SkipSpaces(s + 1, line_end);
+
+			while (s < line_end)
 			{
-				n0--;
-				n1--;
-				n2--;
+				// corner 0 stays, corners 1 and 2 slide along the fan
+				int c = min(corners, 2);
+
+				v[c] = ParseIndex(&s, line_end, v_count);
+				t[c] = 0;
+				n[c] = 0;
+
+				if (s < line_end && *s == '/')
+				{
+					s++;
+
+					if (s < line_end && *s != '/')
+						t[c] = ParseIndex(&s, line_end, uv_count);
+
+					if (s < line_end && *s == '/')
+					{
+						s++;
+						n[c] = ParseIndex(&s, line_end, n_count);
+					}
+				}
+
+				s = SkipSpaces(SkipToken(s, line_end), line_end);
+				corners++;
 
-				f_buffer[f_count - 1].n0 = n0;
-				f_buffer[f_count - 1].n1 = n1;
-				f_buffer[f_count - 1].n2 = n2;
+				if (corners >= 3)
+				{
+					struct Triangle *tri = &mesh->triangles[f_count++];
+
+					tri->v0 = v[0];
+					tri->v1 = v[1];
+					tri->v2 = v[2];
+					tri->uv0 = t[0];
+					tri->uv1 = t[1];
+					tri->uv2 = t[2];
+					tri->n0 = n[0];
+					tri->n1 = n[1];
+					tri->n2 = n[2];
+					tri->material = current_material;
+
+					v[1] = v[2];
+					t[1] = t[2];
+					n[1] = n[2];
+				}
 			}
+		}
+		else if (StartsWithKeyword(s, line_end, "usemtl"))
+		{
+			const char *name = SkipSpaces(s + 6, line_end);
+			current_material = FindMaterial(mesh, name, (int)(SkipToken(name, line_end) - name), current_material);
+		}
 
-			/* Assuming ccw winding. */
-			struct Vector vec0, vec1, vec2;
-			VecSub(&v_buffer[v1].pos, &v_buffer[v0].pos, &vec0);
-			VecSub(&v_buffer[v2].pos, &v_buffer[v0].pos, &vec1);
-			VecCross3(&vec0, &vec1, &vec2);
-			VecNormalize(&vec2, &f_buffer[f_count - 1].normal);
+		p = line_end + 1;
+	}
+}
 
-			break;
+void FinishObjChunk(void *data, int index)
+{
+	struct ObjLoad *load = (struct ObjLoad *)data;
+	struct ObjChunk *chunk = &load->chunks[index];
+	struct Mesh *mesh = load->mesh;
+
+	// faces may refer to vertices of any chunk, so their normals wait until
+	// every chunk has been parsed
+	for (int i = chunk->triangle_base; i < chunk->triangle_base + chunk->num_triangles; i++)
+	{
+		struct Triangle *tri = &mesh->triangles[i];
+
+		if (!IsIndexValid(tri->v0, mesh->num_vertices) || !IsIndexValid(tri->v1, mesh->num_vertices) || !IsIndexValid(tri->v2, mesh->num_vertices) ||
+			!IsIndexValid(tri->n0, mesh->num_normals) || !IsIndexValid(tri->n1, mesh->num_normals) || !IsIndexValid(tri->n2, mesh->num_normals) ||
+			!IsIndexValid(tri->uv0, mesh->num_uvcoords) || !IsIndexValid(tri->uv1, mesh->num_uvcoords) || !IsIndexValid(tri->uv2, mesh->num_uvcoords) ||
+			!IsIndexValid(tri->material, mesh->num_materials))
+		{
+			chunk->failed = true;
+			return;
 		}
+
+		/* Assuming ccw winding. */
+		struct Vector vec0, vec1, vec2;
+		VecSub(&mesh->vertices[tri->v1].pos, &mesh->vertices[tri->v0].pos, &vec0);
+		VecSub(&mesh->vertices[tri->v2].pos, &mesh->vertices[tri->v0].pos, &vec1);
+		VecCross3(&vec0, &vec1, &vec2);
+		VecNormalize(&vec2, &tri->normal);
 	}
+}
 
-	fclose(file);
+int FindMaterial(const struct Mesh *mesh, const char *name, int len, int current_material)
+{
+	// unknown names keep the current material
+	for (int i = 0; i < mesh->num_materials; i++)
+	{
+		if ((int)strlen(mesh->materials[i].name) == len && memcmp(mesh->materials[i].name, name, len) == 0)
+			return i;
+	}
+
+	return current_material;
+}
+
+bool IsIndexValid(int index, int count)
+{
+	// rendering reads the uv, normal and material of every face, so faces
+	// without uvs or normals (index 0) need the mesh to have some, and faces
+	// before the first usemtl (material -1) fail the load
+	return index >= 0 && index < count;
+}
+
+const char *FindLineEnd(const char *p, const char *end)
+{
+	const char *newline = (const char *)memchr(p, '\n', end - p);
+	return newline != NULL ? newline : end;
+}
+
+const char *SkipSpaces(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+
+	return p;
+}
+
+const char *SkipToken(const char *p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+		p++;
 
-	if (v_count > 0 && v_count < MAX_MESH_VERTICES)
+	return p;
+}
+
+bool StartsWithKeyword(const char *p, const char *end, const char *keyword)
+{
+	// the keyword has to be followed by white space
+	size_t len = strlen(keyword);
+
+	return (size_t)(end - p) > len && memcmp(p, keyword, len) == 0 && (p[len] == ' ' || p[len] == '\t');
+}
+
+float ParseFloat(const char **next, const char *p, const char *end)
+{
+	// decimal with an optional exponent, exact for up to 19 significant
+	// digits, then rounded once to double and once to float
+
+	static const double powers_of_ten[] =
 	{
-		mesh->vertices = (struct Vertex *)malloc(v_count * sizeof(struct Vertex));
-		mesh->num_vertices = v_count;
-		memcpy(mesh->vertices, v_buffer, v_count * sizeof(struct Vertex));
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	p = SkipSpaces(p, end);
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int exponent = 0;
+
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		if (mantissa < UINT64_MAX / 10 - 9)
+			mantissa = mantissa * 10 + (*p - '0');
+		else
+			exponent++;
 	}
-	if (v_buffer != NULL)
-		free(v_buffer);
 
-	if (f_count > 0)
+	if (p < end && *p == '.')
 	{
-		mesh->triangles = (struct Triangle *)malloc(f_count * sizeof(struct Triangle));
-		mesh->num_triangles = f_count;
-		memcpy(mesh->triangles, f_buffer, f_count * sizeof(struct Triangle));
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			if (mantissa < UINT64_MAX / 10 - 9)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
 	}
-	if (f_buffer != NULL)
-		free(f_buffer);
 
-	if (n_count > 0)
+	if (p < end && (*p == 'e' || *p == 'E'))
 	{
-		mesh->normals = (struct Vector *)malloc(n_count * sizeof(struct Vector));
-		mesh->num_normals = n_count;
-		memcpy(mesh->normals, n_buffer, n_count * sizeof(struct Vector));
+		const char *q = p + 1;
+		bool exponent_negative = false;
+
+		if (q < end && (*q == '-' || *q == '+'))
+			exponent_negative = *q++ == '-';
+
+		if (q < end && *q >= '0' && *q <= '9')
+		{
+			int e = 0;
+			for (; q < end && *q >= '0' && *q <= '9'; q++)
+				e = min(e * 10 + (*q - '0'), 10000);
+
+			exponent += exponent_negative ? -e : e;
+			p = q;
+		}
 	}
-	if (n_buffer != NULL)
-		free(n_buffer);
 
-	if (uv_count > 0)
+	*next = p;
+
+	double value = (double)mantissa;
+
+	if (exponent < 0)
+		value /= -exponent <= 22 ? powers_of_ten[-exponent] : pow(10.0, -exponent);
+	else if (exponent > 0)
+		value *= exponent <= 22 ? powers_of_ten[exponent] : pow(10.0, exponent);
+
+	return (float)(negative ? -value : value);
+}
+
+int ParseIndex(const char **next, const char *end, int count)
+{
+	// 1 based, negative counts back from the end of the elements so far
+	const char *p = *next;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	int64_t value = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		value = min(value * 10 + (*p - '0'), (int64_t)INT32_MAX);
+
+	*next = p;
+
+	if (negative)
+		return (int)max(count - value, (int64_t)-1);
+
+	return (int)(value - 1);
+}
+
+bool MapFile(const char *file_name, bool copy_on_write, struct MappedFile *file)
+{
+	// copy on write mappings can be written to without touching the file
+
+	file->data = NULL;
+	file->size = 0;
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
 	{
-		mesh->uvcoords = (struct UVCoord *)malloc(uv_count * sizeof(struct UVCoord));
-		mesh->num_uvcoords = uv_count;
-		memcpy(mesh->uvcoords, uv_buffer, uv_count * sizeof(struct UVCoord));
+		CloseHandle(handle);
+		return false;
 	}
-	if (uv_buffer != NULL)
-		free(uv_buffer);
 
-	return mesh;
+	HANDLE mapping = CreateFileMappingA(handle, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL)
+		file->data = (char *)MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+
+	// the view keeps the mapping and the file open
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	CloseHandle(handle);
+
+	if (file->data == NULL)
+		return false;
+
+	file->size = (size_t)size.QuadPart;
+#else
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, (size_t)st.st_size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// the mapping keeps the file open
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	posix_madvise(data, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+
+	file->data = (char *)data;
+	file->size = (size_t)st.st_size;
+#endif
+
+	return true;
+}
+
+void UnmapFile(struct MappedFile *file)
+{
+	if (file->data == NULL)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(file->data);
+#else
+	munmap(file->data, file->size);
+#endif
+
+	file->data = NULL;
+	file->size = 0;
 }
 
 void DestroyMesh(struct Mesh *mesh)
 {
+	// a cached mesh, its arrays and the mesh itself live in the mapping
+	if (mesh != NULL && mesh->cache != NULL)
+	{
+		struct MappedFile file = { (char *)mesh->cache, (size_t)((struct MeshCacheHeader *)mesh->cache)->file_size };
+		UnmapFile(&file);
+		return;
+	}
+
 	if (mesh != NULL)
 	{
 		if (mesh->vertices != NULL)
@@ -283,13 +833,321 @@ void DestroyMesh(struct Mesh *mesh)
 	}
 }
 
-bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh)
+bool WriteMeshCache(const struct Mesh *mesh, char *cache_name, const struct MeshSources *sources)
+{
+	// assumes mesh is valid, sources may be NULL for a cache that never
+	// goes stale
+
+	int num_sources = sources != NULL ? sources->count : 0;
+	int num_materials = mesh->num_materials;
+
+	// lay out every section at its own aligned offset first
+	uint64_t *material_offsets = (uint64_t *)calloc(num_materials * 4 + 1, sizeof(uint64_t));
+	if (material_offsets == NULL)
+		return false;
+
+	uint64_t *name_offsets = material_offsets + num_materials;
+	uint64_t *tex_map_offsets = name_offsets + num_materials;
+	uint64_t *texel_offsets = tex_map_offsets + num_materials;
+
+	struct MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "NOVAMESH", 8);
+	header.version = MESH_CACHE_VERSION;
+	header.byte_order = 0x01020304;
+	header.pointer_size = sizeof(void *);
+	header.mesh_size = sizeof(struct Mesh);
+	header.triangle_size = sizeof(struct Triangle);
+	header.material_size = sizeof(struct Material);
+	header.texture_map_size = sizeof(struct TextureMap);
+	header.num_sources = num_sources;
+
+	uint64_t offset = sizeof(header);
+
+	header.sources_offset = AddCacheSection(&offset, num_sources * sizeof(struct MeshSource));
+	header.mesh_offset = AddCacheSection(&offset, sizeof(struct Mesh));
+
+	uint64_t vertices_offset = AddCacheSection(&offset, (uint64_t)mesh->num_vertices * sizeof(struct Vertex));
+	uint64_t triangles_offset = AddCacheSection(&offset, (uint64_t)mesh->num_triangles * sizeof(struct Triangle));
+	uint64_t normals_offset = AddCacheSection(&offset, (uint64_t)mesh->num_normals * sizeof(struct Vector));
+	uint64_t uvcoords_offset = AddCacheSection(&offset, (uint64_t)mesh->num_uvcoords * sizeof(struct UVCoord));
+	uint64_t materials_offset = AddCacheSection(&offset, (uint64_t)num_materials * sizeof(struct Material));
+
+	for (int i = 0; i < num_materials; i++)
+	{
+		struct Material *material = &mesh->materials[i];
+
+		material_offsets[i] = materials_offset + i * sizeof(struct Material);
+
+		if (material->name != NULL)
+			name_offsets[i] = AddCacheSection(&offset, strlen(material->name) + 1);
+
+		size_t num_texels;
+
+		if (material->tex_map != NULL)
+		{
+			if (!GetTextureMapTexels(material->tex_map, &num_texels))
+			{
+				free(material_offsets);
+				return false;
+			}
+
+			tex_map_offsets[i] = AddCacheSection(&offset, sizeof(struct TextureMap));
+			texel_offsets[i] = AddCacheSection(&offset, (uint64_t)num_texels * sizeof(uint32_t));
+		}
+	}
+
+	header.file_size = AddCacheSection(&offset, 0);
+
+	// written under a temporary name and renamed so a reader never sees a
+	// partial cache
+	char temp_name[300];
+	if (strlen(cache_name) + 5 > sizeof(temp_name))
+	{
+		free(material_offsets);
+		return false;
+	}
+
+	strcpy(temp_name, cache_name);
+	strcat(temp_name, ".tmp");
+
+	FILE *file = fopen(temp_name, "wb");
+	if (file == NULL)
+	{
+		free(material_offsets);
+		return false;
+	}
+
+	// every pointer is stored as the offset of what it points at
+	struct Mesh mesh_image = *mesh;
+	mesh_image.vertices = (struct Vertex *)(uintptr_t)(mesh->num_vertices > 0 ? vertices_offset : 0);
+	mesh_image.triangles = (struct Triangle *)(uintptr_t)(mesh->num_triangles > 0 ? triangles_offset : 0);
+	mesh_image.normals = (struct Vector *)(uintptr_t)(mesh->num_normals > 0 ? normals_offset : 0);
+	mesh_image.uvcoords = (struct UVCoord *)(uintptr_t)(mesh->num_uvcoords > 0 ? uvcoords_offset : 0);
+	mesh_image.materials = (struct Material *)(uintptr_t)(num_materials > 0 ? materials_offset : 0);
+	mesh_image.cache = NULL;
+
+	bool ok = WriteCacheSection(file, &header, sizeof(header), 0);
+
+	if (num_sources > 0)
+		ok = ok && WriteCacheSection(file, sources->files, num_sources * sizeof(struct MeshSource), header.sources_offset);
+
+	ok = ok && WriteCacheSection(file, &mesh_image, sizeof(mesh_image), header.mesh_offset) &&
+		WriteCacheSection(file, mesh->vertices, (size_t)mesh->num_vertices * sizeof(struct Vertex), vertices_offset) &&
+		WriteCacheSection(file, mesh->triangles, (size_t)mesh->num_triangles * sizeof(struct Triangle), triangles_offset) &&
+		WriteCacheSection(file, mesh->normals, (size_t)mesh->num_normals * sizeof(struct Vector), normals_offset) &&
+		WriteCacheSection(file, mesh->uvcoords, (size_t)mesh->num_uvcoords * sizeof(struct UVCoord), uvcoords_offset);
+
+	for (int i = 0; ok && i < num_materials; i++)
+	{
+		struct Material material_image = mesh->materials[i];
+		material_image.name = (char *)(uintptr_t)name_offsets[i];
+		material_image.tex_map = (struct TextureMap *)(uintptr_t)tex_map_offsets[i];
+
+		ok = WriteCacheSection(file, &material_image, sizeof(material_image), material_offsets[i]);
+	}
+
+	for (int i = 0; ok && i < num_materials; i++)
+	{
+		struct Material *material = &mesh->materials[i];
+
+		if (material->name != NULL)
+			ok = WriteCacheSection(file, material->name, strlen(material->name) + 1, name_offsets[i]);
+
+		size_t num_texels;
+
+		if (ok && material->tex_map != NULL && GetTextureMapTexels(material->tex_map, &num_texels))
+		{
+			struct TextureMap tex_map_image = *material->tex_map;
+			tex_map_image.buffer = (uint32_t *)(uintptr_t)texel_offsets[i];
+
+			ok = WriteCacheSection(file, &tex_map_image, sizeof(tex_map_image), tex_map_offsets[i]) &&
+				WriteCacheSection(file, material->tex_map->buffer, num_texels * sizeof(uint32_t), texel_offsets[i]);
+		}
+	}
+
+	ok = ok && WriteCacheSection(file, NULL, 0, header.file_size);
+	ok = fclose(file) == 0 && ok;
+
+	free(material_offsets);
+
+#ifdef _WIN32
+	// rename does not replace an existing file on windows
+	if (ok)
+		remove(cache_name);
+#endif
+
+	if (!ok || rename(temp_name, cache_name) != 0)
+	{
+		remove(temp_name);
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t AddCacheSection(uint64_t *offset, uint64_t size)
+{
+	// returns the aligned start of a section of size bytes at *offset
+	uint64_t start = (*offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+	*offset = start + size;
+
+	return start;
+}
+
+bool WriteCacheSection(FILE *file, const void *data, size_t size, uint64_t offset)
+{
+	// the sections are written in order, the gaps between them are zeroed
+	static const char zeros[MESH_CACHE_ALIGNMENT];
+
+	long position = ftell(file);
+	if (position < 0 || (uint64_t)position > offset)
+		return false;
+
+	size_t gap = (size_t)(offset - (uint64_t)position);
+	if (gap > 0 && fwrite(zeros, 1, gap, file) != gap)
+		return false;
+
+	return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+bool IsMeshCacheFresh(const struct MeshCacheHeader *header)
+{
+	// assumes header->file_size matches the mapping
+
+	uint64_t size = (uint64_t)header->num_sources * sizeof(struct MeshSource);
+	if (header->sources_offset > header->file_size || size > header->file_size - header->sources_offset)
+		return false;
+
+	const struct MeshSource *sources = (const struct MeshSource *)((const char *)header + header->sources_offset);
+
+	for (uint32_t i = 0; i < header->num_sources; i++)
+	{
+		int64_t file_size, mtime;
+
+		if (memchr(sources[i].path, '\0', sizeof(sources[i].path)) == NULL ||
+			!GetFileStamp(sources[i].path, &file_size, &mtime) ||
+			file_size != sources[i].size || mtime != sources[i].mtime)
+			return false;
+	}
+
+	return true;
+}
+
+bool FixUpPointer(void **pointer, char *base, size_t file_size, size_t size)
+{
+	// an offset of 0 would be the header, so it stands for NULL
+
+	uint64_t offset = (uint64_t)(uintptr_t)*pointer;
+
+	if (offset == 0)
+		return size == 0;
+
+	if (offset >= file_size || size > file_size - offset)
+		return false;
+
+	*pointer = base + offset;
+
+	return true;
+}
+
+bool GetTextureMapTexels(const struct TextureMap *tex_map, size_t *count)
+{
+	// the number of texels in the buffer of all mip levels, the layout and
+	// level offsets of a cached texture have to be exactly what
+	// set_texture_layout and create_texture_mip_levels would have made
+
+	int width = tex_map->width;
+	int height = tex_map->height;
+	int num_levels = tex_map->num_mip_levels;
+	bool power_of_two = (width & (width - 1)) == 0 && (height & (height - 1)) == 0;
+
+	if (width <= 0 || height <= 0 || width > 65536 || height > 65536)
+		return false;
+
+	if (num_levels < 0 || num_levels >= MAX_TEXTURE_LEVELS || (num_levels > 0 && !power_of_two))
+		return false;
+
+	int morton_bits = 0;
+	while ((2 << morton_bits) <= min(width, height))
+		morton_bits++;
+
+	if (tex_map->layout == TEXTURE_LAYOUT_MORTON)
+	{
+		if (!power_of_two || tex_map->morton_bits != morton_bits)
+			return false;
+	}
+	else if (tex_map->layout != TEXTURE_LAYOUT_LINEAR)
+	{
+		return false;
+	}
+
+	size_t size = (size_t)width * height;
+
+	for (int level = 1; level <= num_levels; level++)
+	{
+		if (tex_map->mip_offsets[level] != (int)size)
+			return false;
+
+		size += (size_t)max(width >> level, 1) * max(height >> level, 1);
+	}
+
+	// a full chain ends at 1x1
+	if (num_levels > 0 && ((width >> num_levels) > 1 || (height >> num_levels) > 1))
+		return false;
+
+	*count = size;
+
+	return true;
+}
+
+bool AddMeshSource(struct MeshSources *sources, const char *path)
+{
+	if (sources == NULL)
+		return true;
+
+	// a mesh built from too many files is just not cached, count is left
+	// past the limit to say so
+	if (sources->count >= MAX_MESH_SOURCES || strlen(path) >= sizeof(sources->files[0].path))
+	{
+		sources->count = MAX_MESH_SOURCES + 1;
+		return false;
+	}
+
+	struct MeshSource *source = &sources->files[sources->count];
+
+	memset(source, 0, sizeof(struct MeshSource));
+	strcpy(source->path, path);
+
+	if (!GetFileStamp(path, &source->size, &source->mtime))
+		return false;
+
+	sources->count++;
+
+	return true;
+}
+
+bool GetFileStamp(const char *path, int64_t *size, int64_t *mtime)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return false;
+
+	*size = (int64_t)st.st_size;
+	*mtime = (int64_t)st.st_mtime;
+
+	return true;
+}
+
+bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh, struct MeshSources *sources)
 {
 	// note this function does not clean up properly if an error occurs
 	FILE *file = fopen(file_name, "r");
 	if (file == NULL)
 		return false;
 
+	AddMeshSource(sources, file_name);
+
 	char line_buf[80];
 
 	int m_count = 0;
@@ -317,7 +1175,36 @@ bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh)
 
 				sscanf(line_buf, "newmtl %s", name);
 
-				m_buffer[m_count - 1].name = name;
+				// a material without Kd is white so its texture is drawn as is
+				struct Material *material = &m_buffer[m_count - 1];
+				memset(material, 0, sizeof(struct Material));
+				material->name = name;
+				material->diffuse_rgb[0] = material->diffuse_rgb[1] = material->diffuse_rgb[2] = 1.0f;
+			}
+
+			break;
+
+		case 'K':
+			if (m_count == 0)
+				break;
+
+			if (line_buf[1] == 'a')
+				sscanf(line_buf, "Ka %f %f %f", &m_buffer[m_count - 1].ambient_rgb[0], &m_buffer[m_count - 1].ambient_rgb[1], &m_buffer[m_count - 1].ambient_rgb[2]);
+			else if (line_buf[1] == 'd')
+				sscanf(line_buf, "Kd %f %f %f", &m_buffer[m_count - 1].diffuse_rgb[0], &m_buffer[m_count - 1].diffuse_rgb[1], &m_buffer[m_count - 1].diffuse_rgb[2]);
+			else if (line_buf[1] == 's')
+				sscanf(line_buf, "Ks %f %f %f", &m_buffer[m_count - 1].specular_rgb[0], &m_buffer[m_count - 1].specular_rgb[1], &m_buffer[m_count - 1].specular_rgb[2]);
+
+			break;
+
+		case 'i':
+			if (m_count > 0 && strstr(line_buf, "illum") != NULL)
+			{
+				// illum 0 is a constant color without lighting
+				int illum = 1;
+				sscanf(line_buf, "illum %d", &illum);
+
+				m_buffer[m_count - 1].unlit = illum == 0;
 			}
 
 			break;
@@ -337,6 +1224,8 @@ bool CreateMaterialsFromFile(char *file_name, struct Mesh *mesh)
 
 				if (m_buffer[m_count - 1].tex_map == NULL)
 					return false;
+
+				AddMeshSource(sources, full_path);
 			}
 
 			break;
@@ -409,6 +1298,10 @@ struct TextureMap *CreateTextureMapFromFile(char *file_name)
 
 			fseek(file, row_padding, SEEK_CUR);
 		}
+
+		// mips need power of two sides, others stay without them. Textures
+		// stay row major, set_texture_layout switches them to morton.
+		create_texture_mip_levels(texture);
 	}
 
 	fclose(file);
@@ -442,4 +1335,191 @@ bool GetFilePath(char *full_file_path, char *file_path)
 	file_path[path_len] = '\0';
     
     return true;
-}
\ No newline at end of file
+}
+
+bool SaveImageFile(const char *file_name, const uint32_t *pixels, int width, int height, enum ImageFormat format)
+{
+	if (file_name == NULL || pixels == NULL || width <= 0 || height <= 0)
+		return false;
+
+	// encoded whole into memory and written with a single call, the largest
+	// of the formats is QOI with up to 4 bytes per pixel plus its header and
+	// end marker
+	size_t num_pixels = (size_t)width * height;
+	uint8_t *out = (uint8_t *)malloc(num_pixels * 4 + 64);
+	if (out == NULL)
+		return false;
+
+	size_t size;
+
+	switch (format)
+	{
+	case IMAGE_FORMAT_BMP:
+		size = EncodeBmp(pixels, width, height, out);
+		break;
+
+	case IMAGE_FORMAT_QOI:
+		size = EncodeQoi(pixels, width, height, out);
+		break;
+
+	default:
+		size = EncodePpm(pixels, width, height, out);
+	}
+
+	FILE *file = fopen(file_name, "wb");
+	bool ok = file != NULL && fwrite(out, 1, size, file) == size;
+
+	if (file != NULL && fclose(file) != 0)
+		ok = false;
+
+	free(out);
+
+	return ok;
+}
+
+size_t EncodePpm(const uint32_t *pixels, int width, int height, uint8_t *out)
+{
+	uint8_t *p = out + sprintf((char *)out, "P6\n%d %d\n255\n", width, height);
+
+	for (size_t i = 0; i < (size_t)width * height; i++)
+	{
+		*p++ = (uint8_t)(pixels[i] >> 16);
+		*p++ = (uint8_t)(pixels[i] >> 8);
+		*p++ = (uint8_t)pixels[i];
+	}
+
+	return p - out;
+}
+
+size_t EncodeBmp(const uint32_t *pixels, int width, int height, uint8_t *out)
+{
+	// 32 bits per pixel needs no row padding and a negative height stores
+	// the rows top down, so the pixels go in as they are
+	size_t image_size = (size_t)width * height * 4;
+	uint8_t *p = out;
+
+	*p++ = 'B';
+	*p++ = 'M';
+	p = PutUint32(p, (uint32_t)(54 + image_size), false);
+	p = PutUint32(p, 0, false);
+	p = PutUint32(p, 54, false);
+
+	p = PutUint32(p, 40, false);
+	p = PutUint32(p, (uint32_t)width, false);
+	p = PutUint32(p, (uint32_t)-height, false);
+	*p++ = 1;
+	*p++ = 0;
+	*p++ = 32;
+	*p++ = 0;
+
+	// uncompressed, then the image size, resolution and palette counts
+	p = PutUint32(p, 0, false);
+	p = PutUint32(p, (uint32_t)image_size, false);
+	for (int i = 0; i < 4; i++)
+		p = PutUint32(p, 0, false);
+
+	for (size_t i = 0; i < (size_t)width * height; i++)
+		p = PutUint32(p, pixels[i] | 0xff000000u, false);
+
+	return p - out;
+}
+
+size_t EncodeQoi(const uint32_t *pixels, int width, int height, uint8_t *out)
+{
+	// the "Quite OK Image" format, lossless and about as small as PNG at a
+	// fraction of the cost, stored as RGB
+
+	uint8_t *p = out;
+
+	*p++ = 'q';
+	*p++ = 'o';
+	*p++ = 'i';
+	*p++ = 'f';
+	p = PutUint32(p, (uint32_t)width, true);
+	p = PutUint32(p, (uint32_t)height, true);
+	*p++ = 3;
+	*p++ = 0;
+
+	// colors seen before, hashed, and the previous pixel start out black
+	uint32_t index[64] = { 0 };
+	uint32_t prev = 0xff000000u;
+	int run = 0;
+
+	size_t num_pixels = (size_t)width * height;
+
+	for (size_t i = 0; i < num_pixels; i++)
+	{
+		uint32_t px = pixels[i] | 0xff000000u;
+
+		if (px == prev)
+		{
+			run++;
+			if (run == 62 || i + 1 == num_pixels)
+			{
+				*p++ = (uint8_t)(0xc0 | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+
+		if (run > 0)
+		{
+			*p++ = (uint8_t)(0xc0 | (run - 1));
+			run = 0;
+		}
+
+		int r = (px >> 16) & 0xff;
+		int g = (px >> 8) & 0xff;
+		int b = px & 0xff;
+		int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+
+		if (index[hash] == px)
+		{
+			*p++ = (uint8_t)hash;
+		}
+		else
+		{
+			index[hash] = px;
+
+			// channel differences wrap around like the bytes they come from
+			int8_t dr = (int8_t)(r - (int)((prev >> 16) & 0xff));
+			int8_t dg = (int8_t)(g - (int)((prev >> 8) & 0xff));
+			int8_t db = (int8_t)(b - (int)(prev & 0xff));
+			int8_t dr_dg = (int8_t)(dr - dg);
+			int8_t db_dg = (int8_t)(db - dg);
+
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+			{
+				*p++ = (uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			}
+			else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+			{
+				*p++ = (uint8_t)(0x80 | (dg + 32));
+				*p++ = (uint8_t)((dr_dg + 8) << 4 | (db_dg + 8));
+			}
+			else
+			{
+				*p++ = 0xfe;
+				*p++ = (uint8_t)r;
+				*p++ = (uint8_t)g;
+				*p++ = (uint8_t)b;
+			}
+		}
+
+		prev = px;
+	}
+
+	for (int i = 0; i < 7; i++)
+		*p++ = 0;
+	*p++ = 1;
+
+	return p - out;
+}
+
+uint8_t *PutUint32(uint8_t *p, uint32_t value, bool big_endian)
+{
+	for (int i = 0; i < 4; i++)
+		*p++ = (uint8_t)(value >> (big_endian ? 24 - 8 * i : 8 * i));
+
+	return p;
+}
@@ -8,10 +8,31 @@ extern "C" {
 #include "nova_render.h"
 
 	struct Mesh *CreateMeshFromFile(char *file_name);
+
+	// parses the .obj file in line aligned chunks on num_threads threads,
+	// 0 uses one per processor
+	struct Mesh *CreateMeshFromFileWithThreads(char *file_name, int num_threads);
+
+	// the loaders above try file_name + ".nvmesh" first and write it after
+	// parsing, it is used only while the .obj, .mtl and textures are unchanged
+	struct Mesh *CreateMeshFromCache(char *cache_name);
+	bool SaveMeshCache(const struct Mesh *mesh, char *cache_name);
+
 	void DestroyMesh(struct Mesh *mesh);
 
 	void DestroyTextureMap(struct TextureMap *texture);
 
+	enum ImageFormat
+	{
+		IMAGE_FORMAT_PPM,
+		IMAGE_FORMAT_BMP,
+		IMAGE_FORMAT_QOI
+	};
+
+	// writes width x height pixels laid out like the pixel buffer, 0xAARRGGBB
+	// rows from the top down, alpha is not kept, returns false on failure
+	bool SaveImageFile(const char *file_name, const uint32_t *pixels, int width, int height, enum ImageFormat format);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,507 @@
+// Renders a mesh along a camera path without a window and writes every frame
+// to an image file. Frames are rendered concurrently, each worker thread with
+// a RenderContext of its own, and handed through a bounded queue to a writer
+// thread so saving overlaps rendering.
+//
+// It builds anywhere with a C99 compiler, from this directory for example
+//   cc -O2 -std=c99 -D_POSIX_C_SOURCE=200809L -I../../Nova main.c ../../Nova/*.c -lm -lpthread -o nova_render
+// adding -mavx2 -mfma for the AVX2 pixel path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../Nova/nova_render.h"
+#include "../../Nova/nova_utility.h"
+#include "../../Nova/nova_scene.h"
+#include "../../Nova/nova_thread.h"
+
+#define DEFAULT_MODEL "../../Models/f16/f16.obj"
+#define MAX_KEYFRAMES 1024
+
+struct Keyframe
+{
+	struct Vector eye;
+	struct Vector target;
+};
+
+struct RenderOptions
+{
+	const char *model;
+	const char *path;
+	const char *output;
+	enum ImageFormat format;
+	enum TextureFilter texture_filter;
+	bool heatmap;
+	int frames;
+	int width;
+	int height;
+	float hfov;
+	int threads;
+	int queue;
+};
+
+// a rendered image on its way to the writer, or back to be reused
+struct Frame
+{
+	int index;
+	uint32_t *pixels;
+};
+
+struct Batch
+{
+	const struct RenderOptions *options;
+	struct Mesh *mesh;
+
+	// moves the mesh's bounding sphere to the origin with radius 1, the
+	// camera path is given in that space
+	struct Matrix model_mat;
+
+	struct Keyframe *keyframes;
+	int num_keyframes;
+
+	// one per worker
+	struct RenderContext *contexts;
+	int num_workers;
+
+	// every frame is on exactly one of these or being worked on
+	struct WorkQueue *free_frames;
+	struct WorkQueue *rendered_frames;
+
+	int frames_failed;
+};
+
+static bool ParseOptions(int argc, char **argv, struct RenderOptions *options);
+static void PrintUsage(const char *program);
+
+static void SetModelMatrix(const struct Mesh *mesh, struct Matrix *m);
+static int LoadCameraPath(const char *file_name, struct Keyframe *keyframes, int max_keyframes);
+static int CreateTurntable(const struct RenderOptions *options, struct Keyframe *keyframes);
+static void GetCamera(const struct Batch *batch, int frame, struct Keyframe *camera);
+static void SetLookAt(struct Matrix *m, const struct Vector *eye, const struct Vector *target);
+
+static void RenderFrames(void *data, int worker);
+static void WriteFrames(void *data);
+
+int main(int argc, char **argv)
+{
+	struct RenderOptions options;
+	if (!ParseOptions(argc, argv, &options))
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	struct Batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.options = &options;
+
+	batch.keyframes = (struct Keyframe *)malloc(MAX_KEYFRAMES * sizeof(struct Keyframe));
+	if (batch.keyframes == NULL)
+		return 1;
+
+	if (options.path != NULL)
+		batch.num_keyframes = LoadCameraPath(options.path, batch.keyframes, MAX_KEYFRAMES);
+	else
+		batch.num_keyframes = CreateTurntable(&options, batch.keyframes);
+
+	if (batch.num_keyframes == 0)
+	{
+		fprintf(stderr, "unable to read a camera path from %s\n", options.path);
+		return 1;
+	}
+
+	double start = GetTimeMs();
+
+	batch.mesh = CreateMeshFromFile((char *)options.model);
+	if (batch.mesh == NULL)
+	{
+		fprintf(stderr, "unable to load %s\n", options.model);
+		return 1;
+	}
+
+	double load_ms = GetTimeMs() - start;
+
+	SetModelMatrix(batch.mesh, &batch.model_mat);
+
+	int num_workers = options.threads > 0 ? options.threads : GetProcessorCount();
+	num_workers = min(num_workers, options.frames);
+
+	// enough frames in flight for every worker to have one while the writer
+	// holds another, unless asked otherwise
+	int queue = options.queue > 0 ? options.queue : num_workers + 1;
+	size_t frame_size = (size_t)options.width * options.height * sizeof(uint32_t);
+
+	batch.contexts = (struct RenderContext *)calloc(num_workers, sizeof(struct RenderContext));
+	batch.num_workers = num_workers;
+	batch.free_frames = CreateWorkQueue(queue);
+	batch.rendered_frames = CreateWorkQueue(queue);
+
+	struct Frame *frames = (struct Frame *)calloc(queue, sizeof(struct Frame));
+
+	if (batch.contexts == NULL || batch.free_frames == NULL || batch.rendered_frames == NULL || frames == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (int i = 0; i < queue; i++)
+	{
+		frames[i].pixels = (uint32_t *)malloc(frame_size);
+		if (frames[i].pixels == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		PushWorkQueue(batch.free_frames, &frames[i]);
+	}
+
+	for (int w = 0; w < num_workers; w++)
+	{
+		struct RenderContext *context = &batch.contexts[w];
+
+		init(context);
+		set_screen_size(context, options.width, options.height);
+		set_hfov(context, options.hfov);
+		set_texture_filter(context, options.texture_filter);
+		set_stats_enabled(context, options.heatmap);
+	}
+
+	start = GetTimeMs();
+
+	struct Thread *writer = StartThread(WriteFrames, &batch);
+	if (writer == NULL)
+	{
+		fprintf(stderr, "unable to start the writer thread\n");
+		return 1;
+	}
+
+	struct ThreadPool *pool = CreateThreadPool(num_workers);
+	RunThreadPool(pool, RenderFrames, &batch, num_workers);
+	DestroyThreadPool(pool);
+
+	// the writer stops once it has taken the last frame
+	CloseWorkQueue(batch.rendered_frames);
+	JoinThread(writer);
+
+	double total_ms = GetTimeMs() - start;
+
+	printf("loaded %s in %.1f ms\n", options.model, load_ms);
+	printf("rendered and wrote %d frames of %dx%d in %.1f ms on %d threads, %.1f frames/s\n",
+		options.frames - batch.frames_failed, options.width, options.height, total_ms, num_workers,
+		total_ms > 0.0 ? options.frames * 1000.0 / total_ms : 0.0);
+
+	if (batch.frames_failed > 0)
+		fprintf(stderr, "%d frames could not be written\n", batch.frames_failed);
+
+	for (int i = 0; i < queue; i++)
+		free(frames[i].pixels);
+
+	free(frames);
+
+	for (int w = 0; w < num_workers; w++)
+		destroy(&batch.contexts[w]);
+
+	DestroyWorkQueue(batch.rendered_frames);
+	DestroyWorkQueue(batch.free_frames);
+	free(batch.contexts);
+	free(batch.keyframes);
+	DestroyMesh(batch.mesh);
+
+	return batch.frames_failed > 0 ? 1 : 0;
+}
+
+bool ParseOptions(int argc, char **argv, struct RenderOptions *options)
+{
+	options->model = DEFAULT_MODEL;
+	options->path = NULL;
+	options->output = "frame";
+	options->format = IMAGE_FORMAT_QOI;
+	options->texture_filter = TEXTURE_FILTER_TRILINEAR;
+	options->heatmap = false;
+	options->frames = 120;
+	options->width = 1280;
+	options->height = 720;
+	options->hfov = 60.0f;
+	options->threads = 0;
+	options->queue = 0;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const char *arg = argv[i];
+		const char *value = argv[i + 1];
+
+		if (strcmp(arg, "--model") == 0)
+			options->model = value;
+		else if (strcmp(arg, "--path") == 0)
+			options->path = value;
+		else if (strcmp(arg, "--output") == 0)
+			options->output = value;
+		else if (strcmp(arg, "--frames") == 0)
+			options->frames = atoi(value);
+		else if (strcmp(arg, "--hfov") == 0)
+			options->hfov = (float)atof(value);
+		else if (strcmp(arg, "--threads") == 0)
+			options->threads = atoi(value);
+		else if (strcmp(arg, "--queue") == 0)
+			options->queue = atoi(value);
+		else if (strcmp(arg, "--size") == 0)
+		{
+			if (sscanf(value, "%dx%d", &options->width, &options->height) != 2)
+				return false;
+		}
+		else if (strcmp(arg, "--format") == 0)
+		{
+			if (strcmp(value, "qoi") == 0)
+				options->format = IMAGE_FORMAT_QOI;
+			else if (strcmp(value, "ppm") == 0)
+				options->format = IMAGE_FORMAT_PPM;
+			else if (strcmp(value, "bmp") == 0)
+				options->format = IMAGE_FORMAT_BMP;
+			else
+				return false;
+		}
+		else if (strcmp(arg, "--view") == 0)
+		{
+			if (strcmp(value, "shaded") == 0)
+				options->heatmap = false;
+			else if (strcmp(value, "overdraw") == 0)
+				options->heatmap = true;
+			else
+				return false;
+		}
+		else if (strcmp(arg, "--filter") == 0)
+		{
+			if (strcmp(value, "nearest") == 0)
+				options->texture_filter = TEXTURE_FILTER_NEAREST;
+			else if (strcmp(value, "bilinear") == 0)
+				options->texture_filter = TEXTURE_FILTER_BILINEAR;
+			else if (strcmp(value, "trilinear") == 0)
+				options->texture_filter = TEXTURE_FILTER_TRILINEAR;
+			else
+				return false;
+		}
+		else
+			return false;
+	}
+
+	// options come in pairs
+	if (argc % 2 == 0)
+		return false;
+
+	return options->frames > 0 && options->width > 0 && options->height > 0 &&
+		options->hfov > 0.0f && options->hfov < 180.0f && options->threads >= 0 && options->queue >= 0;
+}
+
+void PrintUsage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --model file.obj   mesh to render (" DEFAULT_MODEL ")\n"
+		"  --path file        camera keyframes, one \"eye_x eye_y eye_z target_x target_y target_z\"\n"
+		"                     per line with the mesh scaled to a unit sphere at the origin,\n"
+		"                     spread evenly over the frames (one turn around the mesh)\n"
+		"  --frames n         frames to render (120)\n"
+		"  --size wxh         image size (1280x720)\n"
+		"  --hfov degrees     horizontal field of view (60)\n"
+		"  --filter name      nearest, bilinear or trilinear (trilinear)\n"
+		"  --view name        shaded, or overdraw for a heatmap of the fragments\n"
+		"                     shaded per pixel (shaded)\n"
+		"  --format name      qoi, ppm or bmp (qoi)\n"
+		"  --output prefix    frames are written to prefix_0000.qoi and so on (frame)\n"
+		"  --threads n        render threads, 0 for one per processor (0)\n"
+		"  --queue n          frames in flight between rendering and writing (threads + 1)\n",
+		program);
+}
+
+void SetModelMatrix(const struct Mesh *mesh, struct Matrix *m)
+{
+	struct BoundingBox bounds;
+	struct Vector center;
+	CalcMeshBounds(mesh, &bounds);
+	BoxCenter(&bounds, &center);
+
+	float dx = bounds.max.x - bounds.min.x;
+	float dy = bounds.max.y - bounds.min.y;
+	float dz = bounds.max.z - bounds.min.z;
+	float radius = 0.5f * sqrtf(dx * dx + dy * dy + dz * dz);
+	float scale = radius > 0.0f ? 1.0f / radius : 1.0f;
+
+	MatSetIdentity(m);
+	m->e[0][0] = scale;
+	m->e[1][1] = scale;
+	m->e[2][2] = scale;
+	m->e[0][3] = -center.x * scale;
+	m->e[1][3] = -center.y * scale;
+	m->e[2][3] = -center.z * scale;
+}
+
+int LoadCameraPath(const char *file_name, struct Keyframe *keyframes, int max_keyframes)
+{
+	FILE *file = fopen(file_name, "r");
+	if (file == NULL)
+		return 0;
+
+	char line[256];
+	int count = 0;
+
+	while (count < max_keyframes && fgets(line, sizeof(line), file) != NULL)
+	{
+		struct Keyframe *k = &keyframes[count];
+
+		// anything that is not six numbers, comments and blank lines too, is
+		// skipped
+		if (sscanf(line, "%f %f %f %f %f %f", &k->eye.x, &k->eye.y, &k->eye.z, &k->target.x, &k->target.y, &k->target.z) != 6)
+			continue;
+
+		k->eye.w = 1.0f;
+		k->target.w = 1.0f;
+		count++;
+	}
+
+	fclose(file);
+
+	return count;
+}
+
+int CreateTurntable(const struct RenderOptions *options, struct Keyframe *keyframes)
+{
+	// one turn around the mesh slightly from above, far enough back for the
+	// unit sphere to fit the narrower field of view
+	float vfov = options->hfov * options->height / options->width;
+	float half_fov = 0.5f * min(options->hfov, vfov) * PI / 180.0f;
+	float distance = 1.1f / sinf(half_fov);
+	float elevation = 20.0f * PI / 180.0f;
+
+	// the last keyframe repeats the first, so only n of them are reached
+	int n = min(options->frames, MAX_KEYFRAMES - 1);
+
+	for (int i = 0; i <= n; i++)
+	{
+		float angle = 2.0f * PI * i / n;
+
+		VecSet(&keyframes[i].eye, distance * cosf(elevation) * sinf(angle), distance * sinf(elevation), distance * cosf(elevation) * cosf(angle), 1.0f);
+		VecSet(&keyframes[i].target, 0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	return n + 1;
+}
+
+void GetCamera(const struct Batch *batch, int frame, struct Keyframe *camera)
+{
+	// keyframes are spread evenly over the frames and linearly interpolated,
+	// a turntable leaves out its last keyframe so it loops seamlessly
+	int frames = batch->options->frames;
+	int segments = batch->num_keyframes - 1;
+	float t = 0.0f;
+
+	if (batch->options->path == NULL)
+		t = (float)frame * segments / frames;
+	else if (frames > 1)
+		t = (float)frame * segments / (frames - 1);
+
+	int k = min((int)t, max(segments - 1, 0));
+	float s = segments > 0 ? t - k : 0.0f;
+
+	const struct Keyframe *a = &batch->keyframes[k];
+	const struct Keyframe *b = &batch->keyframes[min(k + 1, segments)];
+
+	VecSet(&camera->eye, a->eye.x + (b->eye.x - a->eye.x) * s, a->eye.y + (b->eye.y - a->eye.y) * s, a->eye.z + (b->eye.z - a->eye.z) * s, 1.0f);
+	VecSet(&camera->target, a->target.x + (b->target.x - a->target.x) * s, a->target.y + (b->target.y - a->target.y) * s, a->target.z + (b->target.z - a->target.z) * s, 1.0f);
+}
+
+void SetLookAt(struct Matrix *m, const struct Vector *eye, const struct Vector *target)
+{
+	// the camera looks down -z with y up, looking straight up or down the
+	// y axis takes -z as up instead
+	struct Vector forward, right, up, world_up;
+
+	VecSub(target, eye, &forward);
+	forward.w = 0.0f;
+	VecNormalize(&forward, &forward);
+
+	VecSet(&world_up, 0.0f, 1.0f, 0.0f, 0.0f);
+	if (fabsf(forward.y) > 0.999f)
+		VecSet(&world_up, 0.0f, 0.0f, -1.0f, 0.0f);
+
+	VecCross3(&forward, &world_up, &right);
+	VecNormalize(&right, &right);
+	VecCross3(&right, &forward, &up);
+
+	MatSetIdentity(m);
+	m->e[0][0] = right.x;
+	m->e[0][1] = right.y;
+	m->e[0][2] = right.z;
+	m->e[1][0] = up.x;
+	m->e[1][1] = up.y;
+	m->e[1][2] = up.z;
+	m->e[2][0] = -forward.x;
+	m->e[2][1] = -forward.y;
+	m->e[2][2] = -forward.z;
+
+	for (int r = 0; r < 3; r++)
+		m->e[r][3] = -(m->e[r][0] * eye->x + m->e[r][1] * eye->y + m->e[r][2] * eye->z);
+}
+
+void RenderFrames(void *data, int worker)
+{
+	// every worker renders every num_workers-th frame with its own context
+
+	struct Batch *batch = (struct Batch *)data;
+	struct RenderContext *context = &batch->contexts[worker];
+
+	for (int f = worker; f < batch->options->frames; f += batch->num_workers)
+	{
+		struct Keyframe camera;
+		struct Matrix view_mat;
+
+		GetCamera(batch, f, &camera);
+		SetLookAt(&view_mat, &camera.eye, &camera.target);
+		MatMul(&view_mat, &batch->model_mat, &context->mv_mat);
+
+		// waits while the writer is behind
+		struct Frame *frame = (struct Frame *)PopWorkQueue(batch->free_frames);
+
+		clear_pixel_buffer(context);
+		clear_depth_buffer(context);
+		render_mesh(context, batch->mesh);
+		resolve_visibility_buffer(context);
+
+		if (batch->options->heatmap)
+			get_overdraw_heatmap(context, context->pixel_buffer->buffer);
+
+		// hand over the finished image and draw the next one into the free
+		// frame's buffer
+		uint32_t *pixels = context->pixel_buffer->buffer;
+		context->pixel_buffer->buffer = frame->pixels;
+		frame->pixels = pixels;
+		frame->index = f;
+
+		PushWorkQueue(batch->rendered_frames, frame);
+	}
+}
+
+void WriteFrames(void *data)
+{
+	static const char *extensions[] = { "ppm", "bmp", "qoi" };
+
+	struct Batch *batch = (struct Batch *)data;
+	const struct RenderOptions *options = batch->options;
+	struct Frame *frame;
+	char file_name[1024];
+
+	while ((frame = (struct Frame *)PopWorkQueue(batch->rendered_frames)) != NULL)
+	{
+		snprintf(file_name, sizeof(file_name), "%s_%04d.%s", options->output, frame->index, extensions[options->format]);
+
+		if (!SaveImageFile(file_name, frame->pixels, options->width, options->height, options->format))
+		{
+			fprintf(stderr, "unable to write %s\n", file_name);
+			batch->frames_failed++;
+		}
+
+		PushWorkQueue(batch->free_frames, frame);
+	}
+}
@@ -0,0 +1,643 @@
+// Renders a spinning mesh into a triple buffered swapchain whose images live
+// in a POSIX shared memory segment, and hands every frame to a viewer process
+// that maps the same segment, without copying a pixel. The renderer draws
+// frame N + 1 while the viewer reads frame N, and both report throughput and
+// the latency from the start of rendering a frame to the viewer having it.
+//
+//   nova_present [options]               renders and waits for a viewer
+//   nova_present --view [options]        shows the frames of a renderer
+//
+// A viewer that is killed midway leaves the renderer waiting for its images.
+//
+// Linux only, from this directory for example
+//   cc -O2 -std=c99 -D_POSIX_C_SOURCE=200809L -I../../Nova main.c ../../Nova/*.c -lm -lpthread -lrt -o nova_present
+// adding -mavx2 -mfma for the AVX2 pixel path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../Nova/nova_render.h"
+#include "../../Nova/nova_utility.h"
+#include "../../Nova/nova_scene.h"
+#include "../../Nova/nova_thread.h"
+
+#define DEFAULT_MODEL "../../Models/f16/f16.obj"
+#define DEFAULT_NAME "/nova_frames"
+#define SHARED_MAGIC 0x41564f4e
+#define MAX_IMAGES 8
+
+// images start on a page of their own
+#define SHARED_ALIGNMENT 4096
+
+struct PresentOptions
+{
+	const char *model;
+	const char *name;
+	const char *output;
+	enum TextureFilter texture_filter;
+	bool view;
+	int frames;
+	int width;
+	int height;
+	int images;
+	int threads;
+};
+
+// a submitted image on its way to the viewer
+struct SharedFrame
+{
+	int image;
+	uint64_t frame;
+	double acquire_ms;
+	double submit_ms;
+};
+
+// the start of the segment, the images follow at image_offset. Everything
+// after lock is only touched while holding it, changed is signalled on
+// every change either side makes.
+struct SharedHeader
+{
+	uint32_t magic;
+	int width;
+	int height;
+	int num_images;
+	size_t image_offset;
+	size_t image_size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	// frames published and not yet taken by the viewer, oldest first
+	struct SharedFrame ready[MAX_IMAGES];
+	int ready_head;
+	int ready_count;
+
+	// images the viewer is done with, until the renderer releases them
+	int released[MAX_IMAGES];
+	int released_count;
+
+	uint64_t frames_published;
+	bool viewer_attached;
+
+	// the renderer published its last frame
+	bool closed;
+};
+
+struct Presenter
+{
+	struct RenderContext *context;
+	struct SharedHeader *header;
+
+	// the swapchain images by index, as published
+	struct SwapchainImage *images[MAX_IMAGES];
+};
+
+static bool ParseOptions(int argc, char **argv, struct PresentOptions *options);
+static void PrintUsage(const char *program);
+
+static int RunRenderer(const struct PresentOptions *options);
+static int RunViewer(const struct PresentOptions *options);
+
+static void SetModelMatrix(const struct Mesh *mesh, struct Matrix *m);
+static void PublishFrames(void *data);
+static void ReclaimFrames(void *data);
+static int CompareDoubles(const void *a, const void *b);
+static void PrintLatency(const char *name, double *ms, int count);
+
+int main(int argc, char **argv)
+{
+	struct PresentOptions options;
+	if (!ParseOptions(argc, argv, &options))
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	return options.view ? RunViewer(&options) : RunRenderer(&options);
+}
+
+bool ParseOptions(int argc, char **argv, struct PresentOptions *options)
+{
+	options->model = DEFAULT_MODEL;
+	options->name = DEFAULT_NAME;
+	options->output = NULL;
+	options->texture_filter = TEXTURE_FILTER_TRILINEAR;
+	options->view = false;
+	options->frames = 600;
+	options->width = 1280;
+	options->height = 720;
+	options->images = 3;
+	options->threads = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--view") == 0)
+			options->view = true;
+		else if (value == NULL)
+			return false;
+		else
+		{
+			// the rest take a value
+			i++;
+
+			if (strcmp(arg, "--model") == 0)
+				options->model = value;
+			else if (strcmp(arg, "--name") == 0)
+				options->name = value;
+			else if (strcmp(arg, "--output") == 0)
+				options->output = value;
+			else if (strcmp(arg, "--frames") == 0)
+				options->frames = atoi(value);
+			else if (strcmp(arg, "--images") == 0)
+				options->images = atoi(value);
+			else if (strcmp(arg, "--threads") == 0)
+				options->threads = atoi(value);
+			else if (strcmp(arg, "--size") == 0)
+			{
+				if (sscanf(value, "%dx%d", &options->width, &options->height) != 2)
+					return false;
+			}
+			else if (strcmp(arg, "--filter") == 0)
+			{
+				if (strcmp(value, "nearest") == 0)
+					options->texture_filter = TEXTURE_FILTER_NEAREST;
+				else if (strcmp(value, "bilinear") == 0)
+					options->texture_filter = TEXTURE_FILTER_BILINEAR;
+				else if (strcmp(value, "trilinear") == 0)
+					options->texture_filter = TEXTURE_FILTER_TRILINEAR;
+				else
+					return false;
+			}
+			else
+				return false;
+		}
+	}
+
+	// two images would leave the renderer waiting whenever the viewer holds
+	// one, and names of shared memory segments start with a slash
+	return options->frames > 0 && options->width > 0 && options->height > 0 &&
+		options->images >= 2 && options->images <= MAX_IMAGES && options->threads >= 0 && options->name[0] == '/';
+}
+
+void PrintUsage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [--view] [options]\n"
+		"  --view             show the frames of a running renderer instead\n"
+		"  --name /name       shared memory segment (" DEFAULT_NAME ")\n"
+		"renderer options\n"
+		"  --model file.obj   mesh to render (" DEFAULT_MODEL ")\n"
+		"  --frames n         frames to render (600)\n"
+		"  --size wxh         image size (1280x720)\n"
+		"  --images n         swapchain images, 2 to 8 (3)\n"
+		"  --filter name      nearest, bilinear or trilinear (trilinear)\n"
+		"  --threads n        render threads, 0 for one per processor (0)\n"
+		"viewer options\n"
+		"  --output prefix    write every frame to prefix_0000.qoi and so on\n",
+		program);
+}
+
+int RunRenderer(const struct PresentOptions *options)
+{
+	struct Mesh *mesh = CreateMeshFromFile((char *)options->model);
+	if (mesh == NULL)
+	{
+		fprintf(stderr, "unable to load %s\n", options->model);
+		return 1;
+	}
+
+	size_t image_size = (size_t)options->width * options->height * BYTES_PER_PIXEL;
+	image_size = (image_size + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+
+	size_t image_offset = (sizeof(struct SharedHeader) + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+	size_t segment_size = image_offset + image_size * options->images;
+
+	// a segment left behind by a renderer that did not exit cleanly is
+	// replaced
+	shm_unlink(options->name);
+
+	int fd = shm_open(options->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, (off_t)segment_size) != 0)
+	{
+		fprintf(stderr, "unable to create %s: %s\n", options->name, strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+			shm_unlink(options->name);
+		}
+		DestroyMesh(mesh);
+		return 1;
+	}
+
+	uint8_t *base = (uint8_t *)mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "unable to map %s: %s\n", options->name, strerror(errno));
+		shm_unlink(options->name);
+		DestroyMesh(mesh);
+		return 1;
+	}
+
+	struct SharedHeader *header = (struct SharedHeader *)base;
+	memset(header, 0, sizeof(struct SharedHeader));
+	header->width = options->width;
+	header->height = options->height;
+	header->num_images = options->images;
+	header->image_offset = image_offset;
+	header->image_size = image_size;
+
+	pthread_mutexattr_t mutex_attr;
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&header->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&header->changed, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	// the viewer checks the magic last, once the rest is set up
+	__sync_synchronize();
+	header->magic = SHARED_MAGIC;
+
+	// the swapchain renders straight into the segment
+	uint32_t *buffers[MAX_IMAGES];
+	for (int i = 0; i < options->images; i++)
+		buffers[i] = (uint32_t *)(base + image_offset + image_size * i);
+
+	struct RenderContext context;
+	init(&context);
+	set_screen_size(&context, options->width, options->height);
+	set_hfov(&context, 60.0f);
+	set_texture_filter(&context, options->texture_filter);
+	set_pixel_format(&context, PIXEL_FORMAT_XRGB8888);
+	set_render_threads(&context, options->threads);
+
+	// on failure nothing is rendered but the cleanup below still runs
+	bool ok = set_swapchain(&context, options->images, buffers);
+	if (!ok)
+		fprintf(stderr, "unable to create the swapchain\n");
+
+	struct Presenter presenter;
+	memset(&presenter, 0, sizeof(presenter));
+	presenter.context = &context;
+	presenter.header = header;
+
+	struct Thread *publisher = NULL;
+	struct Thread *reclaimer = NULL;
+
+	if (ok)
+	{
+		printf("waiting for a viewer, run with --view --name %s\n", options->name);
+		fflush(stdout);
+
+		pthread_mutex_lock(&header->lock);
+		while (!header->viewer_attached)
+			pthread_cond_wait(&header->changed, &header->lock);
+		pthread_mutex_unlock(&header->lock);
+
+		publisher = StartThread(PublishFrames, &presenter);
+		reclaimer = StartThread(ReclaimFrames, &presenter);
+		ok = publisher != NULL && reclaimer != NULL;
+		if (!ok)
+			fprintf(stderr, "unable to start the presenting threads\n");
+	}
+
+	struct Matrix model_mat, rot_y, rot_x, rot, trans, view_mat;
+	SetModelMatrix(mesh, &model_mat);
+	MatSetTranslate(&trans, 0.0f, 0.0f, -2.5f);
+
+	double wait_ms = 0.0;
+	double render_ms = 0.0;
+	double start = GetTimeMs();
+	int frames = 0;
+
+	for (; ok && frames < options->frames; frames++)
+	{
+		double acquire_start = GetTimeMs();
+
+		// waits while the viewer holds every image but the ones in flight
+		struct SwapchainImage *image = acquire_image(&context);
+		if (image == NULL)
+			break;
+
+		double render_start = GetTimeMs();
+		wait_ms += render_start - acquire_start;
+
+		float angle = -0.02f * frames;
+		MatSetRotY(&rot_y, angle);
+		MatSetRotX(&rot_x, angle / 2.0f);
+		MatMul(&rot_x, &rot_y, &rot);
+		MatMul(&trans, &rot, &view_mat);
+		MatMul(&view_mat, &model_mat, &context.mv_mat);
+
+		clear_pixel_buffer(&context);
+		clear_depth_buffer(&context);
+		render_mesh(&context, mesh);
+		resolve_visibility_buffer(&context);
+
+		submit_image(&context);
+		render_ms += GetTimeMs() - render_start;
+	}
+
+	// the publisher closes the segment after the last frame, the reclaimer
+	// stops once the viewer gave them all back
+	close_swapchain(&context);
+
+	// without a publisher nothing else tells the viewer and the reclaimer
+	if (publisher == NULL)
+	{
+		pthread_mutex_lock(&header->lock);
+		header->closed = true;
+		pthread_cond_broadcast(&header->changed);
+		pthread_mutex_unlock(&header->lock);
+	}
+
+	JoinThread(publisher);
+	JoinThread(reclaimer);
+
+	double total_ms = GetTimeMs() - start;
+
+	if (ok)
+	{
+		printf("rendered %d frames of %dx%d into %d shared images in %.1f ms on %d threads, %.1f frames/s\n",
+			frames, options->width, options->height, options->images, total_ms, context.num_threads,
+			total_ms > 0.0 ? frames * 1000.0 / total_ms : 0.0);
+		printf("%.2f ms rendering and %.2f ms waiting for a free image per frame\n",
+			frames > 0 ? render_ms / frames : 0.0, frames > 0 ? wait_ms / frames : 0.0);
+	}
+
+	destroy(&context);
+	DestroyMesh(mesh);
+
+	pthread_cond_destroy(&header->changed);
+	pthread_mutex_destroy(&header->lock);
+	munmap(base, segment_size);
+	shm_unlink(options->name);
+
+	return ok ? 0 : 1;
+}
+
+void PublishFrames(void *data)
+{
+	// the swapchain's reader, hands every submitted image to the viewer
+
+	struct Presenter *presenter = (struct Presenter *)data;
+	struct SharedHeader *header = presenter->header;
+	struct SwapchainImage *image;
+
+	while ((image = take_submitted_image(presenter->context, true)) != NULL)
+	{
+		presenter->images[image->index] = image;
+
+		pthread_mutex_lock(&header->lock);
+
+		// there is room for every image, so nothing is overwritten
+		struct SharedFrame *frame = &header->ready[(header->ready_head + header->ready_count) % MAX_IMAGES];
+		frame->image = image->index;
+		frame->frame = image->frame;
+		frame->acquire_ms = image->acquire_ms;
+		frame->submit_ms = image->submit_ms;
+
+		header->ready_count++;
+		header->frames_published++;
+		pthread_cond_broadcast(&header->changed);
+
+		pthread_mutex_unlock(&header->lock);
+	}
+
+	pthread_mutex_lock(&header->lock);
+	header->closed = true;
+	pthread_cond_broadcast(&header->changed);
+	pthread_mutex_unlock(&header->lock);
+}
+
+void ReclaimFrames(void *data)
+{
+	// gives the images the viewer is done with back to the swapchain
+
+	struct Presenter *presenter = (struct Presenter *)data;
+	struct SharedHeader *header = presenter->header;
+	uint64_t reclaimed = 0;
+
+	pthread_mutex_lock(&header->lock);
+
+	for (;;)
+	{
+		while (header->released_count == 0 && !(header->closed && reclaimed == header->frames_published))
+			pthread_cond_wait(&header->changed, &header->lock);
+
+		if (header->released_count == 0)
+			break;
+
+		int released[MAX_IMAGES];
+		int count = header->released_count;
+		memcpy(released, header->released, count * sizeof(int));
+		header->released_count = 0;
+
+		pthread_mutex_unlock(&header->lock);
+
+		for (int i = 0; i < count; i++)
+			release_image(presenter->context, presenter->images[released[i]]);
+
+		reclaimed += count;
+
+		pthread_mutex_lock(&header->lock);
+	}
+
+	pthread_mutex_unlock(&header->lock);
+}
+
+int RunViewer(const struct PresentOptions *options)
+{
+	int fd = shm_open(options->name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr, "no renderer at %s: %s\n", options->name, strerror(errno));
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct SharedHeader))
+	{
+		fprintf(stderr, "%s is not a renderer's segment\n", options->name);
+		return 1;
+	}
+
+	size_t segment_size = (size_t)st.st_size;
+	uint8_t *base = (uint8_t *)mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "unable to map %s: %s\n", options->name, strerror(errno));
+		return 1;
+	}
+
+	struct SharedHeader *header = (struct SharedHeader *)base;
+	__sync_synchronize();
+
+	if (header->magic != SHARED_MAGIC || header->image_offset + header->image_size * header->num_images > segment_size)
+	{
+		fprintf(stderr, "%s is not a renderer's segment\n", options->name);
+		return 1;
+	}
+
+	pthread_mutex_lock(&header->lock);
+	header->viewer_attached = true;
+	pthread_cond_broadcast(&header->changed);
+	pthread_mutex_unlock(&header->lock);
+
+	int latency_alloc = 1024;
+	double *render_latency = (double *)malloc(latency_alloc * sizeof(double));
+	double *present_latency = (double *)malloc(latency_alloc * sizeof(double));
+	if (render_latency == NULL || present_latency == NULL)
+		return 1;
+
+	int frames = 0;
+	int frames_failed = 0;
+	uint64_t checksum = 0;
+	double start = 0.0;
+	double end = 0.0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&header->lock);
+
+		while (header->ready_count == 0 && !header->closed)
+			pthread_cond_wait(&header->changed, &header->lock);
+
+		if (header->ready_count == 0)
+		{
+			pthread_mutex_unlock(&header->lock);
+			break;
+		}
+
+		struct SharedFrame frame = header->ready[header->ready_head];
+		header->ready_head = (header->ready_head + 1) % MAX_IMAGES;
+		header->ready_count--;
+
+		pthread_mutex_unlock(&header->lock);
+
+		// acquire_ms is on the same monotonic clock in both processes
+		double now = GetTimeMs();
+		if (frames == 0)
+			start = now;
+
+		end = now;
+
+		if (frames == latency_alloc)
+		{
+			latency_alloc *= 2;
+			render_latency = (double *)realloc(render_latency, latency_alloc * sizeof(double));
+			present_latency = (double *)realloc(present_latency, latency_alloc * sizeof(double));
+			if (render_latency == NULL || present_latency == NULL)
+				return 1;
+		}
+
+		render_latency[frames] = now - frame.acquire_ms;
+		present_latency[frames] = now - frame.submit_ms;
+		frames++;
+
+		// reading every pixel stands in for showing them
+		const uint32_t *pixels = (const uint32_t *)(base + header->image_offset + header->image_size * frame.image);
+		checksum = 0;
+
+		for (int i = 0; i < header->width * header->height; i++)
+			checksum = checksum * 31 + pixels[i];
+
+		if (options->output != NULL)
+		{
+			char file_name[1024];
+			snprintf(file_name, sizeof(file_name), "%s_%04d.qoi", options->output, (int)frame.frame);
+
+			if (!SaveImageFile(file_name, pixels, header->width, header->height, IMAGE_FORMAT_QOI))
+				frames_failed++;
+		}
+
+		pthread_mutex_lock(&header->lock);
+		header->released[header->released_count++] = frame.image;
+		pthread_cond_broadcast(&header->changed);
+		pthread_mutex_unlock(&header->lock);
+	}
+
+	double total_ms = end - start;
+
+	printf("received %d frames of %dx%d, %.1f frames/s, last frame checksum %016llx\n",
+		frames, header->width, header->height, frames > 1 && total_ms > 0.0 ? (frames - 1) * 1000.0 / total_ms : 0.0,
+		(unsigned long long)checksum);
+
+	PrintLatency("from acquiring to receiving", render_latency, frames);
+	PrintLatency("from submitting to receiving", present_latency, frames);
+
+	if (frames_failed > 0)
+		fprintf(stderr, "%d frames could not be written\n", frames_failed);
+
+	free(render_latency);
+	free(present_latency);
+	munmap(base, segment_size);
+
+	return frames_failed > 0 ? 1 : 0;
+}
+
+void SetModelMatrix(const struct Mesh *mesh, struct Matrix *m)
+{
+	// moves the mesh's bounding sphere to the origin with radius 1
+	struct BoundingBox bounds;
+	struct Vector center;
+	CalcMeshBounds(mesh, &bounds);
+	BoxCenter(&bounds, &center);
+
+	float dx = bounds.max.x - bounds.min.x;
+	float dy = bounds.max.y - bounds.min.y;
+	float dz = bounds.max.z - bounds.min.z;
+	float radius = 0.5f * sqrtf(dx * dx + dy * dy + dz * dz);
+	float scale = radius > 0.0f ? 1.0f / radius : 1.0f;
+
+	MatSetIdentity(m);
+	m->e[0][0] = scale;
+	m->e[1][1] = scale;
+	m->e[2][2] = scale;
+	m->e[0][3] = -center.x * scale;
+	m->e[1][3] = -center.y * scale;
+	m->e[2][3] = -center.z * scale;
+}
+
+int CompareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+void PrintLatency(const char *name, double *ms, int count)
+{
+	if (count == 0)
+		return;
+
+	double sum = 0.0;
+	for (int i = 0; i < count; i++)
+		sum += ms[i];
+
+	qsort(ms, count, sizeof(double), CompareDoubles);
+
+	printf("latency %s, mean %.2f ms, median %.2f ms, 99th percentile %.2f ms, max %.2f ms\n",
+		name, sum / count, ms[count / 2], ms[(int)(count * 0.99)], ms[count - 1]);
+}
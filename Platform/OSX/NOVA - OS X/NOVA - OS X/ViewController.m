@@ -18,7 +18,7 @@
 @interface ViewController()
 @end
 
-struct Matrix rot, rot2, trans, pos, pos1, screen_mat, proj_mat;
+struct Matrix rot, rot2, trans, pos1;
 struct RenderContext context;
 struct Mesh *mesh;
 float ang = 0.0f;
@@ -41,9 +41,7 @@ NSTimeInterval secs2;
     mesh = CreateMeshFromFile((char *)path.UTF8String);
     
     init(&context);
-    context.screen_mat = &screen_mat;
-    context.proj_mat = &proj_mat;
-    context.mv_mat = &pos;
+    set_render_threads(&context, 0);
     
     set_screen_size(&context, 1024, 1024);
     set_hfov(&context, 60.0f);
@@ -84,7 +82,7 @@ CVReturn DisplayLinkCallback(CVDisplayLinkRef displayLink, const CVTimeStamp* no
     ang -= 0.005f;
     MatSetTranslate(&trans, 0.0f, 0.0f, -5.f);
     MatMul(&rot2, &rot, &pos1);
-    MatMul(&trans, &pos1, &pos);
+    MatMul(&trans, &pos1, &context.mv_mat);
     
     clear_pixel_buffer(&context);
     clear_depth_buffer(&context);
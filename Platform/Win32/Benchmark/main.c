@@ -1,13 +1,1028 @@
+// Renders the f16 model and a few generated stress meshes off screen for a
+// number of frames at several resolutions, fields of view and orientations
+// and prints the timings as JSON to stdout.
+//
+// Besides the Visual Studio project it builds anywhere with a C99 compiler,
+// from this directory for example
+//   cc -O2 -std=c99 -D_POSIX_C_SOURCE=200809L -I../../../Nova main.c ../../../Nova/*.c -lm -lpthread -o benchmark
+// adding -mavx2 -mfma for the AVX2 pixel path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
 #include "../../../Nova/nova_render.h"
 #include "../../../Nova/nova_utility.h"
+#include "../../../Nova/nova_scene.h"
+#include "../../../Nova/nova_lod.h"
+#include "../../../Nova/nova_thread.h"
+
+#define DEFAULT_MODEL "../../../Models/f16/f16.obj"
+#define MAX_BENCH_MESHES 8
+#define CHECKER_SIZE 256
+
+// how far the levels of detail are drawn, they are scaled to each size
+#define LOD_DISTANCE 3.0f
 
-int main(char **args, int argc)
+struct BenchMesh
 {
+	const char *name;
 	struct Mesh *mesh;
-	mesh = CreateMeshFromFile("../../../models/f16/f16.obj");
+	double load_ms;
+	bool cached;
+
+	// moves the mesh's bounding sphere to the origin with radius 1
+	struct Matrix model_mat;
+};
+
+struct Resolution
+{
+	int width;
+	int height;
+};
+
+struct Orientation
+{
+	const char *name;
+	float yaw;
+	float pitch;
+};
+
+struct BenchOptions
+{
+	const char *model;
+	int frames;
+	int warmup;
+	int threads;
+
+	// copies of the mesh drawn in a square formation with one
+	// render_mesh_instanced, 1 draws the mesh alone with render_mesh
+	int instances;
+
+	// every run is repeated with each of these
+	enum RasterMode raster_modes[4];
+	int num_raster_modes;
+
+	enum TextureFilter texture_filter;
+
+	// of every texture, textures are loaded in linear order
+	enum TextureLayout texture_layout;
+	enum ShadingMode shading_mode;
+	enum DrawOrder draw_order;
+	enum DepthFormat depth_format;
+	enum PixelFormat pixel_format;
+	bool depth_prepass;
+	bool hiz;
+	bool stats;
+	bool validate;
+
+	// build levels of detail of every mesh and time them at lod_sizes
+	bool lod;
+};
+
+static const char *raster_mode_names[] = { "float", "fixed", "span", "naive" };
+
+static const struct Resolution resolutions[] =
+{
+	{ 640, 480 },
+	{ 1280, 720 },
+	{ 1920, 1080 }
+};
+
+static const float hfovs[] = { 60.0f, 90.0f };
+
+// diameters in pixels of the bounding sphere the levels of detail are timed
+// at, on the first resolution with the first field of view
+static const float lod_sizes[] = { 400.0f, 200.0f, 100.0f, 50.0f, 25.0f };
+
+// every run also turns the mesh about y from 45 degrees one way of these to
+// 45 degrees the other way over its frames
+static const struct Orientation orientations[] =
+{
+	{ "front", 0.0f, 0.0f },
+	{ "side", PI / 2.0f, 0.0f },
+	{ "top", 0.0f, PI / 2.0f }
+};
+
+static bool ParseOptions(int argc, char **argv, struct BenchOptions *options);
+static void PrintUsage(const char *program);
+
+static bool AddFileMesh(struct BenchMesh *meshes, int *count, const char *file_name);
+static void AddBenchMesh(struct BenchMesh *meshes, int *count, const char *name, struct Mesh *mesh, double load_ms, bool cached);
+static struct Mesh *CreateMesh(int num_vertices, int num_triangles);
+static struct Mesh *CreateSphereMesh(int rings, int segments);
+static struct Mesh *CreateLayersMesh(int layers, int cells);
+static struct Mesh *CreateSliversMesh(int count);
+static void AddQuad(struct Mesh *mesh, int *t, int a, int b, int c, int d);
+static struct TextureMap *CreateCheckerTexture(int size);
+
+static void RunBench(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct Resolution *resolution, float hfov, const struct Orientation *orientation, double *times, bool first);
+static void RunLodSizes(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct MeshLod *lod, double build_ms, bool first);
+static double TimeLodFrames(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct MeshLod *lod, float scale, int *level);
+static struct Matrix *CreateFormation(const struct BenchMesh *bench_mesh, int count);
+static void DrawMesh(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *instance_mats, int num_instances);
+static void ValidateFrame(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *instance_mats, int num_instances, int *differing, int *max_error);
+static void AddStats(struct RenderStats *total, const struct RenderStats *stats);
+static void PrintStats(const struct RenderStats *total, int frames);
+static int CompareTimes(const void *a, const void *b);
+static double Percentile(const double *sorted, int count, double p);
+static void PrintJsonString(const char *s);
+
+int main(int argc, char **argv)
+{
+	struct BenchOptions options;
+	if (!ParseOptions(argc, argv, &options))
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	struct BenchMesh meshes[MAX_BENCH_MESHES];
+	int num_meshes = 0;
+
+	if (!AddFileMesh(meshes, &num_meshes, options.model))
+	{
+		fprintf(stderr, "unable to load %s\n", options.model);
+		return 1;
+	}
+
+	// many small triangles, heavy overdraw and long thin triangles
+	double start = GetTimeMs();
+	struct Mesh *sphere = CreateSphereMesh(48, 80);
+	AddBenchMesh(meshes, &num_meshes, "sphere", sphere, GetTimeMs() - start, false);
+
+	start = GetTimeMs();
+	struct Mesh *layers = CreateLayersMesh(16, 8);
+	AddBenchMesh(meshes, &num_meshes, "layers", layers, GetTimeMs() - start, false);
+
+	start = GetTimeMs();
+	struct Mesh *slivers = CreateSliversMesh(1024);
+	AddBenchMesh(meshes, &num_meshes, "slivers", slivers, GetTimeMs() - start, false);
+
+	if (sphere == NULL || layers == NULL || slivers == NULL)
+	{
+		fprintf(stderr, "unable to create the stress meshes\n");
+		return 1;
+	}
+
+	// textures that cannot take the layout, morton needs power of two
+	// sides, keep the one they have
+	for (int m = 0; m < num_meshes; m++)
+		for (int i = 0; i < meshes[m].mesh->num_materials; i++)
+			set_texture_layout(meshes[m].mesh->materials[i].tex_map, options.texture_layout);
+
+	static struct RenderContext context;
+	init(&context);
+
+	set_texture_filter(&context, options.texture_filter);
+	set_shading_mode(&context, options.shading_mode);
+	set_draw_order(&context, options.draw_order);
+	set_depth_format(&context, options.depth_format);
+	set_pixel_format(&context, options.pixel_format);
+	set_depth_prepass(&context, options.depth_prepass);
+	set_hiz_enabled(&context, options.hiz);
+	set_stats_enabled(&context, options.stats);
+	set_render_threads(&context, options.threads);
+
+	double *times = (double *)malloc(options.frames * sizeof(double));
+	if (times == NULL)
+		return 1;
+
+	printf("{\n");
+	printf("  \"frames\": %d,\n", options.frames);
+	printf("  \"warmup_frames\": %d,\n", options.warmup);
+	printf("  \"threads\": %d,\n", context.num_threads);
+	printf("  \"instances\": %d,\n", options.instances);
+	printf("  \"texture_filter\": \"%s\",\n", options.texture_filter == TEXTURE_FILTER_TRILINEAR ? "trilinear" : options.texture_filter == TEXTURE_FILTER_BILINEAR ? "bilinear" : "nearest");
+	printf("  \"texture_layout\": \"%s\",\n", options.texture_layout == TEXTURE_LAYOUT_MORTON ? "morton" : "linear");
+	printf("  \"shading_mode\": \"%s\",\n", options.shading_mode == SHADING_MODE_DEFERRED ? "deferred" : "forward");
+	printf("  \"draw_order\": \"%s\",\n", options.draw_order == DRAW_ORDER_FRONT_TO_BACK ? "front_to_back" : "mesh");
+	printf("  \"depth_format\": \"%s\",\n", options.depth_format == DEPTH_FORMAT_UNORM16 ? "unorm16" : options.depth_format == DEPTH_FORMAT_REVERSE_FLOAT ? "reverse" : "float");
+	printf("  \"pixel_format\": \"%s\",\n", options.pixel_format == PIXEL_FORMAT_XRGB8888 ? "xrgb8888" : "argb8888");
+	printf("  \"depth_prepass\": %s,\n", options.depth_prepass ? "true" : "false");
+	printf("  \"hiz\": %s,\n", options.hiz ? "true" : "false");
+	printf("  \"stats\": %s,\n", options.stats ? "true" : "false");
+	printf("  \"validate\": %s,\n", options.validate ? "true" : "false");
+
+	printf("  \"meshes\": [\n");
+	for (int m = 0; m < num_meshes; m++)
+	{
+		printf("    { \"name\": ");
+		PrintJsonString(meshes[m].name);
+		printf(", \"vertices\": %d, \"triangles\": %d, \"load_ms\": %.3f, \"cached\": %s }%s\n",
+			meshes[m].mesh->num_vertices, meshes[m].mesh->num_triangles, meshes[m].load_ms,
+			meshes[m].cached ? "true" : "false", m + 1 < num_meshes ? "," : "");
+	}
+	printf("  ],\n");
+
+	if (options.lod)
+	{
+		printf("  \"lod\": [");
+
+		for (int m = 0; m < num_meshes; m++)
+		{
+			start = GetTimeMs();
+			struct MeshLod *lod = CreateMeshLod(meshes[m].mesh, MAX_LOD_LEVELS);
+			double build_ms = GetTimeMs() - start;
+
+			if (lod == NULL)
+			{
+				fprintf(stderr, "unable to build the levels of detail of %s\n", meshes[m].name);
+				return 1;
+			}
+
+			set_raster_mode(&context, options.raster_modes[0]);
+			RunLodSizes(&context, &options, &meshes[m], lod, build_ms, m == 0);
+			DestroyMeshLod(lod);
+		}
+
+		printf("\n  ],\n");
+	}
+
+	printf("  \"runs\": [");
+	bool first = true;
+
+	for (int m = 0; m < num_meshes; m++)
+		for (int r = 0; r < (int)(sizeof(resolutions) / sizeof(resolutions[0])); r++)
+			for (int f = 0; f < (int)(sizeof(hfovs) / sizeof(hfovs[0])); f++)
+				for (int o = 0; o < (int)(sizeof(orientations) / sizeof(orientations[0])); o++)
+					for (int b = 0; b < options.num_raster_modes; b++)
+					{
+						set_raster_mode(&context, options.raster_modes[b]);
+						RunBench(&context, &options, &meshes[m], &resolutions[r], hfovs[f], &orientations[o], times, first);
+						first = false;
+					}
+
+	printf("\n  ]\n}\n");
+
+	free(times);
+	destroy(&context);
+
+	for (int m = 0; m < num_meshes; m++)
+		DestroyMesh(meshes[m].mesh);
+
+	return 0;
+}
 
-	if (mesh != NULL)
+bool ParseOptions(int argc, char **argv, struct BenchOptions *options)
+{
+	options->model = DEFAULT_MODEL;
+	options->frames = 60;
+	options->warmup = 5;
+	options->threads = 1;
+	options->instances = 1;
+	options->raster_modes[0] = RASTER_MODE_FLOAT;
+	options->num_raster_modes = 1;
+	options->texture_filter = TEXTURE_FILTER_NEAREST;
+	options->texture_layout = TEXTURE_LAYOUT_LINEAR;
+	options->shading_mode = SHADING_MODE_FORWARD;
+	options->draw_order = DRAW_ORDER_MESH;
+	options->depth_format = DEPTH_FORMAT_FLOAT;
+	options->pixel_format = PIXEL_FORMAT_ARGB8888;
+	options->depth_prepass = false;
+	options->hiz = false;
+	options->stats = false;
+	options->validate = false;
+	options->lod = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--hiz") == 0)
+			options->hiz = true;
+		else if (strcmp(arg, "--stats") == 0)
+			options->stats = true;
+		else if (strcmp(arg, "--validate") == 0)
+			options->validate = true;
+		else if (strcmp(arg, "--lod") == 0)
+			options->lod = true;
+		else if (strcmp(arg, "--front-to-back") == 0)
+			options->draw_order = DRAW_ORDER_FRONT_TO_BACK;
+		else if (strcmp(arg, "--prepass") == 0)
+			options->depth_prepass = true;
+		else if (strcmp(arg, "--fixed-point") == 0)
+			options->raster_modes[0] = RASTER_MODE_FIXED_POINT;
+		else if (strcmp(arg, "--deferred") == 0)
+			options->shading_mode = SHADING_MODE_DEFERRED;
+		else if (value == NULL)
+			return false;
+		else
+		{
+			// the rest take a value
+			i++;
+
+			if (strcmp(arg, "--model") == 0)
+				options->model = value;
+			else if (strcmp(arg, "--frames") == 0)
+				options->frames = atoi(value);
+			else if (strcmp(arg, "--warmup") == 0)
+				options->warmup = atoi(value);
+			else if (strcmp(arg, "--threads") == 0)
+				options->threads = atoi(value);
+			else if (strcmp(arg, "--instances") == 0)
+				options->instances = atoi(value);
+			else if (strcmp(arg, "--filter") == 0)
+			{
+				if (strcmp(value, "nearest") == 0)
+					options->texture_filter = TEXTURE_FILTER_NEAREST;
+				else if (strcmp(value, "bilinear") == 0)
+					options->texture_filter = TEXTURE_FILTER_BILINEAR;
+				else if (strcmp(value, "trilinear") == 0)
+					options->texture_filter = TEXTURE_FILTER_TRILINEAR;
+				else
+					return false;
+			}
+			else if (strcmp(arg, "--layout") == 0)
+			{
+				if (strcmp(value, "linear") == 0)
+					options->texture_layout = TEXTURE_LAYOUT_LINEAR;
+				else if (strcmp(value, "morton") == 0)
+					options->texture_layout = TEXTURE_LAYOUT_MORTON;
+				else
+					return false;
+			}
+			else if (strcmp(arg, "--raster") == 0)
+			{
+				options->num_raster_modes = 0;
+
+				for (int m = 0; m < (int)(sizeof(raster_mode_names) / sizeof(raster_mode_names[0])); m++)
+					if (strcmp(value, raster_mode_names[m]) == 0 || strcmp(value, "all") == 0)
+						options->raster_modes[options->num_raster_modes++] = (enum RasterMode)m;
+
+				if (options->num_raster_modes == 0)
+					return false;
+			}
+			else if (strcmp(arg, "--depth") == 0)
+			{
+				if (strcmp(value, "float") == 0)
+					options->depth_format = DEPTH_FORMAT_FLOAT;
+				else if (strcmp(value, "reverse") == 0)
+					options->depth_format = DEPTH_FORMAT_REVERSE_FLOAT;
+				else if (strcmp(value, "unorm16") == 0)
+					options->depth_format = DEPTH_FORMAT_UNORM16;
+				else
+					return false;
+			}
+			else if (strcmp(arg, "--pixel-format") == 0)
+			{
+				if (strcmp(value, "argb8888") == 0)
+					options->pixel_format = PIXEL_FORMAT_ARGB8888;
+				else if (strcmp(value, "xrgb8888") == 0)
+					options->pixel_format = PIXEL_FORMAT_XRGB8888;
+				else
+					return false;
+			}
+			else
+				return false;
+		}
+	}
+
+	return options->frames > 0 && options->warmup >= 0 && options->threads >= 0 && options->instances > 0;
+}
+
+void PrintUsage(const char *program)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --model file.obj    model to render besides the stress meshes (" DEFAULT_MODEL ")\n"
+		"  --frames n          timed frames per run (60)\n"
+		"  --warmup n          untimed frames before each run (5)\n"
+		"  --threads n         render threads, 0 for one per processor (1)\n"
+		"  --instances n       draw n copies of every mesh in a square formation\n"
+		"                      with render_mesh_instanced (1)\n"
+		"  --filter name       nearest, bilinear or trilinear (nearest)\n"
+		"  --layout name       texel order of every texture, linear or morton (linear)\n"
+		"  --depth name        depth buffer format, float, reverse or unorm16 (float)\n"
+		"  --pixel-format name argb8888, or xrgb8888 to skip lighting alpha (argb8888)\n"
+		"  --raster name       rasterizer, float, fixed, span, naive or all to repeat\n"
+		"                      every run with each of them (float)\n"
+		"  --fixed-point       same as --raster fixed\n"
+		"  --deferred          deferred shading through the visibility buffer\n"
+		"  --front-to-back     sort triangles front to back every frame\n"
+		"  --prepass           depth pre-pass\n"
+		"  --hiz               hierarchical z\n"
+		"  --stats             add per frame counts and stage times to every run, the\n"
+		"                      timings then include collecting them\n"
+		"  --validate          compare the last frame of every run with the naive\n"
+		"                      rasterizer, which always samples the nearest texel\n"
+		"  --lod               build levels of detail of every mesh and time them\n"
+		"                      against the full mesh at several sizes on screen\n",
+		program);
+}
+
+bool AddFileMesh(struct BenchMesh *meshes, int *count, const char *file_name)
+{
+	double start = GetTimeMs();
+	struct Mesh *mesh = CreateMeshFromFile((char *)file_name);
+	double load_ms = GetTimeMs() - start;
+
+	if (mesh == NULL)
+		return false;
+
+	// name it after the file without its directory and extension
+	static char name[256];
+	const char *base = file_name;
+
+	for (const char *p = file_name; *p != '\0'; p++)
+		if (*p == '/' || *p == '\\')
+			base = p + 1;
+
+	strncpy(name, base, sizeof(name) - 1);
+	char *dot = strrchr(name, '.');
+	if (dot != NULL && dot != name)
+		*dot = '\0';
+
+	AddBenchMesh(meshes, count, name, mesh, load_ms, mesh->cache != NULL);
+	return true;
+}
+
+void AddBenchMesh(struct BenchMesh *meshes, int *count, const char *name, struct Mesh *mesh, double load_ms, bool cached)
+{
+	if (mesh == NULL || *count == MAX_BENCH_MESHES)
+		return;
+
+	struct BenchMesh *bench_mesh = &meshes[(*count)++];
+
+	bench_mesh->name = name;
+	bench_mesh->mesh = mesh;
+	bench_mesh->load_ms = load_ms;
+	bench_mesh->cached = cached;
+
+	struct BoundingBox bounds;
+	struct Vector center;
+	CalcMeshBounds(mesh, &bounds);
+	BoxCenter(&bounds, &center);
+
+	float dx = bounds.max.x - bounds.min.x;
+	float dy = bounds.max.y - bounds.min.y;
+	float dz = bounds.max.z - bounds.min.z;
+	float radius = 0.5f * sqrtf(dx * dx + dy * dy + dz * dz);
+	float scale = radius > 0.0f ? 1.0f / radius : 1.0f;
+
+	MatSetIdentity(&bench_mesh->model_mat);
+	bench_mesh->model_mat.e[0][0] = scale;
+	bench_mesh->model_mat.e[1][1] = scale;
+	bench_mesh->model_mat.e[2][2] = scale;
+	bench_mesh->model_mat.e[0][3] = -center.x * scale;
+	bench_mesh->model_mat.e[1][3] = -center.y * scale;
+	bench_mesh->model_mat.e[2][3] = -center.z * scale;
+}
+
+struct Mesh *CreateMesh(int num_vertices, int num_triangles)
+{
+	// one normal and uv per vertex and a single checkered material, laid out
+	// the way DestroyMesh frees them
+
+	struct Mesh *mesh = (struct Mesh *)calloc(1, sizeof(struct Mesh));
+	if (mesh == NULL)
+		return NULL;
+
+	mesh->num_vertices = num_vertices;
+	mesh->num_normals = num_vertices;
+	mesh->num_uvcoords = num_vertices;
+	mesh->num_triangles = num_triangles;
+	mesh->num_materials = 1;
+
+	mesh->vertices = (struct Vertex *)malloc(num_vertices * sizeof(struct Vertex));
+	mesh->normals = (struct Vector *)malloc(num_vertices * sizeof(struct Vector));
+	mesh->uvcoords = (struct UVCoord *)malloc(num_vertices * sizeof(struct UVCoord));
+	mesh->triangles = (struct Triangle *)calloc(num_triangles, sizeof(struct Triangle));
+	mesh->materials = (struct Material *)calloc(1, sizeof(struct Material));
+
+	if (mesh->vertices == NULL || mesh->normals == NULL || mesh->uvcoords == NULL || mesh->triangles == NULL || mesh->materials == NULL)
+	{
 		DestroyMesh(mesh);
+		return NULL;
+	}
+
+	mesh->materials[0].tex_map = CreateCheckerTexture(CHECKER_SIZE);
+	if (mesh->materials[0].tex_map == NULL)
+	{
+		DestroyMesh(mesh);
+		return NULL;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		mesh->materials[0].ambient_rgb[i] = 0.3f;
+		mesh->materials[0].diffuse_rgb[i] = 1.0f;
+		mesh->materials[0].specular_rgb[i] = 1.0f;
+	}
+
+	return mesh;
+}
+
+struct Mesh *CreateSphereMesh(int rings, int segments)
+{
+	// a uv sphere of radius 1, seams and poles have their own vertices
+	struct Mesh *mesh = CreateMesh((rings + 1) * (segments + 1), rings * segments * 2);
+	if (mesh == NULL)
+		return NULL;
+
+	int v = 0;
+
+	for (int r = 0; r <= rings; r++)
+	{
+		float theta = PI * r / rings;
+
+		for (int s = 0; s <= segments; s++, v++)
+		{
+			float phi = 2.0f * PI * s / segments;
+			float x = sinf(theta) * cosf(phi);
+			float y = cosf(theta);
+			float z = sinf(theta) * sinf(phi);
+
+			VecSet(&mesh->vertices[v].pos, x, y, z, 1.0f);
+			VecSet(&mesh->normals[v], x, y, z, 0.0f);
+			mesh->uvcoords[v].u = 4.0f * s / segments;
+			mesh->uvcoords[v].v = 2.0f * r / rings;
+		}
+	}
+
+	int t = 0;
+
+	for (int r = 0; r < rings; r++)
+	{
+		for (int s = 0; s < segments; s++)
+		{
+			int a = r * (segments + 1) + s;
+			int c = a + segments + 1;
+			AddQuad(mesh, &t, a, a + 1, c + 1, c);
+		}
+	}
+
+	return mesh;
+}
+
+struct Mesh *CreateLayersMesh(int layers, int cells)
+{
+	// stacked screens of cells x cells quads stored back to front, the worst
+	// order for overdraw
+	struct Mesh *mesh = CreateMesh(layers * (cells + 1) * (cells + 1), layers * cells * cells * 2);
+	if (mesh == NULL)
+		return NULL;
+
+	int v = 0;
+	int t = 0;
+
+	for (int l = 0; l < layers; l++)
+	{
+		int first = v;
+		float z = layers > 1 ? -0.5f + (float)l / (layers - 1) : 0.0f;
+
+		for (int j = 0; j <= cells; j++)
+		{
+			for (int i = 0; i <= cells; i++, v++)
+			{
+				float x = -1.0f + 2.0f * i / cells;
+				float y = -0.75f + 1.5f * j / cells;
+
+				VecSet(&mesh->vertices[v].pos, x, y, z, 1.0f);
+				VecSet(&mesh->normals[v], 0.0f, 0.0f, 1.0f, 0.0f);
+				mesh->uvcoords[v].u = (float)i / cells;
+				mesh->uvcoords[v].v = (float)j / cells;
+			}
+		}
+
+		for (int j = 0; j < cells; j++)
+		{
+			for (int i = 0; i < cells; i++)
+			{
+				int a = first + j * (cells + 1) + i;
+				int c = a + cells + 1;
+				AddQuad(mesh, &t, a, a + 1, c + 1, c);
+			}
+		}
+	}
+
+	return mesh;
+}
+
+struct Mesh *CreateSliversMesh(int count)
+{
+	// long triangles a fraction of a pixel high fanned across a square, most
+	// of their bounding boxes are empty
+	struct Mesh *mesh = CreateMesh(count * 3, count);
+	if (mesh == NULL)
+		return NULL;
+
+	for (int i = 0; i < count; i++)
+	{
+		float y = -1.0f + 2.0f * (i + 0.5f) / count;
+		float h = 0.5f / count;
+		int v = i * 3;
+
+		VecSet(&mesh->vertices[v].pos, -1.0f, y - h, 0.0f, 1.0f);
+		VecSet(&mesh->vertices[v + 1].pos, 1.0f, y - 2.0f * h, 0.0f, 1.0f);
+		VecSet(&mesh->vertices[v + 2].pos, 1.0f, y + h, 0.0f, 1.0f);
+
+		for (int k = 0; k < 3; k++)
+		{
+			VecSet(&mesh->normals[v + k], 0.0f, 0.0f, 1.0f, 0.0f);
+			mesh->uvcoords[v + k].u = 0.5f * (mesh->vertices[v + k].pos.x + 1.0f);
+			mesh->uvcoords[v + k].v = 0.5f * (mesh->vertices[v + k].pos.y + 1.0f);
+		}
+
+		struct Triangle *tri = &mesh->triangles[i];
+		tri->v0 = tri->n0 = tri->uv0 = v;
+		tri->v1 = tri->n1 = tri->uv1 = v + 1;
+		tri->v2 = tri->n2 = tri->uv2 = v + 2;
+		VecSet(&tri->normal, 0.0f, 0.0f, 1.0f, 0.0f);
+	}
+
+	return mesh;
+}
+
+void AddQuad(struct Mesh *mesh, int *t, int a, int b, int c, int d)
+{
+	// two triangles sharing the a c diagonal, counter clockwise seen from
+	// the side the normals point to
+	int corners[2][3] = { { a, b, c }, { a, c, d } };
+
+	for (int k = 0; k < 2; k++)
+	{
+		struct Triangle *tri = &mesh->triangles[(*t)++];
+
+		tri->v0 = tri->n0 = tri->uv0 = corners[k][0];
+		tri->v1 = tri->n1 = tri->uv1 = corners[k][1];
+		tri->v2 = tri->n2 = tri->uv2 = corners[k][2];
+		tri->material = 0;
+		VecCopy(&mesh->normals[corners[k][0]], &tri->normal);
+	}
+}
+
+struct TextureMap *CreateCheckerTexture(int size)
+{
+	struct TextureMap *texture = (struct TextureMap *)calloc(1, sizeof(struct TextureMap));
+	if (texture == NULL)
+		return NULL;
+
+	texture->width = size;
+	texture->height = size;
+	texture->buffer = (uint32_t *)malloc(size * size * sizeof(uint32_t));
+
+	if (texture->buffer == NULL)
+	{
+		DestroyTextureMap(texture);
+		return NULL;
+	}
+
+	// 8x8 checkers with a gradient so filtering has something to blend
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			uint32_t c = ((x / (size / 8)) ^ (y / (size / 8))) & 1 ? 255 : 64;
+			uint32_t g = (uint32_t)(255 * x / size);
+			texture->buffer[x + y * size] = 0xff000000u | (c << 16) | (g << 8) | (255 - c);
+		}
+	}
+
+	// the same treatment textures loaded from files get
+	create_texture_mip_levels(texture);
+
+	return texture;
+}
+
+void RunBench(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct Resolution *resolution, float hfov, const struct Orientation *orientation, double *times, bool first)
+{
+	set_screen_size(context, resolution->width, resolution->height);
+	set_hfov(context, hfov);
+
+	// back far enough for the unit bounding sphere to fit the narrower field
+	// of view, within the depth range
+	float half_fov = 0.5f * min(context->hfov, context->vfov) * PI / 180.0f;
+	float distance = 1.0f / sinf(half_fov);
+	distance = max(context->znear + 1.0f, min(distance, context->zfar - 1.0f));
+
+	struct Matrix rot_x, rot_y, rot, trans, view_mat;
+	double fragments = 0.0;
+	double covered = 0.0;
+
+	struct RenderStats total_stats;
+	memset(&total_stats, 0, sizeof(total_stats));
+
+	struct Matrix *instance_mats = NULL;
+	if (options->instances > 1 && (instance_mats = CreateFormation(bench_mesh, options->instances)) == NULL)
+		return;
+
+	for (int f = -options->warmup; f < options->frames; f++)
+	{
+		float spin = 0.5f * PI * ((float)f / options->frames - 0.5f);
+
+		MatSetRotY(&rot_y, orientation->yaw + spin);
+		MatSetRotX(&rot_x, orientation->pitch);
+		MatMul(&rot_x, &rot_y, &rot);
+		MatSetTranslate(&trans, 0.0f, 0.0f, -distance);
+		MatMul(&trans, &rot, &view_mat);
+
+		// the formation's matrices already include the model matrix
+		if (instance_mats != NULL)
+			MatCopy(&view_mat, &context->mv_mat);
+		else
+			MatMul(&view_mat, &bench_mesh->model_mat, &context->mv_mat);
+
+		double start = GetTimeMs();
+
+		clear_pixel_buffer(context);
+		clear_depth_buffer(context);
+		DrawMesh(context, bench_mesh->mesh, instance_mats, options->instances);
+		resolve_visibility_buffer(context);
+
+		double end = GetTimeMs();
+
+		if (f >= 0)
+		{
+			times[f] = end - start;
+
+			// weighted by the pixels covered, frames that show nothing count
+			// for nothing
+			float overdraw = get_overdraw(context);
+			if (overdraw > 0.0f)
+			{
+				fragments += (double)context->stats.fragments_shaded;
+				covered += context->stats.fragments_shaded / overdraw;
+			}
+
+			AddStats(&total_stats, &context->stats);
+		}
+	}
+
+	double total = 0.0;
+	for (int f = 0; f < options->frames; f++)
+		total += times[f];
+
+	qsort(times, options->frames, sizeof(double), CompareTimes);
+
+	double seconds = total / 1000.0;
+	double triangles = (double)bench_mesh->mesh->num_triangles * options->instances * options->frames;
+	double pixels = (double)resolution->width * resolution->height * options->frames;
+
+	printf("%s\n    { \"mesh\": ", first ? "" : ",");
+	PrintJsonString(bench_mesh->name);
+	printf(", \"width\": %d, \"height\": %d, \"hfov\": %.1f, \"orientation\": ", resolution->width, resolution->height, hfov);
+	PrintJsonString(orientation->name);
+	printf(", \"raster_mode\": \"%s\"", raster_mode_names[context->raster_mode]);
+	printf(",\n      \"ms_per_frame\": { \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+		total / options->frames, times[0], Percentile(times, options->frames, 0.5), Percentile(times, options->frames, 0.9),
+		Percentile(times, options->frames, 0.99), times[options->frames - 1]);
+	printf("      \"triangles_per_sec\": %.0f, \"pixels_per_sec\": %.0f, \"overdraw\": %.3f",
+		seconds > 0.0 ? triangles / seconds : 0.0, seconds > 0.0 ? pixels / seconds : 0.0, covered > 0.0 ? fragments / covered : 0.0);
+
+	if (options->stats)
+		PrintStats(&total_stats, options->frames);
+
+	if (options->validate)
+	{
+		int differing, max_error;
+		ValidateFrame(context, bench_mesh->mesh, instance_mats, options->instances, &differing, &max_error);
+
+		printf(",\n      \"validation\": { \"pixels_differing\": %d, \"max_error\": %d }", differing, max_error);
+	}
+
+	printf(" }");
+
+	fflush(stdout);
+	free(instance_mats);
+}
+
+void RunLodSizes(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct MeshLod *lod, double build_ms, bool first)
+{
+	printf("%s\n    { \"mesh\": ", first ? "" : ",");
+	PrintJsonString(bench_mesh->name);
+	printf(", \"build_ms\": %.3f,\n      \"levels\": [", build_ms);
+
+	for (int i = 0; i < lod->num_levels; i++)
+		printf("%s { \"triangles\": %d, \"error\": %.6f }", i > 0 ? "," : "", lod->levels[i]->num_triangles, lod->errors[i]);
+
+	printf(" ],\n      \"sizes\": [");
+
+	set_screen_size(context, resolutions[0].width, resolutions[0].height);
+	set_hfov(context, hfovs[0]);
+
+	// the model matrix makes the bounding sphere's radius 1, so it is scaled
+	// to the radius in pixels over the pixels per unit at LOD_DISTANCE
+	float pixels_per_unit = 0.5f * context->screen_width * fabsf(context->proj_mat.e[0][0]) / LOD_DISTANCE;
+
+	for (int i = 0; i < (int)(sizeof(lod_sizes) / sizeof(lod_sizes[0])); i++)
+	{
+		float scale = 0.5f * lod_sizes[i] / pixels_per_unit;
+
+		int level = 0;
+		double lod_ms = TimeLodFrames(context, options, bench_mesh, lod, scale, &level);
+		double full_ms = TimeLodFrames(context, options, bench_mesh, NULL, scale, NULL);
+
+		printf("%s\n        { \"pixels\": %.0f, \"level\": %d, \"triangles\": %d, \"ms_per_frame\": %.3f, \"full_ms_per_frame\": %.3f }",
+			i > 0 ? "," : "", lod_sizes[i], level, lod->levels[level]->num_triangles, lod_ms, full_ms);
+	}
+
+	printf(" ] }");
+	fflush(stdout);
+}
+
+double TimeLodFrames(struct RenderContext *context, const struct BenchOptions *options, const struct BenchMesh *bench_mesh,
+	const struct MeshLod *lod, float scale, int *level)
+{
+	// turns the mesh like the front runs, drawing the level picked for every
+	// frame, or the full mesh when lod is NULL. Returns the mean time.
+
+	struct Matrix size_mat, rot, trans, view_mat, model_mat;
+
+	MatSetIdentity(&size_mat);
+	size_mat.e[0][0] = scale;
+	size_mat.e[1][1] = scale;
+	size_mat.e[2][2] = scale;
+	MatMul(&size_mat, &bench_mesh->model_mat, &model_mat);
+
+	double total = 0.0;
+
+	for (int f = -options->warmup; f < options->frames; f++)
+	{
+		float spin = 0.5f * PI * ((float)f / options->frames - 0.5f);
+
+		MatSetRotY(&rot, spin);
+		MatSetTranslate(&trans, 0.0f, 0.0f, -LOD_DISTANCE);
+		MatMul(&trans, &rot, &view_mat);
+		MatMul(&view_mat, &model_mat, &context->mv_mat);
+
+		double start = GetTimeMs();
+
+		clear_pixel_buffer(context);
+		clear_depth_buffer(context);
+
+		if (lod != NULL)
+			*level = RenderMeshLod(context, lod, *level);
+		else
+			render_mesh(context, bench_mesh->mesh);
+
+		resolve_visibility_buffer(context);
+
+		double end = GetTimeMs();
+
+		if (f >= 0)
+			total += end - start;
+	}
+
+	return total / options->frames;
+}
+
+struct Matrix *CreateFormation(const struct BenchMesh *bench_mesh, int count)
+{
+	// a square of copies facing the same way in the xy plane, scaled down so
+	// the whole formation fits the unit sphere a single copy would fill
+
+	struct Matrix *matrices = (struct Matrix *)malloc(count * sizeof(struct Matrix));
+	if (matrices == NULL)
+		return NULL;
+
+	int side = (int)ceilf(sqrtf((float)count));
+	float scale = 1.0f / side;
+
+	for (int i = 0; i < count; i++)
+	{
+		struct Matrix place;
+		MatSetIdentity(&place);
+
+		place.e[0][0] = scale;
+		place.e[1][1] = scale;
+		place.e[2][2] = scale;
+		place.e[0][3] = -1.0f + scale * (2 * (i % side) + 1);
+		place.e[1][3] = -1.0f + scale * (2 * (i / side) + 1);
+
+		MatMul(&place, &bench_mesh->model_mat, &matrices[i]);
+	}
+
+	return matrices;
+}
+
+void DrawMesh(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *instance_mats, int num_instances)
+{
+	if (instance_mats != NULL)
+		render_mesh_instanced(context, mesh, instance_mats, num_instances);
+	else
+		render_mesh(context, mesh);
+}
+
+void ValidateFrame(struct RenderContext *context, struct Mesh *mesh, const struct Matrix *instance_mats, int num_instances, int *differing, int *max_error)
+{
+	// draws the frame just rendered again with the naive rasterizer and
+	// compares the two channel by channel
+
+	*differing = 0;
+	*max_error = 0;
+
+	int count = context->screen_width * context->screen_height;
+	uint32_t *pixels = (uint32_t *)malloc(count * sizeof(uint32_t));
+	if (pixels == NULL)
+		return;
+
+	memcpy(pixels, get_pixel_buffer(context), count * sizeof(uint32_t));
+
+	enum RasterMode raster_mode = context->raster_mode;
+	set_raster_mode(context, RASTER_MODE_NAIVE);
+
+	clear_pixel_buffer(context);
+	clear_depth_buffer(context);
+	DrawMesh(context, mesh, instance_mats, num_instances);
+	resolve_visibility_buffer(context);
+
+	set_raster_mode(context, raster_mode);
+
+	const uint32_t *reference = get_pixel_buffer(context);
+
+	for (int i = 0; i < count; i++)
+	{
+		int error = 0;
+
+		for (int shift = 0; shift < 32; shift += 8)
+			error = max(error, abs((int)((pixels[i] >> shift) & 0xff) - (int)((reference[i] >> shift) & 0xff)));
+
+		if (error > 0)
+			(*differing)++;
+
+		*max_error = max(*max_error, error);
+	}
+
+	free(pixels);
+}
+
+void AddStats(struct RenderStats *total, const struct RenderStats *stats)
+{
+	total->triangles_submitted += stats->triangles_submitted;
+	total->triangles_frustum_culled += stats->triangles_frustum_culled;
+	total->triangles_backface_culled += stats->triangles_backface_culled;
+	total->triangles_clipped += stats->triangles_clipped;
+	total->triangles_rasterized += stats->triangles_rasterized;
+	total->pixels_tested += stats->pixels_tested;
+	total->pixels_covered += stats->pixels_covered;
+	total->depth_tests_passed += stats->depth_tests_passed;
+	total->depth_tests_failed += stats->depth_tests_failed;
+	total->fragments_shaded += stats->fragments_shaded;
+	total->hiz_blocks_rejected += stats->hiz_blocks_rejected;
+	total->hiz_triangles_rejected += stats->hiz_triangles_rejected;
+	total->depth_bytes_read += stats->depth_bytes_read;
+	total->depth_bytes_written += stats->depth_bytes_written;
+	total->transform_ms += stats->transform_ms;
+	total->setup_ms += stats->setup_ms;
+	total->raster_ms += stats->raster_ms;
+	total->resolve_ms += stats->resolve_ms;
+}
+
+void PrintStats(const struct RenderStats *total, int frames)
+{
+	// means per frame
+	double n = (double)frames;
+
+	printf(",\n      \"triangles\": { \"submitted\": %.1f, \"frustum_culled\": %.1f, \"backface_culled\": %.1f, \"clipped\": %.1f, \"rasterized\": %.1f },\n",
+		total->triangles_submitted / n, total->triangles_frustum_culled / n, total->triangles_backface_culled / n,
+		total->triangles_clipped / n, total->triangles_rasterized / n);
+	printf("      \"pixels\": { \"tested\": %.1f, \"covered\": %.1f, \"depth_passed\": %.1f, \"depth_failed\": %.1f, \"shaded\": %.1f },\n",
+		total->pixels_tested / n, total->pixels_covered / n, total->depth_tests_passed / n,
+		total->depth_tests_failed / n, total->fragments_shaded / n);
+	printf("      \"hiz\": { \"blocks_rejected\": %.1f, \"triangles_rejected\": %.1f },\n",
+		total->hiz_blocks_rejected / n, total->hiz_triangles_rejected / n);
+	printf("      \"depth_bytes\": { \"read\": %.1f, \"written\": %.1f },\n",
+		total->depth_bytes_read / n, total->depth_bytes_written / n);
+	printf("      \"stage_ms\": { \"transform\": %.3f, \"setup\": %.3f, \"raster\": %.3f, \"resolve\": %.3f }",
+		total->transform_ms / n, total->setup_ms / n, total->raster_ms / n, total->resolve_ms / n);
+}
+
+int CompareTimes(const void *a, const void *b)
+{
+	double ta = *(const double *)a;
+	double tb = *(const double *)b;
+
+	return (ta > tb) - (ta < tb);
+}
+
+double Percentile(const double *sorted, int count, double p)
+{
+	// nearest rank
+	int rank = (int)ceil(p * count);
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void PrintJsonString(const char *s)
+{
+	putchar('"');
+
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
 
-	return 1;
-}
\ No newline at end of file
+	putchar('"');
+}
@@ -5,6 +5,7 @@
 
 #include "../../../Nova/nova_render.h"
 #include "../../../Nova/nova_utility.h"
+#include "../../../Nova/nova_thread.h"
 
 LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
@@ -12,13 +13,23 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 ID2D1Factory *pFactory = NULL;
 ID2D1HwndRenderTarget *pRenderTarget = NULL;
 ID2D1Bitmap *bm = NULL;
-HRESULT CreateD2D(HWND hWnd);
+UINT32 bmWidth = 0, bmHeight = 0;
+HRESULT CreateD2D(HWND hWnd, UINT32 width, UINT32 height);
 void DestroyD2D();
 
 // My vars.
 Mesh *mesh;
 RenderContext context;
 
+// Frames are rendered on their own thread into a swapchain of 3 images, so
+// one is drawn while WM_PAINT shows another. The window size is handed to
+// the render thread packed as width << 16 | height, 0 when unchanged.
+HWND hMainWnd = NULL;
+HANDLE hRenderThread = NULL;
+volatile LONG quit = 0;
+volatile LONG newSize = 0;
+DWORD WINAPI RenderThread(LPVOID param);
+
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR pCmdLine, int nCmdShow)
 {
 	// Set up my stuff.
@@ -27,11 +38,9 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR pCmdLine, int nCmdSho
 		MessageBox(NULL, L"Unable to load mesh file!", L"ERROR", MB_OK);
 
 	init(&context);
-
-	Matrix rot, rot2, trans, pos, pos1, screen_mat, proj_mat;
-	context.mv_mat = &pos;
-	context.proj_mat = &proj_mat;
-	context.screen_mat = &screen_mat;
+	set_render_threads(&context, 0);
+	set_pixel_format(&context, PIXEL_FORMAT_XRGB8888);
+	set_swapchain(&context, 3, NULL);
 
 	SetProcessDPIAware();
 
@@ -46,46 +55,36 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR pCmdLine, int nCmdSho
 	HWND hWnd = CreateWindowEx(0, wc.lpszClassName, L"Nova", WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 500, 500, NULL, NULL, hInstance, NULL);
 	if (hWnd == NULL)
 		return -1;
-	ShowWindow(hWnd, nCmdShow);
 
 	if (FAILED(D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, &pFactory)))
 		return -1;
 
-	// Run the message loop
+	hMainWnd = hWnd;
+	ShowWindow(hWnd, nCmdShow);
+
+	hRenderThread = CreateThread(NULL, 0, RenderThread, NULL, 0, NULL);
+	if (hRenderThread == NULL)
+		return -1;
+
+	// Run the message loop, the render thread asks for a repaint after
+	// every frame.
 	MSG msg = { 0 };
-	DWORD start = GetTickCount();
-	DWORD now;
-	int frame = 0;
-	wchar_t d[20];
-	while (msg.message != WM_QUIT)
+	while (GetMessage(&msg, NULL, 0, 0) > 0)
 	{
-		static float ang = 0.0f;
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
 
-		MatSetRotY(&rot, ang);
-		MatSetRotX(&rot2, ang / 2.0f);
-		ang -= 0.002f;
-		MatSetTranslate(&trans, 0.0f, 0.0f, -3.f);
-		MatMul(&rot2, &rot, &pos1);
-		MatMul(&trans, &pos1, &pos);
+	// The render thread may be waiting for an image, it gets all of them
+	// back until it closes the swapchain.
+	InterlockedExchange(&quit, 1);
 
-		InvalidateRect(hWnd, NULL, FALSE);
+	SwapchainImage *image;
+	while ((image = take_submitted_image(&context, true)) != NULL)
+		release_image(&context, image);
 
-		frame++;
-		now = GetTickCount();
-		if (now - start > 2000)
-		{
-			start = now;
-			_itow_s(frame / 2, d, 20, 10);
-			SetWindowText(hWnd, d);
-			frame = 0;
-		}
-
-		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
-		{
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
-		}
-	}
+	WaitForSingleObject(hRenderThread, INFINITE);
+	CloseHandle(hRenderThread);
 
 	if (pFactory)
 	{
@@ -95,11 +94,59 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR pCmdLine, int nCmdSho
 
 	DestroyD2D();
 	DestroyMesh(mesh);
+	destroy(&context);
+
+	return 0;
+}
+
+DWORD WINAPI RenderThread(LPVOID param)
+{
+	Matrix rot, rot2, trans, pos1;
+	float ang = 0.0f;
+
+	while (!quit)
+	{
+		LONG size = InterlockedExchange(&newSize, 0);
+		if (size != 0)
+		{
+			set_screen_size(&context, size >> 16, size & 0xffff);
+			set_hfov(&context, 60.0f);
+		}
+
+		// Nothing to draw until the window has a size.
+		if (context.screen_width == 0)
+		{
+			Sleep(1);
+			continue;
+		}
+
+		// Waits while WM_PAINT is behind.
+		if (acquire_image(&context) == NULL)
+			break;
+
+		MatSetRotY(&rot, ang);
+		MatSetRotX(&rot2, ang / 2.0f);
+		ang -= 0.002f;
+		MatSetTranslate(&trans, 0.0f, 0.0f, -3.f);
+		MatMul(&rot2, &rot, &pos1);
+		MatMul(&trans, &pos1, &context.mv_mat);
+
+		clear_pixel_buffer(&context);
+		clear_depth_buffer(&context);
+
+		render_mesh(&context, mesh);
+
+		submit_image(&context);
+
+		InvalidateRect(hMainWnd, NULL, FALSE);
+	}
+
+	close_swapchain(&context);
 
 	return 0;
 }
 
-HRESULT CreateD2D(HWND hWnd)
+HRESULT CreateD2D(HWND hWnd, UINT32 width, UINT32 height)
 {
 	HRESULT hr = S_OK;
 
@@ -118,7 +165,9 @@ HRESULT CreateD2D(HWND hWnd)
 			float dpix, dpiy;
 			pFactory->GetDesktopDpi(&dpix, &dpiy);
 			D2D1_BITMAP_PROPERTIES bmp = D2D1::BitmapProperties(pf, dpix, dpiy);
-			pRenderTarget->CreateBitmap(D2D1::SizeU(rc.right, rc.bottom), bmp, &bm);
+			pRenderTarget->CreateBitmap(D2D1::SizeU(width, height), bmp, &bm);
+			bmWidth = width;
+			bmHeight = height;
 		}
 	}
 
@@ -154,32 +203,63 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 	case WM_PAINT:
 	{
-		if (pRenderTarget == NULL)
-		{
-			CreateD2D(hWnd);
-		}
-
 		PAINTSTRUCT ps;
 		HDC hdc = BeginPaint(hWnd, &ps);
 
-		pRenderTarget->BeginDraw();
-
-		clear_pixel_buffer(&context);
-		clear_depth_buffer(&context);
-
-		render_mesh(&context, mesh);
+		// Shows the newest finished frame, older ones are skipped.
+		SwapchainImage *image = take_submitted_image(&context, false);
+		SwapchainImage *next;
 
-		RECT rc;
-		GetClientRect(hWnd, &rc);
-		uint32_t *src = get_pixel_buffer(&context);
-		HRESULT hr = bm->CopyFromMemory(NULL, src, rc.right * BYTES_PER_PIXEL);
-		
-		pRenderTarget->DrawBitmap(bm);
-
-		hr = pRenderTarget->EndDraw();
+		while (image != NULL && (next = take_submitted_image(&context, false)) != NULL)
+		{
+			release_image(&context, image);
+			image = next;
+		}
 
-		if (hr == D2DERR_RECREATE_TARGET)
-			DestroyD2D();
+		if (image != NULL)
+		{
+			// The bitmap follows the size of the frames while resizing.
+			if (pRenderTarget == NULL || bmWidth != (UINT32)image->width || bmHeight != (UINT32)image->height)
+			{
+				DestroyD2D();
+				CreateD2D(hWnd, image->width, image->height);
+			}
+
+			if (bm != NULL)
+			{
+				HRESULT hr = bm->CopyFromMemory(NULL, image->pixels, image->width * BYTES_PER_PIXEL);
+
+				pRenderTarget->BeginDraw();
+				pRenderTarget->DrawBitmap(bm);
+				hr = pRenderTarget->EndDraw();
+
+				if (hr == D2DERR_RECREATE_TARGET)
+					DestroyD2D();
+			}
+
+			// Frames shown per second and the time from starting to render
+			// a frame to showing it, averaged over 2 seconds.
+			static double start = GetTimeMs();
+			static double latency = 0.0;
+			static int frames = 0;
+
+			double now = GetTimeMs();
+			latency += now - image->acquire_ms;
+			frames++;
+
+			if (now - start > 2000.0)
+			{
+				wchar_t title[64];
+				swprintf_s(title, 64, L"%.0f fps, %.1f ms latency", frames * 1000.0 / (now - start), latency / frames);
+				SetWindowText(hWnd, title);
+
+				start = now;
+				latency = 0.0;
+				frames = 0;
+			}
+
+			release_image(&context, image);
+		}
 
 		EndPaint(hWnd, &ps);
 	}
@@ -191,8 +271,9 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 		DestroyD2D();
 
-		set_screen_size(&context, rc.right, rc.bottom);
-		set_hfov(&context, 60.0f);
+		// The render thread resizes the context before its next frame.
+		if (rc.right > 0 && rc.bottom > 0)
+			InterlockedExchange(&newSize, (rc.right << 16) | rc.bottom);
 
 		return 0;
 	}